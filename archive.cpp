@@ -0,0 +1,146 @@
+#include "archive.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace utils {
+
+namespace {
+constexpr size_t TAR_BLOCK_SIZE = 512;
+// Octal size fields hold 11 digits
+constexpr uint64_t TAR_MAX_SIZE = (uint64_t{1} << 33) - 1;
+
+// Writes `value` as a NUL terminated octal number filling `field`.
+bool PutOctal(std::span<char> field, uint64_t value) {
+  const std::string digits = std::format("{:o}", value);
+  if (digits.size() > field.size() - 1) {
+    return false;
+  }
+  const size_t pad = field.size() - 1 - digits.size();
+  std::memset(field.data(), '0', pad);
+  std::memcpy(field.data() + pad, digits.data(), digits.size());
+  field.back() = '\0';
+  return true;
+}
+
+bool PutString(std::span<char> field, std::string_view value) {
+  if (value.size() > field.size()) {
+    return false;
+  }
+  std::memcpy(field.data(), value.data(), value.size());
+  return true;
+}
+} // namespace
+
+bool TarWriter::Header(std::string_view name, char type, uint64_t size,
+                       std::string_view link, uint32_t mode) {
+  std::array<char, TAR_BLOCK_SIZE> block{};
+  const std::span<char> header(block);
+  if (!PutString(header.subspan(0, 100), name) ||
+      !PutOctal(header.subspan(100, 8), mode) ||
+      !PutOctal(header.subspan(108, 8), 0) ||
+      !PutOctal(header.subspan(116, 8), 0) ||
+      !PutOctal(header.subspan(124, 12), size) ||
+      !PutOctal(header.subspan(136, 12), 0) ||
+      !PutString(header.subspan(157, 100), link)) {
+    return false;
+  }
+  block[156] = type;
+  PutString(header.subspan(257, 6), std::string_view("ustar\0", 6));
+  PutString(header.subspan(263, 2), "00");
+
+  // The checksum is taken with its own field read as spaces
+  std::memset(block.data() + 148, ' ', 8);
+  uint32_t checksum = 0;
+  for (const char c : block) {
+    checksum += static_cast<unsigned char>(c);
+  }
+  PutOctal(header.subspan(148, 7), checksum);
+
+  stats::CountWrite(block.size());
+  return static_cast<bool>(out_.write(block.data(), block.size()));
+}
+
+bool TarWriter::Pad(uint64_t size) {
+  static constexpr std::array<char, TAR_BLOCK_SIZE> kZeros{};
+  const size_t padding = static_cast<size_t>(-size % TAR_BLOCK_SIZE);
+  stats::CountWrite(padding);
+  return padding == 0 || out_.write(kZeros.data(), padding);
+}
+
+bool TarWriter::AddFile(std::string_view name,
+                        std::span<const std::byte> data) {
+  if (!Header(name, '0', data.size(), {}, 0644)) {
+    return false;
+  }
+  stats::CountWrite(data.size());
+  return out_.write(reinterpret_cast<const char *>(data.data()),
+                    static_cast<std::streamsize>(data.size())) &&
+         Pad(data.size());
+}
+
+bool TarWriter::AddSection(ImageSource &input, uint64_t offset, uint64_t size,
+                           std::string_view name, SectionDigest *digest) {
+  if (size > TAR_MAX_SIZE ||
+      (size > 0 && (offset > input.size() || size > input.size() - offset)) ||
+      !Header(name, '0', size, {}, 0644)) {
+    return false;
+  }
+
+  // One write per section from the mapping; chunks through `scratch`
+  // otherwise
+  constexpr uint64_t kChunkSize = 1 << 20;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < size;) {
+    const size_t chunk = static_cast<size_t>(
+        input.mapped() ? size : std::min<uint64_t>(size - done, kChunkSize));
+    const auto data = input.Slice(offset + done, chunk, scratch);
+    if (data.empty()) {
+      return false;
+    }
+    if (digest) {
+      digest->Update(data);
+    }
+    stats::CountWrite(data.size());
+    if (!out_.write(reinterpret_cast<const char *>(data.data()),
+                    static_cast<std::streamsize>(data.size()))) {
+      return false;
+    }
+    done += chunk;
+  }
+  return Pad(size);
+}
+
+bool TarWriter::AddDirectory(std::string_view name) {
+  return Header(std::string(name) + "/", '5', 0, {}, 0755);
+}
+
+bool TarWriter::AddSymlink(std::string_view name, std::string_view target) {
+  return Header(name, '2', 0, target, 0777);
+}
+
+bool TarWriter::Finish() {
+  static constexpr std::array<char, 2 * TAR_BLOCK_SIZE> kEnd{};
+  stats::CountWrite(kEnd.size());
+  return out_.write(kEnd.data(), kEnd.size()) && out_.flush();
+}
+
+void ArchiveImages(ImageSource &input, const std::vector<ImageEntry> &entries,
+                   TarWriter &archive, const UnpackOptions &options) {
+  for (const auto &entry : entries) {
+    stats::ScopedTimer timer("archive", entry.name, entry.size);
+    std::optional<SectionDigest> digest;
+    if (options.manifest) {
+      digest.emplace(options.manifest->sha256());
+    }
+    if (!archive.AddSection(input, entry.offset, entry.size, entry.name,
+                            digest ? &*digest : nullptr))
+      throw std::runtime_error("Could not extract image: " + entry.name);
+    if (digest) {
+      options.manifest->Add(entry.name, entry.offset, entry.size, *digest);
+    }
+  }
+}
+
+} // namespace utils
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "digest.h"
+#include "imagesource.h"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <ostream>
+#include <span>
+
+namespace utils {
+
+// Sequential ustar writer behind --output-archive: one stream of 512-byte
+// headers and data, in place of an output directory. Entries are not
+// timestamped (mtime 0), so the same image always gives the same archive.
+class TarWriter {
+public:
+  explicit TarWriter(std::ostream &out) : out_(out) {}
+
+  TarWriter(const TarWriter &) = delete;
+  TarWriter &operator=(const TarWriter &) = delete;
+
+  bool AddFile(std::string_view name, std::span<const std::byte> data);
+  // Writes [offset, offset + size) of the image as `name`, straight from the
+  // mapping when there is one, hashing it into `digest` if set.
+  bool AddSection(ImageSource &input, uint64_t offset, uint64_t size,
+                  std::string_view name, SectionDigest *digest = nullptr);
+  bool AddDirectory(std::string_view name);
+  bool AddSymlink(std::string_view name, std::string_view target);
+
+  // Ends the archive and flushes the stream.
+  bool Finish();
+
+private:
+  bool Header(std::string_view name, char type, uint64_t size,
+              std::string_view link, uint32_t mode);
+  bool Pad(uint64_t size);
+
+  std::ostream &out_;
+};
+
+// Archives every entry as stored in the image, in table order, and records
+// it in `options.manifest` if set. Throws naming the first entry that could
+// not be written.
+void ArchiveImages(ImageSource &input, const std::vector<ImageEntry> &entries,
+                   TarWriter &archive, const UnpackOptions &options);
+
+} // namespace utils
@@ -0,0 +1,494 @@
+// Benchmarks for the unpack and format paths on synthetic images.
+//
+// Images are generated once per configuration into the work directory, then
+// every case is timed with a warm page cache and, where the platform allows
+// dropping a file from the cache, with a cold one. Results are the median of
+// the iterations.
+
+#include "bootimg.h"
+#include "imagesource.h"
+#include "utils.hpp"
+#include "vendorbootimg.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+#ifndef UNPACKBOOTIMG_BENCH_FLAGS
+#define UNPACKBOOTIMG_BENCH_FLAGS "unknown"
+#endif
+
+namespace {
+constexpr uint32_t PAGE_SIZE = 4096;
+constexpr uint32_t LEGACY_PAGE_SIZE = 2048;
+constexpr uint32_t VENDOR_RAMDISK_TABLE_ENTRY_SIZE = 108;
+constexpr size_t FORMAT_CALLS = 10000;
+
+struct BenchArgs {
+  fs::path work_dir = "bench_data";
+  std::vector<uint64_t> sizes = {4 << 10, 1 << 20, 64 << 20};
+  std::vector<uint32_t> fragments = {1, 16, 256};
+  unsigned iterations = 5;
+  unsigned jobs = 0;
+  bool cold = true;
+  bool keep = false;
+};
+
+// Appends little-endian fields and fixed-size strings to a header page.
+class HeaderWriter {
+public:
+  void U32(uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+      bytes_.push_back(static_cast<char>(value >> (8 * i)));
+    }
+  }
+  void U64(uint64_t value) {
+    U32(static_cast<uint32_t>(value));
+    U32(static_cast<uint32_t>(value >> 32));
+  }
+  void Str(std::string_view text, size_t size) {
+    const size_t n = std::min(text.size(), size);
+    bytes_.append(text.data(), n);
+    bytes_.append(size - n, '\0');
+  }
+  const std::string &bytes() const { return bytes_; }
+
+private:
+  std::string bytes_;
+};
+
+// Writes sections page-aligned, filling them with cheap pseudo-random bytes
+// so nothing along the way can shortcut on zeros.
+class ImageWriter {
+public:
+  ImageWriter(const fs::path &path, uint32_t page_size)
+      : output_(path, std::ios::binary | std::ios::trunc),
+        page_size_(page_size) {}
+
+  void Bytes(std::string_view data) {
+    output_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    Pad(data.size());
+  }
+
+  void Random(uint64_t size) {
+    std::vector<uint64_t> chunk(64 << 10);
+    for (uint64_t done = 0; done < size;) {
+      for (auto &word : chunk) {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        word = state_;
+      }
+      const uint64_t n =
+          std::min<uint64_t>(size - done, chunk.size() * sizeof(uint64_t));
+      output_.write(reinterpret_cast<const char *>(chunk.data()),
+                    static_cast<std::streamsize>(n));
+      done += n;
+    }
+    Pad(size);
+  }
+
+  bool Close() {
+    output_.close();
+    return !output_.fail();
+  }
+
+private:
+  void Pad(uint64_t size) {
+    const uint64_t padding = (page_size_ - size % page_size_) % page_size_;
+    static const std::string zeros(PAGE_SIZE, '\0');
+    output_.write(zeros.data(), static_cast<std::streamsize>(padding));
+  }
+
+  std::ofstream output_;
+  uint32_t page_size_;
+  uint64_t state_ = 0x9e3779b97f4a7c15ULL;
+};
+
+constexpr uint32_t OS_VERSION = (14 << 25) | (0 << 18) | (0 << 11) |
+                                ((2024 - 2000) << 4) | 6;
+
+// Kernel and ramdisk each take half of `size`; v1/v2 add a small recovery
+// DTBO and DTB, v4 a 4 KiB signature.
+bool WriteBootImage(const fs::path &path, uint32_t version, uint64_t size) {
+  const auto kernel = static_cast<uint32_t>(size / 2);
+  const auto ramdisk = static_cast<uint32_t>(size - kernel);
+  const uint32_t dtbo = version == 1 || version == 2 ? 8 << 10 : 0;
+  const uint32_t dtb = version == 2 ? 64 << 10 : 0;
+  const uint32_t signature = version == 4 ? 4 << 10 : 0;
+
+  HeaderWriter header;
+  header.Str("ANDROID!", utils::MAGIC_SIZE);
+  uint32_t page_size = PAGE_SIZE;
+  if (version < 3) {
+    page_size = LEGACY_PAGE_SIZE;
+    const auto pages = [&](uint64_t n) {
+      return (n + page_size - 1) / page_size;
+    };
+    header.U32(kernel);
+    header.U32(0x00008000);
+    header.U32(ramdisk);
+    header.U32(0x01000000);
+    header.U32(0); // second
+    header.U32(0x00f00000);
+    header.U32(0x00000100);
+    header.U32(page_size);
+    header.U32(version);
+    header.U32(OS_VERSION);
+    header.Str("bench", 16);
+    header.Str("console=ttyMSM0,115200n8 androidboot.hardware=bench", 512);
+    header.Str("", 32);
+    header.Str("", 1024);
+    if (version >= 1) {
+      header.U32(dtbo);
+      header.U64(page_size * (1 + pages(kernel) + pages(ramdisk)));
+      header.U32(version == 1 ? 1648 : 1660);
+    }
+    if (version == 2) {
+      header.U32(dtb);
+      header.U64(0x01f00000);
+    }
+  } else {
+    header.U32(kernel);
+    header.U32(ramdisk);
+    header.U32(OS_VERSION);
+    header.U32(version == 3 ? 1580 : 1584);
+    for (int i = 0; i < 4; ++i) {
+      header.U32(0);
+    }
+    header.U32(version);
+    header.Str("console=ttyMSM0,115200n8 androidboot.hardware=bench", 1536);
+    if (version == 4) {
+      header.U32(signature);
+    }
+  }
+
+  ImageWriter image(path, page_size);
+  image.Bytes(header.bytes());
+  image.Random(kernel);
+  image.Random(ramdisk);
+  image.Random(signature);
+  image.Random(dtbo);
+  image.Random(dtb);
+  return image.Close();
+}
+
+// The ramdisk region of `size` bytes is split into `fragments` entries (v4
+// only; v3 has a single ramdisk).
+bool WriteVendorBootImage(const fs::path &path, uint32_t version,
+                          uint64_t size, uint32_t fragments) {
+  fragments = version > 3 ? std::max<uint32_t>(fragments, 1) : 1;
+  const auto ramdisk = static_cast<uint32_t>(size);
+  const uint32_t dtb = 64 << 10;
+  const std::string bootconfig = "androidboot.hardware=bench\n";
+  const uint32_t table_size = fragments * VENDOR_RAMDISK_TABLE_ENTRY_SIZE;
+
+  HeaderWriter header;
+  header.Str("VNDRBOOT", utils::MAGIC_SIZE);
+  header.U32(version);
+  header.U32(PAGE_SIZE);
+  header.U32(0x00008000);
+  header.U32(0x01000000);
+  header.U32(ramdisk);
+  header.Str("androidboot.console=ttyMSM0", 2048);
+  header.U32(0x00000100);
+  header.Str("bench", 16);
+  header.U32(version == 3 ? 2112 : 2128);
+  header.U32(dtb);
+  header.U64(0x01f00000);
+  if (version > 3) {
+    header.U32(table_size);
+    header.U32(fragments);
+    header.U32(VENDOR_RAMDISK_TABLE_ENTRY_SIZE);
+    header.U32(static_cast<uint32_t>(bootconfig.size()));
+  }
+
+  HeaderWriter table;
+  const uint32_t fragment_size = ramdisk / fragments;
+  for (uint32_t i = 0; i < fragments; ++i) {
+    const uint32_t offset = i * fragment_size;
+    table.U32(i + 1 == fragments ? ramdisk - offset : fragment_size);
+    table.U32(offset);
+    table.U32(i == 0 ? 1 : 3); // platform, then dlkm
+    table.Str("fragment" + std::to_string(i), 32);
+    for (int j = 0; j < 16; ++j) {
+      table.U32(j == 0 ? i : 0);
+    }
+  }
+
+  ImageWriter image(path, PAGE_SIZE);
+  image.Bytes(header.bytes());
+  image.Random(ramdisk);
+  image.Random(dtb);
+  if (version > 3) {
+    image.Bytes(table.bytes());
+    image.Bytes(bootconfig);
+  }
+  return image.Close();
+}
+
+// Drops the file's pages from the page cache; false where unsupported.
+bool Evict(const fs::path &path) {
+#if defined(POSIX_FADV_DONTNEED)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  ::close(fd);
+  return ok;
+#else
+  (void)path;
+  return false;
+#endif
+}
+
+double Median(std::vector<double> samples) {
+  std::sort(samples.begin(), samples.end());
+  const size_t mid = samples.size() / 2;
+  return samples.size() % 2 ? samples[mid]
+                            : (samples[mid - 1] + samples[mid]) / 2;
+}
+
+std::string FormatSize(uint64_t size) {
+  if (size >= (1ULL << 30) && size % (1ULL << 30) == 0)
+    return std::to_string(size >> 30) + "G";
+  if (size >= (1ULL << 20) && size % (1ULL << 20) == 0)
+    return std::to_string(size >> 20) + "M";
+  if (size >= (1ULL << 10) && size % (1ULL << 10) == 0)
+    return std::to_string(size >> 10) + "K";
+  return std::to_string(size);
+}
+
+void Report(std::string_view name, std::string_view cache, double seconds,
+            uint64_t bytes) {
+  std::cout << std::format("{:<32}{:<6}{:>12.3f} ms", name, cache,
+                           seconds * 1e3);
+  if (bytes > 0 && seconds > 0) {
+    std::cout << std::format("{:>12.1f} MB/s",
+                             static_cast<double>(bytes) / 1e6 / seconds);
+  }
+  std::cout << "\n";
+}
+
+// Times `unpack` warm and cold, then both format functions on its result.
+template <typename Info, typename Unpack>
+void RunCase(const BenchArgs &args, const std::string &name,
+             const fs::path &image, uint64_t payload, Unpack unpack) {
+  const fs::path output = args.work_dir / "out";
+  utils::UnpackOptions options;
+  options.jobs = args.jobs;
+
+  Info info;
+  for (const bool cold : {false, true}) {
+    if (cold && !args.cold) {
+      continue;
+    }
+    std::vector<double> samples;
+    // One untimed run warms the cache (and the output directory)
+    for (unsigned i = 0; i <= args.iterations; ++i) {
+      std::error_code ec;
+      fs::remove_all(output, ec);
+      if (cold && !Evict(image)) {
+        std::cout << std::format("{:<32}cold  unsupported here\n", name);
+        break;
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      utils::ImageSource input;
+      if (!input.Open(image)) {
+        throw std::runtime_error("Could not open " + image.string());
+      }
+      info = unpack(input, output, options);
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      if (i > 0 || cold) {
+        samples.push_back(elapsed.count());
+      }
+    }
+    if (!samples.empty()) {
+      Report(name, cold ? "cold" : "warm", Median(samples), payload);
+    }
+  }
+
+  // Format functions are too quick to time one call at a time
+  size_t sink = 0;
+  auto time_calls = [&](std::string_view label, const auto &call) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < FORMAT_CALLS; ++i) {
+      sink += call();
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << std::format("{:<32}{:<6}{:>12.3f} us/call\n",
+                             name + " " + std::string(label), "warm",
+                             elapsed.count() * 1e6 / FORMAT_CALLS);
+  };
+  time_calls("pretty", [&] { return FormatPrettyText(info).size(); });
+  time_calls("mkbootimg",
+             [&] { return FormatMkbootimgArguments(info).size(); });
+  if (sink == 0) {
+    std::cout << "(empty formatter output)\n";
+  }
+}
+
+uint64_t ParseSize(std::string_view text) {
+  uint64_t value = 0;
+  const auto [ptr, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), value);
+  const std::string_view suffix(ptr, text.data() + text.size() - ptr);
+  if (ec != std::errc() || suffix.size() > 1) {
+    throw std::invalid_argument("Invalid size: " + std::string(text));
+  }
+  if (suffix == "K" || suffix == "k")
+    return value << 10;
+  if (suffix == "M" || suffix == "m")
+    return value << 20;
+  if (suffix == "G" || suffix == "g")
+    return value << 30;
+  if (!suffix.empty())
+    throw std::invalid_argument("Invalid size: " + std::string(text));
+  return value;
+}
+
+template <typename T, typename Parse>
+std::vector<T> ParseList(std::string_view text, Parse parse) {
+  std::vector<T> values;
+  for (size_t start = 0; start <= text.size();) {
+    size_t end = text.find(',', start);
+    if (end == std::string_view::npos)
+      end = text.size();
+    if (end > start)
+      values.push_back(static_cast<T>(parse(text.substr(start, end - start))));
+    start = end + 1;
+  }
+  return values;
+}
+
+BenchArgs ParseArguments(int argc, char *argv[]) {
+  BenchArgs args;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (++i >= argc)
+        throw std::invalid_argument("Missing value for " + std::string(arg));
+      return argv[i];
+    };
+    auto number = [](std::string_view text) {
+      return static_cast<unsigned>(ParseSize(text));
+    };
+
+    if (arg == "--dir") {
+      args.work_dir = value();
+    } else if (arg == "--sizes") {
+      args.sizes = ParseList<uint64_t>(value(), ParseSize);
+    } else if (arg == "--fragments") {
+      args.fragments = ParseList<uint32_t>(value(), number);
+    } else if (arg == "--iterations") {
+      args.iterations = std::max(1U, number(value()));
+    } else if (arg == "--jobs") {
+      args.jobs = number(value());
+    } else if (arg == "--warm-only") {
+      args.cold = false;
+    } else if (arg == "--keep") {
+      args.keep = true;
+    } else if (arg == "-h" || arg == "--help") {
+      std::cout << R"(Usage: unpackbootimg_bench [options]
+
+  --dir <dir>            Work directory for generated images (default: bench_data).
+  --sizes <list>         Payload sizes, e.g. 4K,1M,64M,1G (default: 4K,1M,64M). Boot
+                          images split it between kernel and ramdisk; vendor_boot
+                          images use it for the ramdisk region.
+  --fragments <list>     vendor_boot v4 ramdisk fragment counts, 1-256 (default: 1,16,256).
+  --iterations <n>       Timed runs per case; the median is reported (default: 5).
+  --jobs <n>             Passed to the unpackers as --jobs (default: hardware concurrency).
+  --warm-only            Skip the cold-cache runs.
+  --keep                 Keep the generated images.
+)";
+      std::exit(EXIT_SUCCESS);
+    } else {
+      throw std::invalid_argument("Unknown argument: " + std::string(arg));
+    }
+  }
+  for (const uint32_t n : args.fragments) {
+    if (n < 1 || n > 256)
+      throw std::invalid_argument("Fragment counts must be within 1-256.");
+  }
+  for (const uint64_t size : args.sizes) {
+    if (size == 0 || size > (1ULL << 30))
+      throw std::invalid_argument("Sizes must be within 1 byte and 1G.");
+  }
+  return args;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    const BenchArgs args = ParseArguments(argc, argv);
+    if (!utils::CreateDirectory(args.work_dir)) {
+      throw std::runtime_error("Could not create " + args.work_dir.string());
+    }
+    std::cout << "flags: " << UNPACKBOOTIMG_BENCH_FLAGS << "\n";
+
+    const auto unpack_boot = [](utils::ImageSource &input,
+                                const fs::path &output,
+                                const utils::UnpackOptions &options) {
+      return UnpackBootImage(input, output, options);
+    };
+    const auto unpack_vendor = [](utils::ImageSource &input,
+                                  const fs::path &output,
+                                  const utils::UnpackOptions &options) {
+      return UnpackVendorBootImage(input, output, options);
+    };
+
+    for (const uint64_t size : args.sizes) {
+      for (uint32_t version = 0; version <= 4; ++version) {
+        const std::string name =
+            std::format("boot v{} {}", version, FormatSize(size));
+        const fs::path image = args.work_dir / "boot.img";
+        if (!WriteBootImage(image, version, size))
+          throw std::runtime_error("Could not write " + image.string());
+        RunCase<BootImageInfo>(args, name, image, size, unpack_boot);
+      }
+
+      const fs::path image = args.work_dir / "vendor_boot.img";
+      if (!WriteVendorBootImage(image, 3, size, 1))
+        throw std::runtime_error("Could not write " + image.string());
+      RunCase<VendorBootImageInfo>(
+          args, std::format("vendor v3 {}", FormatSize(size)), image, size,
+          unpack_vendor);
+
+      for (const uint32_t fragments : args.fragments) {
+        if (!WriteVendorBootImage(image, 4, size, fragments))
+          throw std::runtime_error("Could not write " + image.string());
+        RunCase<VendorBootImageInfo>(
+            args,
+            std::format("vendor v4 {} x{}", FormatSize(size), fragments),
+            image, size, unpack_vendor);
+      }
+    }
+
+    if (!args.keep) {
+      std::error_code ec;
+      fs::remove_all(args.work_dir, ec);
+    }
+    return EXIT_SUCCESS;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}
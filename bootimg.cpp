@@ -1,165 +1,326 @@
 #include "bootimg.h"
+#include "archive.h"
+#include "digest.h"
+#include "dtb.h"
+#include "imageview.h"
+#include "report.h"
+#include "threadpool.h"
 
-namespace {
-constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
-constexpr uint32_t SHA_LENGTH = 32;
-constexpr uint32_t BOARDNAME_SIZE = 16;
-constexpr uint32_t CMDLINE_SIZE = 512;
-constexpr uint32_t EXTRA_CMDLINE_SIZE = 1024;
-constexpr uint32_t EXTENDED_CMDLINE_SIZE =
-    CMDLINE_SIZE + EXTRA_CMDLINE_SIZE; // v3 and newer = cmdline + extra cmdline
-} // namespace
-
-BootImageInfo UnpackBootImage(std::ifstream &input,
-                              const std::filesystem::path &output_dir) {
-  BootImageInfo info;
+#include <optional>
 
-  // Read boot magic
-  if (!utils::ReadString(input, utils::MAGIC_SIZE, info.boot_magic))
-    throw errors::FileReadError("boot magic");
-
-  // Read kernel/ramdisk/second info (9 uint32_t)
-  std::array<uint32_t, 9> kernel_ramdisk_second_info;
-  for (auto &val : kernel_ramdisk_second_info) {
-    if (!utils::ReadU32(input, val))
-      throw errors::FileReadError("header information");
+namespace {
+void IndexParams(BootImageInfo &info, const utils::UnpackOptions &options) {
+  if (options.index_params) {
+    info.params.emplace();
+    info.params->cmdline = utils::ParseCmdline(
+        utils::JoinCmdline(info.cmdline, info.extra_cmdline));
   }
+}
 
-  info.header_version = kernel_ramdisk_second_info[8];
-  info.page_size = (info.header_version < 3) ? kernel_ramdisk_second_info[7]
-                                             : BOOT_IMAGE_HEADER_V3_PAGESIZE;
+BootImageInfo ParseBootImageHeader(std::span<const std::byte> header,
+                                   utils::BootImageView &view) {
+  if (const auto result = utils::ParseBootImage(header, view); !result)
+    throw errors::FileReadError(result.field);
 
-  // Handle version-specific fields
-  uint32_t os_version_patch_level;
-  if (info.header_version < 3) {
-    info.kernel_size = kernel_ramdisk_second_info[0];
-    info.kernel_load_address = kernel_ramdisk_second_info[1];
-    info.ramdisk_size = kernel_ramdisk_second_info[2];
-    info.ramdisk_load_address = kernel_ramdisk_second_info[3];
-    info.second_size = kernel_ramdisk_second_info[4];
-    info.second_load_address = kernel_ramdisk_second_info[5];
-    info.tags_load_address = kernel_ramdisk_second_info[6];
-
-    if (!utils::ReadU32(input, os_version_patch_level))
-      throw errors::FileReadError("os/version patch level");
-  } else {
-    info.kernel_size = kernel_ramdisk_second_info[0];
-    info.ramdisk_size = kernel_ramdisk_second_info[1];
-    os_version_patch_level = kernel_ramdisk_second_info[2];
-  }
+  BootImageInfo info;
+  info.boot_magic = view.boot_magic;
+  info.header_version = view.header_version;
+  info.page_size = view.page_size;
+  info.kernel_size = view.kernel_size;
+  info.ramdisk_size = view.ramdisk_size;
+  info.cmdline = view.cmdline;
 
   // Decode OS version/patch level
   auto [os_ver, os_patch] =
-      utils::DecodeOsVersionPatchLevel(os_version_patch_level);
+      utils::DecodeOsVersionPatchLevel(view.os_version_patch_level);
   info.os_version = os_ver.value_or("");
   info.os_patch_level = os_patch.value_or("");
 
-  // Handle command line fields
-  if (info.header_version < 3) {
-    if (!utils::ReadString(input, BOARDNAME_SIZE, info.product_name))
-      throw errors::FileReadError("board name");
+  info.kernel_load_address = view.kernel_load_address;
+  info.ramdisk_load_address = view.ramdisk_load_address;
+  info.second_size = view.second_size;
+  info.second_load_address = view.second_load_address;
+  info.tags_load_address = view.tags_load_address;
+  info.product_name = view.product_name;
+  info.extra_cmdline = view.extra_cmdline;
 
-    if (!utils::ReadString(input, CMDLINE_SIZE, info.cmdline))
-      throw errors::FileReadError("boot cmdline");
+  info.recovery_dtbo_size = view.recovery_dtbo_size;
+  info.recovery_dtbo_offset = view.recovery_dtbo_offset;
+  info.boot_header_size = view.boot_header_size;
 
-    input.seekg(SHA_LENGTH, std::ios::cur);
-    if (!input)
-      throw errors::FileReadError("SHA-1 checksum");
+  info.dtb_size = view.dtb_size;
+  info.dtb_load_address = view.dtb_load_address;
 
-    if (!utils::ReadString(input, EXTRA_CMDLINE_SIZE, info.extra_cmdline))
-      throw errors::FileReadError("boot extra cmdline");
-  } else {
-    if (!utils::ReadString(input, EXTENDED_CMDLINE_SIZE, info.cmdline))
-      throw errors::FileReadError("boot cmdline");
+  info.boot_signature_size = view.boot_signature_size;
+  return info;
+}
+
+std::vector<utils::ImageEntry>
+GetImageEntries(const utils::BootImageView &view,
+                const utils::UnpackOptions &options) {
+  std::vector<utils::ImageEntry> image_entries;
+  for (const auto &section : view.sections) {
+    if (options.Selects(section.name)) {
+      image_entries.emplace_back(section.offset,
+                                 static_cast<uint32_t>(section.size),
+                                 std::string(section.name), section.kind);
+    }
   }
+  return image_entries;
+}
 
-  // Handle version-specific extensions
-  if (info.header_version == 1 || info.header_version == 2) {
-    if (!utils::ReadU32(input, info.recovery_dtbo_size))
-      throw errors::FileReadError("recovery_dtbo_size");
-    if (!utils::ReadU64(input, info.recovery_dtbo_offset))
-      throw errors::FileReadError("recovery_dtbo_offset");
-    if (!utils::ReadU32(input, info.boot_header_size))
-      throw errors::FileReadError("boot_header_size");
+unsigned DecodeJobs(const utils::UnpackOptions &options) {
+  return options.jobs > 0 ? options.jobs
+                          : utils::ThreadPool::DefaultConcurrency();
+}
+
+// Reads the kernel section once more, from the mapping where there is one,
+// to fill in `info`; with --decompress-kernel this also writes it (and, as
+// it then replaces the copy, records it in the manifest and output cache and
+// feeds it to the image tap).
+void ScanKernel(utils::ImageSource &input, const utils::ImageEntry &entry,
+                const std::filesystem::path &output_dir,
+                const utils::UnpackOptions &options, utils::KernelInfo &info) {
+  utils::stats::ScopedTimer timer("scan", entry.name, entry.size);
+  std::optional<utils::SectionDigest> digest;
+  if (options.decompress_kernel && (options.manifest || options.cache)) {
+    digest.emplace(options.manifest && options.manifest->sha256());
+    if (options.image_tap) {
+      digest->Tap(*options.image_tap, entry.offset);
+    }
+  } else if (options.decompress_kernel && options.image_tap) {
+    digest.emplace(*options.image_tap, entry.offset);
   }
 
-  if (info.header_version == 2) {
-    if (!utils::ReadU32(input, info.dtb_size))
-      throw errors::FileReadError("dtb_size");
-    if (!utils::ReadU64(input, info.dtb_load_address))
-      throw errors::FileReadError("dtb_load_address");
+  // An unchanged decoded kernel is still scanned, just not written
+  bool write = options.decompress_kernel;
+  if (write && options.cache) {
+    if (!utils::HashRange(input, entry.offset, entry.size, *digest))
+      throw std::runtime_error("Could not extract image: " + entry.name);
+    write = !options.cache->Unchanged(
+        entry, utils::RamdiskOutput::Decompressed, digest->xxh64());
+    if (!write) {
+      utils::stats::Count(utils::stats::SECTIONS_UNCHANGED);
+    }
   }
+  utils::KernelAnalyzer analyzer(
+      write ? output_dir / entry.name : std::filesystem::path(),
+      DecodeJobs(options), options.pool);
+
+  constexpr uint64_t kScanChunkSize = 1 << 20;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < entry.size;) {
+    const size_t chunk = static_cast<size_t>(
+        std::min<uint64_t>(entry.size - done, kScanChunkSize));
+    const auto data = input.Slice(entry.offset + done, chunk, scratch);
+    if (data.empty() ||
+        analyzer.sputn(reinterpret_cast<const char *>(data.data()),
+                       static_cast<std::streamsize>(chunk)) !=
+            static_cast<std::streamsize>(chunk)) {
+      throw std::runtime_error("Could not extract image: " + entry.name);
+    }
+    if (digest && !options.cache) {
+      digest->Update(data);
+    }
+    done += chunk;
+  }
+  if (!analyzer.Finish(info))
+    throw std::runtime_error("Could not extract image: " + entry.name);
+  if (options.drop_cache && write) {
+    utils::DropCachedFile(output_dir / entry.name);
+  }
+  if (write && options.cache) {
+    options.cache->Record(entry, utils::RamdiskOutput::Decompressed,
+                          digest->xxh64());
+  }
+  if (digest && options.manifest) {
+    options.manifest->Add(entry.name, entry.offset, entry.size, *digest);
+  }
+}
 
-  if (info.header_version >= 4) {
-    if (!utils::ReadU32(input, info.boot_signature_size))
-      throw errors::FileReadError("boot_signature_size");
+std::string KernelFormat(const utils::KernelInfo &kernel) {
+  std::string format = kernel.compression == utils::Compression::None
+                           ? ""
+                           : utils::CompressionName(kernel.compression);
+  if (kernel.compression != utils::Compression::None && !kernel.decoded) {
+    return format + " (not decoded)";
+  }
+  if (kernel.arm64) {
+    return format.empty() ? "arm64 Image" : format + " (arm64 Image)";
   }
+  return format.empty() ? "raw" : format;
+}
 
-  // Calculate image offsets
-  std::vector<utils::ImageEntry> image_entries;
-  const uint32_t page_size = info.page_size;
-  const uint32_t num_header_pages = 1;
+} // namespace
 
-  // Kernel
-  uint32_t num_kernel_pages =
-      utils::GetNumberOfPages(info.kernel_size, page_size);
-  if (info.kernel_size > 0) { // Patch1: Only unpack kernel if it exists
-    image_entries.emplace_back(page_size * num_header_pages, info.kernel_size,
-                               "kernel");
-  }
+BootImageInfo UnpackBootImage(utils::ImageSource &input,
+                              const std::filesystem::path &output_dir,
+                              const utils::UnpackOptions &options) {
+  // Every header version fits in the first (v3+ fixed size) page
+  utils::stats::Stopwatch header_watch;
+  std::vector<std::byte> header_scratch;
+  utils::BootImageView view;
+  BootImageInfo info = ParseBootImageHeader(
+      input.Slice(0,
+                  static_cast<size_t>(std::min<uint64_t>(
+                      input.size(), utils::HEADER_READ_SIZE)),
+                  header_scratch),
+      view);
+  header_watch.Record("header");
+  IndexParams(info, options);
 
-  // Ramdisk
-  uint32_t num_ramdisk_pages =
-      utils::GetNumberOfPages(info.ramdisk_size, page_size);
-  if (info.ramdisk_size > 0) { // Patch2: Only unpack ramdisk if it exists
-    image_entries.emplace_back(page_size *
-                                   (num_header_pages + num_kernel_pages),
-                               info.ramdisk_size, "ramdisk");
+  info.image_dir = output_dir;
+  if (options.verify && (!options.extract || options.archive)) {
+    info.verification = utils::VerifyImage(input, &view);
+  }
+  if (!options.extract) {
+    return info;
   }
 
-  // Second
-  if (info.second_size > 0) {
-    image_entries.emplace_back(
-        page_size * (num_header_pages + num_kernel_pages + num_ramdisk_pages),
-        info.second_size, "second");
+  // Otherwise the checks take the sections as they are extracted
+  std::optional<utils::VerificationTap> tap;
+  utils::UnpackOptions extract_options = options;
+  if (options.verify && !options.archive) {
+    tap.emplace(input, &view);
+    extract_options.image_tap = &*tap;
   }
 
-  // Recovery DTBO
-  if (info.recovery_dtbo_size > 0) {
-    image_entries.emplace_back(info.recovery_dtbo_offset,
-                               info.recovery_dtbo_size, "recovery_dtbo");
+  auto image_entries = GetImageEntries(view, options);
+
+  // The kernel is scanned after the copy, or decoded instead of copied (ahead
+  // of the other sections, as it comes first in the image)
+  std::optional<utils::ImageEntry> kernel;
+  const auto it =
+      std::find_if(image_entries.begin(), image_entries.end(),
+                   [](const auto &entry) {
+                     return entry.kind == utils::SectionKind::Kernel;
+                   });
+  if (it != image_entries.end()) {
+    kernel = *it;
+    if (options.decompress_kernel) {
+      image_entries.erase(it);
+    }
   }
 
-  // DTB
-  if (info.dtb_size > 0) {
-    image_entries.emplace_back(
-        page_size *
-            (num_header_pages + num_kernel_pages + num_ramdisk_pages +
-             utils::GetNumberOfPages(info.second_size, page_size) +
-             utils::GetNumberOfPages(info.recovery_dtbo_size, page_size)),
-        info.dtb_size, "dtb");
+  if (options.archive) {
+    utils::ArchiveImages(input, image_entries, *options.archive, options);
+  } else {
+    // Create output directory
+    if (!utils::CreateDirectory(output_dir))
+      throw std::runtime_error("Could not create output directory.");
+
+    if (kernel && options.decompress_kernel) {
+      ScanKernel(input, *kernel, output_dir, extract_options, info.kernel);
+    }
+    // Extract images
+    utils::ExtractImages(input, image_entries, output_dir, extract_options);
+  }
+  if (kernel && (options.archive || !options.decompress_kernel)) {
+    ScanKernel(input, *kernel, output_dir, options, info.kernel);
   }
+  if (options.split_dtb) {
+    utils::SplitDeviceTrees(input, image_entries, output_dir, options);
+  }
+  if (tap) {
+    info.verification = tap->Finish();
+  }
+
+  return info;
+}
+
+BootImageInfo UnpackBootImage(utils::StreamSource &input,
+                              const std::filesystem::path &output_dir,
+                              const utils::UnpackOptions &options) {
+  utils::stats::Stopwatch header_watch;
+  utils::BootImageView view;
+  BootImageInfo info =
+      ParseBootImageHeader(input.ReadHead(utils::HEADER_READ_SIZE), view);
+  header_watch.Record("header");
+  IndexParams(info, options);
+  if (options.archive)
+    throw std::runtime_error("Archive output needs a seekable image.");
 
-  // Boot signature
-  if (info.boot_signature_size > 0) {
-    image_entries.emplace_back(
-        page_size * (num_header_pages + num_kernel_pages + num_ramdisk_pages),
-        info.boot_signature_size, "boot_signature");
+  info.image_dir = output_dir;
+
+  // The id is recomputed from a tap beside the section sinks; the AVB footer
+  // at the far end of the image cannot be read ahead of what it covers
+  std::optional<utils::BootIdVerifier> id;
+  if (options.verify) {
+    info.verification.emplace();
+    info.verification->avb = {utils::VerifyStatus::NotChecked,
+                              "needs a seekable image"};
+    if (view.header_version < 3) {
+      id.emplace(view);
+    }
+  }
+  if (!options.extract && !id) {
+    return info;
   }
 
   // Create output directory
-  if (!utils::CreateDirectory(output_dir))
+  if (options.extract && !utils::CreateDirectory(output_dir))
     throw std::runtime_error("Could not create output directory.");
 
-  // Extract images
+  // The kernel is teed into the analyzer, which writes it when decoding
+  const auto image_entries = options.extract
+                                 ? GetImageEntries(view, options)
+                                 : std::vector<utils::ImageEntry>();
+  std::optional<utils::KernelAnalyzer> kernel;
+  std::vector<utils::ForwardSink> sinks;
+  std::vector<utils::SectionDigest> digests;
+  digests.reserve(image_entries.size());
   for (const auto &entry : image_entries) {
-    const auto output_path = output_dir / entry.name;
-    if (!utils::ExtractImage(input, entry.offset, entry.size, output_path)) {
-      throw std::runtime_error("Could not extract image: " + entry.name);
+    utils::SectionDigest *digest = nullptr;
+    if (options.manifest) {
+      digest = &digests.emplace_back(options.manifest->sha256());
+    }
+    if (entry.kind == utils::SectionKind::Kernel) {
+      kernel.emplace(options.decompress_kernel ? output_dir / entry.name
+                                               : std::filesystem::path(),
+                     DecodeJobs(options), options.pool);
+      sinks.push_back({entry.offset, entry.size, entry.name, nullptr,
+                       utils::RamdiskOutput::Raw, &*kernel,
+                       options.decompress_kernel ? digest : nullptr});
+      if (options.decompress_kernel) {
+        continue;
+      }
+    }
+    sinks.push_back({entry.offset, entry.size, entry.name, nullptr,
+                     options.OutputFor(entry.kind), nullptr, digest});
+  }
+  if (id) {
+    sinks.push_back({id->begin(), id->end() - id->begin(), "mkbootimg id",
+                     nullptr, utils::RamdiskOutput::Raw, &*id});
+  }
+  // Device tree sections are also kept in memory to be split afterwards
+  std::vector<std::pair<utils::ImageEntry, std::vector<std::byte>>> trees;
+  if (options.split_dtb) {
+    for (const auto &entry : image_entries) {
+      if (utils::IsDeviceTreeSection(entry)) {
+        trees.emplace_back(entry, std::vector<std::byte>());
+      }
+    }
+    for (auto &[entry, data] : trees) {
+      sinks.push_back({entry.offset, entry.size, entry.name, &data});
     }
   }
 
-  info.image_dir = output_dir;
+  // Extract images in file order
+  input.Extract(sinks, output_dir, options);
+  if (kernel && !kernel->Finish(info.kernel))
+    throw std::runtime_error("Could not extract image: kernel");
+  if (id) {
+    info.verification->id = id->Finish();
+  }
+  if (options.split_dtb && options.extract) {
+    utils::SplitDeviceTrees(trees, output_dir, options);
+  }
+
+  for (size_t i = 0; i < digests.size(); ++i) {
+    const auto &entry = image_entries[i];
+    options.manifest->Add(entry.name, entry.offset, entry.size, digests[i]);
+  }
+
   return info;
 }
 
@@ -212,6 +373,31 @@ std::string FormatPrettyText(const BootImageInfo &info) {
         << "\n";
   }
 
+  if (info.kernel.scanned) {
+    oss << "kernel format: " << KernelFormat(info.kernel) << "\n";
+    if (info.kernel.decoded) {
+      oss << "kernel uncompressed size: " << std::dec
+          << info.kernel.uncompressed_size << "\n";
+    }
+    if (info.kernel.arm64) {
+      oss << "kernel image size: " << info.kernel.image_size << "\n"
+          << "kernel text offset: 0x" << std::hex << info.kernel.text_offset
+          << "\n"
+          << "kernel flags: 0x" << info.kernel.flags << std::dec << "\n";
+    }
+    if (!info.kernel.version.empty()) {
+      oss << "kernel version: " << info.kernel.version << "\n";
+    }
+  }
+
+  if (info.verification) {
+    if (const auto &id = info.verification->id) {
+      oss << "boot image id: " << utils::FormatVerifyResult(*id) << "\n";
+    }
+    oss << "avb hash footer: "
+        << utils::FormatVerifyResult(info.verification->avb) << "\n";
+  }
+
   return oss.str();
 }
 
@@ -272,3 +458,119 @@ std::vector<std::string> FormatMkbootimgArguments(const BootImageInfo &info) {
 
   return args;
 }
+
+void AppendJson(const BootImageInfo &info, std::string_view image,
+                std::string &out) {
+  utils::JsonWriter json(out);
+  json.BeginObject();
+  json.String("image", image);
+  json.String("boot_magic", info.boot_magic);
+  json.Number("header_version", info.header_version);
+  json.Number("kernel_size", info.kernel_size);
+  json.Number("ramdisk_size", info.ramdisk_size);
+  if (info.header_version < 3) {
+    json.Number("kernel_load_address", info.kernel_load_address);
+    json.Number("ramdisk_load_address", info.ramdisk_load_address);
+    json.Number("second_size", info.second_size);
+    json.Number("second_load_address", info.second_load_address);
+    json.Number("tags_load_address", info.tags_load_address);
+  }
+  json.Number("page_size", info.page_size);
+  json.String("os_version", info.os_version);
+  json.String("os_patch_level", info.os_patch_level);
+  if (info.header_version < 3) {
+    json.String("product_name", info.product_name);
+  }
+  json.String("cmdline", info.cmdline);
+  if (info.header_version < 3) {
+    json.String("extra_cmdline", info.extra_cmdline);
+  }
+  if (info.params) {
+    utils::AppendJson(*info.params, false, json);
+  }
+  if (info.header_version == 1 || info.header_version == 2) {
+    json.Number("recovery_dtbo_size", info.recovery_dtbo_size);
+    json.Number("recovery_dtbo_offset", info.recovery_dtbo_offset);
+    json.Number("boot_header_size", info.boot_header_size);
+  }
+  if (info.header_version == 2) {
+    json.Number("dtb_size", info.dtb_size);
+    json.Number("dtb_load_address", info.dtb_load_address);
+  }
+  if (info.header_version >= 4) {
+    json.Number("boot_signature_size", info.boot_signature_size);
+  }
+
+  if (info.kernel.scanned) {
+    json.BeginObject("kernel");
+    json.String("format", KernelFormat(info.kernel));
+    json.Bool("decoded", info.kernel.decoded);
+    if (info.kernel.decoded) {
+      json.Number("uncompressed_size", info.kernel.uncompressed_size);
+    }
+    if (info.kernel.arm64) {
+      json.Number("image_size", info.kernel.image_size);
+      json.Number("text_offset", info.kernel.text_offset);
+      json.Number("flags", info.kernel.flags);
+    }
+    if (!info.kernel.version.empty()) {
+      json.String("version", info.kernel.version);
+    }
+    json.EndObject();
+  }
+
+  if (info.verification) {
+    json.BeginObject("verification");
+    if (const auto &id = info.verification->id) {
+      json.String("id", utils::FormatVerifyResult(*id));
+    }
+    json.String("avb", utils::FormatVerifyResult(info.verification->avb));
+    json.EndObject();
+  }
+  json.EndObject();
+}
+
+void AppendRecord(const BootImageInfo &info, std::string_view image,
+                  std::string &out) {
+  utils::RecordWriter record(out, info.boot_magic, info.header_version,
+                             info.page_size, image);
+  for (const uint32_t size :
+       {info.kernel_size, info.ramdisk_size, info.second_size,
+        info.recovery_dtbo_size, info.dtb_size, info.boot_signature_size}) {
+    record.U32(size);
+  }
+  for (const uint32_t value :
+       {info.kernel_load_address, info.ramdisk_load_address,
+        info.second_load_address, info.tags_load_address,
+        info.boot_header_size}) {
+    record.U32(value);
+  }
+  record.U64(info.recovery_dtbo_offset);
+  record.U64(info.dtb_load_address);
+  for (const std::string_view text :
+       {info.os_version, info.os_patch_level, info.product_name, info.cmdline,
+        info.extra_cmdline}) {
+    record.String(text);
+  }
+
+  const auto &kernel = info.kernel;
+  record.U8(kernel.scanned);
+  record.U8(kernel.decoded);
+  record.U8(kernel.arm64);
+  record.U8(0);
+  record.String(kernel.compression == utils::Compression::None
+                    ? ""
+                    : utils::CompressionName(kernel.compression));
+  record.U64(kernel.uncompressed_size);
+  record.U64(kernel.image_size);
+  record.U64(kernel.text_offset);
+  record.U64(kernel.flags);
+  record.String(kernel.version);
+
+  const auto &verification = info.verification;
+  record.VerifyStatus(verification ? verification->id : std::nullopt);
+  record.VerifyStatus(verification
+                          ? std::optional(verification->avb)
+                          : std::nullopt);
+  record.Finish();
+}
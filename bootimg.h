@@ -1,6 +1,11 @@
 #pragma once
 
+#include "bootparams.h"
+#include "imagesource.h"
+#include "kernel.h"
+#include "streamsource.h"
 #include "utils.hpp"
+#include "verify.h"
 
 struct BootImageInfo {
   std::string boot_magic;
@@ -35,11 +40,43 @@ struct BootImageInfo {
   // Version 4+ fields
   uint32_t boot_signature_size = 0;
 
+  // Filled in when the kernel is extracted
+  utils::KernelInfo kernel;
+
+  // Set with --verify
+  std::optional<utils::Verification> verification;
+
+  // Set with UnpackOptions::index_params: cmdline and extra_cmdline
+  std::optional<utils::BootParams> params;
+
   std::filesystem::path image_dir;
 };
 
-BootImageInfo UnpackBootImage(std::ifstream &input,
-                              const std::filesystem::path &output_dir);
+BootImageInfo UnpackBootImage(utils::ImageSource &input,
+                              const std::filesystem::path &output_dir,
+                              const utils::UnpackOptions &options = {});
+
+// Same as above for non-seekable input: sections are read strictly forward.
+BootImageInfo UnpackBootImage(utils::StreamSource &input,
+                              const std::filesystem::path &output_dir,
+                              const utils::UnpackOptions &options = {});
 
 std::string FormatPrettyText(const BootImageInfo &info);
 std::vector<std::string> FormatMkbootimgArguments(const BootImageInfo &info);
+
+// The header information as one JSON object (--format=json) or binary
+// record (--format=record, see report.h), appended to `out`. `image` is the
+// path the image was read from.
+void AppendJson(const BootImageInfo &info, std::string_view image,
+                std::string &out);
+// After the common start: the sizes of kernel, ramdisk, second,
+// recovery_dtbo, dtb and boot_signature, the kernel, ramdisk, second and
+// tags load addresses and boot_header_size (u32 each);
+// recovery_dtbo_offset and dtb_load_address (u64); os_version,
+// os_patch_level, product_name, cmdline and extra_cmdline (strings); the
+// kernel scan: scanned, decoded and arm64 (u8 each, then a reserved u8),
+// compression (string), uncompressed size, image size, text offset and
+// flags (u64 each) and version (string); then the id and avb verify results.
+// Fields a header version lacks are zero or empty.
+void AppendRecord(const BootImageInfo &info, std::string_view image,
+                  std::string &out);
@@ -0,0 +1,327 @@
+#include "bootparams.h"
+#include "imagesource.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace utils {
+
+namespace {
+constexpr size_t BOOT_CMDLINE_SIZE = 512;
+constexpr std::string_view BOOTCONFIG_MAGIC = "#BOOTCONFIG\n";
+constexpr size_t BOOTCONFIG_TRAILER_SIZE =
+    2 * sizeof(uint32_t) + BOOTCONFIG_MAGIC.size();
+
+bool IsSpace(char c) { return std::isspace(static_cast<unsigned char>(c)); }
+
+bool IsKeyChar(char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' ||
+         c == '.';
+}
+
+// One pass over bootconfig text, appending its entries to `out`.
+class BootconfigParser {
+public:
+  BootconfigParser(std::string_view text, std::vector<BootParam> &out)
+      : text_(text), out_(out) {}
+
+  // Empty when everything parsed, the error otherwise.
+  std::string Parse() {
+    while (true) {
+      SkipSeparators();
+      if (AtEnd()) {
+        break;
+      }
+      if (Consume('}')) {
+        if (prefixes_.empty()) {
+          return Error("unbalanced '}'");
+        }
+        prefixes_.pop_back();
+        continue;
+      }
+
+      const size_t start = pos_;
+      while (!AtEnd() && IsKeyChar(text_[pos_])) {
+        ++pos_;
+      }
+      if (pos_ == start) {
+        return Error("expected a key");
+      }
+      std::string key = prefixes_.empty() ? std::string()
+                                          : prefixes_.back() + ".";
+      key += text_.substr(start, pos_ - start);
+
+      SkipBlank();
+      if (Consume('{')) {
+        prefixes_.push_back(std::move(key));
+        continue;
+      }
+      const bool override = Consume(":=");
+      if (!override && !Consume("+=") && !Consume('=')) {
+        if (!AtEntryEnd()) {
+          return Error("expected '=' after " + key);
+        }
+        out_.push_back({std::move(key), {}});
+        continue;
+      }
+      if (override) {
+        std::erase_if(out_, [&key](const BootParam &param) {
+          return param.key == key;
+        });
+      }
+
+      // Array elements may continue on the next lines
+      do {
+        SkipBlank();
+        std::string value;
+        if (!Value(value)) {
+          return Error("unterminated quote in the value of " + key);
+        }
+        out_.push_back({key, std::move(value)});
+        SkipBlank();
+      } while (Consume(',') && (SkipSeparators(false), true));
+      if (!AtEntryEnd()) {
+        return Error("unexpected character after the value of " + key);
+      }
+    }
+    if (!prefixes_.empty()) {
+      return Error("missing '}' for " + prefixes_.back());
+    }
+    return {};
+  }
+
+private:
+  bool AtEnd() const { return pos_ == text_.size(); }
+
+  bool AtEntryEnd() const {
+    return AtEnd() || std::strchr("\n;#}", text_[pos_]) != nullptr;
+  }
+
+  bool Consume(char c) {
+    if (!AtEnd() && text_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  bool Consume(std::string_view token) {
+    if (text_.substr(pos_).starts_with(token)) {
+      pos_ += token.size();
+      return true;
+    }
+    return false;
+  }
+
+  void SkipBlank() {
+    while (!AtEnd() && text_[pos_] != '\n' && IsSpace(text_[pos_])) {
+      ++pos_;
+    }
+  }
+
+  // Whitespace, comments and (with `entries`) the ';' between entries.
+  void SkipSeparators(bool entries = true) {
+    while (!AtEnd()) {
+      if (text_[pos_] == '#') {
+        const size_t end = text_.find('\n', pos_);
+        pos_ = end == std::string_view::npos ? text_.size() : end;
+      } else if (IsSpace(text_[pos_]) || (entries && text_[pos_] == ';')) {
+        ++pos_;
+      } else {
+        return;
+      }
+    }
+  }
+
+  // A quoted value as it is between the quotes, or a bare one up to the
+  // end of the entry, without trailing spaces.
+  bool Value(std::string &value) {
+    if (!AtEnd() && (text_[pos_] == '"' || text_[pos_] == '\'')) {
+      const size_t end = text_.find(text_[pos_], pos_ + 1);
+      if (end == std::string_view::npos) {
+        return false;
+      }
+      value = text_.substr(pos_ + 1, end - pos_ - 1);
+      pos_ = end + 1;
+      return true;
+    }
+    const size_t start = pos_;
+    while (!AtEntryEnd() && text_[pos_] != ',') {
+      ++pos_;
+    }
+    size_t end = pos_;
+    while (end > start && IsSpace(text_[end - 1])) {
+      --end;
+    }
+    value = text_.substr(start, end - start);
+    return true;
+  }
+
+  std::string Error(std::string_view what) const {
+    const auto line =
+        std::count(text_.begin(), text_.begin() + static_cast<ptrdiff_t>(pos_),
+                   '\n') +
+        1;
+    return std::format("line {}: {}", line, what);
+  }
+
+  std::string_view text_;
+  size_t pos_ = 0;
+  std::vector<BootParam> &out_;
+  // Dotted keys of the enclosing { } blocks, innermost last
+  std::vector<std::string> prefixes_;
+};
+
+void AppendParamArray(JsonWriter &json, std::string_view key,
+                      const std::vector<BootParam> &params) {
+  json.BeginArray(key);
+  for (const auto &param : params) {
+    json.BeginObject();
+    json.String("key", param.key);
+    json.String("value", param.value);
+    json.EndObject();
+  }
+  json.EndArray();
+}
+} // namespace
+
+const char *BootconfigTrailerName(BootconfigTrailer trailer) {
+  switch (trailer) {
+  case BootconfigTrailer::Absent:
+    return "absent";
+  case BootconfigTrailer::Valid:
+    return "valid";
+  case BootconfigTrailer::BadSize:
+    return "bad size";
+  case BootconfigTrailer::BadChecksum:
+    return "bad checksum";
+  }
+  return "unknown";
+}
+
+std::string JoinCmdline(std::string_view cmdline,
+                        std::string_view extra_cmdline) {
+  std::string joined(cmdline);
+  if (!extra_cmdline.empty()) {
+    joined += cmdline.size() + 1 < BOOT_CMDLINE_SIZE ? " " : "";
+    joined += extra_cmdline;
+  }
+  return joined;
+}
+
+std::vector<BootParam> ParseCmdline(std::string_view cmdline) {
+  std::vector<BootParam> params;
+  size_t i = 0;
+  while (true) {
+    while (i < cmdline.size() && IsSpace(cmdline[i])) {
+      ++i;
+    }
+    if (i == cmdline.size()) {
+      return params;
+    }
+    const bool quoted = cmdline[i] == '"';
+    const size_t start = quoted ? i + 1 : i;
+    size_t equals = std::string_view::npos;
+    bool in_quote = quoted;
+    for (i = start; i < cmdline.size() && (in_quote || !IsSpace(cmdline[i]));
+         ++i) {
+      if (equals == std::string_view::npos && cmdline[i] == '=') {
+        equals = i;
+      }
+      in_quote ^= cmdline[i] == '"';
+    }
+
+    std::string_view param = cmdline.substr(start, i - start);
+    if (quoted && param.ends_with('"')) {
+      param.remove_suffix(1);
+    }
+    if (equals == std::string_view::npos || equals - start >= param.size()) {
+      params.push_back({std::string(param), {}});
+      continue;
+    }
+    std::string_view value = param.substr(equals - start + 1);
+    if (value.starts_with('"')) {
+      value.remove_prefix(1);
+      if (value.ends_with('"')) {
+        value.remove_suffix(1);
+      }
+    }
+    params.push_back({std::string(param.substr(0, equals - start)),
+                      std::string(value)});
+  }
+}
+
+void ParseBootconfig(std::string_view text, BootParams &params) {
+  params.bootconfig.clear();
+  params.trailer = BootconfigTrailer::Absent;
+  params.bootconfig_error.clear();
+
+  if (text.size() >= BOOTCONFIG_TRAILER_SIZE &&
+      text.ends_with(BOOTCONFIG_MAGIC)) {
+    const auto *trailer = reinterpret_cast<const std::byte *>(
+        text.data() + text.size() - BOOTCONFIG_TRAILER_SIZE);
+    const uint32_t size = LoadU32(trailer);
+    const uint32_t checksum = LoadU32(trailer + sizeof(uint32_t));
+    text.remove_suffix(BOOTCONFIG_TRAILER_SIZE);
+    if (size > text.size()) {
+      params.trailer = BootconfigTrailer::BadSize;
+    } else {
+      // The kernel reads only the `size` bytes before the trailer
+      text = text.substr(text.size() - size);
+      uint32_t sum = 0;
+      for (const char c : text) {
+        sum += static_cast<unsigned char>(c);
+      }
+      params.trailer = sum == checksum ? BootconfigTrailer::Valid
+                                       : BootconfigTrailer::BadChecksum;
+    }
+  }
+
+  // Padding after the text
+  text = text.substr(0, text.find('\0'));
+  params.bootconfig_error = BootconfigParser(text, params.bootconfig).Parse();
+}
+
+bool KeyMatches(std::string_view key, std::string_view pattern) {
+  if (pattern.ends_with('*')) {
+    return key.starts_with(pattern.substr(0, pattern.size() - 1));
+  }
+  return key == pattern;
+}
+
+std::string FormatQuery(const BootParams &params,
+                        std::span<const std::string> patterns) {
+  std::string out;
+  const auto add = [&](std::string_view source,
+                       const std::vector<BootParam> &entries) {
+    for (const auto &param : entries) {
+      if (std::any_of(patterns.begin(), patterns.end(),
+                      [&param](const std::string &pattern) {
+                        return KeyMatches(param.key, pattern);
+                      })) {
+        std::format_to(std::back_inserter(out), "{}\t{}\t{}\n", source,
+                       param.key, param.value);
+      }
+    }
+  };
+  add("cmdline", params.cmdline);
+  add("bootconfig", params.bootconfig);
+  return out;
+}
+
+void AppendJson(const BootParams &params, bool bootconfig, JsonWriter &json) {
+  AppendParamArray(json, "cmdline_params", params.cmdline);
+  if (!bootconfig) {
+    return;
+  }
+  json.BeginObject("bootconfig");
+  json.String("trailer", BootconfigTrailerName(params.trailer));
+  if (!params.bootconfig_error.empty()) {
+    json.String("error", params.bootconfig_error);
+  }
+  AppendParamArray(json, "params", params.bootconfig);
+  json.EndObject();
+}
+
+} // namespace utils
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "report.h"
+#include "utils.hpp"
+
+#include <span>
+
+namespace utils {
+
+// The kernel command line and bootconfig of an image as flat key/value
+// indexes, in source order, for --query and --format=json (and diff).
+
+// A `value` is empty for parameters without one (e.g. quiet). Keys repeat
+// where the source repeats them (console=...), and bootconfig arrays become
+// one entry per element.
+struct BootParam {
+  std::string key;
+  std::string value;
+
+  bool operator==(const BootParam &) const = default;
+};
+
+// The "size, checksum, #BOOTCONFIG\n" trailer bootloaders append to the
+// bootconfig; images built by mkbootimg store the text without one.
+enum class BootconfigTrailer { Absent, Valid, BadSize, BadChecksum };
+
+const char *BootconfigTrailerName(BootconfigTrailer trailer);
+
+struct BootParams {
+  std::vector<BootParam> cmdline;
+  std::vector<BootParam> bootconfig;
+  BootconfigTrailer trailer = BootconfigTrailer::Absent;
+  // Where the bootconfig text stopped making sense, e.g. "line 3: ..." (the
+  // entries before it are kept); empty when it parsed.
+  std::string bootconfig_error;
+};
+
+// cmdline with extra_cmdline, as the kernel of a boot image sees them:
+// mkbootimg only spills into extra_cmdline once cmdline is full.
+std::string JoinCmdline(std::string_view cmdline,
+                        std::string_view extra_cmdline);
+
+// Splits at whitespace outside double quotes and drops the quotes around
+// values (and whole parameters), as the kernel does.
+std::vector<BootParam> ParseCmdline(std::string_view cmdline);
+
+// Parses the bootconfig section of a vendor_boot image: key = value lines
+// as mkbootimg stores them, and the rest of the bootconfig syntax (key {
+// ... } blocks, ';' separators, quoted values, comma separated arrays, +=
+// and :=, # comments) into dotted keys. A trailer is checked and dropped.
+void ParseBootconfig(std::string_view text, BootParams &params);
+
+// `pattern` is a key, or a key prefix followed by '*' (androidboot.*).
+bool KeyMatches(std::string_view key, std::string_view pattern);
+
+// "source<TAB>key<TAB>value" lines for the parameters matching any of the
+// patterns, command line first.
+std::string FormatQuery(const BootParams &params,
+                        std::span<const std::string> patterns);
+
+// "cmdline_params" and, with `bootconfig`, a "bootconfig" object with the
+// trailer status, any error and its "params".
+void AppendJson(const BootParams &params, bool bootconfig, JsonWriter &json);
+
+} // namespace utils
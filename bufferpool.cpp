@@ -0,0 +1,336 @@
+#include "bufferpool.h"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <deque>
+#include <exception>
+#include <new>
+#include <thread>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define UNPACKBOOTIMG_HAVE_MMAP 1
+#endif
+
+namespace utils {
+
+namespace {
+constexpr size_t kPageSize = 4096;
+constexpr size_t kSizeClasses =
+    std::countr_zero(BufferPool::MAX_BUFFER_SIZE) -
+    std::countr_zero(BufferPool::MIN_BUFFER_SIZE) + 1;
+
+size_t SizeClass(size_t size) {
+  return static_cast<size_t>(std::countr_zero(size) -
+                             std::countr_zero(BufferPool::MIN_BUFFER_SIZE));
+}
+
+std::byte *Map(size_t size) {
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  return static_cast<std::byte *>(addr);
+#else
+  return static_cast<std::byte *>(
+      ::operator new(size, std::align_val_t{kPageSize}));
+#endif
+}
+
+void Unmap(std::byte *data, size_t size) {
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  munmap(data, size);
+#else
+  (void)size;
+  ::operator delete(data, std::align_val_t{kPageSize});
+#endif
+}
+
+// The threads the writer stages of PipelineCopy run on. One is started when
+// a copy finds none idle, i.e. for as many copies as ever ran at the same
+// time, and kept for the rest of the process. A fixed pool would not do: a
+// copy waits for its writer, so it must never wait for a thread instead.
+class StageThreads {
+public:
+  static StageThreads &Shared() {
+    static StageThreads threads;
+    return threads;
+  }
+
+  ~StageThreads() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // `job` must not throw.
+  void Run(std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(job));
+    // Every idle thread takes one job, even one already woken for another
+    if (idle_ < jobs_.size()) {
+      try {
+        threads_.emplace_back([this] { Work(); });
+      } catch (...) {
+        jobs_.pop_back();
+        throw;
+      }
+    }
+    wake_.notify_one();
+  }
+
+private:
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      ++idle_;
+      wake_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      --idle_;
+      if (jobs_.empty()) {
+        return;
+      }
+      auto job = std::move(jobs_.front());
+      jobs_.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::function<void()>> jobs_;
+  std::vector<std::thread> threads_;
+  size_t idle_ = 0;
+  bool stopping_ = false;
+};
+} // namespace
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    Release();
+    pool_ = std::exchange(other.pool_, nullptr);
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+void BufferPool::Buffer::Release() {
+  if (pool_) {
+    pool_->Release(data_, size_);
+    pool_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+BufferPool::~BufferPool() {
+  for (size_t i = 0; i < free_.size(); ++i) {
+    for (std::byte *data : free_[i]) {
+      Unmap(data, MIN_BUFFER_SIZE << i);
+    }
+  }
+}
+
+BufferPool &BufferPool::Shared() {
+  static BufferPool pool;
+  return pool;
+}
+
+void BufferPool::SetBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+  Trim(0, 0);
+  released_.notify_all();
+}
+
+size_t BufferPool::BufferSizeFor(uint64_t size) {
+  const uint64_t wanted = std::min<uint64_t>(size / 64, MAX_BUFFER_SIZE);
+  return std::max(static_cast<size_t>(std::bit_ceil(wanted)),
+                  MIN_BUFFER_SIZE);
+}
+
+std::vector<BufferPool::Buffer> BufferPool::Acquire(size_t size,
+                                                    size_t count) {
+  size = std::max(std::bit_ceil(std::min(size, MAX_BUFFER_SIZE)),
+                  MIN_BUFFER_SIZE);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (size > MIN_BUFFER_SIZE && size * count > budget_) {
+    size /= 2;
+  }
+  const auto fits = [&] {
+    return in_use_ == 0 || in_use_ + size * count <= budget_;
+  };
+  if (!fits()) {
+    stats::Count(stats::BUFFER_WAITS);
+    released_.wait(lock, fits);
+  }
+
+  free_.resize(kSizeClasses);
+  auto &list = free_[SizeClass(size)];
+  Trim((count - std::min(list.size(), count)) * size, size);
+  std::vector<Buffer> buffers;
+  buffers.reserve(count);
+  try {
+    while (buffers.size() < count) {
+      std::byte *data = nullptr;
+      if (!list.empty()) {
+        data = list.back();
+        list.pop_back();
+      } else {
+        data = Map(size);
+        allocated_ += size;
+      }
+      in_use_ += size;
+      buffers.push_back(Buffer(this, data, size));
+    }
+  } catch (...) {
+    // The buffers taken so far are released without the lock
+    lock.unlock();
+    throw;
+  }
+  return buffers;
+}
+
+void BufferPool::Release(std::byte *data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  in_use_ -= size;
+  if (allocated_ > budget_) {
+    Unmap(data, size);
+    allocated_ -= size;
+  } else {
+    free_[SizeClass(size)].push_back(data);
+  }
+  released_.notify_all();
+}
+
+void BufferPool::Trim(size_t extra, size_t keep) {
+  for (size_t i = free_.size(); i-- > 0 && allocated_ + extra > budget_;) {
+    const size_t size = MIN_BUFFER_SIZE << i;
+    if (size == keep) {
+      continue;
+    }
+    while (!free_[i].empty() && allocated_ + extra > budget_) {
+      Unmap(free_[i].back(), size);
+      free_[i].pop_back();
+      allocated_ -= size;
+    }
+  }
+}
+
+bool PipelineCopy(uint64_t size, size_t buffer_size, size_t slack,
+                  const ChunkReader &read, const ChunkWriter &write) {
+  if (size == 0) {
+    return true;
+  }
+  const bool single = size + slack <= buffer_size;
+  auto buffers = BufferPool::Shared().Acquire(
+      single ? static_cast<size_t>(size + slack) : buffer_size, single ? 1 : 2);
+  const size_t chunk = buffers.front().size() - slack;
+
+  if (buffers.size() == 1) {
+    for (uint64_t done = 0; done < size;) {
+      const size_t length =
+          static_cast<size_t>(std::min<uint64_t>(size - done, chunk));
+      const auto data = read(done, length, buffers.front().span());
+      if (data.empty() || !write(data)) {
+        return false;
+      }
+      done += length;
+    }
+    return true;
+  }
+
+  // A slot holds its chunk from the read until the writer is done with it
+  const uint64_t chunks = (size + chunk - 1) / chunk;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::array<std::span<const std::byte>, 2> filled;
+  bool failed = false;
+  bool written = false;
+  std::exception_ptr write_error;
+
+  const auto drain = [&] {
+    for (uint64_t i = 0; i < chunks; ++i) {
+      std::span<const std::byte> data;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return failed || !filled[i % 2].empty(); });
+        if (failed) {
+          return;
+        }
+        data = filled[i % 2];
+      }
+      bool ok = false;
+      try {
+        ok = write(data);
+      } catch (...) {
+        write_error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      filled[i % 2] = {};
+      failed = failed || !ok;
+      changed.notify_all();
+      if (!ok) {
+        return;
+      }
+    }
+  };
+  StageThreads::Shared().Run([&] {
+    drain();
+    std::lock_guard<std::mutex> lock(mutex);
+    written = true;
+    changed.notify_all();
+  });
+
+  std::exception_ptr read_error;
+  try {
+    for (uint64_t i = 0; i < chunks; ++i) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return failed || filled[i % 2].empty(); });
+        if (failed) {
+          break;
+        }
+      }
+      const uint64_t offset = i * chunk;
+      const size_t length =
+          static_cast<size_t>(std::min<uint64_t>(size - offset, chunk));
+      const auto data = read(offset, length, buffers[i % 2].span());
+      std::lock_guard<std::mutex> lock(mutex);
+      failed = failed || data.empty();
+      filled[i % 2] = data;
+      changed.notify_all();
+    }
+  } catch (...) {
+    read_error = std::current_exception();
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = true;
+    changed.notify_all();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return written; });
+  }
+
+  if (read_error) {
+    std::rethrow_exception(read_error);
+  }
+  if (write_error) {
+    std::rethrow_exception(write_error);
+  }
+  return !failed;
+}
+
+} // namespace utils
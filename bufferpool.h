@@ -0,0 +1,112 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace utils {
+
+// Process-wide arena of page aligned I/O buffers for the copies that go
+// through memory (unmapped and direct reads, decoded sections). Buffers come
+// in powers of two from MIN_BUFFER_SIZE to MAX_BUFFER_SIZE and go back to a
+// free list when released, so extractions, batch workers and --serve
+// requests reuse them instead of allocating per section. All buffers
+// together, free or handed out, are held to a budget (--buffer-memory):
+// Acquire hands out smaller buffers, then waits, rather than exceed it.
+class BufferPool {
+public:
+  static constexpr size_t MIN_BUFFER_SIZE = 64 << 10;
+  static constexpr size_t MAX_BUFFER_SIZE = 4 << 20;
+  static constexpr size_t DEFAULT_BUDGET = 64 << 20;
+
+  // A buffer handed out by Acquire, returned to the pool on destruction.
+  class Buffer {
+  public:
+    Buffer() = default;
+    ~Buffer() { Release(); }
+
+    Buffer(Buffer &&other) noexcept { *this = std::move(other); }
+    Buffer &operator=(Buffer &&other) noexcept;
+
+    std::byte *data() const { return data_; }
+    size_t size() const { return size_; }
+    std::span<std::byte> span() const { return {data_, size_}; }
+
+  private:
+    friend class BufferPool;
+    Buffer(BufferPool *pool, std::byte *data, size_t size)
+        : pool_(pool), data_(data), size_(size) {}
+    void Release();
+
+    BufferPool *pool_ = nullptr;
+    std::byte *data_ = nullptr;
+    size_t size_ = 0;
+  };
+
+  explicit BufferPool(size_t budget = DEFAULT_BUDGET) : budget_(budget) {}
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // The pool every extraction shares.
+  static BufferPool &Shared();
+
+  // Takes effect for the next Acquire; free buffers beyond it are unmapped.
+  void SetBudget(size_t bytes);
+
+  // Buffer size for copying a section of `size` bytes: about a 64th of it,
+  // so kernels and ramdisks move in MiB requests while small sections do
+  // not tie up more than they need. Larger buffers only pay off where the
+  // page cache is bypassed: a page cached chunk should still be in the CPU
+  // caches when it is written.
+  static size_t BufferSizeFor(uint64_t size);
+
+  // `count` buffers of `size` bytes (rounded up to a power of two within the
+  // limits), taken together so a pipeline never holds one while waiting for
+  // the other. Halves the size while they would not fit the budget at all,
+  // then waits for other users to release theirs; with nothing else handed
+  // out they are allocated regardless, so a tiny budget still makes
+  // progress. Throws std::bad_alloc when the memory cannot be had.
+  std::vector<Buffer> Acquire(size_t size, size_t count = 1);
+
+private:
+  void Release(std::byte *data, size_t size);
+  // Unmaps free buffers (other than of `keep` bytes) until `allocated_ +
+  // extra` fits the budget or none are left. Called with mutex_ held.
+  void Trim(size_t extra, size_t keep);
+
+  std::mutex mutex_;
+  std::condition_variable released_;
+  size_t budget_;
+  // Bytes of all buffers, and of those handed out
+  size_t allocated_ = 0;
+  size_t in_use_ = 0;
+  // Free buffers by size, one list per power of two
+  std::vector<std::vector<std::byte *>> free_;
+};
+
+// Fills `buffer` with the `length` bytes at `offset` (from the start of the
+// copy) and returns them; they may start anywhere in it, e.g. after the
+// alignment of a direct read. Empty on failure.
+using ChunkReader = std::function<std::span<const std::byte>(
+    uint64_t offset, size_t length, std::span<std::byte> buffer)>;
+// Consumes the next chunk, in order. False on failure.
+using ChunkWriter = std::function<bool(std::span<const std::byte> data)>;
+
+// Copies `size` bytes in chunks through two buffers of the shared pool:
+// `read` fills one with chunk N+1 on the calling thread while `write`
+// drains chunk N from the other on a second thread, so the input and the
+// output are busy at the same time. The second threads are kept from one
+// copy to the next; one is only started when every other is busy. `slack`
+// is what the reader needs in a buffer beyond the chunk itself. Copies of a
+// single chunk run inline. Stops at the first failure of either side; an
+// exception thrown by `write` is rethrown here.
+bool PipelineCopy(uint64_t size, size_t buffer_size, size_t slack,
+                  const ChunkReader &read, const ChunkWriter &write);
+
+} // namespace utils
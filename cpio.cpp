@@ -0,0 +1,412 @@
+#include "cpio.h"
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#define UNPACKBOOTIMG_HAVE_UTIMENSAT 1
+#endif
+
+namespace utils {
+
+namespace {
+constexpr size_t CPIO_HEADER_SIZE = 110;
+constexpr size_t CPIO_FIELD_SIZE = 8;
+constexpr std::string_view CPIO_MAGIC = "070701";
+constexpr std::string_view CPIO_CRC_MAGIC = "070702";
+constexpr std::string_view CPIO_TRAILER = "TRAILER!!!";
+
+constexpr uint32_t CPIO_TYPE_MASK = 0170000;
+constexpr uint32_t CPIO_TYPE_DIRECTORY = 0040000;
+constexpr uint32_t CPIO_TYPE_REGULAR = 0100000;
+constexpr uint32_t CPIO_TYPE_SYMLINK = 0120000;
+constexpr uint32_t CPIO_PERMISSION_MASK = 07777;
+
+// newc header fields, in order, after the magic
+enum CpioField {
+  INO,
+  MODE,
+  UID,
+  GID,
+  NLINK,
+  MTIME,
+  FILESIZE,
+  DEVMAJOR,
+  DEVMINOR,
+  RDEVMAJOR,
+  RDEVMINOR,
+  NAMESIZE,
+  CHECK,
+};
+
+// Headers, names and file data are each padded to a multiple of four.
+size_t Padding(uint64_t size) {
+  return static_cast<size_t>((4 - size % 4) % 4);
+}
+
+bool ReadHexField(std::string_view header, CpioField field, uint32_t &value) {
+  const char *begin =
+      header.data() + CPIO_MAGIC.size() + field * CPIO_FIELD_SIZE;
+  const char *end = begin + CPIO_FIELD_SIZE;
+  const auto result = std::from_chars(begin, end, value, 16);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+// Maps an archive name onto a path below the extraction root. Leading
+// slashes and "." components are dropped; ".." is refused.
+std::optional<std::filesystem::path> RelativeEntryPath(std::string_view name) {
+  std::filesystem::path result;
+  while (!name.empty()) {
+    const size_t slash = name.find('/');
+    const auto component = name.substr(0, slash);
+    if (component == "..") {
+      return std::nullopt;
+    }
+    if (!component.empty() && component != ".") {
+      result /= component;
+    }
+    name = slash == std::string_view::npos ? std::string_view()
+                                           : name.substr(slash + 1);
+  }
+  return result;
+}
+
+std::filesystem::perms Permissions(uint32_t mode) {
+  return static_cast<std::filesystem::perms>(mode & CPIO_PERMISSION_MASK);
+}
+
+// Directories left read-only by an earlier extraction are reopened for
+// writing; Finish() restores the archived mode.
+void MakeWritable(const std::filesystem::path &directory) {
+  std::error_code ec;
+  std::filesystem::permissions(directory, std::filesystem::perms::owner_all,
+                               std::filesystem::perm_options::add, ec);
+}
+
+#ifdef UNPACKBOOTIMG_HAVE_UTIMENSAT
+void SetModificationTime(const std::filesystem::path &path, int64_t mtime) {
+  const timespec times[2] = {{0, UTIME_OMIT},
+                             {static_cast<time_t>(mtime), 0}};
+  utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+}
+#endif
+} // namespace
+
+bool IsCpioArchive(std::span<const std::byte> head) {
+  if (head.size() < CPIO_MAGIC_SIZE) {
+    return false;
+  }
+  const std::string_view magic(reinterpret_cast<const char *>(head.data()),
+                               CPIO_MAGIC_SIZE);
+  return magic == CPIO_MAGIC || magic == CPIO_CRC_MAGIC;
+}
+
+CpioExtractor::CpioExtractor(const std::filesystem::path &root)
+    : root_(root) {
+  // A previous raw extraction may have left a file where the tree goes
+  std::error_code ec;
+  const auto status = std::filesystem::symlink_status(root_, ec);
+  if (std::filesystem::exists(status) &&
+      !std::filesystem::is_directory(status)) {
+    std::filesystem::remove(root_, ec);
+  }
+  std::filesystem::create_directories(root_, ec);
+  failed_ = !std::filesystem::is_directory(root_, ec);
+}
+
+CpioExtractor::~CpioExtractor() = default;
+
+std::streamsize CpioExtractor::xsputn(const char *data, std::streamsize size) {
+  if (failed_ ||
+      !Consume(std::span(reinterpret_cast<const std::byte *>(data),
+                         static_cast<size_t>(size)))) {
+    failed_ = true;
+    return 0;
+  }
+  return size;
+}
+
+CpioExtractor::int_type CpioExtractor::overflow(int_type ch) {
+  if (traits_type::eq_int_type(ch, traits_type::eof())) {
+    return traits_type::not_eof(ch);
+  }
+  const char c = traits_type::to_char_type(ch);
+  return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+bool CpioExtractor::Consume(std::span<const std::byte> data) {
+  while (!data.empty()) {
+    switch (state_) {
+    case State::Header: {
+      // Concatenated archives are separated by zero padding
+      if (header_.empty() && archives_ > 0) {
+        const auto it = std::find_if(data.begin(), data.end(), [](std::byte b) {
+          return b != std::byte{0};
+        });
+        data = data.subspan(static_cast<size_t>(it - data.begin()));
+        if (data.empty()) {
+          break;
+        }
+      }
+      const size_t take =
+          std::min(CPIO_HEADER_SIZE - header_.size(), data.size());
+      header_.append(reinterpret_cast<const char *>(data.data()), take);
+      data = data.subspan(take);
+      if (header_.size() < CPIO_HEADER_SIZE) {
+        break;
+      }
+
+      const std::string_view header = header_;
+      const auto magic = header.substr(0, CPIO_MAGIC.size());
+      uint32_t ino, nlink, mtime, file_size, dev_major, dev_minor;
+      if ((magic != CPIO_MAGIC && magic != CPIO_CRC_MAGIC) ||
+          !ReadHexField(header, INO, ino) ||
+          !ReadHexField(header, MODE, mode_) ||
+          !ReadHexField(header, NLINK, nlink) ||
+          !ReadHexField(header, MTIME, mtime) ||
+          !ReadHexField(header, FILESIZE, file_size) ||
+          !ReadHexField(header, DEVMAJOR, dev_major) ||
+          !ReadHexField(header, DEVMINOR, dev_minor) ||
+          !ReadHexField(header, NAMESIZE, name_size_) || name_size_ == 0) {
+        return false;
+      }
+      nlink_ = nlink;
+      mtime_ = mtime;
+      data_left_ = file_size;
+      link_key_ = (static_cast<uint64_t>(dev_major) << 48) ^
+                  (static_cast<uint64_t>(dev_minor) << 32) ^ ino;
+      name_.clear();
+      state_ = State::Name;
+      break;
+    }
+
+    case State::Name: {
+      const size_t want = name_size_ + Padding(CPIO_HEADER_SIZE + name_size_);
+      const size_t take = std::min(want - name_.size(), data.size());
+      name_.append(reinterpret_cast<const char *>(data.data()), take);
+      data = data.subspan(take);
+      if (name_.size() < want) {
+        break;
+      }
+      name_.resize(name_size_ - 1); // Drop the terminating NUL
+      if (!StartEntry()) {
+        return false;
+      }
+      padding_left_ = Padding(data_left_);
+      state_ = State::Data;
+      break;
+    }
+
+    case State::Data: {
+      const size_t take =
+          static_cast<size_t>(std::min<uint64_t>(data_left_, data.size()));
+      if (file_.is_open()) {
+        if (file_.sputn(reinterpret_cast<const char *>(data.data()),
+                        static_cast<std::streamsize>(take)) !=
+            static_cast<std::streamsize>(take)) {
+          return false;
+        }
+      } else if ((mode_ & CPIO_TYPE_MASK) == CPIO_TYPE_SYMLINK) {
+        link_target_.append(reinterpret_cast<const char *>(data.data()), take);
+      }
+      data = data.subspan(take);
+      data_left_ -= take;
+      break;
+    }
+
+    case State::Padding: {
+      const size_t take = std::min(padding_left_, data.size());
+      data = data.subspan(take);
+      padding_left_ -= take;
+      break;
+    }
+    }
+
+    // Entries end as soon as their data and padding are in, without
+    // waiting for more input
+    if (state_ == State::Data && data_left_ == 0) {
+      state_ = State::Padding;
+    }
+    if (state_ == State::Padding && padding_left_ == 0) {
+      if (!EndEntry()) {
+        return false;
+      }
+      header_.clear();
+      state_ = State::Header;
+    }
+  }
+  return true;
+}
+
+bool CpioExtractor::StartEntry() {
+  path_.clear();
+  link_target_.clear();
+
+  if (name_ == CPIO_TRAILER) {
+    ++archives_;
+    mode_ = 0;
+    return true;
+  }
+
+  const auto relative = RelativeEntryPath(name_);
+  if (!relative) {
+    return false;
+  }
+  if (relative->empty()) {
+    mode_ = 0; // The archive root itself; keep the output directory as is
+    return true;
+  }
+  if (!MakeParents(*relative)) {
+    return false;
+  }
+
+  std::error_code ec;
+  path_ = root_ / *relative;
+  const auto status = std::filesystem::symlink_status(path_, ec);
+  const uint32_t type = mode_ & CPIO_TYPE_MASK;
+
+  // Replace what an earlier extraction left rather than writing through it;
+  // links are recreated by Finish()
+  if (std::filesystem::is_directory(status)) {
+    if (type != CPIO_TYPE_DIRECTORY) {
+      return false;
+    }
+  } else if (std::filesystem::exists(status)) {
+    std::filesystem::remove(path_, ec);
+  }
+
+  switch (type) {
+  case CPIO_TYPE_DIRECTORY:
+    if (std::filesystem::is_directory(status)) {
+      MakeWritable(path_);
+    } else if (!std::filesystem::create_directory(path_, ec)) {
+      return false;
+    }
+    directories_.push_back({path_, mode_, mtime_});
+    break;
+  case CPIO_TYPE_REGULAR:
+    if (!file_.open(path_, std::ios::out | std::ios::binary |
+                               std::ios::trunc)) {
+      return false;
+    }
+    files_.push_back({path_, mode_, mtime_});
+    if (nlink_ > 1) {
+      hard_links_[{archives_, link_key_}].push_back(path_);
+    }
+    break;
+  case CPIO_TYPE_SYMLINK:
+    break;
+  default:
+    mode_ = 0; // Device nodes, FIFOs and sockets are not recreated
+    break;
+  }
+  return true;
+}
+
+bool CpioExtractor::EndEntry() {
+  if (file_.is_open()) {
+    if (!file_.close()) {
+      return false;
+    }
+  } else if ((mode_ & CPIO_TYPE_MASK) == CPIO_TYPE_SYMLINK && !path_.empty()) {
+    symlinks_.push_back({{path_, mode_, mtime_}, std::move(link_target_)});
+  }
+  return true;
+}
+
+bool CpioExtractor::MakeParents(const std::filesystem::path &relative) {
+  const auto parent = relative.parent_path();
+  if (parent.empty() || parent == last_parent_) {
+    return true;
+  }
+
+  // Walk the components so an existing symlink can never redirect a write
+  // outside the root
+  std::filesystem::path current = root_;
+  for (const auto &component : parent) {
+    current /= component;
+    std::error_code ec;
+    auto status = std::filesystem::symlink_status(current, ec);
+    if (std::filesystem::is_symlink(status)) {
+      std::filesystem::remove(current, ec);
+      status =
+          std::filesystem::file_status(std::filesystem::file_type::not_found);
+    }
+    if (!std::filesystem::exists(status)) {
+      if (!std::filesystem::create_directory(current, ec)) {
+        return false;
+      }
+    } else if (std::filesystem::is_directory(status)) {
+      MakeWritable(current);
+    } else {
+      return false;
+    }
+  }
+  last_parent_ = parent;
+  return true;
+}
+
+bool CpioExtractor::Finish() {
+  if (failed_ || archives_ == 0 || state_ != State::Header ||
+      !header_.empty()) {
+    failed_ = true;
+    return false;
+  }
+
+  std::error_code ec;
+  bool ok = true;
+
+  // newc stores the data of a hard-linked file with its last name
+  for (const auto &[key, paths] : hard_links_) {
+    for (size_t i = 0; i + 1 < paths.size(); ++i) {
+      std::filesystem::remove(paths[i], ec);
+      std::filesystem::create_hard_link(paths.back(), paths[i], ec);
+      ok = ok && !ec;
+    }
+  }
+
+  for (const auto &file : files_) {
+    std::filesystem::permissions(file.path, Permissions(file.mode), ec);
+    ok = ok && !ec;
+  }
+
+  for (const auto &[link, target] : symlinks_) {
+    std::filesystem::remove(link.path, ec);
+    std::filesystem::create_symlink(target, link.path, ec);
+    ok = ok && !ec;
+  }
+
+  // Children before parents, so read-only directories are locked last
+  std::sort(directories_.begin(), directories_.end(),
+            [](const Metadata &a, const Metadata &b) {
+              return a.path > b.path;
+            });
+  for (const auto &directory : directories_) {
+    std::filesystem::permissions(directory.path, Permissions(directory.mode),
+                                 ec);
+    ok = ok && !ec;
+  }
+
+  ApplyTimes();
+  failed_ = !ok;
+  return ok;
+}
+
+void CpioExtractor::ApplyTimes() {
+#ifdef UNPACKBOOTIMG_HAVE_UTIMENSAT
+  for (const auto &file : files_) {
+    SetModificationTime(file.path, file.mtime);
+  }
+  for (const auto &[link, target] : symlinks_) {
+    SetModificationTime(link.path, link.mtime);
+  }
+  for (const auto &directory : directories_) {
+    SetModificationTime(directory.path, directory.mtime);
+  }
+#endif
+}
+
+} // namespace utils
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <cstddef>
+#include <map>
+#include <span>
+#include <streambuf>
+
+namespace utils {
+
+constexpr size_t CPIO_MAGIC_SIZE = 6;
+
+// Whether `head` starts with the magic of a "newc" cpio archive.
+bool IsCpioArchive(std::span<const std::byte> head);
+
+// Streaming extractor for "newc" cpio archives (070701 and 070702), fed
+// through the streambuf interface so decoders can write straight into it.
+// Regular file data goes to disk as it arrives; modes, symlinks, hard links
+// and timestamps are applied together by Finish(), after every file exists.
+// Archives concatenated back to back (with zero padding between them, as
+// vendor ramdisks do) extract into the same tree. Device nodes, FIFOs and
+// sockets are skipped, and entries that would escape `root` fail the
+// extraction.
+class CpioExtractor : public std::streambuf {
+public:
+  explicit CpioExtractor(const std::filesystem::path &root);
+  ~CpioExtractor() override;
+
+  bool good() const { return !failed_; }
+
+  // Applies the deferred metadata. Fails unless at least one complete
+  // archive was seen and no entry was left truncated.
+  bool Finish();
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override;
+  int_type overflow(int_type ch) override;
+
+private:
+  enum class State { Header, Name, Data, Padding };
+
+  struct Metadata {
+    std::filesystem::path path;
+    uint32_t mode;
+    int64_t mtime;
+  };
+
+  bool Consume(std::span<const std::byte> data);
+  bool StartEntry();
+  bool EndEntry();
+  bool MakeParents(const std::filesystem::path &relative);
+  void ApplyTimes();
+
+  std::filesystem::path root_;
+  bool failed_ = false;
+  uint32_t archives_ = 0; // Trailers seen so far
+  State state_ = State::Header;
+
+  // Current entry
+  std::string header_;
+  std::string name_;
+  uint32_t mode_ = 0;
+  uint32_t name_size_ = 0;
+  uint64_t data_left_ = 0;
+  size_t padding_left_ = 0;
+  int64_t mtime_ = 0;
+  uint64_t link_key_ = 0;
+  uint32_t nlink_ = 0;
+  std::filesystem::path path_;
+  stats::CountingFilebuf file_;
+  std::string link_target_;
+
+  // Deferred work
+  std::filesystem::path last_parent_;
+  std::vector<Metadata> files_;
+  std::vector<Metadata> directories_;
+  std::vector<std::pair<Metadata, std::string>> symlinks_;
+  // Inode numbers restart in every concatenated archive
+  std::map<std::pair<uint32_t, uint64_t>, std::vector<std::filesystem::path>>
+      hard_links_;
+};
+
+} // namespace utils
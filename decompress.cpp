@@ -0,0 +1,653 @@
+#include "decompress.h"
+#include "imagesource.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <zlib.h>
+
+#ifdef UNPACKBOOTIMG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace utils {
+
+namespace {
+constexpr uint32_t LZ4_LEGACY_MAGIC = 0x184C2102;
+constexpr uint32_t LZ4_FRAME_MAGIC = 0x184D2204;
+constexpr uint32_t LZ4_SKIPPABLE_MAGIC = 0x184D2A50; // low nibble is free
+constexpr uint32_t ZSTD_MAGIC = 0xFD2FB528;
+constexpr size_t LZ4_LEGACY_BLOCK_SIZE = 8 << 20;
+constexpr size_t LZ4_LEGACY_MAX_COMPRESSED =
+    LZ4_LEGACY_BLOCK_SIZE + LZ4_LEGACY_BLOCK_SIZE / 255 + 16;
+constexpr size_t LZ4_WINDOW_SIZE = 64 << 10;
+constexpr size_t kSniffSize = 4;
+constexpr size_t kOutputChunkSize = 256 << 10;
+
+bool WriteBytes(std::ostream &output, const std::byte *data, size_t size) {
+  return static_cast<bool>(output.write(reinterpret_cast<const char *>(data),
+                                        static_cast<std::streamsize>(size)));
+}
+
+// Decodes one raw LZ4 block into base[pos, pos + capacity). Matches may
+// reach back into base[0, pos), which holds the history of linked blocks.
+// Returns the number of bytes produced, or -1 on malformed input.
+ptrdiff_t DecodeLz4Block(std::span<const std::byte> src, std::byte *base,
+                         size_t pos, size_t capacity) {
+  const auto *ip = reinterpret_cast<const uint8_t *>(src.data());
+  const auto *const iend = ip + src.size();
+  std::byte *op = base + pos;
+  std::byte *const ostart = op;
+  std::byte *const oend = op + capacity;
+
+  auto read_length = [&](size_t &length) {
+    uint8_t b;
+    do {
+      if (ip >= iend)
+        return false;
+      b = *ip++;
+      length += b;
+    } while (b == 255);
+    return true;
+  };
+
+  while (ip < iend) {
+    const uint8_t token = *ip++;
+
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_length(literals))
+      return -1;
+    if (literals > static_cast<size_t>(iend - ip) ||
+        literals > static_cast<size_t>(oend - op))
+      return -1;
+    std::memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // The last sequence carries literals only
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    const size_t offset = static_cast<size_t>(ip[0]) |
+                          (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+    if (offset == 0 || offset > static_cast<size_t>(op - base))
+      return -1;
+
+    size_t match = token & 15;
+    if (match == 15 && !read_length(match))
+      return -1;
+    match += 4;
+    if (match > static_cast<size_t>(oend - op))
+      return -1;
+
+    const std::byte *from = op - offset;
+    if (offset >= match) {
+      std::memcpy(op, from, match);
+      op += match;
+    } else {
+      // Overlapping match repeats the last `offset` bytes
+      for (size_t i = 0; i < match; ++i) {
+        *op++ = from[i];
+      }
+    }
+  }
+
+  return op - ostart;
+}
+
+class GzipDecompressor : public Decompressor {
+public:
+  explicit GzipDecompressor(std::ostream &output)
+      : output_(output), buffer_(kOutputChunkSize) {
+    ok_ = inflateInit2(&stream_, 16 + MAX_WBITS) == Z_OK;
+  }
+  ~GzipDecompressor() override { inflateEnd(&stream_); }
+
+  bool Feed(std::span<const std::byte> data) override {
+    while (ok_ && !data.empty() && !trailing_) {
+      if (ended_) {
+        // Concatenated members restart the stream; anything else is padding
+        if (static_cast<uint8_t>(data[0]) != 0x1f) {
+          trailing_ = true;
+          break;
+        }
+        inflateReset(&stream_);
+        ended_ = false;
+      }
+
+      const auto chunk = static_cast<uInt>(
+          std::min<size_t>(data.size(), std::numeric_limits<uInt>::max()));
+      stream_.next_in =
+          reinterpret_cast<Bytef *>(const_cast<std::byte *>(data.data()));
+      stream_.avail_in = chunk;
+
+      do {
+        stream_.next_out = reinterpret_cast<Bytef *>(buffer_.data());
+        stream_.avail_out = static_cast<uInt>(buffer_.size());
+        const int ret = inflate(&stream_, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+          ended_ = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+          ok_ = false;
+          return false;
+        }
+        const size_t produced = buffer_.size() - stream_.avail_out;
+        if (!WriteBytes(output_, buffer_.data(), produced)) {
+          ok_ = false;
+          return false;
+        }
+      } while (stream_.avail_out == 0 && !ended_);
+
+      data = data.subspan(chunk - stream_.avail_in);
+    }
+    return ok_;
+  }
+
+  bool Finish() override { return ok_ && ended_; }
+
+private:
+  std::ostream &output_;
+  std::vector<std::byte> buffer_;
+  z_stream stream_{};
+  bool ok_ = false;
+  bool ended_ = false;
+  bool trailing_ = false;
+};
+
+// Legacy LZ4 (`lz4 -l`, used by Android ramdisks): a magic followed by
+// size-prefixed, independent blocks of up to 8 MiB output each. Blocks are
+// collected in batches and decoded concurrently, then written in order.
+class Lz4LegacyDecompressor : public Decompressor {
+public:
+  Lz4LegacyDecompressor(std::ostream &output, unsigned jobs, ThreadPool *pool)
+      : output_(output), jobs_(std::max(jobs, 1U)), pool_(pool) {}
+
+  bool Feed(std::span<const std::byte> data) override {
+    if (!ok_ || done_)
+      return ok_;
+    pending_.insert(pending_.end(), data.begin(), data.end());
+    return Parse();
+  }
+
+  bool Finish() override {
+    if (!ok_ || !Flush())
+      return false;
+    // Up to a few bytes of padding may follow the last block
+    return saw_magic_ && (done_ || pending_.size() - pos_ < 4);
+  }
+
+private:
+  bool Parse() {
+    while (ok_ && !done_ && pending_.size() - pos_ >= 4) {
+      const uint32_t word = LoadU32(pending_.data() + pos_);
+      if (!saw_magic_) {
+        if (word != LZ4_LEGACY_MAGIC)
+          return ok_ = false;
+        saw_magic_ = true;
+        pos_ += 4;
+        continue;
+      }
+      if (word == LZ4_LEGACY_MAGIC) { // concatenated stream
+        pos_ += 4;
+        continue;
+      }
+      if (word == 0 || word > LZ4_LEGACY_MAX_COMPRESSED) {
+        done_ = true; // end of stream, the rest is padding
+        break;
+      }
+      if (pending_.size() - pos_ - 4 < word)
+        break; // block incomplete, wait for more input
+      blocks_.push_back({pos_ + 4, word});
+      pos_ += 4 + static_cast<size_t>(word);
+      if (blocks_.size() >= jobs_ && !Flush())
+        return false;
+    }
+    return ok_;
+  }
+
+  bool Flush() {
+    if (blocks_.empty())
+      return ok_;
+
+    outputs_.resize(blocks_.size());
+    std::vector<ptrdiff_t> produced(blocks_.size(), -1);
+    auto decode = [&](size_t i) {
+      outputs_[i].resize(LZ4_LEGACY_BLOCK_SIZE);
+      produced[i] = DecodeLz4Block(
+          std::span(pending_).subspan(blocks_[i].offset, blocks_[i].size),
+          outputs_[i].data(), 0, outputs_[i].size());
+    };
+
+    if (jobs_ > 1 && blocks_.size() > 1) {
+      if (!pool_) {
+        own_pool_ = std::make_unique<ThreadPool>(jobs_ - 1);
+        pool_ = own_pool_.get();
+      }
+      pool_->ParallelFor(blocks_.size(), decode);
+    } else {
+      for (size_t i = 0; i < blocks_.size(); ++i) {
+        decode(i);
+      }
+    }
+
+    for (size_t i = 0; i < blocks_.size() && ok_; ++i) {
+      ok_ = produced[i] >= 0 &&
+            WriteBytes(output_, outputs_[i].data(),
+                       static_cast<size_t>(produced[i]));
+    }
+
+    blocks_.clear();
+    pending_.erase(pending_.begin(),
+                   pending_.begin() + static_cast<ptrdiff_t>(pos_));
+    pos_ = 0;
+    return ok_;
+  }
+
+  struct Block {
+    size_t offset;
+    size_t size;
+  };
+
+  std::ostream &output_;
+  unsigned jobs_;
+  std::vector<std::byte> pending_;
+  size_t pos_ = 0;
+  std::vector<Block> blocks_;
+  std::vector<std::vector<std::byte>> outputs_;
+  ThreadPool *pool_;
+  std::unique_ptr<ThreadPool> own_pool_;
+  bool ok_ = true;
+  bool saw_magic_ = false;
+  bool done_ = false;
+};
+
+// LZ4 frame format (`lz4` default). Linked blocks reference the previous
+// 64 KiB of output, which is kept in a sliding window.
+class Lz4FrameDecompressor : public Decompressor {
+public:
+  explicit Lz4FrameDecompressor(std::ostream &output) : output_(output) {}
+
+  bool Feed(std::span<const std::byte> data) override {
+    if (!ok_ || done_)
+      return ok_;
+    pending_.insert(pending_.end(), data.begin(), data.end());
+    while (ok_ && !done_ && Step()) {
+    }
+    pending_.erase(pending_.begin(),
+                   pending_.begin() + static_cast<ptrdiff_t>(pos_));
+    pos_ = 0;
+    return ok_;
+  }
+
+  bool Finish() override {
+    return ok_ && frames_ > 0 && (done_ || state_ == State::Magic);
+  }
+
+private:
+  enum class State { Magic, Header, Block, Checksum };
+
+  size_t available() const { return pending_.size() - pos_; }
+
+  // Consumes one syntactic element; returns false when more input is needed.
+  bool Step() {
+    switch (state_) {
+    case State::Magic: {
+      if (available() < 4)
+        return false;
+      const uint32_t magic = LoadU32(pending_.data() + pos_);
+      if (magic == LZ4_FRAME_MAGIC) {
+        pos_ += 4;
+        state_ = State::Header;
+        return true;
+      }
+      if ((magic & 0xFFFFFFF0) == LZ4_SKIPPABLE_MAGIC) {
+        if (available() < 8)
+          return false;
+        const size_t skip = LoadU32(pending_.data() + pos_ + 4);
+        if (available() < 8 + skip)
+          return false;
+        pos_ += 8 + skip;
+        return true;
+      }
+      // Anything after a complete frame is padding
+      if (frames_ == 0)
+        ok_ = false;
+      done_ = true;
+      return false;
+    }
+    case State::Header: {
+      if (available() < 2)
+        return false;
+      const auto flg = static_cast<uint8_t>(pending_[pos_]);
+      const auto bd = static_cast<uint8_t>(pending_[pos_ + 1]);
+      const size_t length =
+          2 + ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0) + 1;
+      if (available() < length)
+        return false;
+      if ((flg >> 6) != 1) {
+        ok_ = false;
+        return false;
+      }
+      const unsigned block_id = (bd >> 4) & 7;
+      if (block_id < 4) {
+        ok_ = false;
+        return false;
+      }
+      block_max_ = size_t{64 << 10} << (2 * (block_id - 4));
+      block_checksum_ = flg & 0x10;
+      content_checksum_ = flg & 0x04;
+      independent_ = flg & 0x20;
+      window_.resize(LZ4_WINDOW_SIZE + block_max_);
+      history_ = 0;
+      pos_ += length;
+      ++frames_;
+      state_ = State::Block;
+      return true;
+    }
+    case State::Block: {
+      if (available() < 4)
+        return false;
+      const uint32_t word = LoadU32(pending_.data() + pos_);
+      if (word == 0) { // end mark
+        pos_ += 4;
+        state_ = State::Checksum;
+        return true;
+      }
+      const bool stored = word & 0x80000000U;
+      const size_t size = word & 0x7FFFFFFFU;
+      const size_t total = 4 + size + (block_checksum_ ? 4 : 0);
+      if (size > block_max_) {
+        ok_ = false;
+        return false;
+      }
+      if (available() < total)
+        return false;
+
+      if (independent_) {
+        history_ = 0;
+      } else if (history_ + block_max_ > window_.size()) {
+        std::memmove(window_.data(),
+                     window_.data() + history_ - LZ4_WINDOW_SIZE,
+                     LZ4_WINDOW_SIZE);
+        history_ = LZ4_WINDOW_SIZE;
+      }
+
+      const auto block = std::span(pending_).subspan(pos_ + 4, size);
+      ptrdiff_t produced;
+      if (stored) {
+        std::memcpy(window_.data() + history_, block.data(), size);
+        produced = static_cast<ptrdiff_t>(size);
+      } else {
+        produced =
+            DecodeLz4Block(block, window_.data(), history_, block_max_);
+      }
+      if (produced < 0 ||
+          !WriteBytes(output_, window_.data() + history_,
+                      static_cast<size_t>(produced))) {
+        ok_ = false;
+        return false;
+      }
+      history_ += static_cast<size_t>(produced);
+      pos_ += total;
+      return true;
+    }
+    case State::Checksum:
+      if (content_checksum_) {
+        if (available() < 4)
+          return false;
+        pos_ += 4;
+      }
+      state_ = State::Magic;
+      return true;
+    }
+    return false;
+  }
+
+  std::ostream &output_;
+  std::vector<std::byte> pending_;
+  size_t pos_ = 0;
+  std::vector<std::byte> window_;
+  size_t history_ = 0;
+  size_t block_max_ = 0;
+  State state_ = State::Magic;
+  unsigned frames_ = 0;
+  bool block_checksum_ = false;
+  bool content_checksum_ = false;
+  bool independent_ = false;
+  bool ok_ = true;
+  bool done_ = false;
+};
+
+#ifdef UNPACKBOOTIMG_WITH_ZSTD
+class ZstdDecompressor : public Decompressor {
+public:
+  explicit ZstdDecompressor(std::ostream &output)
+      : output_(output), stream_(ZSTD_createDStream()),
+        buffer_(ZSTD_DStreamOutSize()) {}
+  ~ZstdDecompressor() override { ZSTD_freeDStream(stream_); }
+
+  bool Feed(std::span<const std::byte> data) override {
+    ZSTD_inBuffer in{data.data(), data.size(), 0};
+    while (ok_ && in.pos < in.size) {
+      ZSTD_outBuffer out{buffer_.data(), buffer_.size(), 0};
+      last_ = ZSTD_decompressStream(stream_, &out, &in);
+      ok_ = !ZSTD_isError(last_) &&
+            WriteBytes(output_, buffer_.data(), out.pos);
+    }
+    return ok_;
+  }
+
+  bool Finish() override { return ok_ && last_ == 0; }
+
+private:
+  std::ostream &output_;
+  ZSTD_DStream *stream_;
+  std::vector<std::byte> buffer_;
+  size_t last_ = 0;
+  bool ok_ = true;
+};
+#endif
+
+} // namespace
+
+Compression DetectCompression(std::span<const std::byte> head) {
+  if (head.size() >= 2 && static_cast<uint8_t>(head[0]) == 0x1f &&
+      static_cast<uint8_t>(head[1]) == 0x8b) {
+    return Compression::Gzip;
+  }
+  if (head.size() >= 4) {
+    switch (LoadU32(head.data())) {
+    case LZ4_LEGACY_MAGIC:
+      return Compression::Lz4Legacy;
+    case LZ4_FRAME_MAGIC:
+      return Compression::Lz4Frame;
+    case ZSTD_MAGIC:
+      return Compression::Zstd;
+    }
+  }
+  return Compression::None;
+}
+
+const char *CompressionName(Compression type) {
+  switch (type) {
+  case Compression::Gzip:
+    return "gzip";
+  case Compression::Lz4Legacy:
+    return "lz4_legacy";
+  case Compression::Lz4Frame:
+    return "lz4";
+  case Compression::Zstd:
+    return "zstd";
+  case Compression::None:
+    break;
+  }
+  return "none";
+}
+
+std::unique_ptr<Decompressor> Decompressor::Create(Compression type,
+                                                   std::ostream &output,
+                                                   unsigned jobs,
+                                                   ThreadPool *pool) {
+  switch (type) {
+  case Compression::Gzip:
+    return std::make_unique<GzipDecompressor>(output);
+  case Compression::Lz4Legacy:
+    return std::make_unique<Lz4LegacyDecompressor>(output, jobs, pool);
+  case Compression::Lz4Frame:
+    return std::make_unique<Lz4FrameDecompressor>(output);
+  case Compression::Zstd:
+#ifdef UNPACKBOOTIMG_WITH_ZSTD
+    return std::make_unique<ZstdDecompressor>(output);
+#else
+    break;
+#endif
+  case Compression::None:
+    break;
+  }
+  return nullptr;
+}
+
+// Where the decoded bytes of a Tree section go: held back until their first
+// CPIO_MAGIC_SIZE show whether they are a cpio archive, then passed on to an
+// extractor for `path`, or else to the file at `path`.
+class SectionWriter::TreeOutput : public std::streambuf {
+public:
+  TreeOutput(const std::filesystem::path &path, stats::CountingFilebuf &file)
+      : path_(path), file_(file) {}
+
+  bool Finish() {
+    if (!target_ && !Choose()) {
+      return false;
+    }
+    if (tree_) {
+      return tree_->Finish();
+    }
+    return file_.close() != nullptr;
+  }
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    const std::streamsize total = size;
+    if (!target_) {
+      const size_t take = std::min(CPIO_MAGIC_SIZE - head_.size(),
+                                   static_cast<size_t>(size));
+      head_.insert(head_.end(), reinterpret_cast<const std::byte *>(data),
+                   reinterpret_cast<const std::byte *>(data) + take);
+      data += take;
+      size -= static_cast<std::streamsize>(take);
+      if (head_.size() < CPIO_MAGIC_SIZE) {
+        return total;
+      }
+      if (!Choose()) {
+        return 0;
+      }
+    }
+    if (size > 0 && target_->sputn(data, size) != size) {
+      return 0;
+    }
+    return total;
+  }
+
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    const char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+  }
+
+  int sync() override { return target_ ? target_->pubsync() : 0; }
+
+private:
+  // Opens the output the head calls for and writes the head to it.
+  bool Choose() {
+    if (IsCpioArchive(head_)) {
+      tree_ = std::make_unique<CpioExtractor>(path_);
+      if (!tree_->good()) {
+        return false;
+      }
+      target_ = tree_.get();
+    } else {
+      if (!file_.open(path_,
+                      std::ios::out | std::ios::binary | std::ios::trunc)) {
+        return false;
+      }
+      target_ = &file_;
+    }
+    const auto size = static_cast<std::streamsize>(head_.size());
+    return target_->sputn(reinterpret_cast<const char *>(head_.data()),
+                          size) == size;
+  }
+
+  std::filesystem::path path_;
+  stats::CountingFilebuf &file_;
+  std::vector<std::byte> head_;
+  std::unique_ptr<CpioExtractor> tree_;
+  std::streambuf *target_ = nullptr;
+};
+
+SectionWriter::SectionWriter(const std::filesystem::path &path,
+                             RamdiskOutput mode, unsigned jobs,
+                             ThreadPool *pool)
+    : decompress_(mode != RamdiskOutput::Raw), jobs_(jobs), pool_(pool) {
+  if (mode == RamdiskOutput::Tree) {
+    tree_ = std::make_unique<TreeOutput>(path, file_);
+    output_.rdbuf(tree_.get());
+  } else if (file_.open(path, std::ios::out | std::ios::binary |
+                                  std::ios::trunc)) {
+    output_.rdbuf(&file_);
+  }
+}
+
+SectionWriter::~SectionWriter() = default;
+
+bool SectionWriter::StartDecoder(std::span<const std::byte> head) {
+  started_ = true;
+  decoder_ =
+      Decompressor::Create(DetectCompression(head), output_, jobs_, pool_);
+  return true;
+}
+
+bool SectionWriter::Write(std::span<const std::byte> data) {
+  if (decompress_ && !started_) {
+    if (sniff_.empty() && data.size() >= kSniffSize) {
+      StartDecoder(data);
+    } else {
+      sniff_.insert(sniff_.end(), data.begin(), data.end());
+      if (sniff_.size() < kSniffSize) {
+        return true;
+      }
+      StartDecoder(sniff_);
+      const auto head = std::move(sniff_);
+      return Write(head);
+    }
+  }
+
+  if (decoder_) {
+    return decoder_->Feed(data);
+  }
+  return WriteBytes(output_, data.data(), data.size());
+}
+
+bool SectionWriter::Finish() {
+  bool ok = true;
+  if (decompress_ && !started_) {
+    StartDecoder(sniff_);
+    const auto head = std::move(sniff_);
+    ok = Write(head);
+  }
+  if (decoder_) {
+    ok = decoder_->Finish() && ok;
+  }
+  ok = output_.flush() && ok;
+  if (tree_) {
+    return tree_->Finish() && ok;
+  }
+  return file_.close() != nullptr && ok;
+}
+
+} // namespace utils
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cpio.h"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <span>
+
+namespace utils {
+
+enum class Compression { None, Gzip, Lz4Legacy, Lz4Frame, Zstd };
+
+// Identifies the compression of a payload from its leading magic bytes.
+Compression DetectCompression(std::span<const std::byte> head);
+const char *CompressionName(Compression type);
+
+// Incremental decoder; decompressed bytes are written to `output`.
+class Decompressor {
+public:
+  virtual ~Decompressor() = default;
+
+  // Returns nullptr when `type` is not supported by this build. `jobs`
+  // bounds how many independent blocks are decoded concurrently, on `pool`
+  // when it is set (e.g. the pool extracting the sections) and otherwise on
+  // one of the decoder's own.
+  static std::unique_ptr<Decompressor> Create(Compression type,
+                                              std::ostream &output,
+                                              unsigned jobs,
+                                              ThreadPool *pool = nullptr);
+
+  virtual bool Feed(std::span<const std::byte> data) = 0;
+  virtual bool Finish() = 0;
+};
+
+// Writes one section to disk. Unless `mode` is Raw the payload format is
+// detected from its first bytes and known formats are decoded on the fly;
+// anything else is passed on unchanged. With Tree the result is unpacked as
+// a cpio archive into the directory `path` instead of written to a file,
+// unless it does not start like one; it is then written as with
+// Decompressed.
+class SectionWriter {
+public:
+  SectionWriter(const std::filesystem::path &path, RamdiskOutput mode,
+                unsigned jobs, ThreadPool *pool = nullptr);
+  ~SectionWriter();
+
+  bool good() const { return static_cast<bool>(output_); }
+  bool Write(std::span<const std::byte> data);
+  bool Finish();
+
+private:
+  class TreeOutput;
+
+  bool StartDecoder(std::span<const std::byte> head);
+
+  stats::CountingFilebuf file_;
+  std::unique_ptr<TreeOutput> tree_;
+  std::ostream output_{nullptr};
+  bool decompress_;
+  unsigned jobs_;
+  ThreadPool *pool_;
+  bool started_ = false;
+  std::vector<std::byte> sniff_;
+  std::unique_ptr<Decompressor> decoder_;
+};
+
+} // namespace utils
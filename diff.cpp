@@ -0,0 +1,430 @@
+#include "diff.h"
+#include "bootparams.h"
+#include "digest.h"
+#include "imageview.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace utils {
+
+namespace {
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+
+// Sections are compared a chunk at a time, and a differing chunk a block at
+// a time to find the byte.
+constexpr size_t kChunkSize = 1 << 20;
+constexpr size_t kBlockSize = 4096;
+
+struct Section {
+  std::string name;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Name and value pairs, in header order.
+using Fields = std::vector<std::pair<std::string, std::string>>;
+
+// One side of the diff, with its strings copied out of the header.
+struct ImageSummary {
+  bool vendor = false;
+  Fields fields;
+  std::string cmdline;
+  std::vector<Section> sections;
+};
+
+std::string HexValue(uint64_t value) { return std::format("0x{:x}", value); }
+
+void AddOsFields(Fields &fields, uint32_t os_version_patch_level) {
+  const auto [version, patch_level] =
+      DecodeOsVersionPatchLevel(os_version_patch_level);
+  fields.emplace_back("os_version", version.value_or(""));
+  fields.emplace_back("os_patch_level", patch_level.value_or(""));
+}
+
+ImageSummary SummarizeBootImage(std::span<const std::byte> header) {
+  BootImageView view;
+  if (const auto result = ParseBootImage(header, view); !result)
+    throw errors::FileReadError(result.field);
+
+  ImageSummary summary;
+  auto &fields = summary.fields;
+  fields.emplace_back("header_version", std::to_string(view.header_version));
+  if (view.header_version < 3) {
+    fields.emplace_back("page_size", std::to_string(view.page_size));
+    fields.emplace_back("kernel_load_address",
+                        HexValue(view.kernel_load_address));
+    fields.emplace_back("ramdisk_load_address",
+                        HexValue(view.ramdisk_load_address));
+    fields.emplace_back("second_load_address",
+                        HexValue(view.second_load_address));
+    fields.emplace_back("tags_load_address",
+                        HexValue(view.tags_load_address));
+  }
+  AddOsFields(fields, view.os_version_patch_level);
+  if (view.header_version < 3) {
+    fields.emplace_back("product_name", std::string(view.product_name));
+    fields.emplace_back(
+        "id", Hex({reinterpret_cast<const uint8_t *>(view.id.data()),
+                   view.id.size()}));
+  }
+  if (view.header_version == 2) {
+    fields.emplace_back("dtb_load_address", HexValue(view.dtb_load_address));
+  }
+
+  summary.cmdline = JoinCmdline(view.cmdline, view.extra_cmdline);
+  for (const auto &section : view.sections) {
+    summary.sections.push_back(
+        {std::string(section.name), section.offset, section.size});
+  }
+  return summary;
+}
+
+// Fragments are keyed by their table name when no other fragment or section
+// could be mistaken for it.
+std::string FragmentKey(std::string_view name, size_t index,
+                        const std::map<std::string_view, size_t> &counts) {
+  if (name.empty() || counts.at(name) > 1 || name == "dtb" ||
+      name == "bootconfig" || name.starts_with("vendor_ramdisk")) {
+    return std::format("vendor_ramdisk{:02}", index);
+  }
+  return std::string(name);
+}
+
+ImageSummary SummarizeVendorBootImage(ImageSource &input,
+                                      std::span<const std::byte> header) {
+  VendorBootImageView view;
+  if (const auto result = ParseVendorBootImage(header, view); !result)
+    throw errors::FileReadError(result.field);
+
+  std::vector<std::byte> table_scratch;
+  if (view.header_version > 3) {
+    const auto table = input.Slice(view.ramdisk_table_offset,
+                                   view.RamdiskTableBytes(), table_scratch);
+    if (const auto result = ParseVendorRamdiskTable(table, view); !result)
+      throw errors::FileReadError(result.field);
+  }
+
+  ImageSummary summary;
+  summary.vendor = true;
+  auto &fields = summary.fields;
+  fields.emplace_back("header_version", std::to_string(view.header_version));
+  fields.emplace_back("page_size", std::to_string(view.page_size));
+  fields.emplace_back("kernel_load_address",
+                      HexValue(view.kernel_load_address));
+  fields.emplace_back("ramdisk_load_address",
+                      HexValue(view.ramdisk_load_address));
+  fields.emplace_back("tags_load_address", HexValue(view.tags_load_address));
+  fields.emplace_back("product_name", std::string(view.product_name));
+  fields.emplace_back("dtb_load_address", HexValue(view.dtb_load_address));
+  summary.cmdline = view.cmdline;
+
+  std::map<std::string_view, size_t> counts;
+  for (size_t i = 0; i < view.ramdisk_table.size(); ++i) {
+    ++counts[view.ramdisk_table[i].name];
+  }
+
+  for (const auto &section : view.sections) {
+    if (section.name == "vendor_ramdisk_table") {
+      continue;
+    }
+    if (section.name != "vendor_ramdisk" || view.header_version <= 3) {
+      summary.sections.push_back(
+          {std::string(section.name), section.offset, section.size});
+      continue;
+    }
+    for (size_t i = 0; i < view.ramdisk_table.size(); ++i) {
+      const auto fragment = view.ramdisk_table[i];
+      std::string key = FragmentKey(fragment.name, i, counts);
+
+      std::string board_id;
+      for (const uint32_t word : fragment.board_id) {
+        board_id += (board_id.empty() ? "" : ",") + HexValue(word);
+      }
+      fields.emplace_back(key + " type", getRamdiskType(fragment.type));
+      fields.emplace_back(key + " board_id", std::move(board_id));
+      summary.sections.push_back(
+          {std::move(key), view.ramdisk_offset + fragment.offset,
+           fragment.size});
+    }
+  }
+  return summary;
+}
+
+ImageSummary Summarize(ImageSource &input) {
+  std::vector<std::byte> scratch;
+  const auto header = input.Slice(
+      0,
+      static_cast<size_t>(std::min<uint64_t>(input.size(), HEADER_READ_SIZE)),
+      scratch);
+  if (header.size() < MAGIC_SIZE)
+    throw errors::FileReadError("boot magic");
+
+  const std::string_view magic(reinterpret_cast<const char *>(header.data()),
+                               MAGIC_SIZE);
+  if (magic == BOOT_MAGIC) {
+    return SummarizeBootImage(header);
+  }
+  if (magic == VENDOR_BOOT_MAGIC) {
+    return SummarizeVendorBootImage(input, header);
+  }
+  throw std::runtime_error("Not a boot or vendor_boot image.");
+}
+
+std::vector<FieldChange> DiffFields(const Fields &before,
+                                    const Fields &after) {
+  const auto find = [](const Fields &fields, const std::string &name) {
+    return std::find_if(fields.begin(), fields.end(),
+                        [&](const auto &field) { return field.first == name; });
+  };
+
+  std::vector<FieldChange> changes;
+  for (const auto &[name, value] : before) {
+    const auto it = find(after, name);
+    if (it == after.end()) {
+      changes.push_back({name, value, std::nullopt});
+    } else if (it->second != value) {
+      changes.push_back({name, value, it->second});
+    }
+  }
+  for (const auto &[name, value] : after) {
+    if (find(before, name) == before.end()) {
+      changes.push_back({name, std::nullopt, value});
+    }
+  }
+  return changes;
+}
+
+// Parameters may repeat (console=...), so they are matched as a multiset:
+// what both sides have is unchanged, and what is left is paired up by name
+// into changed values before the rest counts as removed or added.
+std::vector<FieldChange> DiffParams(const std::vector<BootParam> &before,
+                                    const std::vector<BootParam> &after) {
+  std::vector<bool> matched(after.size(), false);
+  std::vector<const BootParam *> removed;
+  for (const auto &param : before) {
+    size_t j = 0;
+    while (j < after.size() && (matched[j] || after[j] != param)) {
+      ++j;
+    }
+    if (j < after.size()) {
+      matched[j] = true;
+    } else {
+      removed.push_back(&param);
+    }
+  }
+
+  std::vector<FieldChange> changes;
+  for (const auto *param : removed) {
+    size_t j = 0;
+    while (j < after.size() && (matched[j] || after[j].key != param->key)) {
+      ++j;
+    }
+    if (j < after.size()) {
+      matched[j] = true;
+      changes.push_back({param->key, param->value, after[j].value});
+    } else {
+      changes.push_back({param->key, param->value, std::nullopt});
+    }
+  }
+  for (size_t j = 0; j < after.size(); ++j) {
+    if (!matched[j]) {
+      changes.push_back({after[j].key, std::nullopt, after[j].value});
+    }
+  }
+  return changes;
+}
+
+std::string BootconfigText(ImageSource &input, const ImageSummary &summary) {
+  for (const auto &section : summary.sections) {
+    if (section.name != "bootconfig") {
+      continue;
+    }
+    std::vector<std::byte> scratch;
+    const auto data =
+        input.Slice(section.offset, static_cast<size_t>(section.size), scratch);
+    if (data.empty())
+      throw errors::FileReadError(section.name);
+    return {reinterpret_cast<const char *>(data.data()), data.size()};
+  }
+  return {};
+}
+
+// Index of the first byte where two equally sized, non-empty spans differ.
+// memcmp settles most chunks on its own; only a differing one is narrowed
+// down to its block.
+std::optional<size_t> Mismatch(std::span<const std::byte> left,
+                               std::span<const std::byte> right) {
+  if (std::memcmp(left.data(), right.data(), left.size()) == 0) {
+    return std::nullopt;
+  }
+  size_t offset = 0;
+  while (left.size() - offset > kBlockSize &&
+         std::memcmp(left.data() + offset, right.data() + offset,
+                     kBlockSize) == 0) {
+    offset += kBlockSize;
+  }
+  return static_cast<size_t>(
+      std::mismatch(left.begin() + offset, left.end(), right.begin() + offset)
+          .first -
+      left.begin());
+}
+
+// Where the bytes of two sections first differ, or nullopt when they are
+// the same. Mapped images are compared in place.
+std::optional<uint64_t> FirstDifference(ImageSource &before, const Section &a,
+                                        ImageSource &after, const Section &b) {
+  const uint64_t size = std::min(a.size, b.size);
+  std::vector<std::byte> before_scratch;
+  std::vector<std::byte> after_scratch;
+  for (uint64_t done = 0; done < size;) {
+    const size_t chunk =
+        static_cast<size_t>(std::min<uint64_t>(size - done, kChunkSize));
+    const auto left = before.Slice(a.offset + done, chunk, before_scratch);
+    const auto right = after.Slice(b.offset + done, chunk, after_scratch);
+    if (left.empty() || right.empty())
+      throw errors::FileReadError(a.name);
+    if (const auto mismatch = Mismatch(left, right)) {
+      return done + *mismatch;
+    }
+    done += chunk;
+  }
+  if (a.size != b.size) {
+    return size;
+  }
+  return std::nullopt;
+}
+
+uint64_t SectionXxh64(ImageSource &input, const Section &section) {
+  SectionDigest digest(false);
+  if (!HashRange(input, section.offset, section.size, digest))
+    throw errors::FileReadError(section.name);
+  return digest.xxh64();
+}
+
+std::vector<SectionDelta> DiffSections(ImageSource &before,
+                                       const ImageSummary &a,
+                                       ImageSource &after,
+                                       const ImageSummary &b) {
+  const auto find = [](const ImageSummary &summary, const std::string &name) {
+    return std::find_if(
+        summary.sections.begin(), summary.sections.end(),
+        [&](const auto &section) { return section.name == name; });
+  };
+
+  std::vector<SectionDelta> deltas;
+  for (const auto &section : a.sections) {
+    const auto other = find(b, section.name);
+    if (other == b.sections.end()) {
+      deltas.push_back(
+          {section.name, SectionChange::Removed, section.size, 0});
+      continue;
+    }
+    stats::ScopedTimer timer("diff", section.name, section.size);
+    if (const auto first = FirstDifference(before, section, after, *other)) {
+      deltas.push_back({section.name, SectionChange::Changed, section.size,
+                        other->size, *first, SectionXxh64(before, section),
+                        SectionXxh64(after, *other)});
+    }
+  }
+  for (const auto &section : b.sections) {
+    if (find(a, section.name) == a.sections.end()) {
+      deltas.push_back({section.name, SectionChange::Added, 0, section.size});
+    }
+  }
+  return deltas;
+}
+
+std::string FormatValue(const std::optional<std::string> &value) {
+  if (!value) {
+    return "(none)";
+  }
+  return value->empty() ? "(empty)" : *value;
+}
+
+std::string FormatParam(const std::string &name, const std::string &value) {
+  return value.empty() ? name : name + "=" + value;
+}
+
+void FormatParams(std::ostream &out, std::string_view title,
+                  const std::vector<FieldChange> &changes) {
+  if (changes.empty()) {
+    return;
+  }
+  out << title << ":\n";
+  for (const auto &change : changes) {
+    if (!change.after) {
+      out << "  - " << FormatParam(change.name, *change.before) << "\n";
+    } else if (!change.before) {
+      out << "  + " << FormatParam(change.name, *change.after) << "\n";
+    } else {
+      out << "  ~ " << FormatParam(change.name, *change.before) << " -> "
+          << FormatParam(change.name, *change.after) << "\n";
+    }
+  }
+}
+} // namespace
+
+ImageDiff DiffImages(ImageSource &before, ImageSource &after) {
+  const ImageSummary a = Summarize(before);
+  const ImageSummary b = Summarize(after);
+  if (a.vendor != b.vendor)
+    throw std::runtime_error(
+        "Cannot compare a boot image with a vendor_boot image.");
+
+  ImageDiff diff;
+  diff.header = DiffFields(a.fields, b.fields);
+  diff.cmdline = DiffParams(ParseCmdline(a.cmdline), ParseCmdline(b.cmdline));
+  BootParams params_a, params_b;
+  ParseBootconfig(BootconfigText(before, a), params_a);
+  ParseBootconfig(BootconfigText(after, b), params_b);
+  diff.bootconfig = DiffParams(params_a.bootconfig, params_b.bootconfig);
+  diff.sections = DiffSections(before, a, after, b);
+  return diff;
+}
+
+std::string FormatPrettyText(const ImageDiff &diff) {
+  std::ostringstream oss;
+  if (!diff.header.empty()) {
+    oss << "header:\n";
+    for (const auto &change : diff.header) {
+      oss << "  " << change.name << ": " << FormatValue(change.before)
+          << " -> " << FormatValue(change.after) << "\n";
+    }
+  }
+  FormatParams(oss, "cmdline", diff.cmdline);
+  FormatParams(oss, "bootconfig", diff.bootconfig);
+
+  if (!diff.sections.empty()) {
+    oss << "sections:\n";
+    for (const auto &delta : diff.sections) {
+      switch (delta.change) {
+      case SectionChange::Removed:
+        oss << "  - " << delta.name << ": " << delta.size_before
+            << " bytes\n";
+        break;
+      case SectionChange::Added:
+        oss << "  + " << delta.name << ": " << delta.size_after << " bytes\n";
+        break;
+      case SectionChange::Changed:
+        oss << "  ~ " << delta.name << ": ";
+        if (delta.size_before == delta.size_after) {
+          oss << delta.size_before;
+        } else {
+          oss << delta.size_before << " -> " << delta.size_after;
+        }
+        oss << " bytes, first difference at "
+            << HexValue(delta.first_difference) << ", xxh64 "
+            << std::format("{:016x} -> {:016x}", delta.xxh64_before,
+                           delta.xxh64_after)
+            << "\n";
+        break;
+      }
+    }
+  }
+  return oss.str();
+}
+
+} // namespace utils
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "imagesource.h"
+#include "utils.hpp"
+
+#include <optional>
+
+namespace utils {
+
+// One header field, kernel command line parameter or bootconfig entry that
+// differs; a side without it is nullopt. Parameters without a value (e.g.
+// quiet) have an empty value.
+struct FieldChange {
+  std::string name;
+  std::optional<std::string> before;
+  std::optional<std::string> after;
+};
+
+enum class SectionChange { Changed, Added, Removed };
+
+struct SectionDelta {
+  std::string name;
+  SectionChange change;
+  uint64_t size_before = 0;
+  uint64_t size_after = 0;
+  // For changed sections: where their bytes first differ (the end of the
+  // shorter side when the other only extends it), and the XXH64 of each side
+  // as --manifest records it
+  uint64_t first_difference = 0;
+  uint64_t xxh64_before = 0;
+  uint64_t xxh64_after = 0;
+};
+
+// What differs between two images of the same type, in image order.
+// Sections are matched by name: vendor ramdisk fragments by their table name
+// where it is set and unique, by vendor_ramdiskNN otherwise.
+struct ImageDiff {
+  std::vector<FieldChange> header;
+  // Boot images: cmdline with extra_cmdline; vendor_boot: the vendor
+  // cmdline
+  std::vector<FieldChange> cmdline;
+  std::vector<FieldChange> bootconfig;
+  std::vector<SectionDelta> sections;
+
+  bool empty() const {
+    return header.empty() && cmdline.empty() && bootconfig.empty() &&
+           sections.empty();
+  }
+};
+
+// Compares the headers of `before` and `after` and the sections they hold:
+// sizes first, then the bytes, chunk by chunk straight from the mappings
+// where there are any. Nothing is written. Throws when the images are not
+// both boot or both vendor_boot images, or a section runs past its image.
+ImageDiff DiffImages(ImageSource &before, ImageSource &after);
+
+// Nothing for identical images.
+std::string FormatPrettyText(const ImageDiff &diff);
+
+} // namespace utils
@@ -0,0 +1,606 @@
+#include "digest.h"
+#include "imagesource.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define UNPACKBOOTIMG_HAVE_SHA_NI 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_SHA2)
+#include <arm_neon.h>
+#define UNPACKBOOTIMG_HAVE_ARM_SHA2 1
+#endif
+
+namespace utils {
+
+namespace {
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+constexpr size_t XXH64_STRIPE = 32;
+
+uint64_t Xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = std::rotl(acc, 31);
+  return acc * PRIME64_1;
+}
+
+uint64_t Xxh64Merge(uint64_t acc, uint64_t value) {
+  acc ^= Xxh64Round(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+void Xxh64Stripes(std::array<uint64_t, 4> &acc, const std::byte *data,
+                  size_t stripes) {
+  auto [v1, v2, v3, v4] = acc;
+  for (; stripes > 0; --stripes, data += XXH64_STRIPE) {
+    v1 = Xxh64Round(v1, LoadU64(data));
+    v2 = Xxh64Round(v2, LoadU64(data + 8));
+    v3 = Xxh64Round(v3, LoadU64(data + 16));
+    v4 = Xxh64Round(v4, LoadU64(data + 24));
+  }
+  acc = {v1, v2, v3, v4};
+}
+
+constexpr std::array<uint32_t, 64> SHA256_K = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t LoadBE32(const std::byte *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+void Sha256BlocksPortable(std::array<uint32_t, 8> &state,
+                          const std::byte *data, size_t blocks) {
+  for (; blocks > 0; --blocks, data += 64) {
+    std::array<uint32_t, 64> w;
+    for (size_t i = 0; i < 16; ++i) {
+      w[i] = LoadBE32(data + 4 * i);
+    }
+    for (size_t i = 16; i < 64; ++i) {
+      const uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^
+                          (w[i - 15] >> 3);
+      const uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^
+                          (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto [a, b, c, d, e, f, g, h] = state;
+    for (size_t i = 0; i < 64; ++i) {
+      const uint32_t s1 =
+          std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+      const uint32_t ch = (e & f) ^ (~e & g);
+      const uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+      const uint32_t s0 =
+          std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+      const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + s0 + maj;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef UNPACKBOOTIMG_HAVE_SHA_NI
+bool HaveShaNi() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+    return false;
+  }
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+
+// Four rounds per step; the message schedule for the step after next is
+// prepared alongside (Intel's SHA extensions reference layout).
+__attribute__((target("sha,sse4.1"))) void
+Sha256BlocksShaNi(std::array<uint32_t, 8> &state, const std::byte *data,
+                  size_t blocks) {
+  const __m128i byte_swap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // The instructions want the state as ABEF and CDGH
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);        // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);  // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+
+    __m128i w[4];
+    for (int i = 0; i < 4; ++i) {
+      w[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * i)),
+          byte_swap);
+    }
+
+    for (int step = 0; step < 16; ++step) {
+      __m128i &cur = w[step % 4];
+      __m128i &prev = w[(step + 3) % 4];
+      __m128i &next = w[(step + 1) % 4];
+
+      __m128i msg = _mm_add_epi32(
+          cur, _mm_loadu_si128(
+                   reinterpret_cast<const __m128i *>(&SHA256_K[4 * step])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (step >= 3 && step < 15) {
+        next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));
+        next = _mm_sha256msg2_epu32(next, cur);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (step >= 1 && step < 13) {
+        prev = _mm_sha256msg1_epu32(prev, cur);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+#endif
+
+#ifdef UNPACKBOOTIMG_HAVE_ARM_SHA2
+void Sha256BlocksArm(std::array<uint32_t, 8> &state, const std::byte *data,
+                     size_t blocks) {
+  uint32x4_t state0 = vld1q_u32(&state[0]);
+  uint32x4_t state1 = vld1q_u32(&state[4]);
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const uint32x4_t abcd = state0;
+    const uint32x4_t efgh = state1;
+
+    uint32x4_t w[4];
+    for (int i = 0; i < 4; ++i) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(
+          vld1q_u8(reinterpret_cast<const uint8_t *>(data + 16 * i))));
+    }
+
+    for (int step = 0; step < 16; ++step) {
+      uint32x4_t &cur = w[step % 4];
+      const uint32x4_t msg = vaddq_u32(cur, vld1q_u32(&SHA256_K[4 * step]));
+      if (step < 12) {
+        cur = vsha256su0q_u32(cur, w[(step + 1) % 4]);
+      }
+      const uint32x4_t previous = state0;
+      state0 = vsha256hq_u32(state0, state1, msg);
+      state1 = vsha256h2q_u32(state1, previous, msg);
+      if (step < 12) {
+        cur = vsha256su1q_u32(cur, w[(step + 2) % 4], w[(step + 3) % 4]);
+      }
+    }
+
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
+#endif
+
+void Sha256Blocks(std::array<uint32_t, 8> &state, const std::byte *data,
+                  size_t blocks) {
+#if defined(UNPACKBOOTIMG_HAVE_ARM_SHA2)
+  Sha256BlocksArm(state, data, blocks);
+#else
+#ifdef UNPACKBOOTIMG_HAVE_SHA_NI
+  static const bool sha_ni = HaveShaNi();
+  if (sha_ni) {
+    Sha256BlocksShaNi(state, data, blocks);
+    return;
+  }
+#endif
+  Sha256BlocksPortable(state, data, blocks);
+#endif
+}
+
+void Sha1Blocks(std::array<uint32_t, 5> &state, const std::byte *data,
+                size_t blocks) {
+  for (; blocks > 0; --blocks, data += 64) {
+    std::array<uint32_t, 80> w;
+    for (size_t i = 0; i < 16; ++i) {
+      w[i] = LoadBE32(data + 4 * i);
+    }
+    for (size_t i = 16; i < 80; ++i) {
+      w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    auto [a, b, c, d, e] = state;
+    for (size_t i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      const uint32_t t = std::rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = std::rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+// Appends the Merkle-Damgard padding (0x80, zeros, big endian bit count) to
+// the buffered tail and compresses it, for SHA-1 and SHA-256 alike.
+template <typename State, typename Blocks>
+void PadAndCompress(State &state, std::span<const std::byte> buffered,
+                    uint64_t total, Blocks &&blocks) {
+  std::array<std::byte, 128> tail{};
+  std::memcpy(tail.data(), buffered.data(), buffered.size());
+  tail[buffered.size()] = std::byte{0x80};
+  const size_t count = buffered.size() + 9 > 64 ? 2 : 1;
+  const uint64_t bits = total * 8;
+  for (size_t i = 0; i < 8; ++i) {
+    tail[count * 64 - 1 - i] = static_cast<std::byte>(bits >> (8 * i));
+  }
+  blocks(state, tail.data(), count);
+}
+
+template <size_t N>
+std::array<uint8_t, 4 * N>
+BigEndianDigest(const std::array<uint32_t, N> &state) {
+  std::array<uint8_t, 4 * N> digest;
+  for (size_t i = 0; i < N; ++i) {
+    digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+    digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+    digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+    digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+  }
+  return digest;
+}
+
+// Feeds `data` through a block buffer, handing whole blocks to `blocks`.
+template <size_t N, typename Blocks>
+void Absorb(std::array<std::byte, N> &buffer, size_t &buffered,
+            std::span<const std::byte> data, Blocks &&blocks) {
+  if (buffered > 0) {
+    const size_t take = std::min(N - buffered, data.size());
+    std::memcpy(buffer.data() + buffered, data.data(), take);
+    buffered += take;
+    data = data.subspan(take);
+    if (buffered < N) {
+      return;
+    }
+    blocks(buffer.data(), 1);
+    buffered = 0;
+  }
+  const size_t whole = data.size() / N;
+  if (whole > 0) {
+    blocks(data.data(), whole);
+  }
+  const auto rest = data.subspan(whole * N);
+  std::memcpy(buffer.data(), rest.data(), rest.size());
+  buffered = rest.size();
+}
+
+} // namespace
+
+std::string Hex(std::span<const uint8_t> bytes) {
+  std::string hex;
+  hex.reserve(bytes.size() * 2);
+  for (const uint8_t byte : bytes) {
+    hex += std::format("{:02x}", byte);
+  }
+  return hex;
+}
+
+void Xxh64::Update(std::span<const std::byte> data) {
+  total_ += data.size();
+  Absorb(buffer_, buffered_, data, [this](const std::byte *p, size_t n) {
+    Xxh64Stripes(acc_, p, n);
+  });
+}
+
+uint64_t Xxh64::Digest() const {
+  uint64_t h;
+  if (total_ >= XXH64_STRIPE) {
+    const auto [v1, v2, v3, v4] = acc_;
+    h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+        std::rotl(v4, 18);
+    h = Xxh64Merge(h, v1);
+    h = Xxh64Merge(h, v2);
+    h = Xxh64Merge(h, v3);
+    h = Xxh64Merge(h, v4);
+  } else {
+    h = PRIME64_5; // acc_[2] holds the seed, which is 0
+  }
+  h += total_;
+
+  const std::byte *p = buffer_.data();
+  size_t left = buffered_;
+  for (; left >= 8; left -= 8, p += 8) {
+    h ^= Xxh64Round(0, LoadU64(p));
+    h = std::rotl(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (left >= 4) {
+    h ^= static_cast<uint64_t>(LoadU32(p)) * PRIME64_1;
+    h = std::rotl(h, 23) * PRIME64_2 + PRIME64_3;
+    left -= 4;
+    p += 4;
+  }
+  for (; left > 0; --left, ++p) {
+    h ^= static_cast<uint64_t>(*p) * PRIME64_5;
+    h = std::rotl(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+void Sha256::Update(std::span<const std::byte> data) {
+  total_ += data.size();
+  Absorb(buffer_, buffered_, data, [this](const std::byte *p, size_t n) {
+    Sha256Blocks(state_, p, n);
+  });
+}
+
+std::array<uint8_t, 32> Sha256::Digest() const {
+  // Pad a copy so the running state stays usable
+  auto state = state_;
+  PadAndCompress(state, std::span(buffer_).first(buffered_), total_,
+                 Sha256Blocks);
+  return BigEndianDigest(state);
+}
+
+void Sha1::Update(std::span<const std::byte> data) {
+  total_ += data.size();
+  Absorb(buffer_, buffered_, data, [this](const std::byte *p, size_t n) {
+    Sha1Blocks(state_, p, n);
+  });
+}
+
+std::array<uint8_t, 20> Sha1::Digest() const {
+  auto state = state_;
+  PadAndCompress(state, std::span(buffer_).first(buffered_), total_,
+                 Sha1Blocks);
+  return BigEndianDigest(state);
+}
+
+void Manifest::Add(std::string name, uint64_t offset, uint64_t size,
+                   const SectionDigest &digest) {
+  ManifestEntry entry{std::move(name), offset, size, digest.xxh64(),
+                      digest.sha256()};
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.push_back(std::move(entry));
+}
+
+void Manifest::Merge(Manifest &other, uint64_t base) {
+  std::vector<ManifestEntry> moved;
+  {
+    std::lock_guard<std::mutex> lock(other.mutex_);
+    moved.swap(other.entries_);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &entry : moved) {
+    entry.offset += base;
+    entries_.push_back(std::move(entry));
+  }
+}
+
+std::string Manifest::Header(bool sha256) {
+  return sha256 ? "#image\tname\toffset\tsize\txxh64\tsha256\n"
+                : "#image\tname\toffset\tsize\txxh64\n";
+}
+
+void Manifest::Write(std::ostream &out, std::string_view image) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<const ManifestEntry *> sorted;
+  sorted.reserve(entries_.size());
+  for (const auto &entry : entries_) {
+    sorted.push_back(&entry);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](auto *a, auto *b) {
+    return a->offset < b->offset;
+  });
+
+  for (const auto *entry : sorted) {
+    out << image << '\t' << entry->name << '\t' << entry->offset << '\t'
+        << entry->size << '\t' << std::format("{:016x}", entry->xxh64);
+    if (sha256_) {
+      out << '\t' << (entry->sha256 ? Hex(*entry->sha256) : "-");
+    }
+    out << '\n';
+  }
+}
+
+namespace {
+const char *OutputModeName(RamdiskOutput mode) {
+  switch (mode) {
+  case RamdiskOutput::Raw:
+    return "raw";
+  case RamdiskOutput::Decompressed:
+    return "decompressed";
+  case RamdiskOutput::Tree:
+    return "tree";
+  }
+  return "raw";
+}
+
+std::optional<RamdiskOutput> ParseOutputMode(std::string_view name) {
+  for (const auto mode : {RamdiskOutput::Raw, RamdiskOutput::Decompressed,
+                          RamdiskOutput::Tree}) {
+    if (name == OutputModeName(mode)) {
+      return mode;
+    }
+  }
+  return std::nullopt;
+}
+
+constexpr std::string_view CACHE_HEADER = "#unpackbootimg-cache 1";
+} // namespace
+
+OutputCache::OutputCache(std::filesystem::path output_dir)
+    : dir_(std::move(output_dir)) {
+  std::ifstream in(dir_ / CACHE_FILE);
+  std::string line;
+  if (!std::getline(in, line) || line != CACHE_HEADER) {
+    return;
+  }
+
+  // name, mode, size, xxh64, output size, output mtime
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string name, mode_name;
+    Output output{};
+    if (!std::getline(fields, name, '\t') ||
+        !std::getline(fields, mode_name, '\t') ||
+        !(fields >> output.size >> std::hex >> output.xxh64 >> std::dec >>
+          output.file_size >> output.mtime)) {
+      outputs_.clear();
+      return;
+    }
+    const auto mode = ParseOutputMode(mode_name);
+    if (!mode) {
+      outputs_.clear();
+      return;
+    }
+    output.mode = *mode;
+    outputs_[name] = output;
+  }
+}
+
+bool OutputCache::Stat(const std::string &name, uint64_t &file_size,
+                       int64_t &mtime) const {
+  const auto path = dir_ / name;
+  std::error_code ec;
+  const auto status = std::filesystem::symlink_status(path, ec);
+  if (ec || (!std::filesystem::is_regular_file(status) &&
+             !std::filesystem::is_directory(status))) {
+    return false;
+  }
+  // Directories (unpacked ramdisks) only have their modification time
+  file_size = std::filesystem::is_regular_file(status)
+                  ? std::filesystem::file_size(path, ec)
+                  : 0;
+  if (ec) {
+    return false;
+  }
+  const auto time = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return false;
+  }
+  mtime = static_cast<int64_t>(time.time_since_epoch().count());
+  return true;
+}
+
+bool OutputCache::Unchanged(const ImageEntry &entry, RamdiskOutput mode,
+                            uint64_t xxh64) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = outputs_.find(entry.name);
+    if (it == outputs_.end() || it->second.mode != mode ||
+        it->second.size != entry.size || it->second.xxh64 != xxh64) {
+      return false;
+    }
+  }
+
+  uint64_t file_size = 0;
+  int64_t mtime = 0;
+  if (!Stat(entry.name, file_size, mtime)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto &output = outputs_.at(entry.name);
+  return output.file_size == file_size && output.mtime == mtime;
+}
+
+void OutputCache::Record(const ImageEntry &entry, RamdiskOutput mode,
+                         uint64_t xxh64) {
+  Output output{mode, entry.size, xxh64, 0, 0};
+  const bool exists = Stat(entry.name, output.file_size, output.mtime);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (exists) {
+    outputs_[entry.name] = output;
+  } else {
+    outputs_.erase(entry.name);
+  }
+}
+
+bool OutputCache::Save() const {
+  const auto path = dir_ / CACHE_FILE;
+  auto temp_path = path;
+  temp_path += ".tmp";
+  {
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << CACHE_HEADER << '\n';
+    for (const auto &[name, output] : outputs_) {
+      out << name << '\t' << OutputModeName(output.mode) << '\t'
+          << output.size << '\t' << std::format("{:016x}", output.xxh64)
+          << '\t' << output.file_size << '\t' << output.mtime << '\n';
+    }
+    if (!out.flush()) {
+      std::error_code ec;
+      std::filesystem::remove(temp_path, ec);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(temp_path, path, ec);
+  return !ec;
+}
+
+} // namespace utils
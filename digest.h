@@ -0,0 +1,192 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <cstddef>
+#include <map>
+#include <span>
+
+namespace utils {
+
+// Streaming XXH64 (seed 0), the fast content hash used for deduplication.
+class Xxh64 {
+public:
+  void Update(std::span<const std::byte> data);
+  uint64_t Digest() const;
+
+private:
+  std::array<uint64_t, 4> acc_{
+      0x9E3779B185EBCA87ULL + 0xC2B2AE3D27D4EB4FULL, 0xC2B2AE3D27D4EB4FULL, 0,
+      0 - 0x9E3779B185EBCA87ULL};
+  std::array<std::byte, 32> buffer_{};
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
+
+// Streaming SHA-256. Blocks are compressed with the SHA extensions where the
+// CPU has them (SHA-NI detected at run time; ARMv8 when the build targets
+// +crypto) and in portable code otherwise.
+class Sha256 {
+public:
+  void Update(std::span<const std::byte> data);
+  std::array<uint8_t, 32> Digest() const;
+
+private:
+  std::array<uint32_t, 8> state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  std::array<std::byte, 64> buffer_{};
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
+
+// Streaming SHA-1, for the ids legacy mkbootimg writes into v0-v2 headers.
+class Sha1 {
+public:
+  void Update(std::span<const std::byte> data);
+  std::array<uint8_t, 20> Digest() const;
+
+private:
+  std::array<uint32_t, 5> state_{0x67452301, 0xefcdab89, 0x98badcfe,
+                                 0x10325476, 0xc3d2e1f0};
+  std::array<std::byte, 64> buffer_{};
+  size_t buffered_ = 0;
+  uint64_t total_ = 0;
+};
+
+// Lower case hex of a digest.
+std::string Hex(std::span<const uint8_t> bytes);
+
+// Receives sections at their image offsets as extraction reads them, e.g.
+// to verify the image on the way (see verify.h). Feed may be called from
+// several threads at once.
+class ImageTap {
+public:
+  virtual void Feed(uint64_t offset, std::span<const std::byte> data) = 0;
+
+protected:
+  ~ImageTap() = default;
+};
+
+// Digests of one section as stored in the image.
+class SectionDigest {
+public:
+  explicit SectionDigest(bool sha256) {
+    if (sha256) {
+      sha256_.emplace();
+    }
+  }
+  // Hashes nothing itself, only passes the section on to `tap`.
+  SectionDigest(ImageTap &tap, uint64_t offset) : hashed_(false) {
+    Tap(tap, offset);
+  }
+
+  // Also passes the section, which starts at `offset`, on to `tap`.
+  void Tap(ImageTap &tap, uint64_t offset) {
+    tap_ = &tap;
+    tap_offset_ = offset;
+  }
+
+  void Update(std::span<const std::byte> data) {
+    if (hashed_) {
+      xxh64_.Update(data);
+      if (sha256_) {
+        sha256_->Update(data);
+      }
+    }
+    if (tap_) {
+      tap_->Feed(tap_offset_, data);
+      tap_offset_ += data.size();
+    }
+  }
+
+  uint64_t xxh64() const { return xxh64_.Digest(); }
+  std::optional<std::array<uint8_t, 32>> sha256() const {
+    if (!sha256_) {
+      return std::nullopt;
+    }
+    return sha256_->Digest();
+  }
+
+private:
+  bool hashed_ = true;
+  Xxh64 xxh64_;
+  std::optional<Sha256> sha256_;
+  ImageTap *tap_ = nullptr;
+  uint64_t tap_offset_ = 0;
+};
+
+struct ManifestEntry {
+  std::string name;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t xxh64;
+  std::optional<std::array<uint8_t, 32>> sha256;
+};
+
+// Sections recorded while one image is extracted (see --manifest). Safe to
+// add to from the extraction workers.
+class Manifest {
+public:
+  explicit Manifest(bool sha256 = false) : sha256_(sha256) {}
+
+  bool sha256() const { return sha256_; }
+
+  void Add(std::string name, uint64_t offset, uint64_t size,
+           const SectionDigest &digest);
+  // Moves the entries of `other` here, shifting their offsets by `base`
+  // (for sections extracted from a spooled copy of part of the image).
+  void Merge(Manifest &other, uint64_t base);
+
+  // One tab separated line per section, in image order:
+  // image, name, offset, size, xxh64 and (when enabled) sha256.
+  void Write(std::ostream &out, std::string_view image) const;
+  static std::string Header(bool sha256);
+
+private:
+  bool sha256_;
+  mutable std::mutex mutex_;
+  std::vector<ManifestEntry> entries_;
+};
+
+// What earlier runs wrote into an output directory (see --incremental), kept
+// there in CACHE_FILE. An output is unchanged when the image still holds the
+// same section bytes, they are written the same way, and the output itself
+// has not been touched since (same size and modification time). Safe to use
+// from the extraction workers.
+class OutputCache {
+public:
+  static constexpr const char *CACHE_FILE = ".unpackbootimg-cache";
+
+  // Loads the cache of `output_dir`; a missing or malformed file reads as
+  // empty, so every output is written again.
+  explicit OutputCache(std::filesystem::path output_dir);
+
+  bool Unchanged(const ImageEntry &entry, RamdiskOutput mode,
+                 uint64_t xxh64) const;
+  // Records the output just written for `entry`.
+  void Record(const ImageEntry &entry, RamdiskOutput mode, uint64_t xxh64);
+
+  // Writes the cache back, through a temporary file so a failed run never
+  // leaves a truncated one behind.
+  bool Save() const;
+
+private:
+  struct Output {
+    RamdiskOutput mode;
+    uint64_t size;
+    uint64_t xxh64;
+    // Of the output file or directory, when it was recorded
+    uint64_t file_size;
+    int64_t mtime;
+  };
+
+  bool Stat(const std::string &name, uint64_t &file_size,
+            int64_t &mtime) const;
+
+  std::filesystem::path dir_;
+  mutable std::mutex mutex_;
+  std::map<std::string, Output> outputs_;
+};
+
+} // namespace utils
@@ -0,0 +1,312 @@
+#include "dtb.h"
+
+#include <algorithm>
+
+namespace utils {
+
+namespace {
+constexpr uint32_t FDT_MAGIC = 0xd00dfeed;
+constexpr uint32_t DTBO_MAGIC = 0xd7b7ab1e;
+constexpr size_t FDT_HEADER_SIZE = 40;
+constexpr size_t DTBO_HEADER_SIZE = 32;
+constexpr size_t DTBO_ENTRY_SIZE = 32;
+
+constexpr uint32_t FDT_BEGIN_NODE = 1;
+constexpr uint32_t FDT_END_NODE = 2;
+constexpr uint32_t FDT_PROP = 3;
+constexpr uint32_t FDT_NOP = 4;
+constexpr uint32_t FDT_END = 9;
+
+// Device trees are big endian
+uint32_t LoadBE32(const std::byte *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+size_t Align4(size_t n) { return (n + 3) & ~size_t{3}; }
+
+std::string_view PropertyString(std::span<const std::byte> value) {
+  std::string_view s(reinterpret_cast<const char *>(value.data()),
+                     value.size());
+  while (!s.empty() && s.back() == '\0') {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// Root node properties precede its subnodes, so the walk stops at the first
+// subnode.
+bool ReadRootProperties(std::span<const std::byte> structs,
+                        std::span<const std::byte> strings,
+                        DeviceTreeView &view) {
+  size_t pos = 0;
+  int depth = 0;
+  while (pos + 4 <= structs.size()) {
+    const uint32_t token = LoadBE32(structs.data() + pos);
+    pos += 4;
+    switch (token) {
+    case FDT_BEGIN_NODE: {
+      if (++depth > 1) {
+        return true;
+      }
+      const auto name = structs.subspan(pos);
+      const auto end = std::find(name.begin(), name.end(), std::byte{0});
+      if (end == name.end()) {
+        return false;
+      }
+      pos += Align4(static_cast<size_t>(end - name.begin()) + 1);
+      break;
+    }
+    case FDT_PROP: {
+      if (pos + 8 > structs.size()) {
+        return false;
+      }
+      const uint32_t length = LoadBE32(structs.data() + pos);
+      const uint32_t name_offset = LoadBE32(structs.data() + pos + 4);
+      pos += 8;
+      if (length > structs.size() - pos || name_offset >= strings.size()) {
+        return false;
+      }
+      const auto value = structs.subspan(pos, length);
+      pos += Align4(length);
+
+      const std::string_view names(
+          reinterpret_cast<const char *>(strings.data()) + name_offset,
+          strings.size() - name_offset);
+      const std::string_view prop = names.substr(0, names.find('\0'));
+      if (prop == "model") {
+        view.model = PropertyString(value);
+      } else if (prop == "compatible") {
+        view.compatible = PropertyString(value);
+      }
+      break;
+    }
+    case FDT_NOP:
+      break;
+    case FDT_END_NODE:
+    case FDT_END:
+      return true;
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+
+bool IsFdtAt(std::span<const std::byte> data, size_t pos) {
+  return pos + FDT_HEADER_SIZE <= data.size() &&
+         LoadBE32(data.data() + pos) == FDT_MAGIC;
+}
+
+std::vector<DeviceTreeView> FindDtboEntries(std::span<const std::byte> table) {
+  std::vector<DeviceTreeView> trees;
+  const uint32_t entry_size = LoadBE32(table.data() + 12);
+  const uint32_t count = LoadBE32(table.data() + 16);
+  const uint32_t entries_offset = LoadBE32(table.data() + 20);
+  if (entry_size < DTBO_ENTRY_SIZE || entries_offset > table.size() ||
+      count > (table.size() - entries_offset) / entry_size) {
+    return trees;
+  }
+
+  trees.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    const std::byte *entry =
+        table.data() + entries_offset + static_cast<size_t>(i) * entry_size;
+    DeviceTreeView view;
+    view.size = LoadBE32(entry);
+    view.offset = LoadBE32(entry + 4);
+    view.id = LoadBE32(entry + 8);
+    view.rev = LoadBE32(entry + 12);
+    if (view.offset > table.size() || view.size > table.size() - view.offset) {
+      continue;
+    }
+    // Compressed (v1) entries keep their placement but nothing else
+    DeviceTreeView fdt;
+    if (ParseFdt(table.subspan(static_cast<size_t>(view.offset), view.size),
+                 fdt)) {
+      view.model = fdt.model;
+      view.compatible = fdt.compatible;
+    }
+    trees.push_back(view);
+  }
+  return trees;
+}
+
+struct IndexedTree {
+  std::string file; // Empty when not written
+  std::string section;
+  uint64_t offset; // Relative to the image
+  DeviceTreeView view;
+};
+
+std::string TreePrefix(const ImageEntry &entry) {
+  return entry.name == "recovery_dtbo" ? "dtbo" : entry.name;
+}
+
+bool WantsTree(const DeviceTreeView &view, const UnpackOptions &options) {
+  return options.dtb_compatible.empty() ||
+         view.Compatible(options.dtb_compatible);
+}
+
+// Indexes the trees of one section and writes the selected ones through
+// `write(tree, path)`.
+template <typename Write>
+void SplitSection(const ImageEntry &entry, std::span<const std::byte> data,
+                  const std::filesystem::path &output_dir,
+                  const UnpackOptions &options, std::vector<IndexedTree> &index,
+                  Write &&write) {
+  stats::ScopedTimer timer("split", entry.name, entry.size);
+  const auto trees = FindDeviceTrees(data);
+  for (size_t i = 0; i < trees.size(); ++i) {
+    IndexedTree indexed{"", entry.name, entry.offset + trees[i].offset,
+                        trees[i]};
+    if (WantsTree(trees[i], options)) {
+      indexed.file = std::format("{}.{}", TreePrefix(entry), i);
+      if (!write(trees[i], output_dir / indexed.file))
+        throw std::runtime_error("Could not extract image: " + indexed.file);
+    }
+    index.push_back(std::move(indexed));
+  }
+}
+
+// One tab separated line per tree: file (or "-"), section, offset, size,
+// id, rev, model and the compatible strings joined by commas.
+void WriteIndex(const std::filesystem::path &output_dir,
+                const std::vector<IndexedTree> &index) {
+  std::ofstream out(output_dir / DTB_INDEX_FILE,
+                    std::ios::binary | std::ios::trunc);
+  out << "#file\tsection\toffset\tsize\tid\trev\tmodel\tcompatible\n";
+  for (const auto &tree : index) {
+    std::string compatible(tree.view.compatible);
+    std::replace(compatible.begin(), compatible.end(), '\0', ',');
+    const auto number = [](const std::optional<uint32_t> &value) {
+      return value ? std::format("0x{:x}", *value) : std::string("-");
+    };
+    out << (tree.file.empty() ? "-" : tree.file) << '\t' << tree.section
+        << '\t' << tree.offset << '\t' << tree.view.size << '\t'
+        << number(tree.view.id) << '\t' << number(tree.view.rev) << '\t'
+        << tree.view.model << '\t' << compatible << '\n';
+  }
+  if (!out.flush())
+    throw std::runtime_error(std::string("Could not write ") + DTB_INDEX_FILE);
+}
+} // namespace
+
+bool DeviceTreeView::Compatible(std::string_view name) const {
+  for (size_t start = 0; start < compatible.size();) {
+    size_t end = compatible.find('\0', start);
+    if (end == std::string_view::npos) {
+      end = compatible.size();
+    }
+    if (compatible.substr(start, end - start) == name) {
+      return true;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+ParseResult ParseFdt(std::span<const std::byte> data,
+                     DeviceTreeView &view) noexcept {
+  if (data.size() < FDT_HEADER_SIZE) {
+    return {ParseStatus::Truncated, "fdt header"};
+  }
+  if (LoadBE32(data.data()) != FDT_MAGIC) {
+    return {ParseStatus::BadMagic, "fdt header"};
+  }
+  const uint32_t total_size = LoadBE32(data.data() + 4);
+  const uint32_t structs_offset = LoadBE32(data.data() + 8);
+  const uint32_t strings_offset = LoadBE32(data.data() + 12);
+  const uint32_t strings_size = LoadBE32(data.data() + 32);
+  const uint32_t structs_size = LoadBE32(data.data() + 36);
+  if (total_size < FDT_HEADER_SIZE || total_size > data.size() ||
+      structs_offset > total_size ||
+      structs_size > total_size - structs_offset ||
+      strings_offset > total_size ||
+      strings_size > total_size - strings_offset) {
+    return {ParseStatus::Truncated, "fdt"};
+  }
+
+  view.size = total_size;
+  if (!ReadRootProperties(data.subspan(structs_offset, structs_size),
+                          data.subspan(strings_offset, strings_size), view)) {
+    return {ParseStatus::Truncated, "fdt root node"};
+  }
+  return {};
+}
+
+std::vector<DeviceTreeView>
+FindDeviceTrees(std::span<const std::byte> section) {
+  if (section.size() >= DTBO_HEADER_SIZE &&
+      LoadBE32(section.data()) == DTBO_MAGIC) {
+    return FindDtboEntries(section);
+  }
+
+  // Trees are usually back to back; padding or foreign wrappers in between
+  // are skipped by searching for the next valid header
+  std::vector<DeviceTreeView> trees;
+  for (size_t pos = 0; pos + FDT_HEADER_SIZE <= section.size();) {
+    DeviceTreeView view;
+    if (IsFdtAt(section, pos) && ParseFdt(section.subspan(pos), view)) {
+      view.offset = pos;
+      trees.push_back(view);
+      pos += view.size;
+      continue;
+    }
+    pos = (pos + 4) & ~size_t{3};
+    while (pos + FDT_HEADER_SIZE <= section.size() && !IsFdtAt(section, pos)) {
+      pos += 4;
+    }
+  }
+  return trees;
+}
+
+bool IsDeviceTreeSection(const ImageEntry &entry) {
+  return entry.name == "dtb" || entry.name == "recovery_dtbo";
+}
+
+void SplitDeviceTrees(ImageSource &input,
+                      const std::vector<ImageEntry> &entries,
+                      const std::filesystem::path &output_dir,
+                      const UnpackOptions &options) {
+  std::vector<IndexedTree> index;
+  std::vector<std::byte> scratch;
+  for (const auto &entry : entries) {
+    if (!IsDeviceTreeSection(entry)) {
+      continue;
+    }
+    const auto data = input.Slice(entry.offset, entry.size, scratch);
+    if (data.size() != entry.size)
+      throw std::runtime_error("Could not extract image: " + entry.name);
+    SplitSection(entry, data, output_dir, options, index,
+                 [&](const DeviceTreeView &tree,
+                     const std::filesystem::path &path) {
+                   return ExtractImage(input, entry.offset + tree.offset,
+                                       tree.size, path, nullptr,
+                                       options.drop_cache);
+                 });
+  }
+  WriteIndex(output_dir, index);
+}
+
+void SplitDeviceTrees(
+    const std::vector<std::pair<ImageEntry, std::vector<std::byte>>> &sections,
+    const std::filesystem::path &output_dir, const UnpackOptions &options) {
+  std::vector<IndexedTree> index;
+  for (const auto &[entry, data] : sections) {
+    SplitSection(entry, data, output_dir, options, index,
+                 [&](const DeviceTreeView &tree,
+                     const std::filesystem::path &path) {
+                   std::ofstream out(path, std::ios::binary | std::ios::trunc);
+                   stats::CountWrite(tree.size);
+                   out.write(reinterpret_cast<const char *>(data.data() +
+                                                            tree.offset),
+                             static_cast<std::streamsize>(tree.size));
+                   return out.good();
+                 });
+  }
+  WriteIndex(output_dir, index);
+}
+
+} // namespace utils
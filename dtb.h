@@ -0,0 +1,57 @@
+#pragma once
+
+#include "imagesource.h"
+#include "imageview.h"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <span>
+
+namespace utils {
+
+// Written next to the split trees (see UnpackOptions::split_dtb).
+constexpr const char *DTB_INDEX_FILE = "dtb.index";
+
+// One device tree inside a dtb or recovery_dtbo section. Views point into
+// the section bytes.
+struct DeviceTreeView {
+  uint64_t offset = 0; // Relative to the section
+  uint32_t size = 0;
+  // Root node properties; empty when absent or when the tree is stored
+  // compressed (DTBO v1)
+  std::string_view model;
+  std::string_view compatible; // NUL separated, as stored
+  // DTBO table entries only
+  std::optional<uint32_t> id;
+  std::optional<uint32_t> rev;
+
+  bool Compatible(std::string_view name) const;
+};
+
+// Decodes the FDT header at the start of `data` and the model and
+// compatible properties of its root node.
+ParseResult ParseFdt(std::span<const std::byte> data,
+                     DeviceTreeView &view) noexcept;
+
+// The entries of a DTBO table (magic 0xd7b7ab1e) or, for anything else, the
+// FDTs (magic 0xd00dfeed) found in the section, in section order.
+std::vector<DeviceTreeView> FindDeviceTrees(std::span<const std::byte> section);
+
+// Writes each tree of the selected dtb and recovery_dtbo entries to dtb.N or
+// dtbo.N, the source bytes coming straight from `input`, and lists every
+// tree in DTB_INDEX_FILE. With options.dtb_compatible only the matching
+// trees get files.
+void SplitDeviceTrees(ImageSource &input,
+                      const std::vector<ImageEntry> &entries,
+                      const std::filesystem::path &output_dir,
+                      const UnpackOptions &options);
+
+// The same for sections captured while streaming.
+void SplitDeviceTrees(
+    const std::vector<std::pair<ImageEntry, std::vector<std::byte>>> &sections,
+    const std::filesystem::path &output_dir, const UnpackOptions &options);
+
+// Whether SplitDeviceTrees handles `entry`.
+bool IsDeviceTreeSection(const ImageEntry &entry);
+
+} // namespace utils
@@ -0,0 +1,980 @@
+#include "imagesource.h"
+#include "bufferpool.h"
+#include "decompress.h"
+#include "digest.h"
+#include "threadpool.h"
+#include "uring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define UNPACKBOOTIMG_HAVE_MMAP 1
+#endif
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#define UNPACKBOOTIMG_HAVE_COPY_OFFLOAD 1
+#endif
+
+namespace utils {
+
+namespace {
+
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+// Zero runs of whole blocks (relative to the output) are left as holes.
+constexpr uint64_t kHoleBlock = 4096;
+
+bool IsZero(std::span<const std::byte> data) {
+  static constexpr std::array<std::byte, kHoleBlock> kZeros{};
+  for (size_t pos = 0; pos < data.size(); pos += kHoleBlock) {
+    const size_t n = std::min<size_t>(data.size() - pos, kHoleBlock);
+    if (std::memcmp(data.data() + pos, kZeros.data(), n) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A range of output offsets.
+struct Run {
+  uint64_t begin = 0;
+  uint64_t end = 0;
+};
+
+// The blocks of `section` from `begin` on that are not all zero.
+std::vector<Run> NonZeroRuns(std::span<const std::byte> section,
+                             uint64_t begin) {
+  std::vector<Run> runs;
+  for (uint64_t pos = begin; pos < section.size();) {
+    const uint64_t next =
+        std::min<uint64_t>(section.size(), (pos / kHoleBlock + 1) * kHoleBlock);
+    if (!IsZero(section.subspan(static_cast<size_t>(pos),
+                                static_cast<size_t>(next - pos)))) {
+      if (!runs.empty() && runs.back().end == pos) {
+        runs.back().end = next;
+      } else {
+        runs.push_back({pos, next});
+      }
+    }
+    pos = next;
+  }
+  return runs;
+}
+
+// The parts of the section from `begin` on that hold data in a sparse image,
+// or everything where the file system cannot tell.
+std::vector<Run> InputDataRuns(int in_fd, uint64_t offset, uint64_t begin,
+                               uint64_t size) {
+  std::vector<Run> runs;
+  for (uint64_t pos = begin; pos < size;) {
+    stats::Count(stats::SEEK_CALLS, 2);
+    const off_t data =
+        lseek(in_fd, static_cast<off_t>(offset + pos), SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      break; // Only a hole is left
+    }
+    const off_t hole = data < 0 ? -1 : lseek(in_fd, data, SEEK_HOLE);
+    if (hole < 0) {
+      return {{begin, size}};
+    }
+    const uint64_t data_pos = static_cast<uint64_t>(data) - offset;
+    if (data_pos >= size) {
+      break;
+    }
+    pos = std::min<uint64_t>(static_cast<uint64_t>(hole) - offset, size);
+    runs.push_back({data_pos, pos});
+  }
+  return runs;
+}
+
+#ifdef FICLONERANGE
+// Reflinks need block aligned ranges: clones the aligned prefix of the
+// section to `out_fd` at `out_offset` and returns its size.
+uint64_t CloneRange(int in_fd, uint64_t offset, uint64_t size, int out_fd,
+                    uint64_t out_offset) {
+  struct stat in_st;
+  if (fstat(in_fd, &in_st) != 0 || in_st.st_blksize <= 0) {
+    return 0;
+  }
+  const uint64_t block = static_cast<uint64_t>(in_st.st_blksize);
+  const uint64_t aligned = size - (size % block);
+  if (offset % block != 0 || out_offset % block != 0 || aligned == 0) {
+    return 0;
+  }
+  file_clone_range range{};
+  range.src_fd = in_fd;
+  range.src_offset = offset;
+  range.src_length = aligned;
+  range.dest_offset = out_offset;
+  stats::Count(stats::COPY_CALLS);
+  if (ioctl(out_fd, FICLONERANGE, &range) != 0) {
+    return 0;
+  }
+  stats::Count(stats::BYTES_COPIED, aligned);
+  return aligned;
+}
+#else
+uint64_t CloneRange(int, uint64_t, uint64_t, int, uint64_t) { return 0; }
+#endif
+
+// Moves up to `size` bytes from `in_fd` at `offset` to `out_fd` at
+// `out_offset` without passing them through user space. Returns the number
+// of bytes that were transferred; the caller writes the remainder itself.
+uint64_t CopyRange(int in_fd, uint64_t offset, uint64_t size, int out_fd,
+                   uint64_t out_offset) {
+  uint64_t done = 0;
+
+#ifdef SYS_copy_file_range
+  while (done < size) {
+    loff_t in_off = static_cast<loff_t>(offset + done);
+    loff_t out_off = static_cast<loff_t>(out_offset + done);
+    stats::Count(stats::COPY_CALLS);
+    const ssize_t n = syscall(SYS_copy_file_range, in_fd, &in_off, out_fd,
+                              &out_off, static_cast<size_t>(size - done), 0U);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += static_cast<uint64_t>(n);
+    stats::Count(stats::BYTES_COPIED, static_cast<uint64_t>(n));
+  }
+#endif
+
+  if (done < size &&
+      lseek(out_fd, static_cast<off_t>(out_offset + done), SEEK_SET) >= 0) {
+    stats::Count(stats::SEEK_CALLS);
+    while (done < size) {
+      off_t in_off = static_cast<off_t>(offset + done);
+      stats::Count(stats::COPY_CALLS);
+      const ssize_t n =
+          sendfile(out_fd, in_fd, &in_off, static_cast<size_t>(size - done));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      done += static_cast<uint64_t>(n);
+      stats::Count(stats::BYTES_COPIED, static_cast<uint64_t>(n));
+    }
+  }
+
+  return done;
+}
+
+// Writes `data` to `out_fd` at `out_offset` in chunks ending on output
+// block boundaries. With `sparse`, chunks that are all zero are skipped,
+// leaving whole holes.
+bool WriteChunks(int out_fd, std::span<const std::byte> data,
+                 uint64_t out_offset, bool sparse) {
+  constexpr uint64_t kChunkSize = 65536;
+  while (!data.empty()) {
+    const auto chunk = data.first(static_cast<size_t>(std::min<uint64_t>(
+        data.size(), kChunkSize - out_offset % kChunkSize)));
+    ssize_t n = static_cast<ssize_t>(chunk.size());
+    if (sparse && IsZero(chunk)) {
+      stats::Count(stats::BYTES_SPARSE, chunk.size());
+    } else {
+      stats::Count(stats::WRITE_CALLS);
+      n = pwrite(out_fd, chunk.data(), chunk.size(),
+                 static_cast<off_t>(out_offset));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      stats::Count(stats::BYTES_WRITTEN, static_cast<uint64_t>(n));
+    }
+    data = data.subspan(static_cast<size_t>(n));
+    out_offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+// Writes the part of the section the kernel did not copy (see WriteChunks).
+// Mapped images are written straight from the mapping; others are read
+// into pooled buffers, overlapping each read with the previous write.
+// Block devices are read in requests of at least DEVICE_READ_SIZE, and
+// direct reads in the largest requests the pool has.
+bool WriteRemaining(ImageSource &input, int out_fd, uint64_t offset,
+                    uint64_t size, uint64_t out_offset, SectionDigest *digest,
+                    bool sparse) {
+  const auto write = [&](std::span<const std::byte> data) {
+    if (!WriteChunks(out_fd, data, out_offset, sparse)) {
+      return false;
+    }
+    if (digest) {
+      digest->Update(data);
+    }
+    out_offset += data.size();
+    return true;
+  };
+  if (input.mapped()) {
+    std::vector<std::byte> unused;
+    const auto data = input.Slice(offset, static_cast<size_t>(size), unused);
+    return size == 0 || (!data.empty() && write(data));
+  }
+
+  size_t buffer_size = std::max<size_t>(
+      BufferPool::BufferSizeFor(size),
+      input.block_device() ? ImageSource::DEVICE_READ_SIZE : 0);
+  if (input.direct()) {
+    buffer_size = BufferPool::MAX_BUFFER_SIZE;
+  }
+  return PipelineCopy(
+      size, buffer_size, input.read_slack(),
+      [&](uint64_t done, size_t length, std::span<std::byte> buffer) {
+        return input.Read(offset + done, length, buffer);
+      },
+      write);
+}
+
+// Only clean pages can be dropped: waits for the file's writeback (without
+// the metadata flush of fdatasync) first.
+void DropCachedOutput(int out_fd) {
+  sync_file_range(out_fd, 0, 0,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(out_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Writes the section to [out_offset, out_offset + size) of `out_fd`, which
+// already extends that far. With `holes` that range is known to read back
+// as zeros (a hole of a freshly sized output), so zero blocks of a mapped
+// image and holes of a sparse one are skipped, and only the rest is
+// preallocated and copied (offloaded where the kernel can).
+bool WriteSection(ImageSource &input, uint64_t offset, uint64_t size,
+                  int out_fd, uint64_t out_offset, SectionDigest *digest,
+                  bool holes) {
+  // Offloaded bytes are hashed from the mapping; without one they are
+  // copied here instead, hashing them on the way. Direct reads bypass the
+  // page cache the offloads would go through.
+  if (input.fd() < 0 || input.direct() || (digest && !input.mapped())) {
+    return WriteRemaining(input, out_fd, offset, size, out_offset, digest,
+                          holes);
+  }
+  if (digest) {
+    digest->Update(input.view().subspan(static_cast<size_t>(offset),
+                                        static_cast<size_t>(size)));
+  }
+
+  const uint64_t cloned =
+      CloneRange(input.fd(), offset, size, out_fd, out_offset);
+  std::vector<Run> runs;
+  if (!holes) {
+    if (cloned < size) {
+      runs.push_back({cloned, size});
+    }
+  } else if (input.mapped()) {
+    runs = NonZeroRuns(input.view().subspan(static_cast<size_t>(offset),
+                                            static_cast<size_t>(size)),
+                       cloned);
+  } else {
+    runs = InputDataRuns(input.fd(), offset, cloned, size);
+  }
+  uint64_t covered = cloned;
+  for (const auto &run : runs) {
+    const uint64_t length = run.end - run.begin;
+    const uint64_t at = out_offset + run.begin;
+    covered += length;
+    // Only an optimization: file systems without it just allocate on write
+    fallocate(out_fd, 0, static_cast<off_t>(at), static_cast<off_t>(length));
+    const uint64_t copied =
+        CopyRange(input.fd(), offset + run.begin, length, out_fd, at);
+    if (copied < length &&
+        !WriteRemaining(input, out_fd, offset + run.begin + copied,
+                        length - copied, at + copied, nullptr, false)) {
+      return false;
+    }
+  }
+  stats::Count(stats::BYTES_SPARSE, size - covered);
+  return true;
+}
+#endif
+
+std::optional<SectionDigest> EntryDigest(const UnpackOptions &options,
+                                         const ImageEntry &entry) {
+  std::optional<SectionDigest> digest;
+  if (options.manifest || options.cache) {
+    digest.emplace(options.manifest && options.manifest->sha256());
+    if (options.image_tap) {
+      digest->Tap(*options.image_tap, entry.offset);
+    }
+  } else if (options.image_tap) {
+    digest.emplace(*options.image_tap, entry.offset);
+  }
+  return digest;
+}
+
+enum class CacheCheck { Changed, Unchanged, Failed };
+
+// Incremental runs hash the section up front and keep outputs the cache
+// records as unchanged, listing them in the manifest right away.
+CacheCheck CheckCache(ImageSource &input, const ImageEntry &entry,
+                      const UnpackOptions &options, RamdiskOutput mode,
+                      SectionDigest &digest) {
+  if (!HashRange(input, entry.offset, entry.size, digest)) {
+    return CacheCheck::Failed;
+  }
+  if (!options.cache->Unchanged(entry, mode, digest.xxh64())) {
+    return CacheCheck::Changed;
+  }
+  stats::Count(stats::SECTIONS_UNCHANGED);
+  if (options.manifest) {
+    options.manifest->Add(entry.name, entry.offset, entry.size, digest);
+  }
+  return CacheCheck::Unchanged;
+}
+
+// Records a freshly written output in the cache and manifest.
+void RecordOutput(const ImageEntry &entry, const UnpackOptions &options,
+                  RamdiskOutput mode,
+                  const std::optional<SectionDigest> &digest) {
+  if (options.cache) {
+    options.cache->Record(entry, mode, digest->xxh64());
+  }
+  if (options.manifest) {
+    options.manifest->Add(entry.name, entry.offset, entry.size, *digest);
+  }
+}
+
+// Extracts one entry, decoding (and possibly unpacking) it on the way when
+// it is a ramdisk and that was requested.
+bool ExtractEntry(ImageSource &input, const ImageEntry &entry,
+                  const std::filesystem::path &output_dir,
+                  const UnpackOptions &options, unsigned decode_jobs,
+                  ThreadPool *pool) {
+  stats::ScopedTimer timer("extract", entry.name, entry.size);
+  const auto output_path = output_dir / entry.name;
+  const RamdiskOutput mode = options.OutputFor(entry.kind);
+  std::optional<SectionDigest> digest = EntryDigest(options, entry);
+
+  // Without a cache the hash is taken while writing
+  SectionDigest *write_digest = digest ? &*digest : nullptr;
+  if (options.cache) {
+    write_digest = nullptr;
+    switch (CheckCache(input, entry, options, mode, *digest)) {
+    case CacheCheck::Failed:
+      return false;
+    case CacheCheck::Unchanged:
+      return true;
+    case CacheCheck::Changed:
+      break;
+    }
+  }
+
+  if (mode == RamdiskOutput::Raw) {
+    if (!ExtractImage(input, entry.offset, entry.size, output_path,
+                      write_digest, options.drop_cache)) {
+      return false;
+    }
+  } else {
+    SectionWriter writer(output_path, mode, decode_jobs, pool);
+    if (!writer.good()) {
+      return false;
+    }
+
+    const auto write = [&](std::span<const std::byte> data) {
+      if (!writer.Write(data)) {
+        return false;
+      }
+      if (write_digest) {
+        write_digest->Update(data);
+      }
+      return true;
+    };
+    // Unmapped images decode one chunk while the next is read
+    bool copied = true;
+    if (input.mapped()) {
+      constexpr uint64_t kDecodeChunkSize = 1 << 20;
+      std::vector<std::byte> unused;
+      for (uint64_t done = 0; copied && done < entry.size;) {
+        const size_t chunk = static_cast<size_t>(
+            std::min<uint64_t>(entry.size - done, kDecodeChunkSize));
+        const auto data = input.Slice(entry.offset + done, chunk, unused);
+        copied = !data.empty() && write(data);
+        done += chunk;
+      }
+    } else {
+      copied = PipelineCopy(
+          entry.size, BufferPool::BufferSizeFor(entry.size),
+          input.read_slack(),
+          [&](uint64_t done, size_t length, std::span<std::byte> buffer) {
+            return input.Read(entry.offset + done, length, buffer);
+          },
+          write);
+    }
+    if (!copied || !writer.Finish()) {
+      return false;
+    }
+  }
+
+  if (options.drop_cache && mode == RamdiskOutput::Decompressed) {
+    DropCachedFile(output_path);
+  }
+  RecordOutput(entry, options, mode, digest);
+  return true;
+}
+
+// Copies the raw entries among `pending` on the io_uring, leaving the ones
+// that are decoded on the way in `pending`.
+void RingExtractEntries(ImageSource &input,
+                        const std::vector<ImageEntry> &entries,
+                        const std::filesystem::path &output_dir,
+                        const UnpackOptions &options,
+                        std::vector<size_t> &pending,
+                        std::vector<char> &failed) {
+  std::vector<size_t> rest;
+  std::vector<size_t> copied;
+  std::vector<RingCopy> copies;
+  std::vector<std::optional<SectionDigest>> digests(entries.size());
+  for (const size_t i : pending) {
+    const auto &entry = entries[i];
+    const RamdiskOutput mode = options.OutputFor(entry.kind);
+    if (mode != RamdiskOutput::Raw) {
+      rest.push_back(i);
+      continue;
+    }
+    digests[i] = EntryDigest(options, entry);
+    if (options.cache) {
+      const CacheCheck check =
+          CheckCache(input, entry, options, mode, *digests[i]);
+      failed[i] = check == CacheCheck::Failed;
+      if (check != CacheCheck::Changed) {
+        continue;
+      }
+    }
+    RingCopy copy;
+    copy.offset = entry.offset;
+    copy.size = entry.size;
+    copy.path = output_dir / entry.name;
+    copy.digest = digests[i] && !options.cache ? &*digests[i] : nullptr;
+    copies.push_back(std::move(copy));
+    copied.push_back(i);
+  }
+
+  RingExtract(input, copies);
+  for (size_t k = 0; k < copies.size(); ++k) {
+    const size_t i = copied[k];
+    if (!copies[k].ok) {
+      failed[i] = 1;
+      continue;
+    }
+    if (options.drop_cache) {
+      DropCachedFile(copies[k].path);
+    }
+    RecordOutput(entries[i], options, RamdiskOutput::Raw, digests[i]);
+  }
+  pending = std::move(rest);
+}
+
+} // namespace
+
+bool HashRange(ImageSource &input, uint64_t offset, uint64_t size,
+               SectionDigest &digest) {
+  if (!input.mapped()) {
+    return PipelineCopy(
+        size, BufferPool::BufferSizeFor(size), input.read_slack(),
+        [&](uint64_t done, size_t length, std::span<std::byte> buffer) {
+          return input.Read(offset + done, length, buffer);
+        },
+        [&digest](std::span<const std::byte> data) {
+          digest.Update(data);
+          return true;
+        });
+  }
+  constexpr uint64_t kHashChunkSize = 1 << 20;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < size;) {
+    const size_t chunk =
+        static_cast<size_t>(std::min<uint64_t>(size - done, kHashChunkSize));
+    const auto data = input.Slice(offset + done, chunk, scratch);
+    if (data.empty()) {
+      return false;
+    }
+    digest.Update(data);
+    done += chunk;
+  }
+  return true;
+}
+
+void DropCachedRange(ImageSource &input, uint64_t offset, uint64_t size) {
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  if (input.fd() < 0 || size == 0) {
+    return;
+  }
+  // The partial page at the end of the image belongs to this range alone
+  const bool to_end = offset + size >= input.size();
+  // Mapped pages stay cached while the mapping holds them
+  if (input.mapped()) {
+    const auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    const uint64_t begin = (offset + page - 1) / page * page;
+    const uint64_t end = (to_end ? offset + size + page - 1 : offset + size) /
+                         page * page;
+    if (begin < end) {
+      madvise(const_cast<std::byte *>(input.view().data()) + begin,
+              static_cast<size_t>(end - begin), MADV_DONTNEED);
+    }
+  }
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(input.fd(), static_cast<off_t>(offset),
+                to_end ? 0 : static_cast<off_t>(size), POSIX_FADV_DONTNEED);
+#endif
+#else
+  (void)input;
+  (void)offset;
+  (void)size;
+#endif
+}
+
+void DropCachedFile(const std::filesystem::path &path) {
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    DropCachedOutput(fd);
+    ::close(fd);
+  }
+#else
+  (void)path;
+#endif
+}
+
+ImageSource::~ImageSource() {
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  if (!view_.empty()) {
+    munmap(const_cast<std::byte *>(view_.data()), view_.size());
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+#endif
+}
+
+bool ImageSource::Open(const std::filesystem::path &path, bool use_mmap,
+                       bool direct) {
+  stream_.open(path, std::ios::binary);
+  if (!stream_) {
+    return false;
+  }
+
+  std::error_code ec;
+  size_ = std::filesystem::file_size(path, ec);
+  if (ec) {
+    size_ = 0;
+  }
+
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd_ >= 0 && fstat(fd_, &st) == 0 && S_ISBLK(st.st_mode)) {
+    OpenDevice(path, direct);
+    return fd_ >= 0;
+  }
+  if (use_mmap && fd_ >= 0 && size_ > 0 &&
+      size_ <= std::numeric_limits<size_t>::max()) {
+    void *addr = mmap(nullptr, static_cast<size_t>(size_), PROT_READ,
+                      MAP_PRIVATE, fd_, 0);
+    if (addr != MAP_FAILED) {
+      view_ = {static_cast<const std::byte *>(addr),
+               static_cast<size_t>(size_)};
+      madvise(addr, view_.size(), MADV_SEQUENTIAL);
+    }
+  }
+#else
+  (void)use_mmap;
+  (void)direct;
+#endif
+
+  return true;
+}
+
+std::span<std::byte> ImageSource::Allocate(uint64_t size) {
+  if (size == 0 || size > std::numeric_limits<size_t>::max()) {
+    return {};
+  }
+  std::byte *data = nullptr;
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  // Anonymous pages read as zeros without being touched, and are
+  // released like a file mapping
+  void *addr = mmap(nullptr, static_cast<size_t>(size),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    return {};
+  }
+  data = static_cast<std::byte *>(addr);
+#else
+  memory_.resize(static_cast<size_t>(size));
+  data = memory_.data();
+#endif
+  size_ = size;
+  view_ = {data, static_cast<size_t>(size)};
+  return {data, static_cast<size_t>(size)};
+}
+
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+// Partitions are not mapped: readahead over a mapping of the whole device
+// would run on into its unused tail. They are read through pread, of the
+// header described ranges (and an AVB footer at the very end) only.
+void ImageSource::OpenDevice(const std::filesystem::path &path, bool direct) {
+  block_device_ = true;
+  const off_t end = lseek(fd_, 0, SEEK_END);
+  size_ = end > 0 ? static_cast<uint64_t>(end) : 0;
+
+#ifdef O_DIRECT
+  if (!direct) {
+    return;
+  }
+  const int direct_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+  if (direct_fd < 0) {
+    return; // Buffered reads still work
+  }
+  int sector_size = 0;
+#ifdef BLKSSZGET
+  if (ioctl(direct_fd, BLKSSZGET, &sector_size) != 0) {
+    sector_size = 0;
+  }
+#endif
+  ::close(fd_);
+  fd_ = direct_fd;
+  alignment_ = std::max<size_t>(static_cast<size_t>(sector_size), 512);
+#else
+  (void)path;
+  (void)direct;
+#endif
+}
+#endif
+
+std::span<const std::byte> ImageSource::Slice(uint64_t offset, size_t size,
+                                              std::vector<std::byte> &scratch) {
+  if (mapped()) {
+    return Read(offset, size, {});
+  }
+  // Aligned for direct reads
+  scratch.resize(size + read_slack() + alignment_ - 1);
+  std::byte *buffer = scratch.data();
+  buffer += (alignment_ - reinterpret_cast<uintptr_t>(buffer) % alignment_) %
+            alignment_;
+  return Read(offset, size, {buffer, size + read_slack()});
+}
+
+std::span<const std::byte> ImageSource::Read(uint64_t offset, size_t size,
+                                             std::span<std::byte> buffer) {
+  if (mapped()) {
+    if (offset > view_.size() || size > view_.size() - offset) {
+      return {};
+    }
+    stats::Count(stats::BYTES_READ, size); // Page faults, not read calls
+    return view_.subspan(static_cast<size_t>(offset), size);
+  }
+
+#ifdef UNPACKBOOTIMG_HAVE_MMAP
+  if (fd_ >= 0) {
+    if (block_device_ && (offset > size_ || size > size_ - offset)) {
+      return {};
+    }
+    // Direct reads cover whole sectors
+    const uint64_t begin = offset / alignment_ * alignment_;
+    const uint64_t end = (offset + size + alignment_ - 1) / alignment_ *
+                         alignment_;
+    const size_t length = static_cast<size_t>(end - begin);
+    if (length > buffer.size()) {
+      return {};
+    }
+    size_t done = 0;
+    while (done < length) {
+      stats::Count(stats::READ_CALLS);
+      const ssize_t n = pread(fd_, buffer.data() + done, length - done,
+                              static_cast<off_t>(begin + done));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return {};
+      }
+      done += static_cast<size_t>(n);
+      stats::Count(stats::BYTES_READ, static_cast<uint64_t>(n));
+    }
+    return buffer.subspan(static_cast<size_t>(offset - begin), size);
+  }
+#endif
+
+  if (size > buffer.size()) {
+    return {};
+  }
+  stream_.clear();
+  stats::Count(stats::SEEK_CALLS);
+  if (!stream_.seekg(static_cast<std::streamoff>(offset))) {
+    return {};
+  }
+  stats::CountRead(size);
+  if (!stream_.read(reinterpret_cast<char *>(buffer.data()),
+                    static_cast<std::streamsize>(size))) {
+    return {};
+  }
+  return buffer.first(size);
+}
+
+bool ExtractImage(ImageSource &input, uint64_t offset, uint64_t size,
+                  const std::filesystem::path &output_path,
+                  SectionDigest *digest, bool drop_cache) {
+  if (size > 0 && (offset > input.size() || size > input.size() - offset)) {
+    return false;
+  }
+
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  if (input.fd() >= 0) {
+    const int out_fd = ::open(output_path.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out_fd < 0) {
+      return false;
+    }
+
+    // Sized first, so whatever is not written reads back as zeros
+    bool ok = (size == 0 || ftruncate(out_fd, static_cast<off_t>(size)) == 0) &&
+              WriteSection(input, offset, size, out_fd, 0, digest, true);
+    if (ok && drop_cache) {
+      DropCachedOutput(out_fd);
+    }
+    ok = (::close(out_fd) == 0) && ok;
+    return ok;
+  }
+#endif
+
+  if (!input.mapped()) {
+    std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+      return false;
+    }
+    // Hashed on the way, so the section is read only once
+    const bool copied = PipelineCopy(
+        size, BufferPool::BufferSizeFor(size), input.read_slack(),
+        [&](uint64_t done, size_t length, std::span<std::byte> buffer) {
+          return input.Read(offset + done, length, buffer);
+        },
+        [&](std::span<const std::byte> data) {
+          if (digest) {
+            digest->Update(data);
+          }
+          stats::CountWrite(data.size());
+          return static_cast<bool>(
+              output.write(reinterpret_cast<const char *>(data.data()),
+                           static_cast<std::streamsize>(data.size())));
+        });
+    return copied && output.good();
+  }
+
+  std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
+  if (!output) {
+    return false;
+  }
+
+  stats::Count(stats::BYTES_READ, size);
+  stats::CountWrite(size);
+  if (digest) {
+    digest->Update(input.view().subspan(static_cast<size_t>(offset),
+                                        static_cast<size_t>(size)));
+  }
+  if (size > 0 &&
+      !output.write(
+          reinterpret_cast<const char *>(input.view().data() + offset),
+          static_cast<std::streamsize>(size))) {
+    return false;
+  }
+
+  return output.good();
+}
+
+OutputFile::~OutputFile() { Close(); }
+
+bool OutputFile::Open(const std::filesystem::path &path, bool truncate) {
+  Close();
+  path_ = path;
+  holes_ = truncate;
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  fd_ = ::open(path.c_str(),
+               O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0666);
+  return fd_ >= 0;
+#else
+  auto mode = std::ios::in | std::ios::out | std::ios::binary;
+  if (truncate) {
+    mode |= std::ios::trunc;
+  }
+  stream_.open(path, mode);
+  return stream_.is_open();
+#endif
+}
+
+bool OutputFile::Resize(uint64_t size) {
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  if (fd_ >= 0) {
+    return ftruncate(fd_, static_cast<off_t>(size)) == 0;
+  }
+#endif
+  if (!stream_.flush()) {
+    return false;
+  }
+  std::error_code ec;
+  std::filesystem::resize_file(path_, size, ec);
+  return !ec;
+}
+
+bool OutputFile::Write(uint64_t out_offset, std::span<const std::byte> data) {
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  if (fd_ >= 0) {
+    while (!data.empty()) {
+      stats::Count(stats::WRITE_CALLS);
+      const ssize_t n = pwrite(fd_, data.data(), data.size(),
+                               static_cast<off_t>(out_offset));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      stats::Count(stats::BYTES_WRITTEN, static_cast<uint64_t>(n));
+      data = data.subspan(static_cast<size_t>(n));
+      out_offset += static_cast<uint64_t>(n);
+    }
+    return true;
+  }
+#endif
+  stats::CountWrite(data.size());
+  return stream_.seekp(static_cast<std::streamoff>(out_offset)) &&
+         stream_.write(reinterpret_cast<const char *>(data.data()),
+                       static_cast<std::streamsize>(data.size()));
+}
+
+bool OutputFile::Copy(ImageSource &input, uint64_t offset, uint64_t size,
+                      uint64_t out_offset) {
+  if (size > 0 && (offset > input.size() || size > input.size() - offset)) {
+    return false;
+  }
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  if (fd_ >= 0) {
+    return WriteSection(input, offset, size, fd_, out_offset, nullptr,
+                        holes_);
+  }
+#endif
+  if (!input.mapped()) {
+    return PipelineCopy(
+        size, BufferPool::BufferSizeFor(size), input.read_slack(),
+        [&](uint64_t done, size_t length, std::span<std::byte> buffer) {
+          return input.Read(offset + done, length, buffer);
+        },
+        [&](std::span<const std::byte> data) {
+          if (!Write(out_offset, data)) {
+            return false;
+          }
+          out_offset += data.size();
+          return true;
+        });
+  }
+  constexpr uint64_t kChunkSize = 1 << 20;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < size;) {
+    const size_t chunk =
+        static_cast<size_t>(std::min<uint64_t>(size - done, kChunkSize));
+    const auto data = input.Slice(offset + done, chunk, scratch);
+    if (data.empty() || !Write(out_offset + done, data)) {
+      return false;
+    }
+    done += chunk;
+  }
+  return true;
+}
+
+bool OutputFile::Close() {
+  bool ok = true;
+#ifdef UNPACKBOOTIMG_HAVE_COPY_OFFLOAD
+  if (fd_ >= 0) {
+    ok = ::close(fd_) == 0;
+    fd_ = -1;
+  }
+#endif
+  if (stream_.is_open()) {
+    stream_.close();
+    ok = !stream_.fail() && ok;
+  }
+  return ok;
+}
+
+void ExtractImages(ImageSource &input, const std::vector<ImageEntry> &entries,
+                   const std::filesystem::path &output_dir,
+                   const UnpackOptions &options) {
+  std::vector<char> failed(entries.size(), 0);
+  std::vector<size_t> pending(entries.size());
+  std::iota(pending.begin(), pending.end(), 0);
+  // The ring reads into buffers of its own, not aligned for direct reads,
+  // and several sections at a time
+  const bool in_order = options.image_tap && !input.mapped();
+  if (options.io_uring && (input.mapped() || input.fd() >= 0) &&
+      !input.direct() && !in_order && RingUsable()) {
+    RingExtractEntries(input, entries, output_dir, options, pending, failed);
+  }
+
+  unsigned jobs =
+      options.jobs > 0 ? options.jobs : ThreadPool::DefaultConcurrency();
+  if (!input.mapped() && input.fd() < 0) {
+    jobs = 1; // Stream fallback shares one read position.
+  }
+  if (in_order) {
+    jobs = 1;
+  }
+  // Parallel block decoders share what the section pool leaves unused, on
+  // the same pool
+  const unsigned decode_jobs = static_cast<unsigned>(
+      std::max<size_t>(1, jobs / std::max<size_t>(pending.size(), 1)));
+  jobs = static_cast<unsigned>(
+      std::min<size_t>(jobs, std::max<size_t>(pending.size(), 1)));
+  // The calling thread works too, in Wait() and ParallelFor().
+  std::optional<ThreadPool> own_pool;
+  ThreadPool *pool = options.pool;
+  if (!pool && std::max(jobs, decode_jobs) > 1) {
+    pool = &own_pool.emplace(std::max(jobs, decode_jobs) - 1);
+  }
+
+  if (jobs <= 1) {
+    for (const size_t i : pending) {
+      if (!ExtractEntry(input, entries[i], output_dir, options, decode_jobs,
+                        pool)) {
+        failed[i] = 1;
+        break;
+      }
+    }
+  } else {
+    // Start the largest sections first so the tail of the run stays
+    // balanced.
+    std::stable_sort(pending.begin(), pending.end(), [&](size_t a, size_t b) {
+      return entries[a].size > entries[b].size;
+    });
+
+    for (const size_t i : pending) {
+      pool->Submit([&, i] {
+        failed[i] = !ExtractEntry(input, entries[i], output_dir, options,
+                                  decode_jobs, pool);
+      });
+    }
+    pool->Wait();
+  }
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (failed[i]) {
+      throw std::runtime_error("Could not extract image: " + entries[i].name);
+    }
+  }
+}
+
+} // namespace utils
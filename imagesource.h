@@ -0,0 +1,224 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <cstddef>
+#include <span>
+
+namespace utils {
+
+// Read-only view of an input image. When possible the whole file is mapped
+// into memory and header parsing/extraction work directly on the mapping;
+// otherwise every access falls back to the std::ifstream. Block devices
+// (e.g. /dev/block/by-name/boot_a) are read through pread instead, in
+// DEVICE_READ_SIZE requests, and with `direct` bypass the page cache
+// (O_DIRECT, in whole sectors) where the system allows it.
+class ImageSource {
+public:
+  static constexpr uint64_t DEVICE_READ_SIZE = 1 << 20;
+
+  ImageSource() = default;
+  ~ImageSource();
+
+  ImageSource(const ImageSource &) = delete;
+  ImageSource &operator=(const ImageSource &) = delete;
+
+  bool Open(const std::filesystem::path &path, bool use_mmap = true,
+            bool direct = false);
+  // Instead of opening a file: sets up an in-memory image of `size` zero
+  // bytes and returns it, to be filled in before anything reads the image
+  // (e.g. a partition of an OTA payload, see payload.h). It then counts as
+  // mapped. Empty when the memory cannot be had.
+  std::span<std::byte> Allocate(uint64_t size);
+
+  bool mapped() const { return !view_.empty(); }
+  bool block_device() const { return block_device_; }
+  bool direct() const { return alignment_ > 1; }
+  uint64_t size() const { return size_; }
+  std::span<const std::byte> view() const { return view_; }
+  std::ifstream &stream() { return stream_; }
+  // Native descriptor of the image, or -1 where unavailable.
+  int fd() const { return fd_; }
+
+  // Returns `size` bytes at `offset`, pointing into the mapping when mapped
+  // and into `scratch` otherwise. An empty span is returned on short reads.
+  // Safe to call concurrently (with distinct scratch buffers) unless the
+  // source has neither a mapping nor a native descriptor.
+  std::span<const std::byte> Slice(uint64_t offset, size_t size,
+                                   std::vector<std::byte> &scratch);
+  // The same, reading into `buffer` instead (e.g. one of the pool, see
+  // bufferpool.h), which must start on a page boundary and hold `size` +
+  // read_slack() bytes.
+  std::span<const std::byte> Read(uint64_t offset, size_t size,
+                                  std::span<std::byte> buffer);
+  // Room direct reads need beyond the bytes asked for, to cover whole
+  // sectors.
+  size_t read_slack() const { return alignment_ > 1 ? 2 * alignment_ : 0; }
+
+private:
+  void OpenDevice(const std::filesystem::path &path, bool direct);
+
+  std::ifstream stream_;
+  std::span<const std::byte> view_;
+  uint64_t size_ = 0;
+  int fd_ = -1;
+  // Backs view_ where nothing can be mapped
+  std::vector<std::byte> memory_;
+  bool block_device_ = false;
+  // Sector size of direct reads, 1 otherwise
+  size_t alignment_ = 1;
+};
+
+// Cursor over a byte span, mirroring the stream based Read* helpers.
+class ByteReader {
+public:
+  explicit ByteReader(std::span<const std::byte> data) : data_(data) {}
+
+  bool Skip(size_t length) {
+    if (length > data_.size() - pos_)
+      return false;
+    pos_ += length;
+    return true;
+  }
+
+  bool Take(size_t length, std::span<const std::byte> &out) {
+    if (length > data_.size() - pos_)
+      return false;
+    out = data_.subspan(pos_, length);
+    pos_ += length;
+    return true;
+  }
+
+  size_t position() const { return pos_; }
+
+private:
+  std::span<const std::byte> data_;
+  size_t pos_ = 0;
+};
+
+inline uint32_t LoadU32(const std::byte *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint64_t LoadU64(const std::byte *p) {
+  return static_cast<uint64_t>(LoadU32(p)) |
+         (static_cast<uint64_t>(LoadU32(p + 4)) << 32);
+}
+
+inline void StoreU32(std::byte *p, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = static_cast<std::byte>(value >> (8 * i));
+  }
+}
+
+inline void StoreU64(std::byte *p, uint64_t value) {
+  StoreU32(p, static_cast<uint32_t>(value));
+  StoreU32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+inline bool ReadU32(ByteReader &reader, uint32_t &value) {
+  std::span<const std::byte> bytes;
+  if (!reader.Take(sizeof(value), bytes))
+    return false;
+  value = LoadU32(bytes.data());
+  return true;
+}
+
+inline bool ReadU64(ByteReader &reader, uint64_t &value) {
+  std::span<const std::byte> bytes;
+  if (!reader.Take(sizeof(value), bytes))
+    return false;
+  value = LoadU64(bytes.data());
+  return true;
+}
+
+inline bool ReadString(ByteReader &reader, size_t length, std::string &out) {
+  std::span<const std::byte> bytes;
+  if (!reader.Take(length, bytes))
+    return false;
+  out = CStr(std::string_view(reinterpret_cast<const char *>(bytes.data()),
+                              bytes.size()));
+  return true;
+}
+
+template <size_t N>
+inline bool ReadU32Array(ByteReader &reader, std::array<uint32_t, N> &arr) {
+  for (auto &val : arr) {
+    if (!ReadU32(reader, val)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes [offset, offset + size) of the image to `output_path`. On Linux the
+// copy is first offloaded to the kernel (reflink clone, copy_file_range,
+// sendfile); whatever is left is written straight from the mapping, or
+// through pooled buffers (see PipelineCopy) when the image is not mapped.
+// With `digest` the section is hashed too; unmapped inputs then skip the
+// offload so the bytes are read only once. On Linux the output is sized and
+// preallocated up front, and zero blocks (or holes of a sparse image) become
+// holes in it; with `drop_cache` its pages are written back and released
+// from the page cache afterwards.
+bool ExtractImage(ImageSource &input, uint64_t offset, uint64_t size,
+                  const std::filesystem::path &output_path,
+                  SectionDigest *digest = nullptr, bool drop_cache = false);
+
+// An output file written at explicit offsets, for images assembled from
+// parts (see repack.h). On Linux Copy takes the same path as ExtractImage:
+// reflink clone, copy_file_range or sendfile, then writes from the mapping;
+// elsewhere everything goes through a std::fstream.
+class OutputFile {
+public:
+  OutputFile() = default;
+  ~OutputFile();
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  // Opens `path` for writing, creating it if needed. With `truncate` the
+  // file starts out empty, and Copy then leaves zero blocks of what it
+  // copies as holes: every range of the new file must be written at most
+  // once, or not at all to read back as zeros.
+  bool Open(const std::filesystem::path &path, bool truncate);
+  bool Resize(uint64_t size);
+  bool Write(uint64_t out_offset, std::span<const std::byte> data);
+  // Copies [offset, offset + size) of `input` to `out_offset`.
+  bool Copy(ImageSource &input, uint64_t offset, uint64_t size,
+            uint64_t out_offset);
+  // False when anything written could not be flushed.
+  bool Close();
+
+private:
+  std::filesystem::path path_;
+  std::fstream stream_;
+  int fd_ = -1;
+  bool holes_ = false;
+};
+
+// Releases the page cache (and mapping) pages that lie wholly inside
+// [offset, offset + size) of the image, for one-shot unpacks that should not
+// push other data out of the cache. A no-op where unsupported.
+void DropCachedRange(ImageSource &input, uint64_t offset, uint64_t size);
+
+// The same for a written output file, once its writeback has finished.
+void DropCachedFile(const std::filesystem::path &path);
+
+// Feeds [offset, offset + size) of the image to `digest` without writing it
+// anywhere. False when the image is shorter.
+bool HashRange(ImageSource &input, uint64_t offset, uint64_t size,
+               SectionDigest &digest);
+
+// Extracts every entry into `output_dir`, running up to `options.jobs`
+// extractions concurrently, and records them in `options.manifest` if set.
+// With `options.cache` outputs recorded there as unchanged are kept, and with
+// `options.io_uring` the raw outputs are written on the calling thread's
+// ring first (see uring.h). Throws naming the first entry (in table order)
+// that could not be extracted.
+void ExtractImages(ImageSource &input, const std::vector<ImageEntry> &entries,
+                   const std::filesystem::path &output_dir,
+                   const UnpackOptions &options);
+
+} // namespace utils
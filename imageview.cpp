@@ -0,0 +1,535 @@
+#include "imageview.h"
+#include "imagesource.h"
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+
+namespace utils {
+
+namespace {
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
+constexpr uint32_t SHA_LENGTH = 32;
+constexpr uint32_t BOARDNAME_SIZE = 16;
+constexpr uint32_t BOOT_CMDLINE_SIZE = 512;
+constexpr uint32_t BOOT_EXTRA_CMDLINE_SIZE = 1024;
+constexpr uint32_t BOOT_EXTENDED_CMDLINE_SIZE =
+    BOOT_CMDLINE_SIZE + BOOT_EXTRA_CMDLINE_SIZE; // v3+: cmdline + extra cmdline
+constexpr uint32_t VENDOR_CMDLINE_SIZE = 2048;
+// header_version sits at the same offset in every layout of a given type
+constexpr uint32_t BOOT_VERSION_OFFSET = 40;
+constexpr uint32_t VENDOR_BOOT_VERSION_OFFSET = 8;
+constexpr uint32_t VENDOR_RAMDISK_NAME_SIZE = 32;
+// size, offset, type, name and board_id
+constexpr uint32_t VENDOR_RAMDISK_ENTRY_MIN_SIZE =
+    3 * sizeof(uint32_t) + VENDOR_RAMDISK_NAME_SIZE + sizeof(BoardId);
+
+constexpr ParseResult Fail(ParseStatus status, const char *field) {
+  return {status, field};
+}
+
+// String fields are NUL padded; the view stops at the first NUL.
+std::string_view TrimmedView(std::span<const std::byte> bytes) {
+  std::string_view s(reinterpret_cast<const char *>(bytes.data()),
+                     bytes.size());
+  return s.substr(0, s.find('\0'));
+}
+
+// Header layouts are tables of fields in file order; Layout() assigns the
+// offsets at compile time. `name` is what truncation errors report.
+enum class FieldType : uint8_t { U32, U64, String, Bytes, Skip };
+
+template <typename View> struct Field {
+  FieldType type;
+  uint32_t size;
+  const char *name;
+  uint32_t View::*u32 = nullptr;
+  uint64_t View::*u64 = nullptr;
+  std::string_view View::*str = nullptr;
+  std::span<const std::byte> View::*bytes = nullptr;
+  uint32_t offset = 0;
+};
+
+template <typename View>
+constexpr Field<View> U32(uint32_t View::*member, const char *name) {
+  return {FieldType::U32, sizeof(uint32_t), name, member};
+}
+
+template <typename View>
+constexpr Field<View> U64(uint64_t View::*member, const char *name) {
+  return {FieldType::U64, sizeof(uint64_t), name, nullptr, member};
+}
+
+template <typename View>
+constexpr Field<View> Str(std::string_view View::*member, uint32_t size,
+                          const char *name) {
+  return {FieldType::String, size, name, nullptr, nullptr, member};
+}
+
+template <typename View>
+constexpr Field<View> Bytes(std::span<const std::byte> View::*member,
+                            uint32_t size, const char *name) {
+  return {FieldType::Bytes, size, name, nullptr, nullptr, nullptr, member};
+}
+
+template <typename View>
+constexpr Field<View> Skip(uint32_t size, const char *name) {
+  return {FieldType::Skip, size, name};
+}
+
+template <typename View, size_t N, typename... Fields>
+constexpr auto Extend(const std::array<Field<View>, N> &base, Fields... more) {
+  std::array<Field<View>, N + sizeof...(Fields)> fields{};
+  std::copy(base.begin(), base.end(), fields.begin());
+  const std::array<Field<View>, sizeof...(Fields)> tail{more...};
+  std::copy(tail.begin(), tail.end(), fields.begin() + N);
+
+  uint32_t offset = 0;
+  for (auto &field : fields) {
+    field.offset = offset;
+    offset += field.size;
+  }
+  return fields;
+}
+
+template <typename View, typename... Fields>
+constexpr auto Layout(Field<View> first, Fields... rest) {
+  return Extend(std::array<Field<View>, 1>{first}, rest...);
+}
+
+template <typename View>
+constexpr uint32_t LayoutSize(std::span<const Field<View>> layout) {
+  return layout.back().offset + layout.back().size;
+}
+
+template <typename View>
+constexpr uint32_t FieldOffset(std::span<const Field<View>> layout,
+                               uint32_t View::*member) {
+  for (const auto &field : layout) {
+    if (field.u32 == member) {
+      return field.offset;
+    }
+  }
+  return UINT32_MAX;
+}
+
+template <typename View>
+ParseResult Decode(std::span<const std::byte> header,
+                   std::span<const Field<View>> layout, View &view) {
+  if (header.size() < LayoutSize(layout)) {
+    for (const auto &field : layout) {
+      if (field.offset + field.size > header.size())
+        return Fail(ParseStatus::Truncated, field.name);
+    }
+  }
+  for (const auto &field : layout) {
+    const std::byte *p = header.data() + field.offset;
+    switch (field.type) {
+    case FieldType::U32:
+      view.*field.u32 = LoadU32(p);
+      break;
+    case FieldType::U64:
+      view.*field.u64 = LoadU64(p);
+      break;
+    case FieldType::String:
+      view.*field.str = TrimmedView({p, field.size});
+      break;
+    case FieldType::Bytes:
+      view.*field.bytes = {p, field.size};
+      break;
+    case FieldType::Skip:
+      break;
+    }
+  }
+  return {};
+}
+
+// The inverse of Decode. Views may point into `header` itself, hence the
+// memmove.
+template <typename View>
+bool Encode(const View &view, std::span<const Field<View>> layout,
+            std::span<std::byte> header) {
+  if (header.size() < LayoutSize(layout)) {
+    return false;
+  }
+  for (const auto &field : layout) {
+    std::byte *p = header.data() + field.offset;
+    std::span<const std::byte> bytes;
+    switch (field.type) {
+    case FieldType::U32:
+      StoreU32(p, view.*field.u32);
+      continue;
+    case FieldType::U64:
+      StoreU64(p, view.*field.u64);
+      continue;
+    case FieldType::String:
+      bytes = std::as_bytes(std::span(view.*field.str));
+      break;
+    case FieldType::Bytes:
+      bytes = view.*field.bytes;
+      break;
+    case FieldType::Skip:
+      continue;
+    }
+    if (bytes.size() > field.size) {
+      return false;
+    }
+    std::memmove(p, bytes.data(), bytes.size());
+    std::memset(p + bytes.size(), 0, field.size - bytes.size());
+  }
+  return true;
+}
+
+// Field order follows the structs in AOSP's bootimg.h.
+using B = BootImageView;
+
+constexpr auto BOOT_V0 = Layout(
+    Str(&B::boot_magic, MAGIC_SIZE, "boot magic"),
+    U32(&B::kernel_size, "header information"),
+    U32(&B::kernel_load_address, "header information"),
+    U32(&B::ramdisk_size, "header information"),
+    U32(&B::ramdisk_load_address, "header information"),
+    U32(&B::second_size, "header information"),
+    U32(&B::second_load_address, "header information"),
+    U32(&B::tags_load_address, "header information"),
+    U32(&B::page_size, "header information"),
+    U32(&B::header_version, "header information"),
+    U32(&B::os_version_patch_level, "os/version patch level"),
+    Str(&B::product_name, BOARDNAME_SIZE, "board name"),
+    Str(&B::cmdline, BOOT_CMDLINE_SIZE, "boot cmdline"),
+    Bytes(&B::id, SHA_LENGTH, "SHA-1 checksum"),
+    Str(&B::extra_cmdline, BOOT_EXTRA_CMDLINE_SIZE, "boot extra cmdline"));
+
+constexpr auto BOOT_V1 =
+    Extend(BOOT_V0, U32(&B::recovery_dtbo_size, "recovery_dtbo_size"),
+           U64(&B::recovery_dtbo_offset, "recovery_dtbo_offset"),
+           U32(&B::boot_header_size, "boot_header_size"));
+constexpr auto BOOT_V2 =
+    Extend(BOOT_V1, U32(&B::dtb_size, "dtb_size"),
+           U64(&B::dtb_load_address, "dtb_load_address"));
+
+constexpr auto BOOT_V3 = Layout(
+    Str(&B::boot_magic, MAGIC_SIZE, "boot magic"),
+    U32(&B::kernel_size, "header information"),
+    U32(&B::ramdisk_size, "header information"),
+    U32(&B::os_version_patch_level, "header information"),
+    U32(&B::boot_header_size, "header information"),
+    Skip<B>(4 * sizeof(uint32_t), "header information"),
+    U32(&B::header_version, "header information"),
+    Str(&B::cmdline, BOOT_EXTENDED_CMDLINE_SIZE, "boot cmdline"));
+constexpr auto BOOT_V4 =
+    Extend(BOOT_V3, U32(&B::boot_signature_size, "boot_signature_size"));
+
+// Indexed by header_version; newer versions parse as the last entry until
+// they get a layout of their own.
+constexpr std::array<std::span<const Field<B>>, 5> BOOT_LAYOUTS = {
+    BOOT_V0, BOOT_V1, BOOT_V2, BOOT_V3, BOOT_V4};
+
+using V = VendorBootImageView;
+
+constexpr auto VENDOR_BOOT_V3 = Layout(
+    Str(&V::boot_magic, MAGIC_SIZE, "header information"),
+    U32(&V::header_version, "header information"),
+    U32(&V::page_size, "header information"),
+    U32(&V::kernel_load_address, "header information"),
+    U32(&V::ramdisk_load_address, "header information"),
+    U32(&V::vendor_ramdisk_size, "header information"),
+    Str(&V::cmdline, VENDOR_CMDLINE_SIZE, "header information"),
+    U32(&V::tags_load_address, "header information"),
+    Str(&V::product_name, BOARDNAME_SIZE, "header information"),
+    U32(&V::header_size, "header information"),
+    U32(&V::dtb_size, "header information"),
+    U64(&V::dtb_load_address, "header information"));
+
+constexpr auto VENDOR_BOOT_V4 =
+    Extend(VENDOR_BOOT_V3,
+           U32(&V::vendor_ramdisk_table_size, "ramdisk table"),
+           U32(&V::vendor_ramdisk_table_entry_num, "ramdisk table"),
+           U32(&V::vendor_ramdisk_table_entry_size, "ramdisk table"),
+           U32(&V::vendor_bootconfig_size, "ramdisk table"));
+
+// Indexed by header_version - 3, as above.
+constexpr std::array<std::span<const Field<V>>, 2> VENDOR_BOOT_LAYOUTS = {
+    VENDOR_BOOT_V3, VENDOR_BOOT_V4};
+
+// Sizes of the C structs in AOSP's bootimg.h
+static_assert(LayoutSize<B>(BOOT_V0) == 1632);
+static_assert(LayoutSize<B>(BOOT_V1) == 1648);
+static_assert(LayoutSize<B>(BOOT_V2) == 1660);
+static_assert(LayoutSize<B>(BOOT_V3) == 1580);
+static_assert(LayoutSize<B>(BOOT_V4) == 1584);
+static_assert(LayoutSize<V>(VENDOR_BOOT_V3) == 2112);
+static_assert(LayoutSize<V>(VENDOR_BOOT_V4) == 2128);
+
+constexpr bool VersionOffsetsAgree() {
+  for (const auto layout : BOOT_LAYOUTS) {
+    if (FieldOffset(layout, &B::header_version) != BOOT_VERSION_OFFSET)
+      return false;
+  }
+  for (const auto layout : VENDOR_BOOT_LAYOUTS) {
+    if (FieldOffset(layout, &V::header_version) != VENDOR_BOOT_VERSION_OFFSET)
+      return false;
+  }
+  return true;
+}
+static_assert(VersionOffsetsAgree());
+
+uint64_t PageAligned(uint64_t size, uint32_t page_size) {
+  return static_cast<uint64_t>(page_size) *
+         GetNumberOfPages(static_cast<uint32_t>(size), page_size);
+}
+
+template <size_t N>
+void AddSection(FixedList<SectionView, N> &sections, uint64_t offset,
+                uint64_t size, std::string_view name,
+                SectionKind kind = SectionKind::Other) {
+  if (size > 0) {
+    sections.push_back({offset, size, name, kind});
+  }
+}
+
+void AddBootSections(BootImageView &view) {
+  const uint64_t page_size = view.page_size;
+  const uint64_t kernel_offset = page_size; // One header page
+  const uint64_t ramdisk_offset =
+      kernel_offset + PageAligned(view.kernel_size, view.page_size);
+  const uint64_t second_offset =
+      ramdisk_offset + PageAligned(view.ramdisk_size, view.page_size);
+  const uint64_t dtb_offset =
+      second_offset + PageAligned(view.second_size, view.page_size) +
+      PageAligned(view.recovery_dtbo_size, view.page_size);
+
+  auto &sections = view.sections;
+  sections.clear();
+  AddSection(sections, kernel_offset, view.kernel_size, "kernel",
+             SectionKind::Kernel);
+  AddSection(sections, ramdisk_offset, view.ramdisk_size, "ramdisk",
+             SectionKind::Ramdisk);
+  AddSection(sections, second_offset, view.second_size, "second");
+  AddSection(sections, view.recovery_dtbo_offset, view.recovery_dtbo_size,
+             "recovery_dtbo");
+  AddSection(sections, dtb_offset, view.dtb_size, "dtb", SectionKind::Dtb);
+  // v4 has no second stage, so the signature follows the ramdisk
+  AddSection(sections, second_offset, view.boot_signature_size,
+             "boot_signature");
+}
+
+void AddVendorBootSections(VendorBootImageView &view) {
+  view.ramdisk_offset = PageAligned(view.header_size, view.page_size);
+  view.dtb_offset = view.ramdisk_offset +
+                    PageAligned(view.vendor_ramdisk_size, view.page_size);
+  view.ramdisk_table_offset =
+      view.dtb_offset + PageAligned(view.dtb_size, view.page_size);
+  view.bootconfig_offset =
+      view.ramdisk_table_offset +
+      PageAligned(view.vendor_ramdisk_table_size, view.page_size);
+
+  auto &sections = view.sections;
+  sections.clear();
+  AddSection(sections, view.ramdisk_offset, view.vendor_ramdisk_size,
+             "vendor_ramdisk", SectionKind::Ramdisk);
+  AddSection(sections, view.dtb_offset, view.dtb_size, "dtb",
+             SectionKind::Dtb);
+  if (view.header_version > 3) {
+    AddSection(sections, view.ramdisk_table_offset, view.RamdiskTableBytes(),
+               "vendor_ramdisk_table");
+    AddSection(sections, view.bootconfig_offset, view.vendor_bootconfig_size,
+               "bootconfig");
+  }
+}
+} // namespace
+
+const char *ParseStatusName(ParseStatus status) {
+  switch (status) {
+  case ParseStatus::Ok:
+    return "ok";
+  case ParseStatus::Truncated:
+    return "truncated";
+  case ParseStatus::BadMagic:
+    return "bad magic";
+  case ParseStatus::BadRamdiskTable:
+    return "bad ramdisk table";
+  }
+  return "unknown";
+}
+
+VendorRamdiskView VendorRamdiskTableView::operator[](size_t i) const {
+  const std::byte *entry = data_.data() + i * entry_size_;
+  VendorRamdiskView view;
+  view.size = LoadU32(entry);
+  view.offset = LoadU32(entry + 4);
+  view.type = LoadU32(entry + 8);
+  view.name = TrimmedView({entry + 12, VENDOR_RAMDISK_NAME_SIZE});
+  for (size_t j = 0; j < view.board_id.size(); ++j) {
+    view.board_id[j] =
+        LoadU32(entry + 12 + VENDOR_RAMDISK_NAME_SIZE + j * sizeof(uint32_t));
+  }
+  return view;
+}
+
+bool EncodeVendorRamdiskEntry(const VendorRamdiskView &entry,
+                              std::span<std::byte> out) noexcept {
+  if (out.size() < VENDOR_RAMDISK_ENTRY_MIN_SIZE ||
+      entry.name.size() > VENDOR_RAMDISK_NAME_SIZE) {
+    return false;
+  }
+  StoreU32(out.data(), entry.size);
+  StoreU32(out.data() + 4, entry.offset);
+  StoreU32(out.data() + 8, entry.type);
+  std::byte *name = out.data() + 12;
+  std::memmove(name, entry.name.data(), entry.name.size());
+  std::memset(name + entry.name.size(), 0,
+              VENDOR_RAMDISK_NAME_SIZE - entry.name.size());
+  for (size_t j = 0; j < entry.board_id.size(); ++j) {
+    StoreU32(name + VENDOR_RAMDISK_NAME_SIZE + j * sizeof(uint32_t),
+             entry.board_id[j]);
+  }
+  return true;
+}
+
+VendorRamdiskIndex::VendorRamdiskIndex(const VendorRamdiskTableView &table) {
+  entries_.reserve(table.size());
+  by_name_.reserve(table.size());
+  by_type_.reserve(table.size());
+  for (uint32_t i = 0; i < table.size(); ++i) {
+    entries_.push_back(table[i]);
+    by_name_.push_back(i);
+    by_type_.push_back(i);
+  }
+
+  std::stable_sort(by_name_.begin(), by_name_.end(),
+                   [this](uint32_t a, uint32_t b) {
+                     return entries_[a].name < entries_[b].name;
+                   });
+  std::stable_sort(by_type_.begin(), by_type_.end(),
+                   [this](uint32_t a, uint32_t b) {
+                     return std::tie(entries_[a].type, entries_[a].board_id) <
+                            std::tie(entries_[b].type, entries_[b].board_id);
+                   });
+}
+
+std::optional<size_t>
+VendorRamdiskIndex::FindName(std::string_view name) const {
+  const auto it = std::lower_bound(
+      by_name_.begin(), by_name_.end(), name,
+      [this](uint32_t i, std::string_view key) {
+        return entries_[i].name < key;
+      });
+  if (it == by_name_.end() || entries_[*it].name != name) {
+    return std::nullopt;
+  }
+  return *it;
+}
+
+std::span<const uint32_t> VendorRamdiskIndex::FindType(uint32_t type) const {
+  const auto first =
+      std::partition_point(by_type_.begin(), by_type_.end(),
+                           [&](uint32_t i) { return entries_[i].type < type; });
+  const auto last =
+      std::partition_point(first, by_type_.end(), [&](uint32_t i) {
+        return entries_[i].type == type;
+      });
+  return {first, last};
+}
+
+std::optional<size_t>
+VendorRamdiskIndex::Find(uint32_t type, const BoardId &board_id) const {
+  const auto key = std::tie(type, board_id);
+  const auto it = std::lower_bound(
+      by_type_.begin(), by_type_.end(), key,
+      [this](uint32_t i, const auto &k) {
+        return std::tie(entries_[i].type, entries_[i].board_id) < k;
+      });
+  if (it == by_type_.end() || entries_[*it].type != type ||
+      entries_[*it].board_id != board_id) {
+    return std::nullopt;
+  }
+  return *it;
+}
+
+ParseResult ParseBootImage(std::span<const std::byte> image,
+                           BootImageView &view) noexcept {
+  view = {};
+  if (image.size() < MAGIC_SIZE)
+    return Fail(ParseStatus::Truncated, "boot magic");
+  if (TrimmedView(image.first(MAGIC_SIZE)) != BOOT_MAGIC)
+    return Fail(ParseStatus::BadMagic, "boot magic");
+  if (image.size() < BOOT_VERSION_OFFSET + sizeof(uint32_t))
+    return Fail(ParseStatus::Truncated, "header information");
+
+  const uint32_t version = LoadU32(image.data() + BOOT_VERSION_OFFSET);
+  const auto layout =
+      BOOT_LAYOUTS[std::min<size_t>(version, BOOT_LAYOUTS.size() - 1)];
+  if (const auto result = Decode(image, layout, view); !result)
+    return result;
+
+  if (view.header_version >= 3) {
+    view.page_size = BOOT_IMAGE_HEADER_V3_PAGESIZE;
+  }
+  AddBootSections(view);
+  return {};
+}
+
+ParseResult ParseVendorBootImage(std::span<const std::byte> image,
+                                 VendorBootImageView &view) noexcept {
+  view = {};
+  if (image.size() < VENDOR_BOOT_VERSION_OFFSET + sizeof(uint32_t))
+    return Fail(ParseStatus::Truncated, "header information");
+  if (TrimmedView(image.first(MAGIC_SIZE)) != VENDOR_BOOT_MAGIC)
+    return Fail(ParseStatus::BadMagic, "boot magic");
+
+  // Versions below 3 have no vendor_boot image; read them as v3 like before
+  const uint32_t version =
+      LoadU32(image.data() + VENDOR_BOOT_VERSION_OFFSET);
+  const auto layout = VENDOR_BOOT_LAYOUTS[std::min<size_t>(
+      std::max<uint32_t>(version, 3) - 3, VENDOR_BOOT_LAYOUTS.size() - 1)];
+  if (const auto result = Decode(image, layout, view); !result)
+    return result;
+
+  AddVendorBootSections(view);
+
+  // Decode the table too when the span reaches that far
+  if (view.header_version > 3 &&
+      view.ramdisk_table_offset + view.RamdiskTableBytes() <= image.size()) {
+    return ParseVendorRamdiskTable(
+        image.subspan(static_cast<size_t>(view.ramdisk_table_offset)), view);
+  }
+  return {};
+}
+
+bool EncodeBootImageHeader(const BootImageView &view,
+                           std::span<std::byte> header) noexcept {
+  const auto layout = BOOT_LAYOUTS[std::min<size_t>(view.header_version,
+                                                    BOOT_LAYOUTS.size() - 1)];
+  return Encode(view, layout, header);
+}
+
+bool EncodeVendorBootImageHeader(const VendorBootImageView &view,
+                                 std::span<std::byte> header) noexcept {
+  const auto layout = VENDOR_BOOT_LAYOUTS[std::min<size_t>(
+      std::max<uint32_t>(view.header_version, 3) - 3,
+      VENDOR_BOOT_LAYOUTS.size() - 1)];
+  return Encode(view, layout, header);
+}
+
+ParseResult ParseVendorRamdiskTable(std::span<const std::byte> table,
+                                    VendorBootImageView &view) noexcept {
+  view.ramdisk_table = {};
+  if (view.vendor_ramdisk_table_entry_num == 0) {
+    return {};
+  }
+  if (view.vendor_ramdisk_table_entry_size < VENDOR_RAMDISK_ENTRY_MIN_SIZE)
+    return Fail(ParseStatus::BadRamdiskTable, "ramdisk table");
+  if (table.size() < view.RamdiskTableBytes())
+    return Fail(ParseStatus::Truncated, "ramdisk table");
+
+  view.ramdisk_table = VendorRamdiskTableView(
+      table.first(view.RamdiskTableBytes()),
+      view.vendor_ramdisk_table_entry_num,
+      view.vendor_ramdisk_table_entry_size);
+  return {};
+}
+
+} // namespace utils
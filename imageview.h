@@ -0,0 +1,245 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <cstddef>
+#include <span>
+
+namespace utils {
+
+// Allocation-free, non-throwing parsing of boot and vendor_boot images. The
+// parsers decode a byte span (a mapping, a network buffer, or just the first
+// HEADER_READ_SIZE bytes) into view structs whose strings point into that
+// span, so the span must outlive the view. Nothing is read from or written to
+// disk; ExtractImages and friends are layered on top of these.
+
+enum class ParseStatus {
+  Ok,
+  Truncated,          // The span ends inside the header or ramdisk table
+  BadMagic,           // Not the image type the parser was asked for
+  BadRamdiskTable,    // Ramdisk table entries are too small to be decoded
+};
+
+struct ParseResult {
+  ParseStatus status = ParseStatus::Ok;
+  // Header field (or region) the status refers to, for error messages
+  const char *field = "";
+
+  explicit operator bool() const { return status == ParseStatus::Ok; }
+};
+
+const char *ParseStatusName(ParseStatus status);
+
+// A region of the image, relative to its start.
+struct SectionView {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::string_view name;
+  SectionKind kind = SectionKind::Other;
+};
+
+// Fixed-capacity list, so views never allocate.
+template <typename T, size_t N> class FixedList {
+public:
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  static constexpr size_t capacity() { return N; }
+
+  const T *begin() const { return items_.data(); }
+  const T *end() const { return items_.data() + size_; }
+  const T &operator[](size_t i) const { return items_[i]; }
+
+  bool push_back(const T &item) {
+    if (size_ == N)
+      return false;
+    items_[size_++] = item;
+    return true;
+  }
+
+  void clear() { size_ = 0; }
+
+private:
+  std::array<T, N> items_{};
+  size_t size_ = 0;
+};
+
+// Boot images define at most six regions after the header page.
+constexpr size_t MAX_BOOT_SECTIONS = 6;
+// vendor_ramdisk, dtb, ramdisk table and bootconfig.
+constexpr size_t MAX_VENDOR_BOOT_SECTIONS = 4;
+
+struct BootImageView {
+  std::string_view boot_magic;
+  uint32_t header_version = 0;
+  uint32_t page_size = 0;
+
+  uint32_t kernel_size = 0;
+  uint32_t ramdisk_size = 0;
+  // Packed as in the header; see DecodeOsVersionPatchLevel
+  uint32_t os_version_patch_level = 0;
+  std::string_view cmdline;
+
+  // Version <3 fields
+  uint32_t kernel_load_address = 0;
+  uint32_t ramdisk_load_address = 0;
+  uint32_t second_size = 0;
+  uint32_t second_load_address = 0;
+  uint32_t tags_load_address = 0;
+  std::string_view product_name;
+  std::string_view extra_cmdline;
+  // mkbootimg's digest of the sections, SHA-1 zero padded (or SHA-256)
+  std::span<const std::byte> id;
+
+  // Version 1-2 fields
+  uint32_t recovery_dtbo_size = 0;
+  uint64_t recovery_dtbo_offset = 0;
+  uint32_t boot_header_size = 0;
+
+  // Version 2 fields
+  uint32_t dtb_size = 0;
+  uint64_t dtb_load_address = 0;
+
+  // Version 4+ fields
+  uint32_t boot_signature_size = 0;
+
+  // Non-empty regions in header order: kernel, ramdisk, second,
+  // recovery_dtbo, dtb, boot_signature
+  FixedList<SectionView, MAX_BOOT_SECTIONS> sections;
+};
+
+// VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE words, as the bootloader defines
+using BoardId = std::array<uint32_t, 16>;
+
+struct VendorRamdiskView {
+  uint32_t size = 0;
+  uint32_t offset = 0; // Relative to the vendor ramdisk region
+  uint32_t type = 0;
+  std::string_view name;
+  BoardId board_id{};
+};
+
+// Ramdisk table entries, decoded on access so any number of them can be
+// viewed without storage.
+class VendorRamdiskTableView {
+public:
+  VendorRamdiskTableView() = default;
+  VendorRamdiskTableView(std::span<const std::byte> data, uint32_t count,
+                         uint32_t entry_size)
+      : data_(data), count_(count), entry_size_(entry_size) {}
+
+  size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  VendorRamdiskView operator[](size_t i) const;
+
+private:
+  std::span<const std::byte> data_;
+  uint32_t count_ = 0;
+  uint32_t entry_size_ = 0;
+};
+
+// Lookup of ramdisk table entries by name, type and board_id, for tables
+// with many fragments. Entries are decoded once when the index is built;
+// unlike the views this owns storage, but it still points into the table.
+class VendorRamdiskIndex {
+public:
+  VendorRamdiskIndex() = default;
+  explicit VendorRamdiskIndex(const VendorRamdiskTableView &table);
+
+  size_t size() const { return entries_.size(); }
+  // Entries in table order
+  const VendorRamdiskView &operator[](size_t i) const { return entries_[i]; }
+
+  // Table index of the first fragment called `name`.
+  std::optional<size_t> FindName(std::string_view name) const;
+  // Table indices of every fragment of `type`, ordered by board_id.
+  std::span<const uint32_t> FindType(uint32_t type) const;
+  // Table index of the first fragment of `type` whose board_id is exactly
+  // `board_id`.
+  std::optional<size_t> Find(uint32_t type, const BoardId &board_id) const;
+
+private:
+  std::vector<VendorRamdiskView> entries_;
+  std::vector<uint32_t> by_name_; // Name, then table order
+  std::vector<uint32_t> by_type_; // Type, board_id, then table order
+};
+
+struct VendorBootImageView {
+  std::string_view boot_magic;
+  uint32_t header_version = 0;
+  uint32_t page_size = 0;
+  uint32_t kernel_load_address = 0;
+  uint32_t ramdisk_load_address = 0;
+  uint32_t vendor_ramdisk_size = 0;
+  std::string_view cmdline;
+  uint32_t tags_load_address = 0;
+  std::string_view product_name;
+  uint32_t header_size = 0;
+  uint32_t dtb_size = 0;
+  uint64_t dtb_load_address = 0;
+
+  // Version >3 fields
+  uint32_t vendor_ramdisk_table_size = 0;
+  uint32_t vendor_ramdisk_table_entry_num = 0;
+  uint32_t vendor_ramdisk_table_entry_size = 0;
+  uint32_t vendor_bootconfig_size = 0;
+
+  // Where the regions following the header pages start
+  uint64_t ramdisk_offset = 0;
+  uint64_t dtb_offset = 0;
+  uint64_t ramdisk_table_offset = 0;
+  uint64_t bootconfig_offset = 0;
+
+  // Non-empty regions in file order
+  FixedList<SectionView, MAX_VENDOR_BOOT_SECTIONS> sections;
+
+  // Filled in by the parser when the span covers the table; otherwise read
+  // RamdiskTableBytes() at ramdisk_table_offset and pass them to
+  // ParseVendorRamdiskTable.
+  VendorRamdiskTableView ramdisk_table;
+
+  size_t RamdiskTableBytes() const {
+    return static_cast<size_t>(vendor_ramdisk_table_entry_num) *
+           vendor_ramdisk_table_entry_size;
+  }
+};
+
+ParseResult ParseBootImage(std::span<const std::byte> image,
+                           BootImageView &view) noexcept;
+
+ParseResult ParseVendorBootImage(std::span<const std::byte> image,
+                                 VendorBootImageView &view) noexcept;
+
+// Attaches the ramdisk table read separately (e.g. from a stream).
+ParseResult ParseVendorRamdiskTable(std::span<const std::byte> table,
+                                    VendorBootImageView &view) noexcept;
+
+// Write the header fields of `view` into `header`, laid out for its
+// header_version: the inverse of the parsers for the header itself (sizes
+// and offsets are written as they are, not derived). Strings are NUL padded
+// and bytes that no field covers are left alone, so encoding into a copy of
+// the original header keeps its reserved words. False when `header` is
+// shorter than the layout or a string does not fit its field.
+bool EncodeBootImageHeader(const BootImageView &view,
+                           std::span<std::byte> header) noexcept;
+
+bool EncodeVendorBootImageHeader(const VendorBootImageView &view,
+                                 std::span<std::byte> header) noexcept;
+
+// Writes `entry` over the start of one ramdisk table entry; bytes past the
+// fields this build knows are left alone.
+bool EncodeVendorRamdiskEntry(const VendorRamdiskView &entry,
+                              std::span<std::byte> out) noexcept;
+
+// The bytes of `section` within `image`, or an empty span when the image
+// is shorter than the section claims.
+inline std::span<const std::byte> SectionData(std::span<const std::byte> image,
+                                              const SectionView &section) {
+  if (section.offset > image.size() ||
+      section.size > image.size() - section.offset) {
+    return {};
+  }
+  return image.subspan(static_cast<size_t>(section.offset),
+                       static_cast<size_t>(section.size));
+}
+
+} // namespace utils
@@ -0,0 +1,236 @@
+#include "kernel.h"
+#include "imagesource.h"
+
+#include <algorithm>
+
+namespace utils {
+
+namespace {
+constexpr size_t kSniffSize = 4;
+constexpr std::string_view LINUX_BANNER = "Linux version ";
+constexpr size_t MAX_BANNER_SIZE = 512;
+
+// arm64 Image header layout
+constexpr size_t ARM64_HEADER_SIZE = 64;
+constexpr size_t ARM64_TEXT_OFFSET = 8;
+constexpr size_t ARM64_IMAGE_SIZE = 16;
+constexpr size_t ARM64_FLAGS = 24;
+constexpr size_t ARM64_MAGIC_OFFSET = 56;
+constexpr uint32_t ARM64_MAGIC = 0x644d5241; // "ARM\x64"
+
+// Longest suffix of `data` that is a prefix of the banner. The banner has no
+// repeating prefix, so a partial match never hides a shorter one.
+size_t PartialBannerMatch(std::string_view data) {
+  for (size_t n = std::min(data.size(), LINUX_BANNER.size() - 1); n > 0;
+       --n) {
+    if (data.substr(data.size() - n) == LINUX_BANNER.substr(0, n)) {
+      return n;
+    }
+  }
+  return 0;
+}
+} // namespace
+
+// Receives the decoded kernel: counts it, keeps the header, looks for the
+// version banner and optionally writes everything to the output file.
+class KernelAnalyzer::Scanner : public std::streambuf {
+public:
+  explicit Scanner(const std::filesystem::path &output) {
+    if (!output.empty() &&
+        !file_.open(output, std::ios::out | std::ios::binary |
+                                std::ios::trunc)) {
+      failed_ = true;
+    }
+  }
+
+  bool good() const { return !failed_; }
+  uint64_t size() const { return size_; }
+  std::span<const std::byte> head() const { return head_; }
+  const std::string &version() const { return version_; }
+
+  bool Close() {
+    if (file_.is_open() && !file_.close()) {
+      failed_ = true;
+    }
+    return !failed_;
+  }
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    const auto n = static_cast<size_t>(size);
+    if (failed_) {
+      return 0;
+    }
+    if (head_.size() < ARM64_HEADER_SIZE) {
+      const size_t take = std::min(ARM64_HEADER_SIZE - head_.size(), n);
+      const auto *bytes = reinterpret_cast<const std::byte *>(data);
+      head_.insert(head_.end(), bytes, bytes + take);
+    }
+    if (!banner_done_) {
+      Scan(std::string_view(data, n));
+    }
+    size_ += n;
+    if (file_.is_open() && file_.sputn(data, size) != size) {
+      failed_ = true;
+      return 0;
+    }
+    return size;
+  }
+
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    const char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+  }
+
+private:
+  void Scan(std::string_view data) {
+    size_t pos = 0;
+    if (version_.empty()) {
+      // Finish a match that straddled the previous chunk
+      if (matched_ > 0) {
+        const size_t want = LINUX_BANNER.size() - matched_;
+        const auto rest = data.substr(0, want);
+        if (rest != LINUX_BANNER.substr(matched_, rest.size())) {
+          matched_ = 0;
+        } else if (rest.size() < want) {
+          matched_ += rest.size();
+          return;
+        } else {
+          version_ = LINUX_BANNER;
+          pos = want;
+        }
+      }
+      if (version_.empty()) {
+        const size_t found = data.find(LINUX_BANNER);
+        if (found == std::string_view::npos) {
+          matched_ = PartialBannerMatch(data);
+          return;
+        }
+        version_ = LINUX_BANNER;
+        pos = found + LINUX_BANNER.size();
+      }
+    }
+
+    // Collect the banner up to its end of line (or string)
+    const auto tail = data.substr(pos);
+    const size_t end = tail.find_first_of(std::string_view("\n\0", 2));
+    version_.append(tail.substr(0, end));
+    if (end != std::string_view::npos || version_.size() >= MAX_BANNER_SIZE) {
+      version_.resize(std::min(version_.size(), MAX_BANNER_SIZE));
+      banner_done_ = true;
+    }
+  }
+
+  stats::CountingFilebuf file_;
+  bool failed_ = false;
+  uint64_t size_ = 0;
+  std::vector<std::byte> head_;
+  size_t matched_ = 0;
+  bool banner_done_ = false;
+  std::string version_;
+};
+
+KernelAnalyzer::KernelAnalyzer(const std::filesystem::path &output,
+                               unsigned jobs, ThreadPool *pool)
+    : write_output_(!output.empty()), jobs_(jobs), pool_(pool),
+      scanner_(std::make_unique<Scanner>(output)) {
+  failed_ = !scanner_->good();
+  decoded_.rdbuf(scanner_.get());
+}
+
+KernelAnalyzer::~KernelAnalyzer() = default;
+
+bool KernelAnalyzer::Start(std::span<const std::byte> head) {
+  started_ = true;
+  compression_ = DetectCompression(head);
+  decoder_ = Decompressor::Create(compression_, decoded_, jobs_, pool_);
+  return true;
+}
+
+bool KernelAnalyzer::Feed(std::span<const std::byte> data) {
+  if (!started_) {
+    if (sniff_.empty() && data.size() >= kSniffSize) {
+      Start(data);
+    } else {
+      sniff_.insert(sniff_.end(), data.begin(), data.end());
+      if (sniff_.size() < kSniffSize) {
+        return true;
+      }
+      Start(sniff_);
+      const auto head = std::move(sniff_);
+      return Feed(head);
+    }
+  }
+
+  if (!decoder_) {
+    // Stored uncompressed, or in a format this build cannot decode
+    return static_cast<bool>(
+        decoded_.write(reinterpret_cast<const char *>(data.data()),
+                       static_cast<std::streamsize>(data.size())));
+  }
+  if (decode_failed_) {
+    return true;
+  }
+  if (!decoder_->Feed(data)) {
+    decode_failed_ = true;
+    return !write_output_;
+  }
+  return true;
+}
+
+std::streamsize KernelAnalyzer::xsputn(const char *data,
+                                       std::streamsize size) {
+  if (failed_ ||
+      !Feed(std::span(reinterpret_cast<const std::byte *>(data),
+                      static_cast<size_t>(size)))) {
+    failed_ = true;
+    return 0;
+  }
+  return size;
+}
+
+KernelAnalyzer::int_type KernelAnalyzer::overflow(int_type ch) {
+  if (traits_type::eq_int_type(ch, traits_type::eof())) {
+    return traits_type::not_eof(ch);
+  }
+  const char c = traits_type::to_char_type(ch);
+  return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+bool KernelAnalyzer::Finish(KernelInfo &info) {
+  if (!failed_ && !started_) {
+    Start(sniff_);
+    const auto head = std::move(sniff_);
+    failed_ = !Feed(head);
+  }
+  if (decoder_ && !decode_failed_) {
+    decode_failed_ = !decoder_->Finish();
+  }
+  decoded_.flush();
+  failed_ = !scanner_->Close() || failed_ ||
+            (write_output_ && decode_failed_);
+
+  info = {};
+  info.scanned = true;
+  info.compression = compression_;
+  info.decoded = decoder_ ? !decode_failed_ : compression_ == Compression::None;
+  if (info.decoded) {
+    info.uncompressed_size = scanner_->size();
+    info.version = scanner_->version();
+
+    const auto head = scanner_->head();
+    if (head.size() >= ARM64_HEADER_SIZE &&
+        LoadU32(head.data() + ARM64_MAGIC_OFFSET) == ARM64_MAGIC) {
+      info.arm64 = true;
+      info.text_offset = LoadU64(head.data() + ARM64_TEXT_OFFSET);
+      info.image_size = LoadU64(head.data() + ARM64_IMAGE_SIZE);
+      info.flags = LoadU64(head.data() + ARM64_FLAGS);
+    }
+  }
+  return !failed_;
+}
+
+} // namespace utils
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "decompress.h"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <streambuf>
+
+namespace utils {
+
+// What could be learned about a kernel section while it was extracted.
+struct KernelInfo {
+  bool scanned = false;
+  Compression compression = Compression::None;
+  // False when the payload could not be decoded (corrupt, or a format this
+  // build has no decoder for); the fields below are then unknown.
+  bool decoded = false;
+  uint64_t uncompressed_size = 0;
+
+  // arm64 `Image` header fields (Documentation/arch/arm64/booting.rst)
+  bool arm64 = false;
+  uint64_t text_offset = 0;
+  uint64_t image_size = 0;
+  uint64_t flags = 0;
+
+  // The "Linux version ..." banner, without its trailing newline
+  std::string version;
+};
+
+// Consumes a kernel section as stored in the image, through the streambuf
+// interface so it can be teed from any extraction path. Known compressions
+// are decoded on the fly and the decoded bytes are scanned for the arm64
+// header and version banner. With `output` set the decoded kernel is also
+// written there (unknown formats unchanged); otherwise nothing touches disk
+// and decode errors only leave the info incomplete.
+class KernelAnalyzer : public std::streambuf {
+public:
+  explicit KernelAnalyzer(const std::filesystem::path &output = {},
+                          unsigned jobs = 1, ThreadPool *pool = nullptr);
+  ~KernelAnalyzer() override;
+
+  bool good() const { return !failed_; }
+
+  // Fails only when an output file was requested and could not be written
+  // completely.
+  bool Finish(KernelInfo &info);
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override;
+  int_type overflow(int_type ch) override;
+
+private:
+  class Scanner;
+
+  bool Start(std::span<const std::byte> head);
+  bool Feed(std::span<const std::byte> data);
+
+  bool failed_ = false;
+  bool write_output_;
+  unsigned jobs_;
+  ThreadPool *pool_;
+  bool started_ = false;
+  bool decode_failed_ = false;
+  Compression compression_ = Compression::None;
+  std::vector<std::byte> sniff_;
+  std::unique_ptr<Scanner> scanner_;
+  std::ostream decoded_{nullptr};
+  std::unique_ptr<Decompressor> decoder_;
+};
+
+} // namespace utils
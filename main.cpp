@@ -1,12 +1,29 @@
-﻿#include "bootimg.h"
+﻿#include "archive.h"
+#include "bootimg.h"
+#include "bufferpool.h"
+#include "diff.h"
+#include "digest.h"
+#include "imagesource.h"
+#include "payload.h"
+#include "repack.h"
+#include "serve.h"
+#include "threadpool.h"
+#include "uring.h"
 #include "utils.hpp"
 #include "vendorbootimg.h"
 
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -29,10 +46,37 @@ public:
 };
 
 struct ProgramArgs {
-  fs::path boot_img;
+  std::vector<fs::path> boot_imgs;
+  std::optional<fs::path> batch_list;
   fs::path output_dir = "out";
   std::string format = "info";
   bool null_separator = false;
+  bool use_mmap = true;
+  // O_DIRECT reads of block device inputs
+  bool direct_io = false;
+  // Empty, "text" or "json"
+  std::string stats;
+  std::optional<fs::path> manifest;
+  bool manifest_sha256 = false;
+  bool incremental = false;
+  // Single tar stream instead of an output directory; "-" is stdout
+  std::optional<fs::path> output_archive;
+  // New image to write instead of unpacking, with sections from --replace
+  std::optional<fs::path> repack;
+  std::vector<utils::SectionReplacement> replacements;
+  // The two images of `diff <a> <b>`, compared instead of unpacked
+  bool diff = false;
+  std::vector<fs::path> diff_imgs;
+  // Socket to answer requests on instead (see serve.h)
+  std::optional<fs::path> serve;
+  // OTA payload.bin to unpack the boot partitions of (see payload.h)
+  std::optional<fs::path> payload;
+  // Keys (or "prefix*") of the cmdline and bootconfig parameters to print
+  // instead of the header
+  std::vector<std::string> query;
+  // Bytes of copy buffers all extractions share (see bufferpool.h)
+  size_t buffer_memory = utils::BufferPool::DEFAULT_BUDGET;
+  utils::UnpackOptions unpack;
 };
 
 std::string_view TrimOuterQuotes(std::string_view str) {
@@ -46,33 +90,170 @@ std::string_view TrimOuterQuotes(std::string_view str) {
   return str;
 }
 
+unsigned ParseJobs(std::string_view value) {
+  unsigned jobs = 0;
+  const auto [ptr, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), jobs);
+  if (ec != std::errc() || ptr != value.data() + value.size() || jobs == 0) {
+    throw ArgumentError("Invalid job count: '" + std::string(value) +
+                        "'. Use a positive integer.");
+  }
+  return jobs;
+}
+
+size_t ParseBufferMemory(std::string_view value) {
+  size_t megabytes = 0;
+  const auto [ptr, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), megabytes);
+  if (ec != std::errc() || ptr != value.data() + value.size() ||
+      megabytes == 0 || megabytes > (SIZE_MAX >> 20)) {
+    throw ArgumentError("Invalid buffer memory: '" + std::string(value) +
+                        "'. Use a positive number of MiB.");
+  }
+  return megabytes << 20;
+}
+
 void PrintHelp() {
   std::cout << R"(unpackbootimg - Unpack boot, recovery, or vendor_boot images.
 
 Usage:
   unpackbootimg --boot_img <image_path> [options]
+  unpackbootimg --boot_img <a.img> --boot_img <b.img> ... [options]
+  unpackbootimg --batch <list_file|-> [options]
+  unpackbootimg diff <a.img> <b.img> [--no-mmap] [--direct-io] [--stats]
+  unpackbootimg --serve <socket> [options]
 
-Required:
-  --boot_img <path>      Path to the input boot/recovery/vendor_boot image.
+Required (one of):
+  --boot_img <path>      Path to the input boot/recovery/vendor_boot image, or '-' to
+                          stream it from stdin (read strictly front to back).
+                          May be repeated; each image is then unpacked into
+                          <output>/<image name without extension>.
+  --batch <file|->       Unpack every image listed in <file> (or stdin), one
+                          'input<TAB>output_dir' pair per line. Lines without
+                          an output_dir use <output>/<image name>.
+  diff <a.img> <b.img>   Compare two images instead of unpacking them: header fields,
+                          cmdline and bootconfig parameters, and sections matched by
+                          name (fragments by table name), reporting where changed ones
+                          first differ. Prints nothing and exits 0 when the images are
+                          the same, 1 when they differ and 2 on errors (like cmp), e.g.
+                          when one is a boot and the other a vendor_boot image.
+                          Nothing is written. Takes no options but --no-mmap,
+                          --direct-io, --buffer-memory and --stats.
+  --serve <socket>       Keep running and answer requests on the Unix socket <socket>, one
+                          JSON object per line: {"image": "boot.img", "output": "out",
+                          "format": "info", "null": false, "only": ["kernel"],
+                          "extract": true, "verify": false} (only "image" is required;
+                          relative paths are taken from the server's directory). Each is
+                          answered with {"ok": true, "output": "<what would be printed>"}
+                          or {"ok": false, "error": "..."}. The other options apply to
+                          every request. Clients are served side by side; one idle for
+                          30 seconds is disconnected. Stops on SIGINT or SIGTERM.
+  --payload <file>       Unpack the boot, init_boot and vendor_boot partitions of an A/B
+                          OTA payload.bin (full payloads only) into <output>/<partition>,
+                          without writing out the partition images. Only their data is
+                          read; xz and bzip2 compressed operations need a build with
+                          WITH_XZ=1 and WITH_BZIP2=1.
 
 Options:
   -o, --out, --output <dir> Specify the output directory (default: "out").
                           Can use --output=dir or -o=dir format.
-  --format <type>        Output format: 'info' (human-readable) or 'mkbootimg' (args for mkbootimg).
-                          Default: 'info'. Can use --format=type.
+  --format <type>        Output format: 'info' (human-readable), 'mkbootimg' (args for mkbootimg),
+                          'json' (one object per line) or 'record' (little-endian binary
+                          records, see report.h). Default: 'info'. Can use --format=type.
   -0, --null             Use NULL character ('\0') as separator for mkbootimg format output.
+  --no-mmap              Read the image through buffered streams instead of memory-mapping it.
+  --direct-io            Read block device inputs (e.g. /dev/block/by-name/boot_a) with
+                          O_DIRECT, bypassing the page cache. Devices are read in large
+                          sector aligned requests, of the image's sections only.
+  --no-extract           Only parse the image header; do not create or write any files.
+  --query <key>          Print the kernel command line and bootconfig parameters named <key>
+                          as "source<TAB>key<TAB>value" lines (source is cmdline or
+                          bootconfig) instead of the header; a trailing '*' matches a key
+                          prefix (androidboot.*). May be repeated. Implies --no-extract.
+  --only <names>         Comma separated list of sections to extract (e.g. kernel,dtb or
+                          vendor_ramdisk02); vendor ramdisk fragments also match by name.
+  --decompress-ramdisk   Write ramdisks decompressed (gzip, lz4, legacy lz4; zstd when built
+                          with WITH_ZSTD=1). Unknown formats are written unchanged.
+  --decompress-kernel    Write the kernel decompressed (same formats as --decompress-ramdisk).
+                          Data appended after the compressed stream (e.g. a DTB) is dropped.
+  --manifest <file>      Hash every extracted section as it is written and record its image,
+                          name, offset, size and XXH64 in <file> (tab separated).
+  --manifest-sha256      Also record the SHA-256 of each section in the manifest.
+  --split-dtb            Also split dtb and recovery_dtbo into their device trees (dtb.N,
+                          dtbo.N) and list each tree's offset, size, model and compatible
+                          strings in dtb.index.
+  --dtb-compatible <str> Like --split-dtb, but only write the trees compatible with <str>
+                          (all of them are still indexed).
+  --verify               Check the mkbootimg id of v0-v2 boot images and the AVB hash footer
+                          (digests only, not signatures) and report the result; exits with
+                          an error when a check fails.
+  --incremental          Leave outputs alone whose section is unchanged since the last
+                          --incremental run into the same directory (tracked in
+                          <dir>/.unpackbootimg-cache). Images read from stdin are always
+                          written in full.
+  --io-uring             Open, write and close raw outputs through an io_uring (Linux 5.15+),
+                          many files at a time, instead of the kernel copy offload. Falls
+                          back to the regular path where the kernel refuses a ring.
+  --drop-cache           Release each output file from the page cache once it is written
+                          back, and the image once it is unpacked (for one-shot bulk
+                          unpacks). Waits for the writeback of every output.
+  --output-archive <file|->
+                         Write the sections as stored, the vendor ramdisk links and the
+                          header information (info.txt, mkbootimg.args) as one tar
+                          stream to <file> (or stdout) instead of an output directory;
+                          mkbootimg.args refers to the sections by their member names.
+                          Needs a single seekable image; decoding options do not apply.
+  --repack <file>        Write a new image to <file> from the input's header and sections
+                          (as mkbootimg lays them out) instead of unpacking it, then
+                          print the new image's header. Nothing is extracted.
+  --replace <name>=<file> Take section <name> (kernel, ramdisk, dtb, vendor_ramdisk01, a
+                          fragment name, bootconfig, ...) from <file>. May be repeated.
+                          Without --repack the image itself is patched in place: only
+                          the section and header change while it fits its page-rounded
+                          slot, otherwise the later sections are moved.
+  --stats[=text|json]    Print per-phase timings and I/O counters to stderr when done.
+  --unpack-ramdisk       Decompress ramdisks and unpack their cpio archives into ramdisk/ and
+                          vendor_ramdiskNN/ directory trees instead of writing image files.
+                          A ramdisk that is not a cpio archive is written decompressed
+                          (or as stored), as with --decompress-ramdisk.
+  -j, --jobs <n>         Number of sections (or, in batch mode, images) processed in parallel
+                          (default: hardware concurrency).
+  --buffer-memory <MiB>  Memory for the buffers that sections are read into when they cannot
+                          be copied straight from the image or by the kernel (default: 64).
+                          Shared by all extractions; more parallel copies than it holds use
+                          smaller buffers, then wait.
   -h, --help             Show this help message and exit gracefully.
 
 Example:
   unpackbootimg --boot_img boot.img -o=extracted_files --format=mkbootimg
   unpackbootimg --boot_img vendor_boot.img --output "my output dir"
+  find . -name '*.img' | unpackbootimg --batch - -o extracted
 )" << std::endl;
   throw HelpRequested();
 }
 
+void ValidateImagePath(const fs::path &boot_img) {
+  if (boot_img.empty()) {
+    throw ArgumentError("Boot image path cannot be empty.");
+  }
+  if (boot_img == "-") {
+    return;
+  }
+
+  std::error_code ec;
+  if (!fs::exists(boot_img, ec)) {
+    throw ArgumentError("Boot image file not found or inaccessible: " +
+                        boot_img.string());
+  }
+  if (!fs::is_regular_file(boot_img, ec) && !fs::is_block_file(boot_img, ec)) {
+    throw ArgumentError(
+        "Specified boot image path is not a regular file or block device: " +
+        boot_img.string());
+  }
+}
+
 ProgramArgs ParseArguments(int argc, char *argv[]) {
   ProgramArgs args;
-  bool boot_img_provided = false;
 
   for (int i = 1; i < argc; ++i) {
     std::string_view current_arg = argv[i];
@@ -85,6 +266,22 @@ ProgramArgs ParseArguments(int argc, char *argv[]) {
       value_opt = current_arg.substr(equals_pos + 1);
     }
 
+    if (i == 1 && current_arg == "diff") {
+      args.diff = true;
+      continue;
+    }
+    if (args.diff && !current_arg.starts_with('-')) {
+      args.diff_imgs.emplace_back(current_arg);
+      continue;
+    }
+    // A comparison only reads the two images; nothing else applies to it
+    if (args.diff && option_name != "-h" && option_name != "--help" &&
+        option_name != "--no-mmap" && option_name != "--direct-io" &&
+        option_name != "--buffer-memory" && option_name != "--stats")
+      throw ArgumentError("diff does not take " + std::string(option_name) +
+                          "; it only takes --no-mmap, --direct-io, "
+                          "--buffer-memory and --stats.");
+
     if (option_name == "-h" || option_name == "--help") {
       PrintHelp();
     } else if (option_name == "-0" || option_name == "--null") {
@@ -93,11 +290,106 @@ ProgramArgs ParseArguments(int argc, char *argv[]) {
                             " does not take a value.");
       args.null_separator = true;
       continue;
+    } else if (option_name == "--no-mmap") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.use_mmap = false;
+      continue;
+    } else if (option_name == "--direct-io") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.direct_io = true;
+      continue;
+    } else if (option_name == "--no-extract") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.extract = false;
+      continue;
+    } else if (option_name == "--decompress-ramdisk") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      if (args.unpack.ramdisk == utils::RamdiskOutput::Raw)
+        args.unpack.ramdisk = utils::RamdiskOutput::Decompressed;
+      continue;
+    } else if (option_name == "--decompress-kernel") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.decompress_kernel = true;
+      continue;
+    } else if (option_name == "--stats") {
+      const std::string format(value_opt.value_or("text"));
+      if (format != "text" && format != "json")
+        throw ArgumentError("Invalid stats format: '" + format +
+                            "'. Use 'text' or 'json'.");
+      if (!utils::stats::AVAILABLE)
+        throw ArgumentError("This build has no --stats support.");
+      args.stats = format;
+      continue;
+    } else if (option_name == "--manifest-sha256") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.manifest_sha256 = true;
+      continue;
+    } else if (option_name == "--split-dtb") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.split_dtb = true;
+      continue;
+    } else if (option_name == "--verify") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.verify = true;
+      continue;
+    } else if (option_name == "--incremental") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.incremental = true;
+      continue;
+    } else if (option_name == "--io-uring") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      if (!utils::IO_URING_AVAILABLE)
+        throw ArgumentError("This build has no --io-uring support.");
+      args.unpack.io_uring = true;
+      continue;
+    } else if (option_name == "--drop-cache") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.drop_cache = true;
+      continue;
+    } else if (option_name == "--unpack-ramdisk") {
+      if (value_opt)
+        throw ArgumentError("Flag " + std::string(option_name) +
+                            " does not take a value.");
+      args.unpack.ramdisk = utils::RamdiskOutput::Tree;
+      continue;
     }
 
-    bool needs_value = (option_name == "--boot_img" || option_name == "-o" ||
+    bool needs_value = (option_name == "--boot_img" ||
+                        option_name == "--batch" || option_name == "-o" ||
                         option_name == "--out" || option_name == "--output" ||
-                        option_name == "--format");
+                        option_name == "--format" || option_name == "-j" ||
+                        option_name == "--jobs" || option_name == "--only" ||
+                        option_name == "--manifest" ||
+                        option_name == "--dtb-compatible" ||
+                        option_name == "--output-archive" ||
+                        option_name == "--repack" ||
+                        option_name == "--replace" ||
+                        option_name == "--serve" ||
+                        option_name == "--payload" ||
+                        option_name == "--query" ||
+                        option_name == "--buffer-memory");
 
     if (needs_value) {
       if (!value_opt) {
@@ -111,16 +403,65 @@ ProgramArgs ParseArguments(int argc, char *argv[]) {
       std::string_view value = TrimOuterQuotes(*value_opt);
 
       if (option_name == "--boot_img") {
-        args.boot_img = value;
-        boot_img_provided = true;
+        args.boot_imgs.emplace_back(value);
+      } else if (option_name == "--batch") {
+        args.batch_list = fs::path(value);
       } else if (option_name == "-o" || option_name == "--out" ||
                  option_name == "--output") {
         args.output_dir = value;
       } else if (option_name == "--format") {
         args.format = value;
-        if (args.format != "info" && args.format != "mkbootimg") {
+        if (args.format != "info" && args.format != "mkbootimg" &&
+            args.format != "json" && args.format != "record") {
           throw ArgumentError("Invalid format specified: '" + args.format +
-                              "'. Use 'info' or 'mkbootimg'.");
+                              "'. Use 'info', 'mkbootimg', 'json' or "
+                              "'record'.");
+        }
+      } else if (option_name == "-j" || option_name == "--jobs") {
+        args.unpack.jobs = ParseJobs(value);
+      } else if (option_name == "--buffer-memory") {
+        args.buffer_memory = ParseBufferMemory(value);
+      } else if (option_name == "--manifest") {
+        args.manifest = fs::path(value);
+      } else if (option_name == "--output-archive") {
+        args.output_archive = fs::path(value);
+      } else if (option_name == "--repack") {
+        args.repack = fs::path(value);
+      } else if (option_name == "--replace") {
+        const size_t equals = value.find('=');
+        if (equals == 0 || equals == std::string_view::npos ||
+            equals + 1 == value.size())
+          throw ArgumentError("Invalid replacement: '" + std::string(value) +
+                              "'. Use <name>=<file>.");
+        std::string name(value.substr(0, equals));
+        for (const auto &replacement : args.replacements) {
+          if (replacement.name == name)
+            throw ArgumentError("Section replaced twice: " + name);
+        }
+        args.replacements.push_back(
+            {std::move(name), fs::path(value.substr(equals + 1))});
+      } else if (option_name == "--serve") {
+        if (!utils::SERVE_AVAILABLE)
+          throw ArgumentError("This build has no --serve support.");
+        args.serve = fs::path(value);
+      } else if (option_name == "--payload") {
+        args.payload = fs::path(value);
+      } else if (option_name == "--query") {
+        if (value.empty())
+          throw ArgumentError("Missing value for argument: --query");
+        args.query.emplace_back(value);
+        args.unpack.extract = false;
+      } else if (option_name == "--dtb-compatible") {
+        args.unpack.split_dtb = true;
+        args.unpack.dtb_compatible = value;
+      } else if (option_name == "--only") {
+        for (size_t start = 0; start <= value.size();) {
+          size_t end = value.find(',', start);
+          if (end == std::string_view::npos)
+            end = value.size();
+          if (end > start)
+            args.unpack.only.emplace_back(value.substr(start, end - start));
+          start = end + 1;
         }
       }
     } else {
@@ -129,124 +470,851 @@ ProgramArgs ParseArguments(int argc, char *argv[]) {
     }
   }
 
-  if (!boot_img_provided) {
+  args.unpack.index_params = args.format == "json" || !args.query.empty();
+
+  if (!args.query.empty()) {
+    if (args.diff || args.serve || args.manifest || args.output_archive ||
+        args.repack || !args.replacements.empty())
+      throw ArgumentError("--query cannot be combined with diff, --serve, "
+                          "--manifest, --output-archive, --repack or "
+                          "--replace.");
+    if (args.format != "info")
+      throw ArgumentError("--query prints its own format and cannot be "
+                          "combined with --format.");
+  }
+
+  if (args.serve) {
+    if (!args.boot_imgs.empty() || args.batch_list || args.diff ||
+        args.manifest || args.output_archive || args.repack ||
+        !args.replacements.empty() || args.payload)
+      throw ArgumentError("--serve takes its images from requests and cannot "
+                          "be combined with --boot_img, --batch, diff, "
+                          "--manifest, --output-archive, --repack, "
+                          "--replace or --payload.");
+    return args;
+  }
+
+  if (args.diff) {
+    if (args.diff_imgs.size() != 2)
+      throw ArgumentError("diff takes two images.");
+    for (const auto &image : args.diff_imgs) {
+      ValidateImagePath(image);
+    }
+    return args;
+  }
+
+  if (args.payload) {
+    if (!args.boot_imgs.empty() || args.batch_list || args.output_archive ||
+        args.repack || !args.replacements.empty())
+      throw ArgumentError("--payload cannot be combined with --boot_img, "
+                          "--batch, --output-archive, --repack or "
+                          "--replace.");
+    if (*args.payload == "-")
+      throw ArgumentError("--payload needs a seekable file.");
+    ValidateImagePath(*args.payload);
+  } else if (args.boot_imgs.empty() && !args.batch_list) {
     throw ArgumentError("Missing required argument: --boot_img");
   }
+  if (args.manifest_sha256 && !args.manifest) {
+    throw ArgumentError("--manifest-sha256 needs --manifest.");
+  }
+  if (args.manifest && !args.unpack.extract) {
+    throw ArgumentError("--manifest cannot be combined with --no-extract.");
+  }
+  if (args.unpack.split_dtb && !args.unpack.extract) {
+    throw ArgumentError("--split-dtb cannot be combined with --no-extract.");
+  }
+  if (args.incremental && !args.unpack.extract) {
+    throw ArgumentError("--incremental cannot be combined with --no-extract.");
+  }
 
-  if (args.boot_img.empty()) {
-    throw ArgumentError("Boot image path cannot be empty.");
+  if (args.output_archive) {
+    if (args.boot_imgs.size() != 1 || args.batch_list)
+      throw ArgumentError("--output-archive takes a single image.");
+    if (args.boot_imgs.front() == "-")
+      throw ArgumentError("--output-archive needs a seekable image.");
+    if (!args.unpack.extract || args.incremental || args.unpack.io_uring ||
+        args.unpack.split_dtb || args.unpack.decompress_kernel ||
+        args.unpack.ramdisk != utils::RamdiskOutput::Raw)
+      throw ArgumentError("--output-archive writes sections as stored and "
+                          "cannot be combined with --no-extract, "
+                          "--incremental, --io-uring, --split-dtb or the "
+                          "decompression options.");
   }
 
-  std::error_code ec;
-  if (!fs::exists(args.boot_img, ec)) {
-    throw ArgumentError("Boot image file not found or inaccessible: " +
-                        args.boot_img.string());
+  if (args.repack || !args.replacements.empty()) {
+    const std::string mode = args.repack ? "--repack" : "--replace";
+    if (args.boot_imgs.size() != 1 || args.batch_list)
+      throw ArgumentError(mode + " takes a single image.");
+    if (args.boot_imgs.front() == "-")
+      throw ArgumentError(mode + " needs a seekable image.");
+    if (args.output_archive)
+      throw ArgumentError(mode + " cannot be combined with --output-archive.");
   }
-  if (!fs::is_regular_file(args.boot_img, ec)) {
-    throw ArgumentError("Specified boot image path is not a regular file: " +
-                        args.boot_img.string());
+
+  // Batch inputs are validated per image so one bad entry cannot stop the
+  // others.
+  if (args.boot_imgs.size() == 1 && !args.batch_list) {
+    ValidateImagePath(args.boot_imgs.front());
   }
 
   return args;
 }
 
-void PrintMkbootimgArgs(const std::vector<std::string> &cmd_args,
+void PrintMkbootimgArgs(std::ostream &out,
+                        const std::vector<std::string> &cmd_args,
                         bool null_separator) {
   if (cmd_args.empty())
     return;
 
   null_separator ? [&]() {
     for (const auto &arg : cmd_args) {
-      std::cout << arg << '\0';
+      out << arg << '\0';
     }
   }()
                  : [&]() {
                      for (size_t i = 0; i < cmd_args.size(); ++i) {
                        const auto &arg = cmd_args[i];
                        bool needs_quotes = arg.find(' ') != std::string::npos;
-                       std::cout << (needs_quotes ? "\"" + arg + "\"" : arg);
+                       out << (needs_quotes ? "\"" + arg + "\"" : arg);
                        if (i < cmd_args.size() - 1) {
-                         std::cout << " ";
+                         out << " ";
                        }
                      }
-                     std::cout << std::endl;
+                     out << "\n";
                    }();
+}
+
+using ImageInfo =
+    std::variant<std::monostate, BootImageInfo, VendorBootImageInfo>;
 
-  std::flush(std::cout);
+std::string DescribeMagic(std::string_view magic) {
+  std::string magic_str;
+  for (char c : magic) {
+    magic_str += (isprint(static_cast<unsigned char>(c)) ? c : '.');
+  }
+  return magic_str;
 }
 
-int main(int argc, char *argv[]) {
+ImageInfo UnpackStdinImage(const fs::path &output_dir,
+                           const utils::UnpackOptions &unpack) {
+  utils::StreamSource input(std::cin);
+
+  constexpr size_t magic_size = 8;
+  const auto head = input.ReadHead(utils::HEADER_READ_SIZE);
+  if (head.size() < magic_size) {
+    throw std::runtime_error("Failed to read magic from boot image: -");
+  }
+  std::string_view magic_view(reinterpret_cast<const char *>(head.data()),
+                              magic_size);
+
+  if (magic_view == "ANDROID!") {
+    return UnpackBootImage(input, output_dir, unpack);
+  } else if (magic_view == "VNDRBOOT") {
+    return UnpackVendorBootImage(input, output_dir, unpack);
+  }
+  throw std::runtime_error("Invalid boot image magic: '" +
+                           DescribeMagic(magic_view) + "'");
+}
+
+ImageInfo UnpackImage(utils::ImageSource &input, const fs::path &boot_img,
+                      const fs::path &output_dir, const ProgramArgs &args,
+                      const utils::UnpackOptions &unpack);
+
+ImageInfo UnpackImage(const fs::path &boot_img, const fs::path &output_dir,
+                      const ProgramArgs &args,
+                      const utils::UnpackOptions &unpack) {
+  utils::stats::ScopedImage label(boot_img.string());
+  if (boot_img == "-") {
+    return UnpackStdinImage(output_dir, unpack);
+  }
+
+  // Header-only scans read a single page; mapping would only add readahead.
+  // Verification reads the sections, so it maps like extraction.
+  utils::ImageSource input;
+  if (!input.Open(boot_img, args.use_mmap && (unpack.extract || unpack.verify),
+                  args.direct_io)) {
+    throw std::runtime_error("Failed to open boot image: " +
+                             boot_img.string());
+  }
+  return UnpackImage(input, boot_img, output_dir, args, unpack);
+}
+
+ImageInfo UnpackImage(utils::ImageSource &input, const fs::path &boot_img,
+                      const fs::path &output_dir, const ProgramArgs &args,
+                      const utils::UnpackOptions &unpack) {
+  constexpr size_t magic_size = 8;
+  std::vector<std::byte> magic_scratch;
+  const auto magic_bytes = input.Slice(0, magic_size, magic_scratch);
+  if (magic_bytes.empty()) {
+    throw std::runtime_error("Failed to read magic from boot image: " +
+                             boot_img.string());
+  }
+  std::string_view magic_view(
+      reinterpret_cast<const char *>(magic_bytes.data()), magic_size);
+  if (magic_view != "ANDROID!" && magic_view != "VNDRBOOT") {
+    throw std::runtime_error("Invalid boot image magic: '" +
+                             DescribeMagic(magic_view) + "'");
+  }
+
+  std::optional<utils::OutputCache> cache;
+  utils::UnpackOptions options = unpack;
+  if (args.incremental && unpack.extract) {
+    cache.emplace(output_dir);
+    options.cache = &*cache;
+  }
+
+  ImageInfo info;
+  if (magic_view == "ANDROID!") {
+    info = UnpackBootImage(input, output_dir, options);
+  } else {
+    info = UnpackVendorBootImage(input, output_dir, options);
+  }
+  // Sections are read more than once (kernel scan, --split-dtb), so the
+  // image is dropped as a whole once it is done
+  if (unpack.drop_cache) {
+    utils::DropCachedRange(input, 0, input.size());
+  }
+  if (cache && !cache->Save()) {
+    throw std::runtime_error(
+        "Could not write " +
+        (output_dir / utils::OutputCache::CACHE_FILE).string());
+  }
+  return info;
+}
+
+// Destination of --manifest, shared by the batch workers.
+struct ManifestFile {
+  std::ofstream out;
+  std::mutex mutex;
+};
+
+// Unpacks one image and appends its sections to the manifest, if any.
+// `input` is the image when it is already loaded (e.g. from a payload),
+// which `boot_img` then only names.
+ImageInfo UnpackAndRecord(const fs::path &boot_img, const fs::path &output_dir,
+                          const ProgramArgs &args,
+                          const utils::UnpackOptions &unpack,
+                          ManifestFile *manifest_file,
+                          utils::ImageSource *input = nullptr) {
+  const auto unpack_image = [&](const utils::UnpackOptions &options) {
+    return input ? UnpackImage(*input, boot_img, output_dir, args, options)
+                 : UnpackImage(boot_img, output_dir, args, options);
+  };
+  if (!manifest_file) {
+    return unpack_image(unpack);
+  }
+
+  utils::Manifest manifest(args.manifest_sha256);
+  utils::UnpackOptions options = unpack;
+  options.manifest = &manifest;
+  ImageInfo info = unpack_image(options);
+
+  std::lock_guard<std::mutex> lock(manifest_file->mutex);
+  manifest.Write(manifest_file->out, boot_img.string());
+  return info;
+}
+
+// `image` names the input in the structured formats, which are built in
+// one buffer per thread and written at once.
+void WriteImageInfo(std::ostream &out, const ImageInfo &image_info,
+                    const ProgramArgs &args, const fs::path &image) {
+  if (!args.query.empty()) {
+    std::visit(
+        [&out, &args](const auto &info) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
+                                        std::monostate>) {
+            out << utils::FormatQuery(*info.params, args.query);
+          }
+        },
+        image_info);
+  } else if (args.format == "info") {
+    std::visit(
+        [&out](const auto &info) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
+                                        std::monostate>) {
+            out << FormatPrettyText(info);
+          }
+        },
+        image_info);
+  } else if (args.format == "mkbootimg") {
+    std::visit(
+        [&out, &args](const auto &info) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
+                                        std::monostate>) {
+            PrintMkbootimgArgs(out, FormatMkbootimgArguments(info),
+                               args.null_separator);
+          }
+        },
+        image_info);
+  } else {
+    thread_local std::string buffer;
+    buffer.clear();
+    std::visit(
+        [&args, &image](const auto &info) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
+                                        std::monostate>) {
+            if (args.format == "json") {
+              AppendJson(info, image.string(), buffer);
+              buffer += '\n';
+            } else {
+              AppendRecord(info, image.string(), buffer);
+            }
+          }
+        },
+        image_info);
+    out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  }
+}
+
+bool VerificationFailed(const ImageInfo &image_info) {
+  return std::visit(
+      [](const auto &info) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(info)>,
+                                     std::monostate>) {
+          return false;
+        } else {
+          return info.verification && info.verification->failed();
+        }
+      },
+      image_info);
+}
+
+struct BatchItem {
+  fs::path boot_img;
+  fs::path output_dir;
+};
+
+std::vector<BatchItem> CollectBatchItems(const ProgramArgs &args) {
+  std::vector<BatchItem> items;
+  for (const auto &boot_img : args.boot_imgs) {
+    items.push_back({boot_img, args.output_dir / boot_img.stem()});
+  }
+
+  if (args.batch_list) {
+    std::ifstream list_file;
+    std::istream *list = &std::cin;
+    if (*args.batch_list != "-") {
+      list_file.open(*args.batch_list);
+      if (!list_file) {
+        throw ArgumentError("Cannot open batch list: " +
+                            args.batch_list->string());
+      }
+      list = &list_file;
+    }
+
+    std::string line;
+    while (std::getline(*list, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.empty() || line.front() == '#') {
+        continue;
+      }
+      const size_t tab = line.find('\t');
+      fs::path boot_img = line.substr(0, tab);
+      fs::path output_dir = tab == std::string::npos
+                                ? args.output_dir / boot_img.stem()
+                                : fs::path(line.substr(tab + 1));
+      items.push_back({std::move(boot_img), std::move(output_dir)});
+    }
+  }
+
+  std::set<fs::path> output_dirs;
+  for (const auto &item : items) {
+    if (!output_dirs.insert(item.output_dir.lexically_normal()).second) {
+      throw ArgumentError("Several images would be unpacked into " +
+                          item.output_dir.string());
+    }
+  }
+  return items;
+}
+
+double MegabytesPerSecond(uint64_t bytes, double seconds) {
+  return seconds > 0 ? static_cast<double>(bytes) / 1e6 / seconds : 0;
+}
+
+void PrintStats(std::ostream &out, const ProgramArgs &args,
+                std::chrono::steady_clock::time_point start) {
+  using utils::stats::Counter;
+  const std::chrono::duration<double> wall =
+      std::chrono::steady_clock::now() - start;
+  auto snapshot = utils::stats::Collect();
+  const auto counter = [&](Counter c) { return snapshot.counters[c]; };
+
+  if (args.stats == "json") {
+    out << "{\"wall_seconds\":" << std::format("{:.6f}", wall.count())
+        << ",\"bytes_read\":" << counter(utils::stats::BYTES_READ)
+        << ",\"read_calls\":" << counter(utils::stats::READ_CALLS)
+        << ",\"seek_calls\":" << counter(utils::stats::SEEK_CALLS)
+        << ",\"bytes_written\":" << counter(utils::stats::BYTES_WRITTEN)
+        << ",\"write_calls\":" << counter(utils::stats::WRITE_CALLS)
+        << ",\"bytes_sparse\":" << counter(utils::stats::BYTES_SPARSE)
+        << ",\"bytes_copied\":" << counter(utils::stats::BYTES_COPIED)
+        << ",\"copy_calls\":" << counter(utils::stats::COPY_CALLS)
+        << ",\"sections_unchanged\":"
+        << counter(utils::stats::SECTIONS_UNCHANGED)
+        << ",\"ring_submits\":" << counter(utils::stats::RING_SUBMITS)
+        << ",\"buffer_waits\":" << counter(utils::stats::BUFFER_WAITS)
+        << ",\"timings\":[";
+    for (size_t i = 0; i < snapshot.timings.size(); ++i) {
+      const auto &t = snapshot.timings[i];
+      out << (i ? "," : "") << "{\"image\":" << utils::JsonQuote(t.image)
+          << ",\"phase\":" << utils::JsonQuote(t.phase)
+          << ",\"name\":" << utils::JsonQuote(t.name)
+          << ",\"seconds\":" << std::format("{:.6f}", t.seconds)
+          << ",\"bytes\":" << t.bytes << ",\"mb_per_s\":"
+          << std::format("{:.1f}", MegabytesPerSecond(t.bytes, t.seconds))
+          << "}";
+    }
+    out << "]}\n";
+    return;
+  }
+
+  // Images of a batch run concurrently; keep each one's lines together
+  const bool batch = args.boot_imgs.size() != 1 || args.batch_list;
+  std::stable_sort(
+      snapshot.timings.begin(), snapshot.timings.end(),
+      [](const auto &a, const auto &b) { return a.image < b.image; });
+  out << std::format("stats: {:.3f} ms wall\n", wall.count() * 1e3);
+  for (const auto &t : snapshot.timings) {
+    std::string line = "  ";
+    if (batch) {
+      line += t.image + ": ";
+    }
+    line += std::format("{:<9}{:<24}{:>10.3f} ms", t.phase, t.name,
+                        t.seconds * 1e3);
+    if (t.bytes > 0) {
+      line += std::format("{:>13} B{:>10.1f} MB/s", t.bytes,
+                          MegabytesPerSecond(t.bytes, t.seconds));
+    }
+    out << line << "\n";
+  }
+  out << std::format("  read:    {} bytes, {} calls, {} seeks\n",
+                     counter(utils::stats::BYTES_READ),
+                     counter(utils::stats::READ_CALLS),
+                     counter(utils::stats::SEEK_CALLS))
+      << std::format("  written: {} bytes, {} calls\n",
+                     counter(utils::stats::BYTES_WRITTEN),
+                     counter(utils::stats::WRITE_CALLS))
+      << std::format("  copied:  {} bytes in kernel, {} calls\n",
+                     counter(utils::stats::BYTES_COPIED),
+                     counter(utils::stats::COPY_CALLS));
+  if (counter(utils::stats::BYTES_SPARSE) > 0) {
+    out << std::format("  holes:   {} zero bytes not written\n",
+                       counter(utils::stats::BYTES_SPARSE));
+  }
+  if (args.incremental) {
+    out << std::format("  kept:    {} unchanged sections\n",
+                       counter(utils::stats::SECTIONS_UNCHANGED));
+  }
+  if (args.unpack.io_uring) {
+    out << std::format("  ring:    {} submissions\n",
+                       counter(utils::stats::RING_SUBMITS));
+  }
+  if (counter(utils::stats::BUFFER_WAITS) > 0) {
+    out << std::format("  buffers: {} copies waited for --buffer-memory\n",
+                       counter(utils::stats::BUFFER_WAITS));
+  }
+}
+
+// Unpacks every item on a bounded pool. Results are printed in input order,
+// each under a "==> image <==" line; failures are reported per image on
+// stderr without stopping the rest.
+int RunBatch(const ProgramArgs &args, ManifestFile *manifest_file) {
+  const std::vector<BatchItem> items = CollectBatchItems(args);
+
+  struct Result {
+    bool done = false;
+    bool ok = false;
+    bool verify_failed = false;
+    std::string text;
+  };
+  std::vector<Result> results(items.size());
+  std::mutex output_mutex;
+  size_t next_to_print = 0;
+  size_t failures = 0;
+
+  // Parallelism comes from images here; each one extracts sequentially.
+  utils::UnpackOptions unpack = args.unpack;
+  unpack.jobs = 1;
+
+  const unsigned workers = static_cast<unsigned>(std::min<size_t>(
+      args.unpack.jobs > 0 ? args.unpack.jobs
+                           : utils::ThreadPool::DefaultConcurrency(),
+      std::max<size_t>(items.size(), 1)));
+
+  const auto unpack_item = [&](size_t i) {
+    const auto &item = items[i];
+    Result result;
+    try {
+      ValidateImagePath(item.boot_img);
+      std::ostringstream out;
+      const ImageInfo info = UnpackAndRecord(item.boot_img, item.output_dir,
+                                             args, unpack, manifest_file);
+      WriteImageInfo(out, info, args, item.boot_img);
+      result.text = std::move(out).str();
+      result.verify_failed = VerificationFailed(info);
+      result.ok = true;
+    } catch (const std::exception &e) {
+      result.text = e.what();
+    } catch (...) {
+      result.text = "An unexpected error occurred.";
+    }
+    result.done = true;
+
+    std::lock_guard<std::mutex> lock(output_mutex);
+    results[i] = std::move(result);
+    for (; next_to_print < results.size() && results[next_to_print].done;
+         ++next_to_print) {
+      auto &ready = results[next_to_print];
+      const auto &name = items[next_to_print].boot_img;
+      if (ready.ok) {
+        // Structured formats name their image themselves
+        if (args.format == "info" || args.format == "mkbootimg") {
+          std::cout << "==> " << name.string() << " <==\n";
+        }
+        std::cout << ready.text;
+        if (ready.verify_failed) {
+          ++failures;
+          std::cerr << name.string() << ": verification failed\n";
+        }
+      } else {
+        ++failures;
+        std::cerr << name.string() << ": " << ready.text << "\n";
+      }
+      ready.text.clear();
+    }
+    std::cout.flush();
+  };
+
+  if (workers <= 1) {
+    for (size_t i = 0; i < items.size(); ++i) {
+      unpack_item(i);
+    }
+  } else {
+    // The calling thread works too, in Wait().
+    utils::ThreadPool pool(workers - 1);
+    for (size_t i = 0; i < items.size(); ++i) {
+      pool.Submit([&unpack_item, i] { unpack_item(i); });
+    }
+    pool.Wait();
+  }
+
+  std::cerr << "Unpacked " << (items.size() - failures) << " of "
+            << items.size() << " images.\n";
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Unpacks the single image into args.output_archive, followed by its header
+// information; the report goes to stderr when the archive is stdout.
+int RunArchive(const ProgramArgs &args, ManifestFile *manifest_file) {
+  const fs::path &path = *args.output_archive;
+  const bool to_stdout = path == "-";
+  std::vector<char> buffer(1 << 20);
+  std::ofstream file;
+  if (!to_stdout) {
+    file.rdbuf()->pubsetbuf(buffer.data(),
+                            static_cast<std::streamsize>(buffer.size()));
+    file.open(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!file)
+      throw std::runtime_error("Could not open archive: " + path.string());
+  }
+  std::ostream &out = to_stdout ? std::cout : file;
+
+  ImageInfo info;
   try {
-    if (argc < 2) {
-      PrintHelp();
+    utils::TarWriter archive(out);
+    utils::UnpackOptions unpack = args.unpack;
+    unpack.archive = &archive;
+    info = UnpackAndRecord(args.boot_imgs.front(), args.output_dir, args,
+                           unpack, manifest_file);
+    // mkbootimg.args names the sections by their members, relative to the
+    // root of the archive
+    std::visit(
+        [](auto &image) {
+          if constexpr (!std::is_same_v<std::decay_t<decltype(image)>,
+                                        std::monostate>) {
+            image.image_dir.clear();
+          }
+        },
+        info);
+
+    ProgramArgs metadata = args;
+    metadata.format = "info";
+    std::ostringstream pretty;
+    WriteImageInfo(pretty, info, metadata, args.boot_imgs.front());
+    metadata.format = "mkbootimg";
+    std::ostringstream mkbootimg;
+    WriteImageInfo(mkbootimg, info, metadata, args.boot_imgs.front());
+    const auto add = [&archive](std::string_view name,
+                                const std::string &text) {
+      return archive.AddFile(name, std::as_bytes(std::span(text)));
+    };
+    if (!add("info.txt", pretty.str()) ||
+        !add("mkbootimg.args", mkbootimg.str()) || !archive.Finish())
+      throw std::runtime_error("Could not write archive: " + path.string());
+  } catch (...) {
+    // Leave no truncated archive behind
+    if (!to_stdout) {
+      file.close();
+      std::error_code ec;
+      fs::remove(path, ec);
     }
+    throw;
+  }
 
-    const ProgramArgs args = ParseArguments(argc, argv);
+  std::ostream &report = to_stdout ? std::cerr : std::cout;
+  WriteImageInfo(report, info, args, args.boot_imgs.front());
+  report.flush();
+  if (VerificationFailed(info)) {
+    std::cerr << "Verification failed.\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Writes the repacked image (or patches the input with --replace alone),
+// then reports its header the way --no-extract would (and checks it with
+// --verify).
+int RunRepack(const ProgramArgs &args) {
+  const fs::path &boot_img = args.boot_imgs.front();
+  const fs::path &output = args.repack ? *args.repack : boot_img;
+  if (args.repack) {
+    std::error_code ec;
+    if (fs::equivalent(boot_img, output, ec))
+      throw std::runtime_error("--repack cannot overwrite its input: " +
+                               output.string());
+    utils::stats::ScopedImage label(boot_img.string());
+    utils::ImageSource input;
+    if (!input.Open(boot_img, args.use_mmap, args.direct_io))
+      throw std::runtime_error("Failed to open boot image: " +
+                               boot_img.string());
+    utils::RepackImage(input, output, args.replacements);
+  } else {
+    utils::stats::ScopedImage label(boot_img.string());
+    utils::ReplaceSections(boot_img, args.replacements);
+  }
+
+  utils::UnpackOptions header_only;
+  header_only.extract = false;
+  header_only.verify = args.unpack.verify;
+  const ImageInfo info =
+      UnpackImage(output, args.output_dir, args, header_only);
+  WriteImageInfo(std::cout, info, args, output);
+  std::cout.flush();
+  if (VerificationFailed(info)) {
+    std::cerr << "Verification failed.\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Exit status of diff mode when the images could not be compared; like cmp,
+// 1 only means they differ.
+constexpr int EXIT_DIFF_TROUBLE = 2;
 
-    std::ifstream input(args.boot_img, std::ios::binary);
-    if (!input) {
+// Prints what differs between the two images of diff mode; like cmp, exits
+// with 1 when they differ.
+int RunDiff(const ProgramArgs &args) {
+  std::array<utils::ImageSource, 2> inputs;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!inputs[i].Open(args.diff_imgs[i], args.use_mmap, args.direct_io))
       throw std::runtime_error("Failed to open boot image: " +
-                               args.boot_img.string());
+                               args.diff_imgs[i].string());
+  }
+  const utils::ImageDiff diff = utils::DiffImages(inputs[0], inputs[1]);
+  std::cout << utils::FormatPrettyText(diff);
+  std::cout.flush();
+  return diff.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Unpacks the boot partitions of args.payload one after the other, each
+// loaded into memory with its operations decoded concurrently, and prints
+// their header information as batches do.
+int RunPayload(const ProgramArgs &args, ManifestFile *manifest_file) {
+  utils::ImageSource input;
+  if (!input.Open(*args.payload, args.use_mmap, args.direct_io))
+    throw std::runtime_error("Failed to open payload: " +
+                             args.payload->string());
+  const utils::Payload payload = utils::ReadPayload(input);
+
+  const unsigned jobs = args.unpack.jobs > 0
+                            ? args.unpack.jobs
+                            : utils::ThreadPool::DefaultConcurrency();
+  std::optional<utils::ThreadPool> pool;
+  if (jobs > 1) {
+    pool.emplace(jobs - 1);
+  }
+  utils::UnpackOptions unpack = args.unpack;
+  unpack.pool = pool ? &*pool : nullptr;
+
+  size_t images = 0;
+  size_t failures = 0;
+  for (const std::string_view name : utils::PAYLOAD_IMAGES) {
+    const utils::PayloadPartition *partition = payload.Find(name);
+    if (!partition) {
+      continue;
+    }
+    ++images;
+    const fs::path image_name = args.payload->string() + ":" + partition->name;
+    utils::stats::ScopedImage label(image_name.string());
+    try {
+      utils::ImageSource image;
+      utils::LoadPartition(input, payload, *partition, image, unpack.pool);
+      const ImageInfo info =
+          UnpackAndRecord(image_name, args.output_dir / partition->name, args,
+                          unpack, manifest_file, &image);
+      if (args.format == "info" || args.format == "mkbootimg") {
+        std::cout << "==> " << image_name.string() << " <==\n";
+      }
+      WriteImageInfo(std::cout, info, args, image_name);
+      std::cout.flush();
+      if (VerificationFailed(info)) {
+        ++failures;
+        std::cerr << image_name.string() << ": verification failed\n";
+      }
+    } catch (const std::exception &e) {
+      ++failures;
+      std::cerr << image_name.string() << ": " << e.what() << "\n";
+    }
+  }
+
+  if (images == 0)
+    throw std::runtime_error("No boot, init_boot or vendor_boot partition in " +
+                             args.payload->string());
+  std::cerr << "Unpacked " << (images - failures) << " of " << images
+            << " images.\n";
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Answers --serve requests until the server is stopped. A request stands
+// for --boot_img, --output, --format, --null, --only, --no-extract and
+// --verify; every other option comes from the command line. One extraction
+// pool serves all of them.
+int RunServe(const ProgramArgs &args) {
+  const unsigned jobs = args.unpack.jobs > 0
+                            ? args.unpack.jobs
+                            : utils::ThreadPool::DefaultConcurrency();
+  std::optional<utils::ThreadPool> pool;
+  if (jobs > 1) {
+    pool.emplace(jobs - 1);
+  }
+
+  utils::Serve(*args.serve, [&](const utils::ServeRequest &request) {
+    if (request.image == "-")
+      throw std::runtime_error("Requests cannot read the image from stdin.");
+    ValidateImagePath(request.image);
+
+    ProgramArgs request_args = args;
+    request_args.format = request.format;
+    request_args.null_separator = request.null_separator;
+    request_args.unpack.only = request.only;
+    request_args.unpack.extract = request.extract;
+    request_args.unpack.verify = request.verify;
+    request_args.unpack.index_params = request.format == "json";
+    request_args.unpack.pool = pool ? &*pool : nullptr;
+    const ImageInfo info = UnpackImage(request.image, request.output,
+                                       request_args, request_args.unpack);
+
+    std::ostringstream out;
+    WriteImageInfo(out, info, request_args, request.image);
+    utils::ServeResponse response;
+    response.output = out.str();
+    if (VerificationFailed(info)) {
+      response.ok = false;
+      response.error = "Verification failed.";
     }
+    return response;
+  });
+  return EXIT_SUCCESS;
+}
+
+int Run(const ProgramArgs &args) {
+  utils::BufferPool::Shared().SetBudget(args.buffer_memory);
+  if (args.diff) {
+    return RunDiff(args);
+  }
+  if (args.serve) {
+    return RunServe(args);
+  }
 
-    constexpr size_t magic_size = 8;
-    char magic[magic_size];
-    if (!input.read(magic, magic_size)) {
-      throw std::runtime_error("Failed to read magic from boot image: " +
-                               args.boot_img.string());
+  std::optional<ManifestFile> manifest;
+  if (args.manifest) {
+    manifest.emplace();
+    manifest->out.open(*args.manifest, std::ios::out | std::ios::trunc);
+    if (!manifest->out)
+      throw std::runtime_error("Could not open manifest: " +
+                               args.manifest->string());
+    manifest->out << utils::Manifest::Header(args.manifest_sha256);
+  }
+  ManifestFile *manifest_file = manifest ? &*manifest : nullptr;
+
+  int status = EXIT_SUCCESS;
+  if (args.payload) {
+    status = RunPayload(args, manifest_file);
+  } else if (args.boot_imgs.size() != 1 || args.batch_list) {
+    status = RunBatch(args, manifest_file);
+  } else if (args.repack || !args.replacements.empty()) {
+    status = RunRepack(args);
+  } else if (args.output_archive) {
+    status = RunArchive(args, manifest_file);
+  } else {
+    const ImageInfo info =
+        UnpackAndRecord(args.boot_imgs.front(), args.output_dir, args,
+                        args.unpack, manifest_file);
+    WriteImageInfo(std::cout, info, args, args.boot_imgs.front());
+    std::cout.flush();
+    if (VerificationFailed(info)) {
+      std::cerr << "Verification failed.\n";
+      status = EXIT_FAILURE;
     }
-    input.seekg(0, std::ios::beg);
+  }
 
-    std::variant<std::monostate, BootImageInfo, VendorBootImageInfo> image_info;
-    std::string_view magic_view(magic, magic_size);
+  if (manifest && !manifest->out.flush())
+    throw std::runtime_error("Could not write manifest: " +
+                             args.manifest->string());
+  return status;
+}
 
-    if (magic_view == "ANDROID!") {
-      image_info = UnpackBootImage(input, args.output_dir);
-    } else if (magic_view == "VNDRBOOT") {
-      image_info = UnpackVendorBootImage(input, args.output_dir);
-    } else {
-      std::string magic_str;
-      for (size_t i = 0; i < magic_size; ++i) {
-        char c = magic[i];
-        magic_str += (isprint(static_cast<unsigned char>(c)) ? c : '.');
-      }
-      throw std::runtime_error("Invalid boot image magic: '" + magic_str + "'");
+int main(int argc, char *argv[]) {
+  const int error_status = argc > 1 && std::string_view(argv[1]) == "diff"
+                               ? EXIT_DIFF_TROUBLE
+                               : EXIT_FAILURE;
+  try {
+    if (argc < 2) {
+      PrintHelp();
     }
 
-    if (args.format == "info") {
-      std::visit(
-          [](const auto &info) {
-            if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
-                                          std::monostate>) {
-              std::cout << FormatPrettyText(info);
-            }
-          },
-          image_info);
-    } else if (args.format == "mkbootimg") {
-      std::visit(
-          [&args](const auto &info) {
-            if constexpr (!std::is_same_v<std::decay_t<decltype(info)>,
-                                          std::monostate>) {
-              PrintMkbootimgArgs(FormatMkbootimgArguments(info),
-                                 args.null_separator);
-            }
-          },
-          image_info);
+    const ProgramArgs args = ParseArguments(argc, argv);
+    if (args.stats.empty()) {
+      return Run(args);
     }
 
-    return EXIT_SUCCESS;
+    // Report what was measured even when the run fails
+    utils::stats::Enable();
+    const auto start = std::chrono::steady_clock::now();
+    int status = EXIT_FAILURE;
+    try {
+      status = Run(args);
+    } catch (...) {
+      PrintStats(std::cerr, args, start);
+      throw;
+    }
+    PrintStats(std::cerr, args, start);
+    return status;
 
   } catch (const HelpRequested &) {
     return EXIT_SUCCESS;
   } catch (const ArgumentError &e) {
     std::cerr << "Argument Error: " << e.what() << std::endl;
     std::cerr << "Use -h or --help for usage instructions." << std::endl;
-    return EXIT_FAILURE;
+    return error_status;
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
-    return EXIT_FAILURE;
+    return error_status;
   } catch (...) {
     std::cerr << "An unexpected error occurred." << std::endl;
-    return EXIT_FAILURE;
+    return error_status;
   }
 }
\ No newline at end of file
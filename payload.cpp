@@ -0,0 +1,485 @@
+#include "payload.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#ifdef UNPACKBOOTIMG_WITH_XZ
+#include <lzma.h>
+#endif
+#ifdef UNPACKBOOTIMG_WITH_BZIP2
+#include <bzlib.h>
+#endif
+
+namespace utils {
+
+namespace {
+// magic, file_format_version, manifest_size and (from version 2 on)
+// metadata_signature_size, all big-endian
+constexpr size_t PAYLOAD_HEADER_SIZE = 4 + 8 + 8 + 4;
+// Anything larger is not a manifest
+constexpr uint64_t PAYLOAD_MAX_MANIFEST_SIZE = 64 << 20;
+
+// InstallOperation.Type values of full payloads
+enum OperationType : uint32_t {
+  REPLACE = 0,
+  REPLACE_BZ = 1,
+  ZERO = 6,
+  DISCARD = 7,
+  REPLACE_XZ = 8,
+};
+
+uint64_t LoadBigEndian(const std::byte *p, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i) {
+    value = (value << 8) | static_cast<uint64_t>(p[i]);
+  }
+  return value;
+}
+
+// Cursor over protobuf wire format: the fields of one message, in order.
+class ProtoReader {
+public:
+  enum WireType : uint32_t { VARINT = 0, FIXED64 = 1, BYTES = 2, FIXED32 = 5 };
+
+  explicit ProtoReader(std::span<const std::byte> data) : data_(data) {}
+
+  // Moves to the next field; false at the end of the message and when it
+  // is malformed (see ok()).
+  bool Next() {
+    if (pos_ == data_.size()) {
+      return false;
+    }
+    uint64_t tag = 0;
+    if (!ReadVarint(tag) || (tag >> 3) == 0 || (tag >> 3) > UINT32_MAX) {
+      return Fail();
+    }
+    field_ = static_cast<uint32_t>(tag >> 3);
+    wire_type_ = static_cast<uint32_t>(tag & 7);
+    return true;
+  }
+
+  uint32_t field() const { return field_; }
+  bool ok() const { return ok_; }
+
+  bool Varint(uint64_t &value) {
+    return (wire_type_ == VARINT && ReadVarint(value)) || Fail();
+  }
+
+  bool Bytes(std::span<const std::byte> &value) {
+    uint64_t size = 0;
+    if (wire_type_ != BYTES || !ReadVarint(size) ||
+        size > data_.size() - pos_) {
+      return Fail();
+    }
+    value = data_.subspan(pos_, static_cast<size_t>(size));
+    pos_ += static_cast<size_t>(size);
+    return true;
+  }
+
+  // Fields this reader does not know are skipped.
+  bool Skip() {
+    uint64_t value = 0;
+    std::span<const std::byte> bytes;
+    switch (wire_type_) {
+    case VARINT:
+      return Varint(value);
+    case BYTES:
+      return Bytes(bytes);
+    case FIXED64:
+    case FIXED32: {
+      const size_t size = wire_type_ == FIXED64 ? 8 : 4;
+      if (size > data_.size() - pos_) {
+        return Fail();
+      }
+      pos_ += size;
+      return true;
+    }
+    default:
+      return Fail();
+    }
+  }
+
+private:
+  bool ReadVarint(uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && pos_ < data_.size(); shift += 7) {
+      const auto byte = static_cast<uint8_t>(data_[pos_++]);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Fail() {
+    ok_ = false;
+    return false;
+  }
+
+  std::span<const std::byte> data_;
+  size_t pos_ = 0;
+  uint32_t field_ = 0;
+  uint32_t wire_type_ = 0;
+  bool ok_ = true;
+};
+
+bool ParseExtent(std::span<const std::byte> data, PayloadExtent &extent) {
+  ProtoReader reader(data);
+  while (reader.Next()) {
+    const bool ok = reader.field() == 1   ? reader.Varint(extent.start_block)
+                    : reader.field() == 2 ? reader.Varint(extent.num_blocks)
+                                          : reader.Skip();
+    if (!ok) {
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+bool ParseOperation(std::span<const std::byte> data,
+                    PayloadOperation &operation) {
+  ProtoReader reader(data);
+  uint64_t type = 0;
+  std::span<const std::byte> extent;
+  while (reader.Next()) {
+    bool ok = true;
+    switch (reader.field()) {
+    case 1:
+      ok = reader.Varint(type) && type <= UINT32_MAX;
+      operation.type = static_cast<uint32_t>(type);
+      break;
+    case 2:
+      ok = reader.Varint(operation.data_offset);
+      break;
+    case 3:
+      ok = reader.Varint(operation.data_length);
+      break;
+    case 6:
+      ok = reader.Bytes(extent) &&
+           ParseExtent(extent, operation.dst_extents.emplace_back());
+      break;
+    default:
+      ok = reader.Skip();
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+bool ParsePartitionInfo(std::span<const std::byte> data, uint64_t &size) {
+  ProtoReader reader(data);
+  while (reader.Next()) {
+    if (!(reader.field() == 1 ? reader.Varint(size) : reader.Skip())) {
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+bool ParsePartition(std::span<const std::byte> data,
+                    PayloadPartition &partition) {
+  ProtoReader reader(data);
+  std::span<const std::byte> bytes;
+  while (reader.Next()) {
+    bool ok = true;
+    switch (reader.field()) {
+    case 1:
+      ok = reader.Bytes(bytes);
+      partition.name.assign(reinterpret_cast<const char *>(bytes.data()),
+                            bytes.size());
+      break;
+    case 7:
+      ok = reader.Bytes(bytes) && ParsePartitionInfo(bytes, partition.size);
+      break;
+    case 8:
+      ok = reader.Bytes(bytes) &&
+           ParseOperation(bytes, partition.operations.emplace_back());
+      break;
+    default:
+      ok = reader.Skip();
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+bool ParseManifest(std::span<const std::byte> data, Payload &payload) {
+  ProtoReader reader(data);
+  std::span<const std::byte> bytes;
+  uint64_t block_size = 0;
+  while (reader.Next()) {
+    bool ok = true;
+    switch (reader.field()) {
+    case 3:
+      ok = reader.Varint(block_size) && block_size > 0 &&
+           block_size <= UINT32_MAX;
+      payload.block_size = static_cast<uint32_t>(block_size);
+      break;
+    case 13:
+      ok = reader.Bytes(bytes) &&
+           ParsePartition(bytes, payload.partitions.emplace_back());
+      break;
+    default:
+      ok = reader.Skip();
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+const char *OperationName(uint32_t type) {
+  switch (type) {
+  case REPLACE:
+    return "REPLACE";
+  case REPLACE_BZ:
+    return "REPLACE_BZ";
+  case ZERO:
+    return "ZERO";
+  case DISCARD:
+    return "DISCARD";
+  case REPLACE_XZ:
+    return "REPLACE_XZ";
+  }
+  return nullptr;
+}
+
+// Empty when the operation can be run; why not otherwise.
+std::string CheckOperation(const PayloadOperation &operation) {
+  const char *name = OperationName(operation.type);
+  if (!name) {
+    return "operation type " + std::to_string(operation.type) +
+           " is not supported (only full payloads can be read)";
+  }
+#ifndef UNPACKBOOTIMG_WITH_BZIP2
+  if (operation.type == REPLACE_BZ) {
+    return "REPLACE_BZ operations need a build with WITH_BZIP2=1";
+  }
+#endif
+#ifndef UNPACKBOOTIMG_WITH_XZ
+  if (operation.type == REPLACE_XZ) {
+    return "REPLACE_XZ operations need a build with WITH_XZ=1";
+  }
+#endif
+  return {};
+}
+
+#ifdef UNPACKBOOTIMG_WITH_XZ
+// Decodes `data` into `targets`, which it has to fill exactly.
+bool DecodeXz(std::span<const std::byte> data,
+              std::span<const std::span<std::byte>> targets) {
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK) {
+    return false;
+  }
+  stream.next_in = reinterpret_cast<const uint8_t *>(data.data());
+  stream.avail_in = data.size();
+  bool ok = true;
+  for (const auto &target : targets) {
+    stream.next_out = reinterpret_cast<uint8_t *>(target.data());
+    stream.avail_out = target.size();
+    while (ok && stream.avail_out > 0) {
+      const lzma_ret ret = lzma_code(&stream, LZMA_FINISH);
+      ok = ret == LZMA_OK || (ret == LZMA_STREAM_END && stream.avail_out == 0);
+    }
+  }
+  lzma_end(&stream);
+  return ok;
+}
+#endif
+
+#ifdef UNPACKBOOTIMG_WITH_BZIP2
+bool DecodeBzip2(std::span<const std::byte> data,
+                 std::span<const std::span<std::byte>> targets) {
+  if (data.size() > UINT_MAX) {
+    return false;
+  }
+  bz_stream stream{};
+  if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+    return false;
+  }
+  stream.next_in =
+      const_cast<char *>(reinterpret_cast<const char *>(data.data()));
+  stream.avail_in = static_cast<unsigned>(data.size());
+  bool ok = true;
+  for (const auto &target : targets) {
+    for (size_t done = 0; ok && done < target.size();) {
+      const size_t chunk = std::min<size_t>(target.size() - done, UINT_MAX);
+      stream.next_out = reinterpret_cast<char *>(target.data() + done);
+      stream.avail_out = static_cast<unsigned>(chunk);
+      const int ret = BZ2_bzDecompress(&stream);
+      const size_t produced = chunk - stream.avail_out;
+      done += produced;
+      // bzip2 reports a truncated stream as no progress
+      ok = (ret == BZ_OK && produced > 0) ||
+           (ret == BZ_STREAM_END && done == target.size());
+    }
+  }
+  BZ2_bzDecompressEnd(&stream);
+  return ok;
+}
+#endif
+
+bool RunOperation(ImageSource &input, const Payload &payload,
+                  const PayloadOperation &operation,
+                  std::span<std::byte> image) {
+  // Memory from ImageSource::Allocate starts out zero
+  if (operation.type == ZERO || operation.type == DISCARD) {
+    return true;
+  }
+
+  std::vector<std::span<std::byte>> targets;
+  for (const auto &extent : operation.dst_extents) {
+    targets.push_back(
+        image.subspan(static_cast<size_t>(extent.start_block *
+                                          payload.block_size),
+                      static_cast<size_t>(extent.num_blocks *
+                                          payload.block_size)));
+  }
+  std::vector<std::byte> scratch;
+  const auto data =
+      input.Slice(payload.data_offset + operation.data_offset,
+                  static_cast<size_t>(operation.data_length), scratch);
+  if (data.size() != operation.data_length) {
+    return false;
+  }
+
+  switch (operation.type) {
+  case REPLACE: {
+    // The data may end inside the last block, which keeps its zeros
+    auto rest = data;
+    for (const auto &target : targets) {
+      const size_t n = std::min(rest.size(), target.size());
+      std::memcpy(target.data(), rest.data(), n);
+      rest = rest.subspan(n);
+    }
+    return rest.empty();
+  }
+#ifdef UNPACKBOOTIMG_WITH_XZ
+  case REPLACE_XZ:
+    return DecodeXz(data, targets);
+#endif
+#ifdef UNPACKBOOTIMG_WITH_BZIP2
+  case REPLACE_BZ:
+    return DecodeBzip2(data, targets);
+#endif
+  }
+  return false;
+}
+} // namespace
+
+const PayloadPartition *Payload::Find(std::string_view name) const {
+  const auto it = std::find_if(
+      partitions.begin(), partitions.end(),
+      [name](const PayloadPartition &partition) {
+        return partition.name == name;
+      });
+  return it == partitions.end() ? nullptr : &*it;
+}
+
+Payload ReadPayload(ImageSource &input) {
+  std::vector<std::byte> scratch;
+  const auto header =
+      input.Slice(0,
+                  static_cast<size_t>(
+                      std::min<uint64_t>(input.size(), PAYLOAD_HEADER_SIZE)),
+                  scratch);
+  if (header.size() < PAYLOAD_HEADER_SIZE - 4 ||
+      std::memcmp(header.data(), PAYLOAD_MAGIC.data(), PAYLOAD_MAGIC.size()))
+    throw std::runtime_error("Not an OTA payload (no CrAU magic).");
+
+  Payload payload;
+  payload.version = LoadBigEndian(header.data() + 4, 8);
+  const uint64_t manifest_size = LoadBigEndian(header.data() + 12, 8);
+  if (payload.version != 1 && payload.version != 2)
+    throw std::runtime_error("Unsupported payload version " +
+                             std::to_string(payload.version) + ".");
+  uint64_t manifest_offset = PAYLOAD_HEADER_SIZE - 4;
+  uint64_t signature_size = 0;
+  if (payload.version == 2) {
+    if (header.size() < PAYLOAD_HEADER_SIZE)
+      throw errors::FileReadError("payload header");
+    signature_size = LoadBigEndian(header.data() + 20, 4);
+    manifest_offset = PAYLOAD_HEADER_SIZE;
+  }
+  if (manifest_size > PAYLOAD_MAX_MANIFEST_SIZE)
+    throw std::runtime_error("Payload manifest is too large.");
+  payload.data_offset = manifest_offset + manifest_size + signature_size;
+
+  std::vector<std::byte> manifest_scratch;
+  const auto manifest =
+      input.Slice(manifest_offset, static_cast<size_t>(manifest_size),
+                  manifest_scratch);
+  if (manifest.size() != manifest_size)
+    throw errors::FileReadError("payload manifest");
+  if (!ParseManifest(manifest, payload))
+    throw std::runtime_error("Malformed payload manifest.");
+  return payload;
+}
+
+void LoadPartition(ImageSource &input, const Payload &payload,
+                   const PayloadPartition &partition, ImageSource &image,
+                   ThreadPool *pool) {
+  stats::ScopedTimer timer("payload", partition.name, partition.size);
+  const auto fail = [&partition](const std::string &why) {
+    return std::runtime_error("Cannot load " + partition.name +
+                              " from the payload: " + why);
+  };
+
+  // A manifest without new_partition_info leaves the size at 0
+  if (partition.size == 0)
+    throw fail("the partition is empty or its size is missing");
+
+  // Everything is checked up front, so the operations cannot write out of
+  // bounds
+  const uint64_t block_size = payload.block_size;
+  for (const auto &operation : partition.operations) {
+    if (const std::string why = CheckOperation(operation); !why.empty())
+      throw fail(why);
+    for (const auto &extent : operation.dst_extents) {
+      if (extent.start_block > partition.size / block_size ||
+          extent.num_blocks >
+              partition.size / block_size - extent.start_block)
+        throw fail("operation writes past the end of the partition");
+    }
+    if (payload.data_offset > input.size() ||
+        operation.data_offset > input.size() - payload.data_offset ||
+        operation.data_length >
+            input.size() - payload.data_offset - operation.data_offset)
+      throw fail("operation data runs past the end of the payload");
+  }
+  const auto memory = image.Allocate(partition.size);
+  if (memory.empty())
+    throw fail("could not allocate " + std::to_string(partition.size) +
+               " bytes");
+
+  // The stream fallback shares one read position
+  const auto &operations = partition.operations;
+  std::vector<char> failed(operations.size(), 0);
+  if (!pool || (!input.mapped() && input.fd() < 0)) {
+    for (size_t i = 0; i < operations.size(); ++i) {
+      failed[i] = !RunOperation(input, payload, operations[i], memory);
+    }
+  } else {
+    for (size_t i = 0; i < operations.size(); ++i) {
+      pool->Submit([&, i] {
+        failed[i] = !RunOperation(input, payload, operations[i], memory);
+      });
+    }
+    pool->Wait();
+  }
+  for (size_t i = 0; i < operations.size(); ++i) {
+    if (failed[i])
+      throw fail("could not decode operation " + std::to_string(i) + " (" +
+                 OperationName(operations[i].type) + ")");
+  }
+}
+
+} // namespace utils
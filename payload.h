@@ -0,0 +1,69 @@
+#pragma once
+
+#include "imagesource.h"
+#include "threadpool.h"
+#include "utils.hpp"
+
+#include <array>
+
+namespace utils {
+
+// Input adapter for A/B OTA payload.bin files (update_engine's "CrAU"
+// format): a header, a protobuf manifest listing the install operations of
+// every partition, and the data those operations write. Only the operations
+// of the partitions asked for are read, so the rest of a multi-gigabyte
+// payload is never touched. Full payloads only: operations must replace
+// their blocks (REPLACE, REPLACE_BZ with WITH_BZIP2=1, REPLACE_XZ with
+// WITH_XZ=1) or zero them (ZERO, DISCARD); those of incremental payloads
+// need the old partition.
+
+constexpr std::string_view PAYLOAD_MAGIC = "CrAU";
+
+// What --payload unpacks, in this order, where the payload has it.
+constexpr std::array<std::string_view, 3> PAYLOAD_IMAGES = {
+    "boot", "init_boot", "vendor_boot"};
+
+struct PayloadExtent {
+  uint64_t start_block = 0;
+  uint64_t num_blocks = 0;
+};
+
+struct PayloadOperation {
+  uint32_t type = 0;
+  // Relative to Payload::data_offset
+  uint64_t data_offset = 0;
+  uint64_t data_length = 0;
+  std::vector<PayloadExtent> dst_extents;
+};
+
+struct PayloadPartition {
+  std::string name;
+  // new_partition_info.size
+  uint64_t size = 0;
+  std::vector<PayloadOperation> operations;
+};
+
+struct Payload {
+  uint64_t version = 0;
+  uint32_t block_size = 4096;
+  // Where the operation data starts in the file
+  uint64_t data_offset = 0;
+  std::vector<PayloadPartition> partitions;
+
+  const PayloadPartition *Find(std::string_view name) const;
+};
+
+// Reads the header and manifest at the start of `input`. Throws when it is
+// not a payload or the manifest is malformed.
+Payload ReadPayload(ImageSource &input);
+
+// Fills `image` with `partition` as an in-memory image (see
+// ImageSource::Allocate), running its operations concurrently on `pool`
+// (one after the other without one). Throws naming the partition when it
+// is empty (or has no size), when an operation is not supported by this
+// build or when its data cannot be read or decoded.
+void LoadPartition(ImageSource &input, const Payload &payload,
+                   const PayloadPartition &partition, ImageSource &image,
+                   ThreadPool *pool);
+
+} // namespace utils
@@ -0,0 +1,568 @@
+#include "repack.h"
+#include "imageview.h"
+#include "verify.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+
+namespace utils {
+
+namespace {
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+
+// Where the bytes of one section of the new image come from: a range of an
+// input (the original image or a replacement file), or bytes built here.
+struct Source {
+  ImageSource *input = nullptr;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::span<const std::byte> bytes;
+};
+
+Source Bytes(std::span<const std::byte> bytes) {
+  return {nullptr, 0, bytes.size(), bytes};
+}
+
+// One section of the new image. Sections are padded to the page size,
+// except vendor ramdisk fragments but the last, which are packed.
+struct PlacedSection {
+  std::string name;
+  Source source;
+  uint64_t offset = 0;
+  bool padded = true;
+};
+
+// The new image: its sections in file order, the header first.
+struct Plan {
+  std::vector<std::byte> header;
+  std::vector<std::byte> table;
+  std::vector<PlacedSection> sections;
+  uint32_t page_size = 0;
+  // Where the original image holds data, header included
+  std::vector<std::pair<uint64_t, uint64_t>> original_ranges;
+  // End of the last section of the original image and of the new one,
+  // padding included
+  uint64_t original_end = 0;
+  uint64_t end = 0;
+};
+
+uint64_t PageAligned(uint64_t size, uint32_t page_size) {
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+uint32_t SizeField(const Source &source) {
+  return static_cast<uint32_t>(source.size);
+}
+
+// The replacement files, opened when a section takes them.
+class ReplacementFiles {
+public:
+  explicit ReplacementFiles(std::span<const SectionReplacement> replacements)
+      : replacements_(replacements), files_(replacements.size()),
+        used_(replacements.size(), false) {}
+
+  bool Has(std::string_view name) const {
+    return std::any_of(replacements_.begin(), replacements_.end(),
+                       [&](const auto &r) { return r.name == name; });
+  }
+
+  // The file replacing the section called `name` (or `alias`, if set), or
+  // `original` when there is none.
+  Source Take(std::string_view name, std::string_view alias,
+              Source original) {
+    for (size_t i = 0; i < replacements_.size(); ++i) {
+      const auto &replacement = replacements_[i];
+      if (replacement.name != name &&
+          (alias.empty() || replacement.name != alias)) {
+        continue;
+      }
+      auto &file = files_[i];
+      if (!file) {
+        file = std::make_unique<ImageSource>();
+        if (!file->Open(replacement.path))
+          throw std::runtime_error("Could not open replacement for " +
+                                   replacement.name + ": " +
+                                   replacement.path.string());
+      }
+      // Header size fields are 32 bits wide
+      if (file->size() > UINT32_MAX)
+        throw std::runtime_error("Replacement for " + replacement.name +
+                                 " is too large: " +
+                                 replacement.path.string());
+      used_[i] = true;
+      return {file.get(), 0, file->size(), {}};
+    }
+    return original;
+  }
+
+  // Throws naming the first replacement that no section took.
+  void CheckAllUsed() const {
+    for (size_t i = 0; i < replacements_.size(); ++i) {
+      if (!used_[i])
+        throw std::runtime_error("No section to replace: " +
+                                 replacements_[i].name);
+    }
+  }
+
+private:
+  std::span<const SectionReplacement> replacements_;
+  std::vector<std::unique_ptr<ImageSource>> files_;
+  std::vector<bool> used_;
+};
+
+// Feeds the bytes of `source` to `sink`, in file order with the rest.
+void Feed(std::streambuf &sink, std::string_view name, const Source &source) {
+  if (!source.input) {
+    sink.sputn(reinterpret_cast<const char *>(source.bytes.data()),
+               static_cast<std::streamsize>(source.bytes.size()));
+    return;
+  }
+  constexpr uint64_t kChunkSize = 1 << 20;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < source.size;) {
+    const size_t chunk = static_cast<size_t>(
+        std::min<uint64_t>(source.size - done, kChunkSize));
+    const auto data =
+        source.input->Slice(source.offset + done, chunk, scratch);
+    if (data.empty())
+      throw std::runtime_error("Could not read section: " +
+                               std::string(name));
+    sink.sputn(reinterpret_cast<const char *>(data.data()),
+               static_cast<std::streamsize>(data.size()));
+    done += chunk;
+  }
+}
+
+// Feeds the padding between two sections.
+void FeedZeros(std::streambuf &sink, uint64_t size) {
+  static constexpr std::array<char, 4096> kZeros{};
+  while (size > 0) {
+    const size_t chunk =
+        static_cast<size_t>(std::min<uint64_t>(size, kZeros.size()));
+    sink.sputn(kZeros.data(), static_cast<std::streamsize>(chunk));
+    size -= chunk;
+  }
+}
+
+bool WriteZeros(OutputFile &output, uint64_t offset, uint64_t size) {
+  static constexpr std::array<std::byte, 65536> kZeros{};
+  while (size > 0) {
+    const size_t chunk =
+        static_cast<size_t>(std::min<uint64_t>(size, kZeros.size()));
+    if (!output.Write(offset, std::span(kZeros).first(chunk))) {
+      return false;
+    }
+    offset += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+// Writes zeros over what the original image held in [begin, end).
+bool ZeroStale(OutputFile &output, const Plan &plan, uint64_t begin,
+               uint64_t end) {
+  for (const auto &[first, last] : plan.original_ranges) {
+    const uint64_t from = std::max(first, begin);
+    const uint64_t to = std::min(last, end);
+    if (from < to && !WriteZeros(output, from, to - from)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <size_t N>
+std::vector<std::pair<uint64_t, uint64_t>>
+DataRanges(const FixedList<SectionView, N> &sections, uint64_t header_size) {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges{{0, header_size}};
+  for (const auto &section : sections) {
+    ranges.emplace_back(section.offset, section.offset + section.size);
+  }
+  return ranges;
+}
+
+// The first `size` bytes of the image, as a buffer to patch.
+std::vector<std::byte> ReadHeader(ImageSource &input, uint64_t size) {
+  std::vector<std::byte> scratch;
+  const auto data = input.Slice(0, static_cast<size_t>(size), scratch);
+  if (data.empty()) {
+    throw errors::FileReadError("header information");
+  }
+  return {data.begin(), data.end()};
+}
+
+// End of an image: its last section, padded to the page size.
+template <size_t N>
+uint64_t ImageEnd(const FixedList<SectionView, N> &sections,
+                  uint64_t header_size, uint32_t page_size) {
+  uint64_t end = header_size;
+  for (const auto &section : sections) {
+    end = std::max(end, PageAligned(section.offset + section.size, page_size));
+  }
+  return end;
+}
+
+Plan PlanBootImage(ImageSource &input, ReplacementFiles &files) {
+  std::vector<std::byte> scratch;
+  BootImageView view;
+  if (const auto result = ParseBootImage(
+          input.Slice(0,
+                      static_cast<size_t>(
+                          std::min<uint64_t>(input.size(), HEADER_READ_SIZE)),
+                      scratch),
+          view);
+      !result)
+    throw errors::FileReadError(result.field);
+  if (view.page_size == 0)
+    throw std::runtime_error("Invalid page size: 0");
+
+  const auto original = [&](std::string_view name) -> Source {
+    for (const auto &section : view.sections) {
+      if (section.name == name) {
+        return {&input, section.offset, section.size, {}};
+      }
+    }
+    return {};
+  };
+  const auto take = [&](std::string_view name) {
+    return files.Take(name, {}, original(name));
+  };
+
+  // The sections each header version has room for, in header order
+  const uint32_t version = view.header_version;
+  std::array<std::pair<std::string_view, Source>, MAX_BOOT_SECTIONS> sources{
+      {{"kernel", take("kernel")}, {"ramdisk", take("ramdisk")}}};
+  if (version < 3) {
+    sources[2] = {"second", take("second")};
+  }
+  if (version == 1 || version == 2) {
+    sources[3] = {"recovery_dtbo", take("recovery_dtbo")};
+  }
+  if (version == 2) {
+    sources[4] = {"dtb", take("dtb")};
+  }
+  if (version >= 4) {
+    sources[5] = {"boot_signature", take("boot_signature")};
+  }
+  files.CheckAllUsed();
+  const auto source_of = [&](std::string_view name) {
+    const auto it =
+        std::find_if(sources.begin(), sources.end(),
+                     [&](const auto &source) { return source.first == name; });
+    return it == sources.end() ? Source() : it->second;
+  };
+
+  BootImageView next = view;
+  next.kernel_size = SizeField(sources[0].second);
+  next.ramdisk_size = SizeField(sources[1].second);
+  next.second_size = SizeField(sources[2].second);
+  next.recovery_dtbo_size = SizeField(sources[3].second);
+  next.dtb_size = SizeField(sources[4].second);
+  next.boot_signature_size = SizeField(sources[5].second);
+  if (version == 1 || version == 2) {
+    next.recovery_dtbo_offset =
+        next.recovery_dtbo_size == 0
+            ? 0
+            : view.page_size + PageAligned(next.kernel_size, view.page_size) +
+                  PageAligned(next.ramdisk_size, view.page_size) +
+                  PageAligned(next.second_size, view.page_size);
+  }
+
+  // The new layout is read back from the encoded header, so it is exactly
+  // what the parser (and the bootloader) will see
+  Plan plan;
+  plan.page_size = view.page_size;
+  plan.header = ReadHeader(input, view.page_size);
+  BootImageView placed;
+  if (!EncodeBootImageHeader(next, plan.header) ||
+      !ParseBootImage(plan.header, placed))
+    throw std::runtime_error("Could not encode the boot image header.");
+
+  if (version < 3) {
+    BootIdVerifier id(placed);
+    uint64_t pos = id.begin();
+    for (const auto &section : placed.sections) {
+      if (section.offset >= id.end()) {
+        break;
+      }
+      FeedZeros(id, section.offset - pos);
+      Feed(id, section.name, source_of(section.name));
+      pos = section.offset + section.size;
+    }
+    const auto digest = id.Id();
+    next.id = digest;
+    EncodeBootImageHeader(next, plan.header);
+  }
+
+  plan.sections.push_back({"header", Bytes(plan.header), 0});
+  for (const auto &section : placed.sections) {
+    plan.sections.push_back({std::string(section.name),
+                             source_of(section.name), section.offset});
+  }
+  plan.original_ranges = DataRanges(view.sections, plan.header.size());
+  plan.original_end =
+      ImageEnd(view.sections, plan.header.size(), view.page_size);
+  plan.end = ImageEnd(placed.sections, plan.header.size(), view.page_size);
+  return plan;
+}
+
+Plan PlanVendorBootImage(ImageSource &input, ReplacementFiles &files) {
+  std::vector<std::byte> scratch;
+  VendorBootImageView view;
+  if (const auto result = ParseVendorBootImage(
+          input.Slice(0,
+                      static_cast<size_t>(
+                          std::min<uint64_t>(input.size(), HEADER_READ_SIZE)),
+                      scratch),
+          view);
+      !result)
+    throw errors::FileReadError(result.field);
+  if (view.page_size == 0)
+    throw std::runtime_error("Invalid page size: 0");
+
+  Plan plan;
+  plan.page_size = view.page_size;
+  std::vector<std::byte> table_scratch;
+  const uint32_t version = view.header_version;
+  if (version > 3) {
+    const auto bytes = input.Slice(view.ramdisk_table_offset,
+                                   view.RamdiskTableBytes(), table_scratch);
+    if (const auto result = ParseVendorRamdiskTable(bytes, view); !result)
+      throw errors::FileReadError(result.field);
+    plan.table.assign(bytes.begin(), bytes.end());
+  }
+
+  const auto original = [&](std::string_view name) -> Source {
+    for (const auto &section : view.sections) {
+      if (section.name == name) {
+        return {&input, section.offset, section.size, {}};
+      }
+    }
+    return {};
+  };
+
+  // v4 ramdisks are rebuilt from their fragments, in table order
+  std::vector<std::string> names;
+  std::vector<Source> fragments;
+  if (version > 3) {
+    if (files.Has("vendor_ramdisk"))
+      throw std::runtime_error("The vendor ramdisk of a v4 image is replaced "
+                               "by fragment (e.g. vendor_ramdisk00).");
+    for (size_t i = 0; i < view.ramdisk_table.size(); ++i) {
+      const auto entry = view.ramdisk_table[i];
+      names.push_back(std::format("vendor_ramdisk{:02}", i));
+      fragments.push_back(files.Take(
+          names.back(), entry.name,
+          {&input, view.ramdisk_offset + entry.offset, entry.size, {}}));
+    }
+  } else {
+    names.emplace_back("vendor_ramdisk");
+    fragments.push_back(
+        files.Take("vendor_ramdisk", {}, original("vendor_ramdisk")));
+  }
+  const Source dtb = files.Take("dtb", {}, original("dtb"));
+  const Source bootconfig =
+      version > 3 ? files.Take("bootconfig", {}, original("bootconfig"))
+                  : Source();
+  files.CheckAllUsed();
+
+  uint64_t ramdisk_size = 0;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    if (version > 3) {
+      auto entry = view.ramdisk_table[i];
+      entry.offset = static_cast<uint32_t>(ramdisk_size);
+      entry.size = SizeField(fragments[i]);
+      const size_t entry_size = view.vendor_ramdisk_table_entry_size;
+      EncodeVendorRamdiskEntry(
+          entry, std::span(plan.table).subspan(i * entry_size, entry_size));
+    }
+    ramdisk_size += fragments[i].size;
+  }
+  if (ramdisk_size > UINT32_MAX)
+    throw std::runtime_error("The new vendor ramdisk is too large.");
+
+  VendorBootImageView next = view;
+  next.vendor_ramdisk_size = static_cast<uint32_t>(ramdisk_size);
+  next.dtb_size = SizeField(dtb);
+  next.vendor_bootconfig_size = SizeField(bootconfig);
+
+  plan.header =
+      ReadHeader(input, PageAligned(view.header_size, view.page_size));
+  VendorBootImageView placed;
+  if (!EncodeVendorBootImageHeader(next, plan.header) ||
+      !ParseVendorBootImage(plan.header, placed))
+    throw std::runtime_error(
+        "Could not encode the vendor boot image header.");
+
+  plan.sections.push_back({"header", Bytes(plan.header), 0});
+  uint64_t at = placed.ramdisk_offset;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    plan.sections.push_back(
+        {names[i], fragments[i], at, i + 1 == fragments.size()});
+    at += fragments[i].size;
+  }
+  plan.sections.push_back({"dtb", dtb, placed.dtb_offset});
+  if (version > 3) {
+    plan.sections.push_back({"vendor_ramdisk_table", Bytes(plan.table),
+                             placed.ramdisk_table_offset});
+    plan.sections.push_back(
+        {"bootconfig", bootconfig, placed.bootconfig_offset});
+  }
+  plan.original_ranges = DataRanges(view.sections, plan.header.size());
+  plan.original_end =
+      ImageEnd(view.sections, plan.header.size(), view.page_size);
+  plan.end = ImageEnd(placed.sections, plan.header.size(), view.page_size);
+  return plan;
+}
+
+Plan PlanImage(ImageSource &input, ReplacementFiles &files) {
+  std::vector<std::byte> scratch;
+  const auto magic_bytes = input.Slice(0, MAGIC_SIZE, scratch);
+  if (magic_bytes.empty())
+    throw errors::FileReadError("boot magic");
+  const std::string_view magic(
+      reinterpret_cast<const char *>(magic_bytes.data()), MAGIC_SIZE);
+  if (magic == BOOT_MAGIC) {
+    return PlanBootImage(input, files);
+  }
+  if (magic == VENDOR_BOOT_MAGIC) {
+    return PlanVendorBootImage(input, files);
+  }
+  throw std::runtime_error("Invalid boot image magic.");
+}
+
+void WritePlacedSection(OutputFile &output, const PlacedSection &section) {
+  stats::ScopedTimer timer("repack", section.name, section.source.size);
+  const auto &source = section.source;
+  const bool ok = source.input ? source.size == 0 ||
+                                     output.Copy(*source.input, source.offset,
+                                                 source.size, section.offset)
+                               : output.Write(section.offset, source.bytes);
+  if (!ok)
+    throw std::runtime_error("Could not write section: " + section.name);
+}
+
+// Moves a section of `image` within the file it is read from, chunk by
+// chunk from the end that cannot overwrite bytes still to be read.
+void MoveSection(ImageSource &image, OutputFile &output,
+                 const PlacedSection &section) {
+  stats::ScopedTimer timer("move", section.name, section.source.size);
+  constexpr uint64_t kChunkSize = 1 << 20;
+  const uint64_t from = section.source.offset;
+  const uint64_t size = section.source.size;
+  const bool backwards = section.offset > from;
+  std::vector<std::byte> scratch;
+  for (uint64_t done = 0; done < size;) {
+    const uint64_t chunk = std::min<uint64_t>(size - done, kChunkSize);
+    const uint64_t pos = backwards ? size - done - chunk : done;
+    const auto data =
+        image.Slice(from + pos, static_cast<size_t>(chunk), scratch);
+    if (data.empty() || !output.Write(section.offset + pos, data))
+      throw std::runtime_error("Could not move section: " + section.name);
+    done += chunk;
+  }
+}
+} // namespace
+
+void RepackImage(ImageSource &input, const std::filesystem::path &output_path,
+                 std::span<const SectionReplacement> replacements) {
+  ReplacementFiles files(replacements);
+  const Plan plan = PlanImage(input, files);
+
+  OutputFile output;
+  if (!output.Open(output_path, true))
+    throw std::runtime_error("Could not create " + output_path.string());
+  try {
+    if (!output.Resize(plan.end))
+      throw std::runtime_error("Could not size the new image.");
+    for (const auto &section : plan.sections) {
+      WritePlacedSection(output, section);
+    }
+    if (!output.Close())
+      throw std::runtime_error("Could not write " + output_path.string());
+  } catch (...) {
+    output.Close();
+    std::error_code ec;
+    std::filesystem::remove(output_path, ec);
+    throw;
+  }
+}
+
+void ReplaceSections(const std::filesystem::path &image_path,
+                     std::span<const SectionReplacement> replacements) {
+  // Read through pread: a mapping would see the image change and, once it
+  // is shortened, fault past its end
+  ImageSource image;
+  if (!image.Open(image_path, false))
+    throw std::runtime_error("Failed to open boot image: " +
+                             image_path.string());
+  ReplacementFiles files(replacements);
+  const Plan plan = PlanImage(image, files);
+
+  // Data after the last section (an AVB footer, partition padding) stays
+  // where it is, so the image can only grow into it when there is none
+  if (image.size() < plan.original_end)
+    throw errors::FileReadError("image sections");
+  const bool trailing = image.size() > plan.original_end;
+  if (trailing && plan.end > plan.original_end)
+    throw std::runtime_error("The new sections do not fit before the data "
+                             "that follows them; use --repack instead.");
+
+  OutputFile output;
+  if (!output.Open(image_path, false))
+    throw std::runtime_error("Could not open " + image_path.string() +
+                             " for writing");
+  if (plan.end > image.size() && !output.Resize(plan.end))
+    throw std::runtime_error("Could not extend " + image_path.string());
+
+  // Later sections move by the growth of the ones before them. Moves
+  // towards the end go last to first and the others first to last, so no
+  // move overwrites a section that has yet to be moved.
+  std::vector<const PlacedSection *> moves;
+  for (const auto &section : plan.sections) {
+    if (section.source.input == &image &&
+        section.source.offset != section.offset) {
+      moves.push_back(&section);
+    }
+  }
+  for (auto it = moves.rbegin(); it != moves.rend(); ++it) {
+    if ((*it)->offset > (*it)->source.offset) {
+      MoveSection(image, output, **it);
+    }
+  }
+  for (const auto *section : moves) {
+    if (section->offset < section->source.offset) {
+      MoveSection(image, output, *section);
+    }
+  }
+
+  // Then the replacements and the table, the header last, and zeros over
+  // whatever is left of the old sections in the padding
+  const auto &header = plan.sections.front();
+  for (const auto &section : plan.sections) {
+    if (section.source.input != &image && &section != &header) {
+      WritePlacedSection(output, section);
+    }
+  }
+  for (const auto &section : plan.sections) {
+    const bool rewritten = section.source.input != &image ||
+                           section.source.offset != section.offset;
+    const uint64_t end = section.offset + section.source.size;
+    if (rewritten && section.padded &&
+        !ZeroStale(output, plan, end, PageAligned(end, plan.page_size)))
+      throw std::runtime_error("Could not write section: " + section.name);
+  }
+  WritePlacedSection(output, header);
+
+  bool ok = true;
+  if (plan.end < plan.original_end) {
+    ok = trailing ? ZeroStale(output, plan, plan.end, plan.original_end)
+                  : output.Resize(plan.end);
+  }
+  if (!output.Close() || !ok)
+    throw std::runtime_error("Could not write " + image_path.string());
+}
+
+} // namespace utils
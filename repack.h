@@ -0,0 +1,44 @@
+#pragma once
+
+#include "imagesource.h"
+#include "utils.hpp"
+
+#include <span>
+
+namespace utils {
+
+// A section to take from a file instead of the original image: a boot image
+// section name (kernel, ramdisk, second, recovery_dtbo, dtb,
+// boot_signature), or for vendor_boot images vendor_ramdisk (v3), a
+// fragment by output or table name (vendor_ramdisk01, dlkm), dtb or
+// bootconfig.
+struct SectionReplacement {
+  std::string name;
+  std::filesystem::path path;
+};
+
+// Writes a new boot or vendor_boot image to `output_path`, laid out as
+// mkbootimg does (every section padded to the page size) from the header of
+// `input` and its sections, each taken from its replacement file if there is
+// one. Sizes, offsets, the vendor ramdisk table and the mkbootimg id of
+// v0-v2 images are updated to match; every other header field is kept.
+// Sections are copied as ExtractImage copies them (reflink or
+// copy_file_range first), padding is left as holes, and whatever followed
+// the last section (an AVB footer, partition padding) is dropped. Throws when
+// a replacement names no section of the image; no output is left behind on
+// failure.
+void RepackImage(ImageSource &input, const std::filesystem::path &output_path,
+                 std::span<const SectionReplacement> replacements);
+
+// The same layout written over the image at `image_path` itself, writing
+// only what changes: a replacement that still fits the page-rounded slot of
+// the section (or, for a fragment, leaves the ramdisk's page count alone)
+// costs the section, the header and the ramdisk table; otherwise the later
+// sections are moved by the difference first. Data after the last section
+// stays in place (left stale, like an AVB footer would be), so the image
+// cannot grow into it. Not crash safe: an interrupted run leaves the image
+// half patched.
+void ReplaceSections(const std::filesystem::path &image_path,
+                     std::span<const SectionReplacement> replacements);
+
+} // namespace utils
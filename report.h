@@ -0,0 +1,137 @@
+#pragma once
+
+#include "utils.hpp"
+#include "verify.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace utils {
+
+// Writers behind --format=json and --format=record. Both append to a buffer
+// the caller keeps (and reuses), formatting numbers in place, so a report is
+// built without temporary strings and leaves in a single write.
+
+// One JSON object per image, keys in the order of the header information.
+class JsonWriter {
+public:
+  explicit JsonWriter(std::string &out) : out_(out) {}
+
+  // `key` is empty for the top level object and array elements.
+  void BeginObject(std::string_view key = {}) {
+    Key(key);
+    out_ += '{';
+    first_ = true;
+  }
+  void EndObject() {
+    out_ += '}';
+    first_ = false;
+  }
+  void BeginArray(std::string_view key) {
+    Key(key);
+    out_ += '[';
+    first_ = true;
+  }
+  void EndArray() {
+    out_ += ']';
+    first_ = false;
+  }
+
+  void Number(std::string_view key, uint64_t value) {
+    Key(key);
+    std::format_to(std::back_inserter(out_), "{}", value);
+  }
+  void String(std::string_view key, std::string_view value) {
+    Key(key);
+    AppendJsonString(out_, value);
+  }
+  void Bool(std::string_view key, bool value) {
+    Key(key);
+    out_ += value ? "true" : "false";
+  }
+
+private:
+  void Key(std::string_view key) {
+    if (!first_) {
+      out_ += ',';
+    }
+    first_ = false;
+    if (!key.empty()) {
+      AppendJsonString(out_, key);
+      out_ += ':';
+    }
+  }
+
+  std::string &out_;
+  bool first_ = true;
+};
+
+// Records are little-endian and start with
+//   u32     record_size      the whole record, this field included
+//   u32     schema           RECORD_SCHEMA
+//   char[8] magic            "ANDROID!" or "VNDRBOOT"
+//   u32     header_version
+//   u32     page_size
+//   string  image            the path the image was read from
+// followed by the fields of the image type, in the order its AppendRecord
+// documents. Strings are a u32 length and that many bytes (no NUL); verify
+// results are one byte, 0 when not checked (no --verify, or no id to check)
+// and otherwise the VerifyStatus plus one. Records of a batch are simply
+// concatenated; readers skip to the next one by record_size, so fields added
+// at the end in later schemas do not break them.
+constexpr uint32_t RECORD_SCHEMA = 1;
+
+class RecordWriter {
+public:
+  // Starts a record at the end of `out`.
+  RecordWriter(std::string &out, std::string_view magic,
+               uint32_t header_version, uint32_t page_size,
+               std::string_view image)
+      : out_(out), start_(out.size()) {
+    U32(0);
+    U32(RECORD_SCHEMA);
+    Fixed(magic, MAGIC_SIZE);
+    U32(header_version);
+    U32(page_size);
+    String(image);
+  }
+
+  void U8(uint8_t value) { out_ += static_cast<char>(value); }
+  void U32(uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      out_ += static_cast<char>(value >> shift);
+    }
+  }
+  void U64(uint64_t value) {
+    U32(static_cast<uint32_t>(value));
+    U32(static_cast<uint32_t>(value >> 32));
+  }
+  void String(std::string_view value) {
+    U32(static_cast<uint32_t>(value.size()));
+    out_ += value;
+  }
+  // `value` NUL padded (or cut) to `size` bytes.
+  void Fixed(std::string_view value, size_t size) {
+    const size_t n = std::min(value.size(), size);
+    out_.append(value.data(), n);
+    out_.append(size - n, '\0');
+  }
+
+  void VerifyStatus(const std::optional<VerifyResult> &result) {
+    U8(result ? static_cast<uint8_t>(result->status) + 1 : 0);
+  }
+
+  // Fills in record_size.
+  void Finish() {
+    const auto size = static_cast<uint32_t>(out_.size() - start_);
+    for (int i = 0; i < 4; ++i) {
+      out_[start_ + i] = static_cast<char>(size >> (8 * i));
+    }
+  }
+
+private:
+  std::string &out_;
+  size_t start_;
+};
+
+} // namespace utils
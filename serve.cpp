@@ -0,0 +1,518 @@
+#include "serve.h"
+
+#include <array>
+
+#ifdef UNPACKBOOTIMG_HAVE_UNIX_SOCKETS
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <list>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace utils {
+
+namespace {
+// Longest request line read; a client sending more is disconnected
+constexpr size_t kMaxRequestSize = 64 << 10;
+// A client that sends nothing, or takes no response, for this long is
+// disconnected
+constexpr std::chrono::seconds kClientTimeout{30};
+
+// Cursor over one request line, for the flat objects requests are.
+class JsonReader {
+public:
+  explicit JsonReader(std::string_view text) : text_(text) {}
+
+  bool Consume(char c) {
+    SkipSpace();
+    if (pos_ < text_.size() && text_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  bool AtEnd() {
+    SkipSpace();
+    return pos_ == text_.size();
+  }
+
+  bool String(std::string &out) {
+    if (!Consume('"')) {
+      return false;
+    }
+    out.clear();
+    while (pos_ < text_.size()) {
+      const char c = text_[pos_++];
+      if (c == '"') {
+        return true;
+      }
+      if (static_cast<unsigned char>(c) < 0x20) {
+        return false;
+      }
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (pos_ == text_.size()) {
+        return false;
+      }
+      switch (text_[pos_++]) {
+      case '"':
+        out += '"';
+        break;
+      case '\\':
+        out += '\\';
+        break;
+      case '/':
+        out += '/';
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u':
+        if (!CodePoint(out)) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+      }
+    }
+    return false;
+  }
+
+  bool Bool(bool &out) {
+    SkipSpace();
+    for (const bool value : {true, false}) {
+      const std::string_view word = value ? "true" : "false";
+      if (text_.substr(pos_).starts_with(word)) {
+        pos_ += word.size();
+        out = value;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool StringArray(std::vector<std::string> &out) {
+    out.clear();
+    if (!Consume('[')) {
+      return false;
+    }
+    if (Consume(']')) {
+      return true;
+    }
+    do {
+      if (!String(out.emplace_back())) {
+        return false;
+      }
+    } while (Consume(','));
+    return Consume(']');
+  }
+
+private:
+  void SkipSpace() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\r')) {
+      ++pos_;
+    }
+  }
+
+  bool Hex4(uint32_t &value) {
+    if (text_.size() - pos_ < 4) {
+      return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+      const char c = text_[pos_++];
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= static_cast<uint32_t>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        value |= static_cast<uint32_t>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        value |= static_cast<uint32_t>(c - 'A' + 10);
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // A \u escape (and the low surrogate following a high one), as UTF-8.
+  bool CodePoint(std::string &out) {
+    uint32_t code = 0;
+    if (!Hex4(code)) {
+      return false;
+    }
+    if (code >= 0xd800 && code < 0xdc00) {
+      uint32_t low = 0;
+      if (!text_.substr(pos_).starts_with("\\u")) {
+        return false;
+      }
+      pos_ += 2;
+      if (!Hex4(low) || low < 0xdc00 || low >= 0xe000) {
+        return false;
+      }
+      code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+    } else if (code >= 0xdc00 && code < 0xe000) {
+      return false;
+    }
+
+    if (code < 0x80) {
+      out += static_cast<char>(code);
+    } else if (code < 0x800) {
+      out += static_cast<char>(0xc0 | (code >> 6));
+      out += static_cast<char>(0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+      out += static_cast<char>(0xe0 | (code >> 12));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (code & 0x3f));
+    } else {
+      out += static_cast<char>(0xf0 | (code >> 18));
+      out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+      out += static_cast<char>(0x80 | (code & 0x3f));
+    }
+    return true;
+  }
+
+  std::string_view text_;
+  size_t pos_ = 0;
+};
+
+#ifdef UNPACKBOOTIMG_HAVE_UNIX_SOCKETS
+volatile std::sig_atomic_t stop_requested = 0;
+
+void RequestStop(int) { stop_requested = 1; }
+
+// Closes the descriptor when it goes out of scope.
+class ScopedFd {
+public:
+  explicit ScopedFd(int fd) : fd_(fd) {}
+  ~ScopedFd() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  ScopedFd(const ScopedFd &) = delete;
+  ScopedFd &operator=(const ScopedFd &) = delete;
+
+  int get() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+// The listening socket, removed from the file system again when done.
+class Listener {
+public:
+  explicit Listener(const std::filesystem::path &path) : path_(path) {
+    const std::string name = path.string();
+    if (name.size() >= sizeof(address_.sun_path))
+      throw std::runtime_error("Socket path is too long: " + name);
+    address_.sun_family = AF_UNIX;
+    std::memcpy(address_.sun_path, name.data(), name.size());
+
+    RemoveStale();
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0 ||
+        ::bind(fd_, reinterpret_cast<const sockaddr *>(&address_),
+               sizeof(address_)) != 0)
+      throw std::runtime_error("Could not create socket " + name + ": " +
+                               std::strerror(errno));
+    bound_ = true;
+    if (::listen(fd_, SOMAXCONN) != 0)
+      throw std::runtime_error("Could not listen on " + name + ": " +
+                               std::strerror(errno));
+  }
+
+  ~Listener() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    if (bound_) {
+      std::error_code ec;
+      std::filesystem::remove(path_, ec);
+    }
+  }
+
+  Listener(const Listener &) = delete;
+  Listener &operator=(const Listener &) = delete;
+
+  int fd() const { return fd_; }
+
+private:
+  // A socket file nobody accepts on any more is left by a server that was
+  // killed; one that still accepts belongs to a running server.
+  void RemoveStale() {
+    std::error_code ec;
+    if (!std::filesystem::is_socket(path_, ec)) {
+      return;
+    }
+    const ScopedFd probe(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if (probe.get() >= 0 &&
+        ::connect(probe.get(), reinterpret_cast<const sockaddr *>(&address_),
+                  sizeof(address_)) == 0)
+      throw std::runtime_error("Already serving on " + path_.string());
+    std::filesystem::remove(path_, ec);
+  }
+
+  std::filesystem::path path_;
+  sockaddr_un address_{};
+  int fd_ = -1;
+  bool bound_ = false;
+};
+
+bool SendAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t written = ::write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR && !stop_requested) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(static_cast<size_t>(written));
+  }
+  return true;
+}
+
+ServeResponse Answer(
+    std::string_view line,
+    const std::function<ServeResponse(const ServeRequest &)> &handle) {
+  std::string error;
+  const auto request = ParseServeRequest(line, error);
+  if (!request) {
+    return {false, {}, error};
+  }
+  try {
+    return handle(*request);
+  } catch (const std::exception &e) {
+    return {false, {}, e.what()};
+  }
+}
+
+// A connection and what it sent of its next request.
+struct Client {
+  explicit Client(int fd) : fd(fd) {}
+
+  ScopedFd fd;
+  std::string pending;
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + kClientTimeout;
+};
+
+// Reads what the client sent, once poll() reported it readable, and answers
+// every request that is complete. False once the client is to be dropped:
+// it hung up, sent too long a request or stopped taking responses.
+bool ServeClient(
+    Client &client,
+    const std::function<ServeResponse(const ServeRequest &)> &handle) {
+  std::array<char, 4096> chunk;
+  const ssize_t got = ::read(client.fd.get(), chunk.data(), chunk.size());
+  if (got < 0) {
+    return errno == EINTR;
+  }
+  if (got == 0) {
+    return false;
+  }
+  client.pending.append(chunk.data(), static_cast<size_t>(got));
+  client.deadline = std::chrono::steady_clock::now() + kClientTimeout;
+
+  for (size_t newline; (newline = client.pending.find('\n')) !=
+                       std::string::npos;) {
+    const std::string line = client.pending.substr(0, newline);
+    client.pending.erase(0, newline + 1);
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    if (!SendAll(client.fd.get(), FormatServeResponse(Answer(line, handle)))) {
+      return false;
+    }
+  }
+  if (client.pending.size() > kMaxRequestSize) {
+    SendAll(client.fd.get(),
+            FormatServeResponse({false, {}, "Request too long."}));
+    return false;
+  }
+  return true;
+}
+
+// Time left until the first client deadline, for poll(); -1 without one.
+int PollTimeout(const std::list<Client> &clients) {
+  if (clients.empty()) {
+    return -1;
+  }
+  auto deadline = clients.front().deadline;
+  for (const auto &client : clients) {
+    deadline = std::min(deadline, client.deadline);
+  }
+  const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  return static_cast<int>(std::max<int64_t>(left.count(), 0));
+}
+#endif
+} // namespace
+
+std::optional<ServeRequest> ParseServeRequest(std::string_view line,
+                                              std::string &error) {
+  JsonReader reader(line);
+  ServeRequest request;
+  bool has_image = false;
+  error = "Malformed request.";
+  if (!reader.Consume('{')) {
+    return std::nullopt;
+  }
+  if (!reader.Consume('}')) {
+    do {
+      std::string key;
+      std::string value;
+      if (!reader.String(key) || !reader.Consume(':')) {
+        return std::nullopt;
+      }
+      bool ok = false;
+      if (key == "image") {
+        ok = reader.String(value);
+        request.image = value;
+        has_image = true;
+      } else if (key == "output") {
+        ok = reader.String(value);
+        request.output = value;
+      } else if (key == "format") {
+        ok = reader.String(request.format);
+      } else if (key == "null") {
+        ok = reader.Bool(request.null_separator);
+      } else if (key == "only") {
+        ok = reader.StringArray(request.only);
+      } else if (key == "extract") {
+        ok = reader.Bool(request.extract);
+      } else if (key == "verify") {
+        ok = reader.Bool(request.verify);
+      } else {
+        error = "Unknown request key: " + key;
+        return std::nullopt;
+      }
+      if (!ok) {
+        error = "Invalid value for request key: " + key;
+        return std::nullopt;
+      }
+    } while (reader.Consume(','));
+    if (!reader.Consume('}')) {
+      return std::nullopt;
+    }
+  }
+  if (!reader.AtEnd()) {
+    return std::nullopt;
+  }
+
+  if (!has_image || request.image.empty()) {
+    error = "Request has no image.";
+    return std::nullopt;
+  }
+  // Binary records do not fit the JSON string of a response
+  if (request.format != "info" && request.format != "mkbootimg" &&
+      request.format != "json") {
+    error = "Invalid format: '" + request.format +
+            "'. Use 'info', 'mkbootimg' or 'json'.";
+    return std::nullopt;
+  }
+  error.clear();
+  return request;
+}
+
+std::string FormatServeResponse(const ServeResponse &response) {
+  std::string line = response.ok ? "{\"ok\":true"
+                                 : "{\"ok\":false,\"error\":" +
+                                       JsonQuote(response.error);
+  if (response.ok || !response.output.empty()) {
+    line += ",\"output\":" + JsonQuote(response.output);
+  }
+  return line + "}\n";
+}
+
+void Serve(const std::filesystem::path &socket_path,
+           const std::function<ServeResponse(const ServeRequest &)> &handle) {
+#ifdef UNPACKBOOTIMG_HAVE_UNIX_SOCKETS
+  const Listener listener(socket_path);
+
+  // Without SA_RESTART a stop interrupts accept() and read()
+  struct sigaction action {};
+  action.sa_handler = RequestStop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  // A client hanging up mid-response must not end the server
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // A response is not held up by a client that stops reading
+  timeval send_timeout{};
+  send_timeout.tv_sec = kClientTimeout.count();
+
+  std::list<Client> clients;
+  std::vector<pollfd> fds;
+  while (!stop_requested) {
+    fds.assign(1, {listener.fd(), POLLIN, 0});
+    for (const auto &client : clients) {
+      fds.push_back({client.fd.get(), POLLIN, 0});
+    }
+    if (::poll(fds.data(), fds.size(), PollTimeout(clients)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Could not poll " + socket_path.string() +
+                               ": " + std::strerror(errno));
+    }
+
+    auto client = clients.begin();
+    for (size_t i = 1; i < fds.size(); ++i) {
+      const bool keep =
+          fds[i].revents != 0
+              ? ServeClient(*client, handle)
+              : std::chrono::steady_clock::now() < client->deadline;
+      client = keep ? std::next(client) : clients.erase(client);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      const int fd = ::accept(listener.fd(), nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) {
+          continue;
+        }
+        throw std::runtime_error("Could not accept on " +
+                                 socket_path.string() + ": " +
+                                 std::strerror(errno));
+      }
+      clients.emplace_back(fd);
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                   sizeof(send_timeout));
+    }
+  }
+#else
+  (void)socket_path;
+  (void)handle;
+  throw std::runtime_error("This build has no --serve support.");
+#endif
+}
+
+} // namespace utils
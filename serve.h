@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <functional>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define UNPACKBOOTIMG_HAVE_UNIX_SOCKETS 1
+#endif
+
+namespace utils {
+
+// Daemon behind --serve: one warm process answering unpack requests over a
+// Unix socket, so bursts of (mostly header-only) queries skip the exec and
+// start-up cost of a process each. Requests and responses are one JSON
+// object per line; a client may send any number of them on one connection.
+// Connections are watched together with poll(), so a client that is slow to
+// send does not hold up the others, and one silent for a while is dropped.
+// Requests are answered one at a time, each as soon as it is complete, so
+// the extraction thread pool can be shared between them.
+#ifdef UNPACKBOOTIMG_HAVE_UNIX_SOCKETS
+constexpr bool SERVE_AVAILABLE = true;
+#else
+constexpr bool SERVE_AVAILABLE = false;
+#endif
+
+// {"image": "boot.img", "output": "out", "format": "info", "null": false,
+//  "only": ["kernel", "dtb"], "extract": true, "verify": false}
+// Only "image" is required; the defaults are those of the command line,
+// and "format" is one of info, mkbootimg or json.
+struct ServeRequest {
+  std::filesystem::path image;
+  std::filesystem::path output = "out";
+  std::string format = "info";
+  bool null_separator = false;
+  std::vector<std::string> only;
+  bool extract = true;
+  bool verify = false;
+};
+
+// Sent back as {"ok": true, "output": "..."}, or with "ok": false and an
+// "error" (and whatever output there was, e.g. for failed verification).
+struct ServeResponse {
+  bool ok = true;
+  std::string output;
+  std::string error;
+};
+
+// Decodes one request line. Unknown keys and values of the wrong type are
+// errors, like unknown command line arguments; nullopt with `error` set
+// then.
+std::optional<ServeRequest> ParseServeRequest(std::string_view line,
+                                              std::string &error);
+
+std::string FormatServeResponse(const ServeResponse &response);
+
+// Listens at `socket_path` and answers every request with `handle` until
+// SIGINT or SIGTERM, then removes the socket. A stale socket left by an
+// earlier run is replaced; throws when a server is still listening there or
+// the socket cannot be set up.
+void Serve(const std::filesystem::path &socket_path,
+           const std::function<ServeResponse(const ServeRequest &)> &handle);
+
+} // namespace utils
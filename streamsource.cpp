@@ -0,0 +1,168 @@
+#include "streamsource.h"
+#include "decompress.h"
+#include "digest.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace utils {
+
+namespace {
+constexpr size_t kForwardChunkSize = 1 << 20;
+} // namespace
+
+std::span<const std::byte> StreamSource::ReadHead(size_t size) {
+  if (!head_read_) {
+    head_read_ = true;
+    head_.resize(size);
+    input_.read(reinterpret_cast<char *>(head_.data()),
+                static_cast<std::streamsize>(size));
+    head_.resize(static_cast<size_t>(input_.gcount()));
+    position_ = head_.size();
+  }
+  return head_;
+}
+
+size_t StreamSource::ReadAt(uint64_t offset, std::span<std::byte> out) {
+  size_t done = 0;
+
+  // Bytes captured with the header are served from memory
+  if (offset < head_.size()) {
+    done = std::min<size_t>(out.size(),
+                            head_.size() - static_cast<size_t>(offset));
+    std::memcpy(out.data(), head_.data() + offset, done);
+    offset += done;
+    if (done == out.size()) {
+      return done;
+    }
+  }
+
+  // Skip forward over bytes no sink wants
+  if (offset < position_) {
+    return done; // Already consumed; callers never ask for this.
+  }
+  if (position_ < offset) {
+    stats::Count(stats::SEEK_CALLS);
+    input_.ignore(static_cast<std::streamsize>(offset - position_));
+    position_ += static_cast<uint64_t>(input_.gcount());
+    if (position_ < offset) {
+      return done;
+    }
+  }
+
+  input_.read(reinterpret_cast<char *>(out.data() + done),
+              static_cast<std::streamsize>(out.size() - done));
+  const auto got = static_cast<size_t>(input_.gcount());
+  stats::CountRead(got);
+  position_ += got;
+  return done + got;
+}
+
+void StreamSource::Extract(const std::vector<ForwardSink> &sinks,
+                           const std::filesystem::path &output_dir,
+                           const UnpackOptions &options) {
+  std::vector<size_t> order(sinks.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return sinks[a].offset < sinks[b].offset;
+  });
+
+  struct Active {
+    const ForwardSink *sink;
+    std::unique_ptr<SectionWriter> output;
+    uint64_t end;
+    stats::Stopwatch watch;
+  };
+  std::vector<Active> active;
+  std::vector<std::byte> chunk(kForwardChunkSize);
+
+  auto fail = [](const ForwardSink &sink) {
+    throw std::runtime_error("Could not extract image: " + sink.name);
+  };
+
+  size_t next = 0;
+  uint64_t pos = 0;
+  while (next < order.size() || !active.empty()) {
+    if (active.empty()) {
+      pos = std::max(pos, sinks[order[next]].offset);
+    }
+
+    // Start every sink that begins here
+    while (next < order.size() && sinks[order[next]].offset <= pos) {
+      const ForwardSink &sink = sinks[order[next++]];
+      Active entry{&sink, nullptr, sink.offset + sink.size, {}};
+      if (sink.buffer) {
+        sink.buffer->clear();
+        sink.buffer->reserve(static_cast<size_t>(sink.size));
+      } else if (!sink.tap) {
+        entry.output = std::make_unique<SectionWriter>(
+            output_dir / sink.name, sink.output,
+            options.jobs > 0 ? options.jobs : ThreadPool::DefaultConcurrency(),
+            options.pool);
+        if (!entry.output->good()) {
+          fail(sink);
+        }
+      }
+      if (sink.size > 0) {
+        active.push_back(std::move(entry));
+      } else if (entry.output && !entry.output->Finish()) {
+        fail(sink);
+      } else if (!sink.buffer) {
+        entry.watch.Record(sink.tap ? "scan" : "extract", sink.name);
+      }
+    }
+    if (active.empty()) {
+      continue;
+    }
+
+    // Read up to the next point where the set of active sinks changes
+    uint64_t limit = next < order.size() ? sinks[order[next]].offset
+                                         : std::numeric_limits<uint64_t>::max();
+    for (const auto &entry : active) {
+      limit = std::min(limit, entry.end);
+    }
+    const size_t want =
+        static_cast<size_t>(std::min<uint64_t>(limit - pos, chunk.size()));
+    const size_t got = ReadAt(pos, std::span(chunk).first(want));
+    if (got < want) {
+      fail(*active.front().sink);
+    }
+
+    for (auto &entry : active) {
+      if (entry.sink->digest) {
+        entry.sink->digest->Update(std::span(chunk).first(got));
+      }
+      if (entry.sink->buffer) {
+        entry.sink->buffer->insert(entry.sink->buffer->end(), chunk.begin(),
+                                   chunk.begin() + got);
+      } else if (entry.sink->tap) {
+        if (entry.sink->tap->sputn(reinterpret_cast<const char *>(chunk.data()),
+                                   static_cast<std::streamsize>(got)) !=
+            static_cast<std::streamsize>(got)) {
+          fail(*entry.sink);
+        }
+      } else if (!entry.output->Write(std::span(chunk).first(got))) {
+        fail(*entry.sink);
+      }
+    }
+    pos += got;
+
+    std::erase_if(active, [&](Active &entry) {
+      if (entry.end > pos) {
+        return false;
+      }
+      if (entry.output && !entry.output->Finish()) {
+        fail(*entry.sink);
+      }
+      if (!entry.sink->buffer) {
+        entry.watch.Record(entry.sink->tap ? "scan" : "extract",
+                           entry.sink->name, entry.sink->size);
+      }
+      return true;
+    });
+  }
+}
+
+} // namespace utils
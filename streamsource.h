@@ -0,0 +1,55 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <cstddef>
+#include <span>
+#include <streambuf>
+
+namespace utils {
+
+// One output range of a forward extraction. The bytes go to
+// `output_dir / name`, or into `buffer` or `tap` when one is given, and are
+// also hashed into `digest` if set.
+struct ForwardSink {
+  uint64_t offset;
+  uint64_t size;
+  std::string name;
+  std::vector<std::byte> *buffer = nullptr;
+  // Decode (and for Tree, unpack) ramdisks on the way to disk.
+  RamdiskOutput output = RamdiskOutput::Raw;
+  std::streambuf *tap = nullptr;
+  SectionDigest *digest = nullptr;
+};
+
+// Strictly forward reader for non-seekable inputs (pipes, stdin). The first
+// bytes are kept for header parsing; everything after that is read once, in
+// order, and never buffered beyond a single chunk.
+class StreamSource {
+public:
+  explicit StreamSource(std::istream &input) : input_(input) {}
+
+  StreamSource(const StreamSource &) = delete;
+  StreamSource &operator=(const StreamSource &) = delete;
+
+  // Reads up to `size` leading bytes (fewer at end of input). Later calls
+  // return the bytes captured by the first one.
+  std::span<const std::byte> ReadHead(size_t size);
+
+  // Writes every sink while reading the input once, front to back. Sinks may
+  // overlap; shared bytes are teed into each of them. Throws naming the
+  // first sink that could not be completed.
+  void Extract(const std::vector<ForwardSink> &sinks,
+               const std::filesystem::path &output_dir,
+               const UnpackOptions &options = {});
+
+private:
+  size_t ReadAt(uint64_t offset, std::span<std::byte> out);
+
+  std::istream &input_;
+  std::vector<std::byte> head_;
+  bool head_read_ = false;
+  uint64_t position_ = 0;
+};
+
+} // namespace utils
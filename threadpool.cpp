@@ -0,0 +1,139 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+namespace utils {
+
+unsigned ThreadPool::DefaultConcurrency() {
+  const unsigned n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0) {
+    threads = DefaultConcurrency();
+  }
+
+  queues_.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+
+  workers_.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i) {
+    workers_.emplace_back([this, i] { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  const size_t index = next_queue_++ % queues_.size();
+  unfinished_++;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    queued_++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  work_cv_.notify_one();
+}
+
+bool ThreadPool::TryRunOne(size_t home) {
+  std::function<void()> task;
+
+  for (size_t i = 0; i < queues_.size() && !task; ++i) {
+    auto &queue = *queues_[(home + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+    // Own queue: take the oldest task; foreign queue: steal the newest.
+    if (i == 0) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    } else {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+
+  queued_--;
+  task();
+
+  if (--unfinished_ == 0) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    done_cv_.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+  for (;;) {
+    if (TryRunOne(index)) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    work_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0) {
+      return;
+    }
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)> &task) {
+  struct Progress {
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+  // Helpers that start after every index was taken only touch `progress`
+  const auto progress = std::make_shared<Progress>();
+  const auto run = [progress, &task, count] {
+    for (size_t i; (i = progress->next++) < count;) {
+      task(i);
+      std::lock_guard<std::mutex> lock(progress->mutex);
+      if (++progress->done == count) {
+        progress->finished.notify_all();
+      }
+    }
+  };
+
+  const size_t helpers = std::min<size_t>(count, workers_.size() + 1) - 1;
+  for (size_t i = 0; i < helpers; ++i) {
+    Submit(run);
+  }
+  run();
+  std::unique_lock<std::mutex> lock(progress->mutex);
+  progress->finished.wait(lock, [&] { return progress->done == count; });
+}
+
+void ThreadPool::Wait() {
+  while (unfinished_ > 0) {
+    if (TryRunOne(next_queue_ % queues_.size())) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    done_cv_.wait(lock, [this] { return unfinished_ == 0 || queued_ > 0; });
+  }
+}
+
+} // namespace utils
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils {
+
+// Fixed size work-stealing pool. Each worker owns a deque and runs tasks from
+// its front; idle workers steal from the back of the others. Wait() lets the
+// calling thread help until every submitted task has finished. Tasks must not
+// throw.
+class ThreadPool {
+public:
+  // `threads` == 0 selects std::thread::hardware_concurrency().
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void Submit(std::function<void()> task);
+  void Wait();
+
+  // Runs task(0) to task(count - 1) on the calling thread and whichever
+  // workers are free, and returns once they are done. Unlike Wait() it only
+  // waits for these, so tasks of this pool may call it.
+  void ParallelFor(size_t count, const std::function<void(size_t)> &task);
+
+  unsigned size() const { return static_cast<unsigned>(workers_.size()); }
+
+  static unsigned DefaultConcurrency();
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool TryRunOne(size_t home);
+  void WorkerLoop(size_t index);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> unfinished_{0};
+
+  std::mutex state_mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  bool stop_ = false;
+};
+
+} // namespace utils
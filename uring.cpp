@@ -0,0 +1,692 @@
+#include "uring.h"
+
+#ifdef UNPACKBOOTIMG_HAVE_IO_URING
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace utils {
+
+#ifdef UNPACKBOOTIMG_HAVE_IO_URING
+namespace {
+
+constexpr unsigned kRingEntries = 256;
+// Output files open at the same time, one registered descriptor each
+constexpr unsigned kFileSlots = 64;
+// Read buffers for unmapped images; a file holds at most two at a time
+constexpr unsigned kBuffers = 16;
+constexpr size_t kBufferSize = 256 << 10;
+// Longer mapped sections are written in several requests
+constexpr uint64_t kMaxWrite = 1 << 30;
+
+int RingSetup(unsigned entries, io_uring_params &params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+}
+
+int RingEnter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+}
+
+int RingRegister(int fd, unsigned opcode, const void *arg, unsigned count) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// A submission and completion queue pair with kFileSlots registered file
+// slots and (where the memlock limit allows) kBuffers registered buffers.
+class IoRing {
+public:
+  IoRing() = default;
+  ~IoRing();
+
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+
+  bool Init();
+
+  bool Supports(uint8_t opcode) const { return supported_[opcode]; }
+  bool fixed_buffers() const { return fixed_buffers_; }
+  std::byte *buffer(unsigned index) const {
+    return static_cast<std::byte *>(buffers_) + index * kBufferSize;
+  }
+
+  // Free submission queue entries.
+  unsigned space() const {
+    return sq_entries_ - (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+  }
+
+  // Fills in the next entry; the request goes out with the next Submit().
+  io_uring_sqe &Queue(uint8_t opcode, uint64_t user_data);
+
+  // Submits the queued requests and, with `wait`, blocks until a completion
+  // is available. False when the ring is broken.
+  bool Submit(bool wait);
+
+  template <typename Handle> void Reap(Handle &&handle) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      handle(cqes_[head & cq_mask_]);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  int fd_ = -1;
+  void *sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  void *buffers_ = MAP_FAILED;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+
+  unsigned tail_ = 0;   // Published to the kernel by Submit()
+  unsigned queued_ = 0; // Not yet consumed by the kernel
+  bool fixed_buffers_ = false;
+  std::array<bool, 256> supported_{};
+};
+
+IoRing::~IoRing() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (buffers_ != MAP_FAILED) {
+    munmap(buffers_, kBuffers * kBufferSize);
+  }
+}
+
+bool IoRing::Init() {
+  // Newer setup flags only help; older kernels reject them
+  io_uring_params params{};
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                 IORING_SETUP_SINGLE_ISSUER;
+  fd_ = RingSetup(kRingEntries, params);
+  if (fd_ < 0 && errno == EINVAL) {
+    params = {};
+    fd_ = RingSetup(kRingEntries, params);
+  }
+  if (fd_ < 0) {
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  cq_ring_ = single_mmap
+                 ? sq_ring_
+                 : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  if (cq_ring_ == MAP_FAILED) {
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+  auto *sq = static_cast<char *>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  auto *cq = static_cast<char *>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  tail_ = *sq_tail_;
+
+  std::vector<std::byte> probe_storage(sizeof(io_uring_probe) +
+                                       256 * sizeof(io_uring_probe_op));
+  auto *probe = reinterpret_cast<io_uring_probe *>(probe_storage.data());
+  if (RingRegister(fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+    return false;
+  }
+  for (unsigned i = 0; i < probe->ops_len; ++i) {
+    if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) {
+      supported_[probe->ops[i].op] = true;
+    }
+  }
+  // Opening into and closing registered slots came with 5.15, as did
+  // IORING_OP_LINKAT, which (unlike a slot index) the probe can see
+  for (const uint8_t opcode :
+       {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_LINKAT}) {
+    if (!Supports(opcode)) {
+      return false;
+    }
+  }
+
+  const std::vector<int> slots(kFileSlots, -1);
+  if (RingRegister(fd_, IORING_REGISTER_FILES, slots.data(), kFileSlots) < 0) {
+    return false;
+  }
+
+  buffers_ = mmap(nullptr, kBuffers * kBufferSize, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers_ == MAP_FAILED) {
+    return false;
+  }
+  std::array<iovec, kBuffers> iovecs;
+  for (unsigned i = 0; i < kBuffers; ++i) {
+    iovecs[i] = {buffer(i), kBufferSize};
+  }
+  // Unregistered buffers work too, just with a page lookup per request
+  fixed_buffers_ = RingRegister(fd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                                kBuffers) == 0;
+  return true;
+}
+
+io_uring_sqe &IoRing::Queue(uint8_t opcode, uint64_t user_data) {
+  const unsigned index = tail_ & sq_mask_;
+  io_uring_sqe &sqe = sqes_[index];
+  sqe = {};
+  sqe.opcode = opcode;
+  sqe.user_data = user_data;
+  sq_array_[index] = index;
+  ++tail_;
+  ++queued_;
+  return sqe;
+}
+
+bool IoRing::Submit(bool wait) {
+  __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+  stats::Count(stats::RING_SUBMITS);
+  const int n = RingEnter(fd_, queued_, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0);
+  if (n < 0) {
+    // Interrupted, or the completions need reaping first
+    return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+  }
+  queued_ -= std::min(static_cast<unsigned>(n), queued_);
+  return true;
+}
+
+std::unique_ptr<IoRing> &ThreadRingSlot() {
+  thread_local std::unique_ptr<IoRing> ring;
+  return ring;
+}
+
+// The calling thread's ring, set up on first use; nullptr once the kernel
+// refused one.
+IoRing *ThreadRing() {
+  thread_local bool refused = false;
+  auto &ring = ThreadRingSlot();
+  if (!ring && !refused) {
+    auto created = std::make_unique<IoRing>();
+    if (created->Init()) {
+      ring = std::move(created);
+    } else {
+      refused = true;
+    }
+  }
+  return ring.get();
+}
+
+// Requests may still be pending in a broken ring; start over with a new one.
+void DropThreadRing() { ThreadRingSlot().reset(); }
+
+enum Op : uint8_t { OP_OPEN, OP_READ, OP_WRITE, OP_CLOSE };
+
+// Completions carry the copy index, a buffer index and the operation.
+uint64_t Tag(Op op, size_t job, unsigned buffer = 0) {
+  return (static_cast<uint64_t>(job) << 16) | (buffer << 8) | op;
+}
+
+class RingExtractor {
+public:
+  RingExtractor(IoRing &ring, ImageSource &input, std::span<RingCopy> copies)
+      : ring_(ring), input_(input), copies_(copies), jobs_(copies.size()) {
+    for (unsigned i = 0; i < kFileSlots; ++i) {
+      free_slots_.push_back(kFileSlots - 1 - i);
+    }
+    for (unsigned i = 0; i < kBuffers; ++i) {
+      free_buffers_.push_back(kBuffers - 1 - i);
+    }
+  }
+
+  bool Run();
+
+private:
+  struct Job {
+    unsigned slot = 0;
+    uint64_t read = 0; // Unmapped images only
+    uint64_t written = 0;
+    uint64_t write_length = 0; // Of the mapped write in flight
+    unsigned in_flight = 0;
+    unsigned writes = 0;
+    unsigned buffers = 0;
+    bool reading = false;
+    bool opened = false;
+    bool close_queued = false;
+    bool closed = false;
+    bool failed = false;
+    bool waiting = false; // For a buffer
+    bool finished = false;
+    std::vector<unsigned> ready; // Read before the file was open
+  };
+
+  struct Buffer {
+    size_t job = 0;
+    uint32_t length = 0;
+    uint32_t done = 0; // Bytes written
+    uint64_t file_offset = 0;
+  };
+
+  // Makes room for a chain of `count` requests, which must go out together.
+  void Reserve(unsigned count);
+  io_uring_sqe &Queue(Op op, size_t job, unsigned buffer = 0);
+
+  void Start(size_t job);
+  void QueueOpen(size_t job, bool linked);
+  void QueueMappedWrite(size_t job, bool linked);
+  void QueueBufferWrite(unsigned buffer);
+  void QueueClose(size_t job);
+  void TryRead(size_t job);
+  void Release(unsigned buffer);
+  void Complete(const io_uring_cqe &cqe);
+  // Closes the file once everything is written and retires finished jobs
+  void Advance(size_t job);
+
+  IoRing &ring_;
+  ImageSource &input_;
+  std::span<RingCopy> copies_;
+  std::vector<Job> jobs_;
+  std::array<Buffer, kBuffers> buffers_{};
+  std::vector<unsigned> free_slots_;
+  std::vector<unsigned> free_buffers_;
+  std::deque<size_t> waiters_;
+  size_t in_flight_ = 0;
+  size_t active_ = 0;
+  bool broken_ = false;
+};
+
+void RingExtractor::Reserve(unsigned count) {
+  if (ring_.space() < count && !ring_.Submit(false)) {
+    broken_ = true;
+  }
+}
+
+io_uring_sqe &RingExtractor::Queue(Op op, size_t job, unsigned buffer) {
+  static constexpr uint8_t kOpcodes[] = {IORING_OP_OPENAT, IORING_OP_READ,
+                                         IORING_OP_WRITE, IORING_OP_CLOSE};
+  Reserve(1);
+  ++in_flight_;
+  ++jobs_[job].in_flight;
+  return ring_.Queue(kOpcodes[op], Tag(op, job, buffer));
+}
+
+void RingExtractor::Start(size_t job) {
+  Job &state = jobs_[job];
+  RingCopy &copy = copies_[job];
+  copy.ok = false;
+  if (copy.size > 0 && (copy.offset > input_.size() ||
+                        copy.size > input_.size() - copy.offset)) {
+    state.finished = true;
+    return;
+  }
+  state.slot = free_slots_.back();
+  free_slots_.pop_back();
+  ++active_;
+
+  if (!input_.mapped()) {
+    QueueOpen(job, false);
+    TryRead(job);
+    return;
+  }
+
+  // One chain per file: open, write and close. A short write or a failure
+  // cancels the rest of the chain, which Complete() then finishes by hand.
+  stats::Count(stats::BYTES_READ, copy.size);
+  if (copy.digest) {
+    copy.digest->Update(input_.view().subspan(
+        static_cast<size_t>(copy.offset), static_cast<size_t>(copy.size)));
+  }
+  const bool chained_close = copy.size <= kMaxWrite;
+  Reserve(3);
+  QueueOpen(job, true);
+  if (copy.size > 0) {
+    QueueMappedWrite(job, chained_close);
+  }
+  if (chained_close) {
+    QueueClose(job);
+  }
+}
+
+void RingExtractor::QueueOpen(size_t job, bool linked) {
+  io_uring_sqe &sqe = Queue(OP_OPEN, job);
+  sqe.fd = AT_FDCWD;
+  sqe.addr = reinterpret_cast<uint64_t>(copies_[job].path.c_str());
+  sqe.len = 0666;
+  // Registered slots have no close-on-exec flag to set
+  sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  sqe.file_index = jobs_[job].slot + 1;
+  if (linked) {
+    sqe.flags |= IOSQE_IO_LINK;
+  }
+}
+
+void RingExtractor::QueueMappedWrite(size_t job, bool linked) {
+  Job &state = jobs_[job];
+  const RingCopy &copy = copies_[job];
+  state.write_length = std::min(copy.size - state.written, kMaxWrite);
+  ++state.writes;
+  io_uring_sqe &sqe = Queue(OP_WRITE, job);
+  sqe.fd = static_cast<int>(state.slot);
+  sqe.flags |= IOSQE_FIXED_FILE | (linked ? IOSQE_IO_LINK : 0);
+  sqe.addr = reinterpret_cast<uint64_t>(input_.view().data() + copy.offset +
+                                        state.written);
+  sqe.len = static_cast<uint32_t>(state.write_length);
+  sqe.off = state.written;
+}
+
+void RingExtractor::QueueBufferWrite(unsigned buffer) {
+  const Buffer &chunk = buffers_[buffer];
+  Job &state = jobs_[chunk.job];
+  ++state.writes;
+  io_uring_sqe &sqe = Queue(OP_WRITE, chunk.job, buffer);
+  if (ring_.fixed_buffers()) {
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.buf_index = static_cast<uint16_t>(buffer);
+  }
+  sqe.fd = static_cast<int>(state.slot);
+  sqe.flags |= IOSQE_FIXED_FILE;
+  sqe.addr = reinterpret_cast<uint64_t>(ring_.buffer(buffer) + chunk.done);
+  sqe.len = chunk.length - chunk.done;
+  sqe.off = chunk.file_offset + chunk.done;
+}
+
+void RingExtractor::QueueClose(size_t job) {
+  jobs_[job].close_queued = true;
+  io_uring_sqe &sqe = Queue(OP_CLOSE, job);
+  sqe.file_index = jobs_[job].slot + 1;
+}
+
+// Reads are issued one at a time per file, so the digest sees the section in
+// order; a second buffer lets the next read overlap the previous write.
+void RingExtractor::TryRead(size_t job) {
+  Job &state = jobs_[job];
+  const RingCopy &copy = copies_[job];
+  if (state.failed || state.reading || state.read == copy.size ||
+      state.buffers >= 2) {
+    return;
+  }
+  if (free_buffers_.empty()) {
+    if (!state.waiting) {
+      state.waiting = true;
+      waiters_.push_back(job);
+    }
+    return;
+  }
+
+  const unsigned buffer = free_buffers_.back();
+  free_buffers_.pop_back();
+  const uint32_t length = static_cast<uint32_t>(
+      std::min<uint64_t>(copy.size - state.read, kBufferSize));
+  buffers_[buffer] = {job, length, 0, state.read};
+  ++state.buffers;
+  state.reading = true;
+
+  stats::Count(stats::READ_CALLS);
+  io_uring_sqe &sqe = Queue(OP_READ, job, buffer);
+  if (ring_.fixed_buffers()) {
+    sqe.opcode = IORING_OP_READ_FIXED;
+    sqe.buf_index = static_cast<uint16_t>(buffer);
+  }
+  sqe.fd = input_.fd();
+  sqe.addr = reinterpret_cast<uint64_t>(ring_.buffer(buffer));
+  sqe.len = length;
+  sqe.off = copy.offset + state.read;
+}
+
+void RingExtractor::Release(unsigned buffer) {
+  --jobs_[buffers_[buffer].job].buffers;
+  free_buffers_.push_back(buffer);
+  while (!free_buffers_.empty() && !waiters_.empty()) {
+    const size_t job = waiters_.front();
+    waiters_.pop_front();
+    jobs_[job].waiting = false;
+    TryRead(job);
+  }
+}
+
+void RingExtractor::Complete(const io_uring_cqe &cqe) {
+  const size_t job = static_cast<size_t>(cqe.user_data >> 16);
+  const unsigned buffer = static_cast<unsigned>((cqe.user_data >> 8) & 0xff);
+  const auto op = static_cast<Op>(cqe.user_data & 0xff);
+  Job &state = jobs_[job];
+  --in_flight_;
+  --state.in_flight;
+
+  switch (op) {
+  case OP_OPEN:
+    if (cqe.res < 0) {
+      state.failed = true;
+      break;
+    }
+    state.opened = true;
+    for (const unsigned ready : state.ready) {
+      QueueBufferWrite(ready);
+    }
+    state.ready.clear();
+    break;
+  case OP_READ: {
+    state.reading = false;
+    if (cqe.res <= 0 || state.failed) {
+      state.failed = true; // A zero read means the image is shorter
+      Release(buffer);
+      break;
+    }
+    Buffer &chunk = buffers_[buffer];
+    chunk.length = static_cast<uint32_t>(cqe.res);
+    stats::Count(stats::BYTES_READ, chunk.length);
+    if (copies_[job].digest) {
+      copies_[job].digest->Update(
+          std::span<const std::byte>(ring_.buffer(buffer), chunk.length));
+    }
+    state.read += chunk.length;
+    if (state.opened) {
+      QueueBufferWrite(buffer);
+    } else {
+      state.ready.push_back(buffer);
+    }
+    TryRead(job);
+    break;
+  }
+  case OP_WRITE: {
+    --state.writes;
+    const bool mapped = input_.mapped();
+    if (cqe.res <= 0 || state.failed) {
+      state.failed = true;
+      if (!mapped) {
+        Release(buffer);
+      }
+      break;
+    }
+    const auto n = static_cast<uint64_t>(cqe.res);
+    stats::Count(stats::WRITE_CALLS);
+    stats::Count(stats::BYTES_WRITTEN, n);
+    state.written += n;
+    if (mapped) {
+      if (state.written < copies_[job].size) {
+        QueueMappedWrite(job, false);
+      }
+      break;
+    }
+    Buffer &chunk = buffers_[buffer];
+    chunk.done += static_cast<uint32_t>(n);
+    if (chunk.done < chunk.length) {
+      QueueBufferWrite(buffer);
+    } else {
+      Release(buffer);
+      TryRead(job);
+    }
+    break;
+  }
+  case OP_CLOSE:
+    state.close_queued = false;
+    if (cqe.res != -ECANCELED) {
+      state.closed = true;
+      state.failed = state.failed || cqe.res < 0;
+    }
+    break;
+  }
+  Advance(job);
+}
+
+void RingExtractor::Advance(size_t job) {
+  Job &state = jobs_[job];
+  const RingCopy &copy = copies_[job];
+  if (state.failed) {
+    for (const unsigned ready : state.ready) {
+      Release(ready);
+    }
+    state.ready.clear();
+  }
+  if (state.opened && !state.closed && !state.close_queued &&
+      !state.reading && state.writes == 0 &&
+      (state.failed || state.written == copy.size)) {
+    QueueClose(job);
+  }
+  if (state.in_flight == 0 && !state.finished &&
+      (state.closed || !state.opened)) {
+    state.finished = true;
+    copies_[job].ok =
+        !state.failed && state.closed && state.written == copy.size;
+    free_slots_.push_back(state.slot);
+    --active_;
+  }
+}
+
+bool RingExtractor::Run() {
+  size_t next = 0;
+  while (!broken_ && (next < copies_.size() || active_ > 0)) {
+    while (next < copies_.size() && !free_slots_.empty()) {
+      Start(next++);
+    }
+    if (!ring_.Submit(in_flight_ > 0)) {
+      broken_ = true;
+      break;
+    }
+    ring_.Reap([&](const io_uring_cqe &cqe) { Complete(cqe); });
+  }
+  return !broken_;
+}
+
+} // namespace
+
+bool RingUsable() { return ThreadRing() != nullptr; }
+
+bool RingExtract(ImageSource &input, std::span<RingCopy> copies) {
+  IoRing *ring = ThreadRing();
+  if (!ring || (!input.mapped() && input.fd() < 0)) {
+    return false;
+  }
+  uint64_t bytes = 0;
+  for (const auto &copy : copies) {
+    bytes += copy.size;
+  }
+  stats::ScopedTimer timer("extract", "io_uring", bytes);
+  if (!RingExtractor(*ring, input, copies).Run()) {
+    DropThreadRing();
+  }
+  return true;
+}
+
+bool RingReplaceSymlinks(
+    const std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+        &links) {
+  IoRing *ring = ThreadRing();
+  if (!ring || !ring->Supports(IORING_OP_UNLINKAT) ||
+      !ring->Supports(IORING_OP_SYMLINKAT)) {
+    return false;
+  }
+
+  size_t in_flight = 0;
+  bool ok = true;
+  const auto reap = [&](const io_uring_cqe &) { --in_flight; };
+  for (const auto &[target, link] : links) {
+    while (ok && ring->space() < 2) {
+      ok = ring->Submit(false);
+      ring->Reap(reap);
+    }
+    if (!ok) {
+      break;
+    }
+    // A failed unlink (nothing there yet) must not cancel the symlink
+    io_uring_sqe &unlink = ring->Queue(IORING_OP_UNLINKAT, 0);
+    unlink.fd = AT_FDCWD;
+    unlink.addr = reinterpret_cast<uint64_t>(link.c_str());
+    unlink.flags |= IOSQE_IO_HARDLINK;
+    io_uring_sqe &symlink = ring->Queue(IORING_OP_SYMLINKAT, 0);
+    symlink.fd = AT_FDCWD;
+    symlink.addr = reinterpret_cast<uint64_t>(target.c_str());
+    symlink.addr2 = reinterpret_cast<uint64_t>(link.c_str());
+    in_flight += 2;
+  }
+  while (ok && in_flight > 0) {
+    ok = ring->Submit(true);
+    ring->Reap(reap);
+  }
+  if (!ok) {
+    DropThreadRing();
+  }
+  return true;
+}
+
+#else
+
+bool RingUsable() { return false; }
+
+bool RingExtract(ImageSource &, std::span<RingCopy>) { return false; }
+
+bool RingReplaceSymlinks(
+    const std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+        &) {
+  return false;
+}
+
+#endif
+
+} // namespace utils
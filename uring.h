@@ -0,0 +1,56 @@
+#pragma once
+
+#include "digest.h"
+#include "imagesource.h"
+#include "utils.hpp"
+
+#include <span>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define UNPACKBOOTIMG_HAVE_IO_URING 1
+#endif
+
+namespace utils {
+
+// Extraction engine behind --io-uring. Each thread owns one ring, set up on
+// first use and kept for later images (so batch workers reuse theirs). Output
+// files are opened, written and closed by queued requests on registered
+// ("direct") descriptors, many files at a time: from a mapped image an open,
+// write and close go out as one linked chain per file; unmapped images are
+// read into registered buffers. The raw syscalls are used, so no liburing is
+// needed. Kernel copy offload (reflinks, copy_file_range) is not used here.
+#ifdef UNPACKBOOTIMG_HAVE_IO_URING
+constexpr bool IO_URING_AVAILABLE = true;
+#else
+constexpr bool IO_URING_AVAILABLE = false;
+#endif
+
+// One section to copy to its own output file.
+struct RingCopy {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::filesystem::path path;
+  // Fed the section bytes in order when set
+  SectionDigest *digest = nullptr;
+  bool ok = false;
+};
+
+// Whether the calling thread has (or could set up) a ring; false when the
+// build lacks the engine or the kernel refuses it (older than 5.15, or
+// io_uring disabled).
+bool RingUsable();
+
+// Runs every copy to completion on the calling thread's ring, setting each
+// `ok`. `input` must be mapped or have a native descriptor. False, with
+// nothing done, when !RingUsable().
+bool RingExtract(ImageSource &input, std::span<RingCopy> copies);
+
+// Replaces each `link` (second) by a symlink to `target` (first), queueing
+// the unlinkat and symlinkat calls. False, with nothing done, when the ring
+// is unusable or the kernel lacks those operations (before 5.18); failures of
+// individual links are ignored.
+bool RingReplaceSymlinks(
+    const std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+        &links);
+
+} // namespace utils
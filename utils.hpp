@@ -1,13 +1,17 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <ios>
 #include <istream>
+#include <iterator>
 #include <limits>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <stdio.h>
@@ -21,61 +25,237 @@
 
 namespace utils {
 constexpr uint32_t MAGIC_SIZE = 8;
+// Every boot/vendor_boot header version fits in the first 4 KiB.
+constexpr uint32_t HEADER_READ_SIZE = 4096;
+
+// Timing and I/O counters behind --stats. Hooks cost one relaxed load while
+// stats are off at run time; building with UNPACKBOOTIMG_NO_STATS turns them
+// into empty inline functions.
+namespace stats {
+
+enum Counter {
+  BYTES_READ,
+  READ_CALLS,
+  SEEK_CALLS,
+  BYTES_WRITTEN,
+  WRITE_CALLS,
+  BYTES_COPIED, // Moved by the kernel (reflink, copy_file_range, sendfile)
+  COPY_CALLS,
+  SECTIONS_UNCHANGED, // Left alone by --incremental
+  RING_SUBMITS,       // io_uring_enter calls (--io-uring)
+  BYTES_SPARSE,       // Zero output blocks left as holes
+  BUFFER_WAITS,       // Copies that waited for --buffer-memory
+  COUNTER_COUNT,
+};
 
-inline std::string getRamdiskType(uint32_t type) {
-    static const std::unordered_map<uint32_t, std::string> ramdiskMap = {
-        {0, "none"},
-        {1, "platform"},
-        {2, "recovery"},
-        {3, "dlkm"},
-    };
+struct Timing {
+  std::string image;
+  std::string phase;
+  std::string name;
+  double seconds;
+  uint64_t bytes;
+};
 
-    auto it = ramdiskMap.find(type);
-    return (it != ramdiskMap.end()) ? it->second : "none";
-}
+struct Snapshot {
+  std::array<uint64_t, COUNTER_COUNT> counters{};
+  std::vector<Timing> timings;
+};
 
-inline bool CreateDirectory(const std::filesystem::path &dir_path) {
-  std::error_code ec;
-  std::filesystem::create_directories(dir_path, ec);
-  return !ec;
-}
+#ifndef UNPACKBOOTIMG_NO_STATS
+constexpr bool AVAILABLE = true;
 
-inline bool ExtractImage(std::ifstream &input, uint64_t offset, uint64_t size,
-                         const std::filesystem::path &output_path) {
-  if (size == 0) {
-    std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
-    return output.good();
+class Registry {
+public:
+  static Registry &Get() {
+    static Registry registry;
+    return registry;
   }
 
-  if (!input.seekg(offset)) {
-    return false;
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  void Enable() { enabled_.store(true, std::memory_order_relaxed); }
+
+  void Add(Counter counter, uint64_t n) {
+    counters_[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t Get(Counter counter) const {
+    return counters_[counter].load(std::memory_order_relaxed);
   }
 
-  std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
-  if (!output) {
-    return false;
+  void Record(Timing timing) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timings_.push_back(std::move(timing));
+  }
+  std::vector<Timing> timings() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return timings_;
   }
 
-  constexpr std::streamsize kChunkSize = 65536;
-  std::vector<char> buffer(kChunkSize);
-  uint64_t remaining = size;
+private:
+  std::atomic<bool> enabled_{false};
+  std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters_{};
+  std::mutex mutex_;
+  std::vector<Timing> timings_;
+};
 
-  while (remaining > 0) {
-    const std::streamsize bytes_to_read = static_cast<std::streamsize>(
-        std::min(remaining, static_cast<uint64_t>(kChunkSize)));
+// Image the current thread is working on, used to label batch timings.
+inline thread_local std::string current_image;
 
-    if (!input.read(buffer.data(), bytes_to_read)) {
-      return false;
+inline bool Enabled() { return Registry::Get().enabled(); }
+inline void Enable() { Registry::Get().Enable(); }
+
+inline Snapshot Collect() {
+  Snapshot snapshot;
+  for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+    snapshot.counters[i] = Registry::Get().Get(static_cast<Counter>(i));
+  }
+  snapshot.timings = Registry::Get().timings();
+  return snapshot;
+}
+
+inline void Count(Counter counter, uint64_t n = 1) {
+  if (Enabled()) {
+    Registry::Get().Add(counter, n);
+  }
+}
+
+inline void CountRead(uint64_t bytes) {
+  Count(READ_CALLS);
+  Count(BYTES_READ, bytes);
+}
+
+inline void CountWrite(uint64_t bytes) {
+  Count(WRITE_CALLS);
+  Count(BYTES_WRITTEN, bytes);
+}
+
+// Started at construction; Record() adds one timing line.
+class Stopwatch {
+public:
+  Stopwatch() : active_(Enabled()) {
+    if (active_) {
+      start_ = std::chrono::steady_clock::now();
     }
+  }
 
-    if (!output.write(buffer.data(), bytes_to_read)) {
-      return false;
+  void Record(std::string_view phase, std::string_view name = {},
+              uint64_t bytes = 0) const {
+    if (!active_) {
+      return;
     }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    Registry::Get().Record({current_image, std::string(phase),
+                            std::string(name), elapsed.count(), bytes});
+  }
+
+private:
+  bool active_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Times the enclosing scope.
+class ScopedTimer {
+public:
+  explicit ScopedTimer(std::string_view phase, std::string_view name = {},
+                       uint64_t bytes = 0)
+      : phase_(phase), name_(name), bytes_(bytes) {}
+  ~ScopedTimer() { watch_.Record(phase_, name_, bytes_); }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  Stopwatch watch_;
+  std::string_view phase_;
+  std::string_view name_;
+  uint64_t bytes_;
+};
+
+// Labels the timings recorded by this thread until it goes out of scope.
+class ScopedImage {
+public:
+  explicit ScopedImage(std::string image)
+      : previous_(std::exchange(current_image, std::move(image))) {}
+  ~ScopedImage() { current_image = std::move(previous_); }
+
+  ScopedImage(const ScopedImage &) = delete;
+  ScopedImage &operator=(const ScopedImage &) = delete;
 
-    remaining -= static_cast<uint64_t>(bytes_to_read);
+private:
+  std::string previous_;
+};
+
+// A filebuf that counts what is written through it. Writes that the base
+// class splits internally are counted once.
+class CountingFilebuf : public std::filebuf {
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    in_xsputn_ = true;
+    const std::streamsize written = std::filebuf::xsputn(data, size);
+    in_xsputn_ = false;
+    CountWrite(static_cast<uint64_t>(written));
+    return written;
   }
 
-  return output.good();
+  int_type overflow(int_type ch) override {
+    if (!in_xsputn_ && !traits_type::eq_int_type(ch, traits_type::eof())) {
+      CountWrite(1);
+    }
+    return std::filebuf::overflow(ch);
+  }
+
+private:
+  bool in_xsputn_ = false;
+};
+#else
+constexpr bool AVAILABLE = false;
+
+inline bool Enabled() { return false; }
+inline void Enable() {}
+inline Snapshot Collect() { return {}; }
+inline void Count(Counter, uint64_t = 1) {}
+inline void CountRead(uint64_t) {}
+inline void CountWrite(uint64_t) {}
+
+class Stopwatch {
+public:
+  void Record(std::string_view, std::string_view = {}, uint64_t = 0) const {}
+};
+
+class ScopedTimer {
+public:
+  explicit ScopedTimer(std::string_view, std::string_view = {},
+                       uint64_t = 0) {}
+};
+
+class ScopedImage {
+public:
+  explicit ScopedImage(const std::string &) {}
+};
+
+using CountingFilebuf = std::filebuf;
+#endif
+
+} // namespace stats
+
+inline std::string getRamdiskType(uint32_t type) {
+    static const std::unordered_map<uint32_t, std::string> ramdiskMap = {
+        {0, "none"},
+        {1, "platform"},
+        {2, "recovery"},
+        {3, "dlkm"},
+    };
+
+    auto it = ramdiskMap.find(type);
+    return (it != ramdiskMap.end()) ? it->second : "none";
+}
+
+inline bool CreateDirectory(const std::filesystem::path &dir_path) {
+  const auto name = dir_path.filename().string();
+  stats::ScopedTimer timer("mkdir", name);
+  std::error_code ec;
+  std::filesystem::create_directories(dir_path, ec);
+  return !ec;
 }
 
 inline uint32_t GetNumberOfPages(uint32_t image_size, uint32_t page_size) {
@@ -85,6 +265,36 @@ inline uint32_t GetNumberOfPages(uint32_t image_size, uint32_t page_size) {
   return (image_size + page_size - 1) / page_size;
 }
 
+// Appends `text` as a JSON string literal. Bytes from 0x80 up are copied
+// as they are, so UTF-8 text stays readable.
+inline void AppendJsonString(std::string &out, std::string_view text) {
+  out += '"';
+  for (const char c : text) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        std::format_to(std::back_inserter(out), "\\u{:04x}",
+                       static_cast<unsigned>(c));
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+inline std::string JsonQuote(std::string_view text) {
+  std::string quoted;
+  AppendJsonString(quoted, text);
+  return quoted;
+}
+
 inline std::string CStr(std::string_view s) {
   if (auto pos = s.find('\0'); pos != std::string_view::npos) {
     return std::string(s.substr(0, pos));
@@ -218,13 +428,95 @@ inline bool ReadU32Array(std::istream &stream, std::array<uint32_t, N> &arr) {
   return true;
 }
 
+enum class SectionKind { Other, Kernel, Ramdisk, Dtb };
+
+class ImageTap;
+class Manifest;
+class OutputCache;
+class SectionDigest;
+class TarWriter;
+class ThreadPool;
+
+// How ramdisk sections are written: as stored, decompressed, or unpacked
+// from their cpio archive into a directory tree.
+enum class RamdiskOutput { Raw, Decompressed, Tree };
+
 struct ImageEntry {
   uint64_t offset;
   uint32_t size;
   std::string name;
+  SectionKind kind;
+
+  ImageEntry(uint64_t o, uint32_t s, std::string n,
+             SectionKind k = SectionKind::Other)
+      : offset(o), size(s), name(std::move(n)), kind(k) {}
+};
 
-  ImageEntry(uint64_t o, uint32_t s, std::string n)
-      : offset(o), size(s), name(std::move(n)) {}
+struct UnpackOptions {
+  // Number of sections extracted concurrently; 0 = hardware concurrency.
+  unsigned jobs = 0;
+  // When false only the header is parsed and nothing is written to disk.
+  bool extract = true;
+  // Section names to extract (e.g. "kernel", "vendor_ramdisk02" or a vendor
+  // ramdisk fragment name); empty selects every section.
+  std::vector<std::string> only;
+  // Ramdisks are decompressed for Decompressed and Tree (gzip, LZ4
+  // legacy/frame, zstd if built in).
+  RamdiskOutput ramdisk = RamdiskOutput::Raw;
+  // Write the kernel decompressed (same formats as ramdisks).
+  bool decompress_kernel = false;
+  // When set, every extracted section is hashed (as stored in the image) on
+  // its way to disk and recorded here.
+  Manifest *manifest = nullptr;
+  // When set (--incremental), sections whose output it records as unchanged
+  // are hashed but not written again, and rewritten outputs are recorded.
+  OutputCache *cache = nullptr;
+  // Check the mkbootimg id and AVB hash footer (see verify.h); the outcome
+  // is reported with the header information.
+  bool verify = false;
+  // When set, every extracted section is also fed to it as it is read (for
+  // --verify, see VerificationTap). Unmapped images are then extracted one
+  // section after the other, in file order, so the tap gets them in order.
+  ImageTap *image_tap = nullptr;
+  // Also split dtb and recovery_dtbo into their device trees (dtb.N,
+  // dtbo.N) and index them (see dtb.h); with `dtb_compatible` only trees
+  // listing it in their root compatible property are written.
+  bool split_dtb = false;
+  std::string dtb_compatible;
+  // Queue the opens, writes and closes of raw outputs (and the vendor
+  // ramdisk links) on an io_uring instead (see uring.h); ignored where the
+  // kernel refuses one. Sections that are decoded on the way still go
+  // through the regular path.
+  bool io_uring = false;
+  // Release each output from the page cache once it is written, after its
+  // writeback (--drop-cache); callers drop the image pages when done with
+  // it (see DropCachedRange).
+  bool drop_cache = false;
+  // When set (--output-archive), sections are appended to this archive as
+  // stored instead of being written under the output directory.
+  TarWriter *archive = nullptr;
+  // When set (--serve), sections are extracted on this pool, kept from one
+  // image to the next, instead of one started for each image.
+  ThreadPool *pool = nullptr;
+  // Index the kernel command line and bootconfig into the image information
+  // (see bootparams.h); the bootconfig is read even without `extract`.
+  bool index_params = false;
+
+  RamdiskOutput OutputFor(SectionKind kind) const {
+    return kind == SectionKind::Ramdisk ? ramdisk : RamdiskOutput::Raw;
+  }
+
+  bool Selects(std::string_view name) const {
+    if (only.empty()) {
+      return true;
+    }
+    for (const auto &selected : only) {
+      if (selected == name) {
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
 } // namespace utils
@@ -1,119 +1,111 @@
 #include "vendorbootimg.h"
+#include "archive.h"
+#include "digest.h"
+#include "dtb.h"
+#include "report.h"
+#include "uring.h"
+
+#include <algorithm>
 
 namespace {
-constexpr uint32_t VENDOR_RAMDISK_NAME_SIZE = 32;
-constexpr uint32_t CMDLINE_SIZE = 2048;
-constexpr uint32_t BOARDNAME_SIZE = 16;
-} // namespace
+constexpr const char *VENDOR_RAMDISK_SPOOL = ".vendor_ramdisk.spool";
 
 VendorBootImageInfo
-UnpackVendorBootImage(std::ifstream &input,
-                      const std::filesystem::path &output_dir) {
+ParseVendorBootImageHeader(std::span<const std::byte> header,
+                           utils::VendorBootImageView &view) {
+  if (const auto result = utils::ParseVendorBootImage(header, view); !result)
+    throw errors::FileReadError(result.field);
+
   VendorBootImageInfo info;
+  info.boot_magic = view.boot_magic;
+  info.header_version = view.header_version;
+  info.page_size = view.page_size;
+  info.kernel_load_address = view.kernel_load_address;
+  info.ramdisk_load_address = view.ramdisk_load_address;
+  info.vendor_ramdisk_size = view.vendor_ramdisk_size;
+  info.cmdline = view.cmdline;
+  info.tags_load_address = view.tags_load_address;
+  info.product_name = view.product_name;
+  info.header_size = view.header_size;
+  info.dtb_size = view.dtb_size;
+  info.dtb_load_address = view.dtb_load_address;
+
+  info.vendor_ramdisk_table_size = view.vendor_ramdisk_table_size;
+  info.vendor_ramdisk_table_entry_num = view.vendor_ramdisk_table_entry_num;
+  info.vendor_ramdisk_table_entry_size = view.vendor_ramdisk_table_entry_size;
+  info.vendor_bootconfig_size = view.vendor_bootconfig_size;
+  return info;
+}
 
-  // Read header fields
-  if (!(utils::ReadString(input, utils::MAGIC_SIZE, info.boot_magic) &&
-        utils::ReadU32(input, info.header_version) &&
-        utils::ReadU32(input, info.page_size) &&
-        utils::ReadU32(input, info.kernel_load_address) &&
-        utils::ReadU32(input, info.ramdisk_load_address) &&
-        utils::ReadU32(input, info.vendor_ramdisk_size) &&
-        utils::ReadString(input, CMDLINE_SIZE, info.cmdline) &&
-        utils::ReadU32(input, info.tags_load_address) &&
-        utils::ReadString(input, BOARDNAME_SIZE, info.product_name) &&
-        utils::ReadU32(input, info.header_size) &&
-        utils::ReadU32(input, info.dtb_size) &&
-        utils::ReadU64(input, info.dtb_load_address))) {
-    throw errors::FileReadError("header information");
-  }
-
-  info.cmdline = utils::CStr(info.cmdline);
-  info.product_name = utils::CStr(info.product_name);
-
-  // Handle version >3 fields
-  if (info.header_version > 3) {
-    if (!(utils::ReadU32(input, info.vendor_ramdisk_table_size) &&
-          utils::ReadU32(input, info.vendor_ramdisk_table_entry_num) &&
-          utils::ReadU32(input, info.vendor_ramdisk_table_entry_size) &&
-          utils::ReadU32(input, info.vendor_bootconfig_size))) {
-      throw errors::FileReadError("ramdisk table");
-    }
+void ParseVendorRamdiskTable(VendorBootImageInfo &info,
+                             utils::VendorBootImageView &view,
+                             std::span<const std::byte> table) {
+  if (const auto result = utils::ParseVendorRamdiskTable(table, view);
+      !result)
+    throw errors::FileReadError(result.field);
+
+  info.vendor_ramdisk_table.reserve(view.ramdisk_table.size());
+  for (size_t i = 0; i < view.ramdisk_table.size(); ++i) {
+    const auto fragment = view.ramdisk_table[i];
+    VendorRamdiskTableEntry entry;
+    entry.output_name = std::format("vendor_ramdisk{:02}", i);
+    entry.size = fragment.size;
+    entry.offset = fragment.offset;
+    entry.type = fragment.type;
+    entry.name = fragment.name;
+    entry.board_id = fragment.board_id;
+    info.vendor_ramdisk_table.push_back(std::move(entry));
   }
+}
 
-  // Calculate offsets
-  const uint32_t page_size = info.page_size;
-  const uint32_t num_header_pages =
-      utils::GetNumberOfPages(info.header_size, page_size);
-  const uint32_t ramdisk_offset_base = page_size * num_header_pages;
+// Fragments can be selected by output name or by their table name
+bool SelectsFragment(const utils::UnpackOptions &options,
+                     const VendorRamdiskTableEntry &entry) {
+  return options.Selects(entry.output_name) || options.Selects(entry.name);
+}
 
+std::vector<utils::ImageEntry>
+GetImageEntries(const VendorBootImageInfo &info,
+                const utils::VendorBootImageView &view,
+                const utils::UnpackOptions &options) {
   std::vector<utils::ImageEntry> image_entries;
-  std::vector<std::pair<std::string, std::string>> vendor_ramdisk_symlinks;
 
-  // Handle vendor ramdisk table
   if (info.header_version > 3) {
-    const uint32_t table_pages =
-        utils::GetNumberOfPages(info.vendor_ramdisk_table_size, page_size);
-    const uint64_t table_offset =
-        page_size *
-        (num_header_pages +
-         utils::GetNumberOfPages(info.vendor_ramdisk_size, page_size) +
-         utils::GetNumberOfPages(info.dtb_size, page_size));
-
-    for (uint32_t i = 0; i < info.vendor_ramdisk_table_entry_num; ++i) {
-      const uint64_t entry_offset =
-          table_offset + (info.vendor_ramdisk_table_entry_size * i);
-      input.seekg(entry_offset);
-
-      VendorRamdiskTableEntry entry;
-      if (!(utils::ReadU32(input, entry.size) &&
-            utils::ReadU32(input, entry.offset) &&
-            utils::ReadU32(input, entry.type) &&
-            utils::ReadString(input, VENDOR_RAMDISK_NAME_SIZE, entry.name) &&
-            utils::ReadU32Array(input, entry.board_id))) {
-        throw errors::FileReadError("ramdisk: " + entry.name);
+    for (const auto &entry : info.vendor_ramdisk_table) {
+      if (SelectsFragment(options, entry)) {
+        image_entries.emplace_back(view.ramdisk_offset + entry.offset,
+                                   entry.size, entry.output_name,
+                                   utils::SectionKind::Ramdisk);
       }
-
-      entry.output_name = std::format("vendor_ramdisk{:02}", i);
-      entry.name = utils::CStr(entry.name);
-
-      image_entries.emplace_back(ramdisk_offset_base + entry.offset, entry.size,
-                                 entry.output_name);
-
-      vendor_ramdisk_symlinks.emplace_back(entry.output_name, entry.name);
-      info.vendor_ramdisk_table.push_back(std::move(entry));
     }
 
     // Handle bootconfig
-    const uint64_t bootconfig_offset =
-        page_size *
-        (num_header_pages +
-         utils::GetNumberOfPages(info.vendor_ramdisk_size, page_size) +
-         utils::GetNumberOfPages(info.dtb_size, page_size) + table_pages);
-    image_entries.emplace_back(bootconfig_offset, info.vendor_bootconfig_size,
-                               "bootconfig");
-  } else {
-    image_entries.emplace_back(ramdisk_offset_base, info.vendor_ramdisk_size,
-                               "vendor_ramdisk");
+    if (options.Selects("bootconfig")) {
+      image_entries.emplace_back(view.bootconfig_offset,
+                                 info.vendor_bootconfig_size, "bootconfig");
+    }
+  } else if (options.Selects("vendor_ramdisk")) {
+    image_entries.emplace_back(view.ramdisk_offset, info.vendor_ramdisk_size,
+                               "vendor_ramdisk", utils::SectionKind::Ramdisk);
   }
 
   // Handle DTB
-  if (info.dtb_size > 0) {
-    const uint64_t dtb_offset =
-        page_size *
-        (num_header_pages +
-         utils::GetNumberOfPages(info.vendor_ramdisk_size, page_size));
-    image_entries.emplace_back(dtb_offset, info.dtb_size, "dtb");
+  if (info.dtb_size > 0 && options.Selects("dtb")) {
+    image_entries.emplace_back(view.dtb_offset, info.dtb_size, "dtb",
+                               utils::SectionKind::Dtb);
   }
 
-  // Create output directory
-  if (!utils::CreateDirectory(output_dir))
-    throw std::runtime_error("Could not create output directory.");
+  return image_entries;
+}
 
-  // Extract images
-  for (const auto &entry : image_entries) {
-    const auto output_path = output_dir / entry.name;
-    if (!utils::ExtractImage(input, entry.offset, entry.size, output_path)) {
-      throw std::runtime_error("Could not extract image: " + entry.name);
+void CreateVendorRamdiskSymlinks(const VendorBootImageInfo &info,
+                                 const std::filesystem::path &output_dir,
+                                 const utils::UnpackOptions &options) {
+  utils::stats::ScopedTimer timer("symlinks");
+  std::vector<std::pair<std::string, std::string>> vendor_ramdisk_symlinks;
+  for (const auto &entry : info.vendor_ramdisk_table) {
+    if (SelectsFragment(options, entry)) {
+      vendor_ramdisk_symlinks.emplace_back(entry.output_name, entry.name);
     }
   }
 
@@ -123,18 +115,300 @@ UnpackVendorBootImage(std::ifstream &input,
     if (!utils::CreateDirectory(symlink_dir))
       throw std::runtime_error("Could not create symlink directory.");
 
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+        links;
     for (const auto &[src, dst] : vendor_ramdisk_symlinks) {
-      const auto src_path =
-          std::filesystem::relative(output_dir / src, symlink_dir);
-      const auto dst_path = symlink_dir / std::format("ramdisk_{}", dst);
+      auto src_path = std::filesystem::relative(output_dir / src, symlink_dir);
+      auto dst_path = symlink_dir / std::format("ramdisk_{}", dst);
 
+      // Links that already point at their fragment are left alone
+      std::error_code ec;
+      if (std::filesystem::read_symlink(dst_path, ec) == src_path && !ec)
+        continue;
+      links.emplace_back(std::move(src_path), std::move(dst_path));
+    }
+
+    if (options.io_uring && utils::RingReplaceSymlinks(links))
+      return;
+    for (const auto &[src_path, dst_path] : links) {
       std::error_code ec;
       std::filesystem::remove(dst_path, ec);
       std::filesystem::create_symlink(src_path, dst_path, ec);
     }
   }
+}
+
+// The archive counterpart of CreateVendorRamdiskSymlinks: the same links,
+// as entries after the fragments they point at.
+void ArchiveVendorRamdiskSymlinks(const VendorBootImageInfo &info,
+                                  utils::TarWriter &archive,
+                                  const utils::UnpackOptions &options) {
+  if (info.header_version <= 3) {
+    return;
+  }
+  bool directory = false;
+  for (const auto &entry : info.vendor_ramdisk_table) {
+    if (!SelectsFragment(options, entry)) {
+      continue;
+    }
+    if (!directory && !archive.AddDirectory("vendor-ramdisk-by-name"))
+      throw std::runtime_error("Could not create symlink directory.");
+    directory = true;
+    const auto link =
+        std::format("vendor-ramdisk-by-name/ramdisk_{}", entry.name);
+    if (!archive.AddSymlink(link, "../" + entry.output_name))
+      throw std::runtime_error("Could not create symlink: " + link);
+  }
+}
+
+void IndexParams(VendorBootImageInfo &info,
+                 std::span<const std::byte> bootconfig) {
+  info.params.emplace();
+  info.params->cmdline = utils::ParseCmdline(info.cmdline);
+  utils::ParseBootconfig({reinterpret_cast<const char *>(bootconfig.data()),
+                          bootconfig.size()},
+                         *info.params);
+}
+
+} // namespace
+
+VendorBootImageInfo
+UnpackVendorBootImage(utils::ImageSource &input,
+                      const std::filesystem::path &output_dir,
+                      const utils::UnpackOptions &options) {
+  utils::stats::Stopwatch header_watch;
+  std::vector<std::byte> scratch;
+  utils::VendorBootImageView view;
+  VendorBootImageInfo info = ParseVendorBootImageHeader(
+      input.Slice(0,
+                  static_cast<size_t>(std::min<uint64_t>(
+                      input.size(), utils::HEADER_READ_SIZE)),
+                  scratch),
+      view);
+  header_watch.Record("header");
+
+  // Handle vendor ramdisk table
+  if (info.header_version > 3) {
+    utils::stats::ScopedTimer timer("table");
+    ParseVendorRamdiskTable(info, view,
+                            input.Slice(view.ramdisk_table_offset,
+                                        view.RamdiskTableBytes(), scratch));
+  }
+
+  if (options.index_params) {
+    std::vector<std::byte> bootconfig_scratch;
+    std::span<const std::byte> bootconfig;
+    if (info.header_version > 3 && info.vendor_bootconfig_size > 0) {
+      bootconfig = input.Slice(view.bootconfig_offset,
+                               info.vendor_bootconfig_size, bootconfig_scratch);
+      if (bootconfig.empty())
+        throw errors::FileReadError("bootconfig");
+    }
+    IndexParams(info, bootconfig);
+  }
 
   info.image_dir = output_dir;
+  if (options.verify && (!options.extract || options.archive)) {
+    info.verification = utils::VerifyImage(input, nullptr);
+  }
+  if (!options.extract) {
+    return info;
+  }
+
+  const auto image_entries = GetImageEntries(info, view, options);
+
+  if (options.archive) {
+    utils::ArchiveImages(input, image_entries, *options.archive, options);
+    ArchiveVendorRamdiskSymlinks(info, *options.archive, options);
+    return info;
+  }
+
+  // Create output directory
+  if (!utils::CreateDirectory(output_dir))
+    throw std::runtime_error("Could not create output directory.");
+
+  // Extract images; the checks take the sections on the way
+  std::optional<utils::VerificationTap> tap;
+  utils::UnpackOptions extract_options = options;
+  if (options.verify) {
+    tap.emplace(input, nullptr);
+    extract_options.image_tap = &*tap;
+  }
+  utils::ExtractImages(input, image_entries, output_dir, extract_options);
+  if (tap) {
+    info.verification = tap->Finish();
+  }
+  if (options.split_dtb) {
+    utils::SplitDeviceTrees(input, image_entries, output_dir, options);
+  }
+
+  CreateVendorRamdiskSymlinks(info, output_dir, options);
+
+  return info;
+}
+
+VendorBootImageInfo
+UnpackVendorBootImage(utils::StreamSource &input,
+                      const std::filesystem::path &output_dir,
+                      const utils::UnpackOptions &options) {
+  utils::stats::Stopwatch header_watch;
+  utils::VendorBootImageView view;
+  VendorBootImageInfo info = ParseVendorBootImageHeader(
+      input.ReadHead(utils::HEADER_READ_SIZE), view);
+  header_watch.Record("header");
+  if (options.archive)
+    throw std::runtime_error("Archive output needs a seekable image.");
+  info.image_dir = output_dir;
+  if (options.verify) {
+    info.verification.emplace();
+    info.verification->avb = {utils::VerifyStatus::NotChecked,
+                              "needs a seekable image"};
+  }
+
+  // The v4 ramdisk table sits after the ramdisks it describes, so the whole
+  // ramdisk region is spooled to disk and split once the table is known.
+  // Nothing else needs buffering.
+  std::vector<utils::ForwardSink> sinks;
+  std::vector<std::byte> table;
+  bool spool = false;
+  // Hashed in passing; used when the spool becomes the only fragment as is
+  std::optional<utils::SectionDigest> spool_digest;
+
+  std::vector<std::byte> bootconfig;
+  if (info.header_version > 3) {
+    sinks.push_back({view.ramdisk_table_offset, view.RamdiskTableBytes(),
+                     "ramdisk table", &table});
+    if (options.index_params && info.vendor_bootconfig_size > 0) {
+      sinks.push_back({view.bootconfig_offset, info.vendor_bootconfig_size,
+                       "bootconfig", &bootconfig});
+    }
+
+    if (options.extract) {
+      spool = std::any_of(
+          options.only.begin(), options.only.end(),
+          [](const std::string &name) {
+            return name != "dtb" && name != "bootconfig";
+          });
+      spool = spool || options.only.empty();
+      if (spool) {
+        if (options.manifest) {
+          spool_digest.emplace(options.manifest->sha256());
+        }
+        sinks.push_back({view.ramdisk_offset, info.vendor_ramdisk_size,
+                         VENDOR_RAMDISK_SPOOL, nullptr,
+                         utils::RamdiskOutput::Raw, nullptr,
+                         spool_digest ? &*spool_digest : nullptr});
+      }
+    }
+  }
+
+  const auto image_entries = options.extract
+                                 ? GetImageEntries(info, view, options)
+                                 : std::vector<utils::ImageEntry>();
+  std::vector<utils::SectionDigest> digests;
+  digests.reserve(image_entries.size());
+  // Device tree sections are also kept in memory to be split afterwards
+  std::vector<std::pair<utils::ImageEntry, std::vector<std::byte>>> trees;
+  if (options.split_dtb) {
+    for (const auto &entry : image_entries) {
+      if (utils::IsDeviceTreeSection(entry)) {
+        trees.emplace_back(entry, std::vector<std::byte>());
+      }
+    }
+    for (auto &[entry, data] : trees) {
+      sinks.push_back({entry.offset, entry.size, entry.name, &data});
+    }
+  }
+  if (options.extract) {
+    for (const auto &entry : image_entries) {
+      utils::SectionDigest *digest = nullptr;
+      if (options.manifest) {
+        digest = &digests.emplace_back(options.manifest->sha256());
+      }
+      sinks.push_back({entry.offset, entry.size, entry.name, nullptr,
+                       options.OutputFor(entry.kind), nullptr, digest});
+    }
+
+    // Create output directory
+    if (!utils::CreateDirectory(output_dir))
+      throw std::runtime_error("Could not create output directory.");
+  }
+
+  // Extract images in file order
+  try {
+    input.Extract(sinks, output_dir, options);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(output_dir / VENDOR_RAMDISK_SPOOL, ec);
+    throw;
+  }
+
+  for (size_t i = 0; i < digests.size(); ++i) {
+    const auto &entry = image_entries[i];
+    options.manifest->Add(entry.name, entry.offset, entry.size, digests[i]);
+  }
+  if (options.split_dtb && options.extract) {
+    utils::SplitDeviceTrees(trees, output_dir, options);
+  }
+
+  if (info.header_version > 3) {
+    utils::stats::ScopedTimer timer("table");
+    ParseVendorRamdiskTable(info, view, table);
+  }
+  if (options.index_params) {
+    IndexParams(info, bootconfig);
+  }
+  if (!spool) {
+    return info;
+  }
+
+  // Split the spooled ramdisk region into its fragments
+  const auto spool_path = output_dir / VENDOR_RAMDISK_SPOOL;
+  std::vector<utils::ImageEntry> fragments;
+  for (const auto &entry : info.vendor_ramdisk_table) {
+    if (SelectsFragment(options, entry)) {
+      fragments.emplace_back(entry.offset, entry.size, entry.output_name,
+                             utils::SectionKind::Ramdisk);
+    }
+  }
+
+  if (options.ramdisk == utils::RamdiskOutput::Raw &&
+      fragments.size() == 1 && fragments.front().offset == 0 &&
+      fragments.front().size == info.vendor_ramdisk_size) {
+    std::error_code ec;
+    std::filesystem::rename(spool_path, output_dir / fragments.front().name,
+                            ec);
+    if (ec)
+      throw std::runtime_error("Could not extract image: " +
+                               fragments.front().name);
+    if (spool_digest) {
+      options.manifest->Add(fragments.front().name, view.ramdisk_offset,
+                            fragments.front().size, *spool_digest);
+    }
+  } else {
+    // Fragment offsets are relative to the spool; the manifest wants them
+    // relative to the image
+    utils::UnpackOptions spool_options = options;
+    utils::Manifest spool_manifest(options.manifest &&
+                                   options.manifest->sha256());
+    if (options.manifest) {
+      spool_options.manifest = &spool_manifest;
+    }
+    {
+      utils::ImageSource spooled;
+      if (!spooled.Open(spool_path))
+        throw std::runtime_error("Could not reopen spooled vendor ramdisk.");
+      utils::ExtractImages(spooled, fragments, output_dir, spool_options);
+    }
+    if (options.manifest) {
+      options.manifest->Merge(spool_manifest, view.ramdisk_offset);
+    }
+    std::error_code ec;
+    std::filesystem::remove(spool_path, ec);
+  }
+
+  CreateVendorRamdiskSymlinks(info, output_dir, options);
+
   return info;
 }
 
@@ -192,6 +466,11 @@ std::string FormatPrettyText(const VendorBootImageInfo &info) {
         << "\n";
   }
 
+  if (info.verification) {
+    oss << "avb hash footer: "
+        << utils::FormatVerifyResult(info.verification->avb) << "\n";
+  }
+
   return oss.str();
 }
 
@@ -248,3 +527,86 @@ FormatMkbootimgArguments(const VendorBootImageInfo &info) {
 
   return args;
 }
+
+void AppendJson(const VendorBootImageInfo &info, std::string_view image,
+                std::string &out) {
+  utils::JsonWriter json(out);
+  json.BeginObject();
+  json.String("image", image);
+  json.String("boot_magic", info.boot_magic);
+  json.Number("header_version", info.header_version);
+  json.Number("page_size", info.page_size);
+  json.Number("kernel_load_address", info.kernel_load_address);
+  json.Number("ramdisk_load_address", info.ramdisk_load_address);
+  json.Number("vendor_ramdisk_size", info.vendor_ramdisk_size);
+  json.String("cmdline", info.cmdline);
+  json.Number("tags_load_address", info.tags_load_address);
+  json.String("product_name", info.product_name);
+  json.Number("header_size", info.header_size);
+  json.Number("dtb_size", info.dtb_size);
+  json.Number("dtb_load_address", info.dtb_load_address);
+
+  if (info.header_version > 3) {
+    json.Number("vendor_ramdisk_table_size", info.vendor_ramdisk_table_size);
+    json.BeginArray("vendor_ramdisk_table");
+    for (const auto &entry : info.vendor_ramdisk_table) {
+      json.BeginObject();
+      json.String("output_name", entry.output_name);
+      json.Number("size", entry.size);
+      json.Number("offset", entry.offset);
+      json.String("type", utils::getRamdiskType(entry.type));
+      json.String("name", entry.name);
+      json.BeginArray("board_id");
+      for (const uint32_t word : entry.board_id) {
+        json.Number({}, word);
+      }
+      json.EndArray();
+      json.EndObject();
+    }
+    json.EndArray();
+    json.Number("vendor_bootconfig_size", info.vendor_bootconfig_size);
+  }
+  if (info.params) {
+    utils::AppendJson(*info.params, info.header_version > 3, json);
+  }
+
+  if (info.verification) {
+    json.BeginObject("verification");
+    json.String("avb", utils::FormatVerifyResult(info.verification->avb));
+    json.EndObject();
+  }
+  json.EndObject();
+}
+
+void AppendRecord(const VendorBootImageInfo &info, std::string_view image,
+                  std::string &out) {
+  utils::RecordWriter record(out, info.boot_magic, info.header_version,
+                             info.page_size, image);
+  for (const uint32_t value :
+       {info.kernel_load_address, info.ramdisk_load_address,
+        info.vendor_ramdisk_size, info.tags_load_address, info.header_size,
+        info.dtb_size}) {
+    record.U32(value);
+  }
+  record.U64(info.dtb_load_address);
+  record.U32(info.vendor_ramdisk_table_size);
+  record.U32(info.vendor_bootconfig_size);
+  record.String(info.cmdline);
+  record.String(info.product_name);
+
+  record.U32(static_cast<uint32_t>(info.vendor_ramdisk_table.size()));
+  for (const auto &entry : info.vendor_ramdisk_table) {
+    record.U32(entry.size);
+    record.U32(entry.offset);
+    record.U32(entry.type);
+    record.Fixed(entry.name, 32);
+    for (const uint32_t word : entry.board_id) {
+      record.U32(word);
+    }
+  }
+
+  record.VerifyStatus(info.verification
+                          ? std::optional(info.verification->avb)
+                          : std::nullopt);
+  record.Finish();
+}
@@ -1,6 +1,11 @@
 #pragma once
 
+#include "bootparams.h"
+#include "imagesource.h"
+#include "imageview.h"
+#include "streamsource.h"
 #include "utils.hpp"
+#include "verify.h"
 
 struct VendorRamdiskTableEntry {
   std::string output_name;
@@ -8,7 +13,7 @@ struct VendorRamdiskTableEntry {
   uint32_t offset;
   uint32_t type;
   std::string name;
-  std::array<uint32_t, 4> board_id; // 16 bytes = 4 * uint32_t
+  utils::BoardId board_id;
 };
 
 struct VendorBootImageInfo {
@@ -32,13 +37,40 @@ struct VendorBootImageInfo {
   uint32_t vendor_bootconfig_size = 0;
   std::vector<VendorRamdiskTableEntry> vendor_ramdisk_table;
 
+  // Set with --verify
+  std::optional<utils::Verification> verification;
+
+  // Set with UnpackOptions::index_params: the vendor cmdline and (v4) the
+  // bootconfig section
+  std::optional<utils::BootParams> params;
+
   std::filesystem::path image_dir;
 };
 
 VendorBootImageInfo
-UnpackVendorBootImage(std::ifstream &input,
-                      const std::filesystem::path &output_dir);
+UnpackVendorBootImage(utils::ImageSource &input,
+                      const std::filesystem::path &output_dir,
+                      const utils::UnpackOptions &options = {});
+
+// Same as above for non-seekable input: sections are read strictly forward.
+VendorBootImageInfo
+UnpackVendorBootImage(utils::StreamSource &input,
+                      const std::filesystem::path &output_dir,
+                      const utils::UnpackOptions &options = {});
 
 std::string FormatPrettyText(const VendorBootImageInfo &info);
 std::vector<std::string>
 FormatMkbootimgArguments(const VendorBootImageInfo &info);
+
+// As for boot images (see bootimg.h).
+void AppendJson(const VendorBootImageInfo &info, std::string_view image,
+                std::string &out);
+// After the common start: the kernel and ramdisk load addresses,
+// vendor_ramdisk_size, tags_load_address, header_size and dtb_size (u32
+// each); dtb_load_address (u64); vendor_ramdisk_table_size and
+// vendor_bootconfig_size (u32 each); cmdline and product_name (strings); the
+// fragment count (u32) and for each fragment its size, offset and type (u32
+// each), name (32 bytes, NUL padded) and board_id (16 u32); then the avb
+// verify result.
+void AppendRecord(const VendorBootImageInfo &info, std::string_view image,
+                  std::string &out);
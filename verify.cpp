@@ -0,0 +1,436 @@
+#include "verify.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace utils {
+
+namespace {
+constexpr std::string_view AVB_FOOTER_MAGIC = "AVBf";
+constexpr std::string_view AVB_VBMETA_MAGIC = "AVB0";
+constexpr size_t AVB_VBMETA_HEADER_SIZE = 256;
+constexpr uint64_t AVB_DESCRIPTOR_TAG_HASH = 2;
+// Tag and num_bytes_following
+constexpr size_t AVB_DESCRIPTOR_HEADER_SIZE = 16;
+// image_size, hash_algorithm[32], three lengths, flags and reserved[60]
+constexpr size_t AVB_HASH_DESCRIPTOR_SIZE = 8 + 32 + 4 * 4 + 60;
+constexpr size_t SHA1_DIGEST_SIZE = 20;
+// vbmeta structs are a few KiB; anything larger is not one
+constexpr uint64_t AVB_VBMETA_MAX_SIZE = 1 << 20;
+
+// AVB structs are big endian, unlike the boot image headers
+uint32_t LoadBE32(const std::byte *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+uint64_t LoadBE64(const std::byte *p) {
+  return (static_cast<uint64_t>(LoadBE32(p)) << 32) | LoadBE32(p + 4);
+}
+
+std::string_view Magic(std::span<const std::byte> bytes, size_t size) {
+  return {reinterpret_cast<const char *>(bytes.data()), size};
+}
+
+const char *VerifyStatusName(VerifyStatus status) {
+  switch (status) {
+  case VerifyStatus::NotChecked:
+    return "not checked";
+  case VerifyStatus::Pass:
+    return "pass";
+  case VerifyStatus::Fail:
+    return "fail";
+  case VerifyStatus::Unsupported:
+    return "unsupported";
+  }
+  return "unknown";
+}
+
+VerifyResult Result(VerifyStatus status, std::string detail) {
+  return {status, std::move(detail)};
+}
+
+// Finds the hash descriptor to check. A result means there is nothing to
+// hash, and says why.
+std::optional<VerifyResult>
+FindAvbHashDescriptor(ImageSource &input, std::vector<std::byte> &scratch,
+                      AvbHashDescriptor &descriptor) {
+  if (input.size() < AVB_FOOTER_SIZE) {
+    return Result(VerifyStatus::NotChecked, "no footer");
+  }
+  std::vector<std::byte> footer_scratch;
+  AvbFooter footer;
+  const auto footer_result = ParseAvbFooter(
+      input.Slice(input.size() - AVB_FOOTER_SIZE, AVB_FOOTER_SIZE,
+                  footer_scratch),
+      footer);
+  if (footer_result.status == ParseStatus::BadMagic) {
+    return Result(VerifyStatus::NotChecked, "no footer");
+  }
+  if (!footer_result || footer.vbmeta_size > AVB_VBMETA_MAX_SIZE ||
+      footer.vbmeta_offset > input.size() ||
+      footer.vbmeta_size > input.size() - footer.vbmeta_offset) {
+    return Result(VerifyStatus::Fail, "malformed footer");
+  }
+
+  const auto vbmeta =
+      input.Slice(footer.vbmeta_offset,
+                  static_cast<size_t>(footer.vbmeta_size), scratch);
+  const auto result = ParseAvbHashDescriptor(vbmeta, descriptor);
+  if (result.status == ParseStatus::BadMagic) {
+    return Result(VerifyStatus::Unsupported, result.field);
+  }
+  if (!result) {
+    return Result(VerifyStatus::Fail,
+                  std::string("malformed vbmeta: ") + result.field);
+  }
+  if (descriptor.algorithm != "sha256") {
+    return Result(VerifyStatus::Unsupported, std::string(descriptor.algorithm));
+  }
+  if (descriptor.image_size > input.size()) {
+    return Result(VerifyStatus::Fail, "image truncated");
+  }
+  return std::nullopt;
+}
+} // namespace
+
+std::string FormatVerifyResult(const VerifyResult &result) {
+  std::string text = VerifyStatusName(result.status);
+  if (!result.detail.empty()) {
+    text += " (" + result.detail + ")";
+  }
+  return text;
+}
+
+bool Verification::failed() const {
+  return (id && id->status == VerifyStatus::Fail) ||
+         avb.status == VerifyStatus::Fail;
+}
+
+BootIdVerifier::BootIdVerifier(const BootImageView &view) {
+  const auto offset_of = [&view](std::string_view name) -> uint64_t {
+    for (const auto &section : view.sections) {
+      if (section.name == name) {
+        return section.offset;
+      }
+    }
+    return 0;
+  };
+
+  // In mkbootimg's order, which is also file order
+  ranges_.push_back({offset_of("kernel"), view.kernel_size});
+  ranges_.push_back({offset_of("ramdisk"), view.ramdisk_size});
+  ranges_.push_back({offset_of("second"), view.second_size});
+  if (view.header_version > 0) {
+    ranges_.push_back({offset_of("recovery_dtbo"), view.recovery_dtbo_size});
+  }
+  if (view.header_version > 1) {
+    ranges_.push_back({offset_of("dtb"), view.dtb_size});
+  }
+
+  bool first = true;
+  for (const auto &range : ranges_) {
+    if (range.size == 0) {
+      continue;
+    }
+    if (first) {
+      begin_ = range.offset;
+      first = false;
+    } else if (range.offset < end_) {
+      ordered_ = false;
+    }
+    end_ = range.offset + range.size;
+  }
+  if (first) {
+    end_ = begin_;
+  }
+  pos_ = begin_;
+
+  std::copy_n(view.id.begin(), std::min(view.id.size(), expected_.size()),
+              expected_.begin());
+  sha256_ = std::any_of(expected_.begin() + SHA1_DIGEST_SIZE, expected_.end(),
+                        [](std::byte b) { return b != std::byte{0}; });
+}
+
+void BootIdVerifier::Hash(std::span<const std::byte> data) {
+  if (sha256_) {
+    sha256_hash_.Update(data);
+  } else {
+    sha1_hash_.Update(data);
+  }
+}
+
+void BootIdVerifier::CloseSections() {
+  while (next_ < ranges_.size() &&
+         (ranges_[next_].size == 0 ||
+          pos_ >= ranges_[next_].offset + ranges_[next_].size)) {
+    const uint32_t size = ranges_[next_].size;
+    const std::array<std::byte, 4> le{
+        static_cast<std::byte>(size), static_cast<std::byte>(size >> 8),
+        static_cast<std::byte>(size >> 16), static_cast<std::byte>(size >> 24)};
+    Hash(le);
+    ++next_;
+  }
+}
+
+std::streamsize BootIdVerifier::xsputn(const char *data,
+                                       std::streamsize size) {
+  auto bytes = std::span(reinterpret_cast<const std::byte *>(data),
+                         static_cast<size_t>(size));
+  CloseSections();
+  while (ordered_ && !bytes.empty() && next_ < ranges_.size()) {
+    const auto &range = ranges_[next_];
+    if (pos_ < range.offset) {
+      const size_t skip = static_cast<size_t>(
+          std::min<uint64_t>(bytes.size(), range.offset - pos_));
+      bytes = bytes.subspan(skip);
+      pos_ += skip;
+      continue;
+    }
+    const size_t take = static_cast<size_t>(
+        std::min<uint64_t>(bytes.size(), range.offset + range.size - pos_));
+    Hash(bytes.first(take));
+    bytes = bytes.subspan(take);
+    pos_ += take;
+    CloseSections();
+  }
+  pos_ += bytes.size();
+  return size;
+}
+
+BootIdVerifier::int_type BootIdVerifier::overflow(int_type ch) {
+  if (traits_type::eq_int_type(ch, traits_type::eof())) {
+    return traits_type::not_eof(ch);
+  }
+  const char c = traits_type::to_char_type(ch);
+  xsputn(&c, 1);
+  return ch;
+}
+
+VerifyResult BootIdVerifier::Finish() {
+  if (std::all_of(expected_.begin(), expected_.end(),
+                  [](std::byte b) { return b == std::byte{0}; })) {
+    return Result(VerifyStatus::NotChecked, "no id");
+  }
+  if (!ordered_) {
+    return Result(VerifyStatus::Unsupported, "sections out of order");
+  }
+  CloseSections();
+  if (next_ < ranges_.size()) {
+    return Result(VerifyStatus::Fail, "image truncated");
+  }
+  return Result(Id() == expected_ ? VerifyStatus::Pass : VerifyStatus::Fail,
+                sha256_ ? "SHA-256" : "SHA-1");
+}
+
+std::array<std::byte, 32> BootIdVerifier::Id() {
+  CloseSections();
+  std::array<std::byte, 32> id{};
+  if (sha256_) {
+    const auto digest = sha256_hash_.Digest();
+    std::memcpy(id.data(), digest.data(), digest.size());
+  } else {
+    const auto digest = sha1_hash_.Digest();
+    std::memcpy(id.data(), digest.data(), digest.size());
+  }
+  return id;
+}
+
+ParseResult ParseAvbFooter(std::span<const std::byte> footer,
+                           AvbFooter &out) noexcept {
+  if (footer.size() < AVB_FOOTER_SIZE) {
+    return {ParseStatus::Truncated, "AVB footer"};
+  }
+  if (Magic(footer, AVB_FOOTER_MAGIC.size()) != AVB_FOOTER_MAGIC) {
+    return {ParseStatus::BadMagic, "AVB footer"};
+  }
+  // Magic and major/minor version come first
+  out.original_image_size = LoadBE64(footer.data() + 12);
+  out.vbmeta_offset = LoadBE64(footer.data() + 20);
+  out.vbmeta_size = LoadBE64(footer.data() + 28);
+  return {};
+}
+
+ParseResult ParseAvbHashDescriptor(std::span<const std::byte> vbmeta,
+                                   AvbHashDescriptor &out) noexcept {
+  if (vbmeta.size() < AVB_VBMETA_HEADER_SIZE) {
+    return {ParseStatus::Truncated, "vbmeta header"};
+  }
+  if (Magic(vbmeta, AVB_VBMETA_MAGIC.size()) != AVB_VBMETA_MAGIC) {
+    return {ParseStatus::BadMagic, "vbmeta header"};
+  }
+
+  // Descriptors sit in the auxiliary block, after the authentication block
+  const uint64_t auth_size = LoadBE64(vbmeta.data() + 12);
+  const uint64_t descriptors_offset = LoadBE64(vbmeta.data() + 96);
+  const uint64_t descriptors_size = LoadBE64(vbmeta.data() + 104);
+  const uint64_t available = vbmeta.size() - AVB_VBMETA_HEADER_SIZE;
+  if (auth_size > available || descriptors_offset > available - auth_size ||
+      descriptors_size > available - auth_size - descriptors_offset) {
+    return {ParseStatus::Truncated, "vbmeta descriptors"};
+  }
+  auto descriptors = vbmeta.subspan(
+      static_cast<size_t>(AVB_VBMETA_HEADER_SIZE + auth_size +
+                          descriptors_offset),
+      static_cast<size_t>(descriptors_size));
+
+  while (descriptors.size() >= AVB_DESCRIPTOR_HEADER_SIZE) {
+    const uint64_t tag = LoadBE64(descriptors.data());
+    const uint64_t following = LoadBE64(descriptors.data() + 8);
+    if (following > descriptors.size() - AVB_DESCRIPTOR_HEADER_SIZE) {
+      return {ParseStatus::Truncated, "vbmeta descriptors"};
+    }
+    const auto body = descriptors.subspan(AVB_DESCRIPTOR_HEADER_SIZE,
+                                          static_cast<size_t>(following));
+    descriptors = descriptors.subspan(
+        AVB_DESCRIPTOR_HEADER_SIZE + static_cast<size_t>(following));
+    if (tag != AVB_DESCRIPTOR_TAG_HASH) {
+      continue;
+    }
+
+    if (body.size() < AVB_HASH_DESCRIPTOR_SIZE) {
+      return {ParseStatus::Truncated, "hash descriptor"};
+    }
+    const uint32_t name_size = LoadBE32(body.data() + 40);
+    const uint32_t salt_size = LoadBE32(body.data() + 44);
+    const uint32_t digest_size = LoadBE32(body.data() + 48);
+    const uint64_t trailing =
+        static_cast<uint64_t>(name_size) + salt_size + digest_size;
+    if (trailing > body.size() - AVB_HASH_DESCRIPTOR_SIZE) {
+      return {ParseStatus::Truncated, "hash descriptor"};
+    }
+
+    out.image_size = LoadBE64(body.data());
+    out.algorithm = Magic(body.subspan(8), 32);
+    out.algorithm = out.algorithm.substr(0, out.algorithm.find('\0'));
+    auto rest = body.subspan(AVB_HASH_DESCRIPTOR_SIZE);
+    out.partition = Magic(rest, name_size);
+    out.salt = rest.subspan(name_size, salt_size);
+    out.digest = rest.subspan(name_size + salt_size, digest_size);
+    return {};
+  }
+  return {ParseStatus::BadMagic, "no hash descriptor"};
+}
+
+AvbHashVerifier::AvbHashVerifier(const AvbHashDescriptor &descriptor)
+    : image_size_(descriptor.image_size), partition_(descriptor.partition),
+      digest_(descriptor.digest.begin(), descriptor.digest.end()) {
+  hash_.Update(descriptor.salt);
+}
+
+std::streamsize AvbHashVerifier::xsputn(const char *data,
+                                        std::streamsize size) {
+  const size_t take = static_cast<size_t>(
+      std::min<uint64_t>(static_cast<uint64_t>(size), image_size_ - pos_));
+  hash_.Update({reinterpret_cast<const std::byte *>(data), take});
+  pos_ += take;
+  return size;
+}
+
+AvbHashVerifier::int_type AvbHashVerifier::overflow(int_type ch) {
+  if (traits_type::eq_int_type(ch, traits_type::eof())) {
+    return traits_type::not_eof(ch);
+  }
+  const char c = traits_type::to_char_type(ch);
+  xsputn(&c, 1);
+  return ch;
+}
+
+VerifyResult AvbHashVerifier::Finish() {
+  const std::string detail = "sha256, partition " + partition_;
+  if (pos_ < image_size_) {
+    return Result(VerifyStatus::Fail, "image truncated");
+  }
+  const auto digest = hash_.Digest();
+  const bool match =
+      digest_.size() == digest.size() &&
+      std::memcmp(digest_.data(), digest.data(), digest.size()) == 0;
+  return Result(match ? VerifyStatus::Pass : VerifyStatus::Fail, detail);
+}
+
+VerificationTap::VerificationTap(ImageSource &input,
+                                 const BootImageView *boot)
+    : input_(input) {
+  if (boot && boot->header_version < 3) {
+    id_.emplace(*boot);
+  }
+
+  std::vector<std::byte> vbmeta_scratch;
+  AvbHashDescriptor descriptor;
+  if (auto result =
+          FindAvbHashDescriptor(input, vbmeta_scratch, descriptor)) {
+    verification_.avb = std::move(*result);
+  } else {
+    avb_.emplace(descriptor);
+  }
+
+  // One pass over everything either check covers
+  begin_ = avb_ ? 0 : id_ ? id_->begin() : 0;
+  end_ = std::max(avb_ ? avb_->end() : 0, id_ ? id_->end() : 0);
+  pos_ = begin_;
+}
+
+void VerificationTap::Feed(uint64_t offset, std::span<const std::byte> data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FillTo(std::min(offset, end_));
+  if (pos_ < offset || offset + data.size() <= pos_) {
+    return; // A read failed, or these bytes were hashed already
+  }
+  const uint64_t skip = pos_ - offset;
+  const uint64_t to = std::min<uint64_t>(offset + data.size(), end_);
+  if (pos_ < to) {
+    Hash(pos_, data.subspan(static_cast<size_t>(skip),
+                            static_cast<size_t>(to - pos_)));
+  }
+}
+
+Verification VerificationTap::Finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats::ScopedTimer timer("verify", "", end_ - pos_);
+    FillTo(end_);
+  }
+  Verification verification = std::move(verification_);
+  if (id_) {
+    verification.id = id_->Finish();
+  }
+  if (avb_) {
+    verification.avb = avb_->Finish();
+  }
+  return verification;
+}
+
+void VerificationTap::FillTo(uint64_t offset) {
+  constexpr uint64_t kVerifyChunkSize = 1 << 20;
+  while (pos_ < offset) {
+    const size_t chunk = static_cast<size_t>(
+        std::min<uint64_t>(offset - pos_, kVerifyChunkSize));
+    const auto data = input_.Slice(pos_, chunk, scratch_);
+    if (data.empty()) {
+      return; // The verifiers report the shortfall
+    }
+    Hash(pos_, data);
+  }
+}
+
+void VerificationTap::Hash(uint64_t offset, std::span<const std::byte> data) {
+  const uint64_t end = offset + data.size();
+  if (avb_ && offset < avb_->end()) {
+    avb_->sputn(reinterpret_cast<const char *>(data.data()),
+                static_cast<std::streamsize>(data.size()));
+  }
+  if (id_ && end > id_->begin() && offset < id_->end()) {
+    const uint64_t from = std::max(offset, id_->begin());
+    const uint64_t to = std::min(end, id_->end());
+    id_->sputn(reinterpret_cast<const char *>(data.data() + (from - offset)),
+               static_cast<std::streamsize>(to - from));
+  }
+  pos_ = end;
+}
+
+Verification VerifyImage(ImageSource &input, const BootImageView *boot) {
+  return VerificationTap(input, boot).Finish();
+}
+
+} // namespace utils
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "digest.h"
+#include "imagesource.h"
+#include "imageview.h"
+#include "utils.hpp"
+
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <streambuf>
+
+namespace utils {
+
+// Integrity checks behind --verify. Only digests are compared: the vbmeta
+// signature and a v4 boot_signature are not checked against any key.
+
+enum class VerifyStatus {
+  NotChecked,  // Nothing to check (no AVB footer), or not from this input
+  Pass,
+  Fail,
+  Unsupported, // Present, but in a form this build cannot check
+};
+
+struct VerifyResult {
+  VerifyStatus status = VerifyStatus::NotChecked;
+  // The algorithm used, or why nothing was checked
+  std::string detail;
+};
+
+// E.g. "pass (SHA-1)" or "not checked (no footer)".
+std::string FormatVerifyResult(const VerifyResult &result);
+
+struct Verification {
+  // The mkbootimg id in v0-v2 boot image headers
+  std::optional<VerifyResult> id;
+  // The hash descriptor of an AVB footer (avbtool add_hash_footer)
+  VerifyResult avb;
+
+  bool failed() const;
+};
+
+// Recomputes the mkbootimg id of a v0-v2 boot image: the digest of kernel,
+// ramdisk, second (plus recovery_dtbo from v1 and dtb from v2), each followed
+// by its 32-bit size. The image bytes from begin() to end() are fed through
+// the streambuf in order; bytes between the sections are skipped.
+class BootIdVerifier : public std::streambuf {
+public:
+  explicit BootIdVerifier(const BootImageView &view);
+
+  uint64_t begin() const { return begin_; }
+  uint64_t end() const { return end_; }
+
+  VerifyResult Finish();
+  // The id of the bytes fed so far, as the header stores it (SHA-1 zero
+  // padded, or SHA-256 when the expected one is). Complete once end() was
+  // reached; repacking takes it in place of the expected id.
+  std::array<std::byte, 32> Id();
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override;
+  int_type overflow(int_type ch) override;
+
+private:
+  struct Range {
+    uint64_t offset = 0;
+    uint32_t size = 0;
+  };
+
+  void Hash(std::span<const std::byte> data);
+  // Appends the sizes of the sections that are complete at pos_
+  void CloseSections();
+
+  FixedList<Range, 5> ranges_;
+  size_t next_ = 0;
+  uint64_t begin_ = 0;
+  uint64_t end_ = 0;
+  uint64_t pos_ = 0;
+  bool ordered_ = true;
+  bool sha256_ = false;
+  Sha1 sha1_hash_;
+  Sha256 sha256_hash_;
+  std::array<std::byte, 32> expected_{};
+};
+
+constexpr size_t AVB_FOOTER_SIZE = 64;
+
+// The last AVB_FOOTER_SIZE bytes of an image with an AVB footer.
+struct AvbFooter {
+  uint64_t original_image_size = 0;
+  uint64_t vbmeta_offset = 0;
+  uint64_t vbmeta_size = 0;
+};
+
+// The first hash descriptor of a vbmeta struct. Views point into it.
+struct AvbHashDescriptor {
+  uint64_t image_size = 0;
+  std::string_view algorithm;
+  std::string_view partition;
+  std::span<const std::byte> salt;
+  std::span<const std::byte> digest;
+};
+
+ParseResult ParseAvbFooter(std::span<const std::byte> footer,
+                           AvbFooter &out) noexcept;
+
+// Fails with BadMagic when the vbmeta struct holds no hash descriptor.
+ParseResult ParseAvbHashDescriptor(std::span<const std::byte> vbmeta,
+                                   AvbHashDescriptor &out) noexcept;
+
+// Recomputes the digest of a hash descriptor over the first image_size
+// bytes of the image, which are fed through the streambuf from offset 0.
+class AvbHashVerifier : public std::streambuf {
+public:
+  explicit AvbHashVerifier(const AvbHashDescriptor &descriptor);
+
+  uint64_t end() const { return image_size_; }
+
+  VerifyResult Finish();
+
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize size) override;
+  int_type overflow(int_type ch) override;
+
+private:
+  uint64_t image_size_;
+  uint64_t pos_ = 0;
+  std::string partition_;
+  std::vector<std::byte> digest_;
+  Sha256 hash_;
+};
+
+// Runs every check that applies to a seekable image while extraction reads
+// it: the footer and vbmeta are read from its end up front, then the
+// sections extraction feeds in (UnpackOptions::image_tap) go to all digests
+// at the same time. Bytes the sections do not cover, such as the header and
+// padding, are read from `input` when a later section arrives or in Finish,
+// so each byte is read once as long as sections come in file order; a section
+// that arrives after bytes past its start were read is skipped, not hashed
+// twice. `boot` enables the mkbootimg id.
+class VerificationTap : public ImageTap {
+public:
+  VerificationTap(ImageSource &input, const BootImageView *boot);
+
+  void Feed(uint64_t offset, std::span<const std::byte> data) override;
+
+  // Reads what was not fed, up to the end of the checked bytes.
+  Verification Finish();
+
+private:
+  // Reads and hashes the bytes from pos_ up to `offset`. Called with
+  // mutex_ held.
+  void FillTo(uint64_t offset);
+  void Hash(uint64_t offset, std::span<const std::byte> data);
+
+  ImageSource &input_;
+  Verification verification_;
+  std::optional<BootIdVerifier> id_;
+  std::optional<AvbHashVerifier> avb_;
+  uint64_t begin_ = 0;
+  uint64_t end_ = 0;
+  uint64_t pos_ = 0;
+  std::mutex mutex_;
+  std::vector<std::byte> scratch_;
+};
+
+// The checks of VerificationTap as a pass of their own, for --no-extract and
+// --archive: the covered bytes are read once, front to back.
+Verification VerifyImage(ImageSource &input, const BootImageView *boot);
+
+} // namespace utils